@@ -374,14 +374,18 @@ static int add_comm_membership(TR_COMM_TABLE *ctab, struct comm_memb_entry *entr
   TR_COMM *comm=tr_comm_table_find_comm(ctab, comm_name);
   TR_RP_REALM *rp_realm=(entry->role==TR_ROLE_RP)?(tr_comm_table_find_rp_realm(ctab, realm_name)):(NULL);
   TR_IDP_REALM *idp_realm=(entry->role==TR_ROLE_IDP)?(tr_comm_table_find_idp_realm(ctab, realm_name)):(NULL);
-  json_t *prov=NULL;
+  TR_PROVENANCE *prov=NULL;
+  TR_NAME *origin=NULL;
   
   if ((comm==NULL) || ((rp_realm==NULL)&&(idp_realm==NULL)))
     return 1;
 
-  prov=json_array();
-  if (entry->origin!=NULL)
-    json_array_append(prov, json_string(entry->origin));
+  prov=tr_provenance_new(NULL);
+  if (entry->origin!=NULL) {
+    origin=tr_new_name(entry->origin);
+    tr_provenance_add(prov, origin);
+    tr_free_name(origin);
+  }
 
   switch (entry->role) {
   case TR_ROLE_IDP:
@@ -391,9 +395,10 @@ static int add_comm_membership(TR_COMM_TABLE *ctab, struct comm_memb_entry *entr
     tr_comm_add_rp_realm(ctab, comm, rp_realm, 0, prov, NULL); /* Expiry!? */
     break;
   default:
+    tr_provenance_free(prov);
     return 2;
   }
-  
+  tr_provenance_free(prov); /* memberships keep their own copies */
   return 0;
 }
 
@@ -524,6 +529,7 @@ static int community_test(void)
 {
   TALLOC_CTX *mem_ctx=talloc_new(NULL);
   TR_COMM_TABLE *ctab=tr_comm_table_new(mem_ctx);
+  TR_COMM *first=NULL, *second=NULL;
 
   assert(0==tr_comm_table_size(ctab));
 
@@ -620,6 +626,22 @@ static int community_test(void)
   assert(0==remove_comm_set_member(ctab, comm_set_1, 0));
   assert(0==tr_comm_table_size(ctab));
 
+  /* a community sharing an id with a removed one is still found */
+  first=tr_comm_new(mem_ctx);
+  second=tr_comm_new(mem_ctx);
+  assert((first!=NULL) && (second!=NULL));
+  tr_comm_set_id(first, tr_new_name("dup.example.com"));
+  tr_comm_set_id(second, tr_new_name("dup.example.com"));
+  tr_comm_table_add_comm(ctab, first);
+  tr_comm_table_add_comm(ctab, second);
+  assert(first==tr_comm_table_find_comm(ctab, tr_comm_get_id(first)));
+  tr_comm_table_remove_comm(ctab, first);
+  assert(second==tr_comm_table_find_comm(ctab, tr_comm_get_id(second)));
+  tr_comm_table_remove_comm(ctab, second);
+  assert(NULL==tr_comm_table_find_comm(ctab, tr_comm_get_id(second)));
+  tr_comm_free(first);
+  tr_comm_free(second);
+
   talloc_free(mem_ctx);
   return 0;
 }
@@ -776,15 +798,41 @@ static int membership_test(void)
 {
   TALLOC_CTX *mem_ctx=talloc_new(NULL);
   TR_COMM_TABLE *ctab=tr_comm_table_new(mem_ctx);
+  TR_COMM_ITER *iter=tr_comm_iter_new(mem_ctx);
+  TR_COMM_MEMB *memb=NULL;
+  TR_NAME *realm_name=tr_new_name("rp 2");
+  TR_NAME *comm_name=tr_new_name("comm 1");
+  TR_NAME *origin=tr_new_name("peer 1");
   size_t ii=0;
+  size_t n_memb=0;
   size_t size=0;
 
   assert(ctab!=NULL);
+  assert(iter!=NULL);
   assert(0==add_comm_set(ctab, comm_set_1));
   assert(0==add_rp_realm_set(ctab, rp_realm_set_1));
   assert(0==add_idp_realm_set(ctab, idp_realm_set_1));
   assert(0==add_member_set(ctab, member_set_1));
 
+  /* each membership is visited once, and new ones go out with triggered updates */
+  for (memb=tr_comm_memb_iter_all_first(iter, ctab); memb!=NULL; memb=tr_comm_memb_iter_all_next(iter)) {
+    assert(tr_comm_memb_is_triggered(memb));
+    tr_comm_memb_set_triggered(memb, 0);
+    n_memb++;
+  }
+  for (ii=0; member_set_1[ii].role!=TR_ROLE_UNKNOWN; ii++)
+    ;
+  assert(ii==n_memb);
+
+  /* an unchanged membership received again does not */
+  assert(0==add_comm_membership(ctab, &member_set_1[8]));
+  memb=tr_comm_table_find_rp_memb_origin(ctab, realm_name, comm_name, origin);
+  assert(memb!=NULL);
+  assert(!tr_comm_memb_is_triggered(memb));
+  tr_free_name(realm_name);
+  tr_free_name(comm_name);
+  tr_free_name(origin);
+
   size=tr_comm_table_size(ctab);
   tr_comm_table_sweep(ctab);
   assert(size==tr_comm_table_size(ctab));
@@ -824,6 +872,61 @@ static int membership_test(void)
 
 /**********************************************************************/
 /* main */
+static int provenance_test(void)
+{
+  TALLOC_CTX *mem_ctx=talloc_new(NULL);
+  TR_PROVENANCE *p1=tr_provenance_new(mem_ctx);
+  TR_PROVENANCE *p2=NULL;
+  TR_NAME *a=tr_new_name("a.example.com");
+  TR_NAME *b=tr_new_name("b.example.com");
+  TR_NAME *c=tr_new_name("c.example.com");
+  json_t *jprov=NULL;
+
+  assert(p1!=NULL);
+  assert(0==tr_provenance_len(p1));
+  assert(NULL==tr_provenance_get_origin(p1));
+  assert(!tr_provenance_contains(p1, a));
+
+  assert(0==tr_provenance_add(p1, a));
+  assert(0==tr_provenance_add(p1, b));
+  assert(2==tr_provenance_len(p1));
+  assert(tr_name_equal(a, tr_provenance_get_origin(p1)));
+  assert(tr_provenance_contains(p1, a));
+  assert(tr_provenance_contains(p1, b));
+  assert(!tr_provenance_contains(p1, c));
+
+  /* round trip through the wire format */
+  jprov=tr_provenance_to_json(p1);
+  assert(jprov!=NULL);
+  assert(2==json_array_size(jprov));
+  p2=tr_provenance_from_json(mem_ctx, jprov);
+  json_decref(jprov);
+  assert(p2!=NULL);
+  assert(0==tr_provenance_cmp(p1, p2, 0));
+  assert(tr_provenance_contains(p2, b));
+
+  /* last hop only */
+  assert(0==tr_provenance_add(p1, c));
+  assert(0!=tr_provenance_cmp(p1, p2, 0));
+  assert(0!=tr_provenance_cmp(p1, p2, 1));
+  assert(0==tr_provenance_add(p2, c));
+  assert(0==tr_provenance_cmp(p1, p2, 1));
+  assert(0==tr_provenance_cmp(p1, p2, 0));
+
+  /* entries must all be strings */
+  jprov=json_array();
+  json_array_append_new(jprov, json_string("a.example.com"));
+  json_array_append_new(jprov, json_integer(1));
+  assert(NULL==tr_provenance_from_json(mem_ctx, jprov));
+  json_decref(jprov);
+
+  tr_free_name(a);
+  tr_free_name(b);
+  tr_free_name(c);
+  talloc_free(mem_ctx);
+  return 0;
+}
+
 int main(void)
 {
   assert(0==community_test());
@@ -834,5 +937,7 @@ int main(void)
   printf("IDP realm tests passed.\n");
   assert(0==membership_test());
   printf("Membership tests passed.\n");
+  assert(0==provenance_test());
+  printf("Provenance tests passed.\n");
   return 0;
 }
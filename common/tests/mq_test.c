@@ -34,7 +34,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include <tr_mq.h>
 
@@ -45,118 +48,273 @@ static void notify_cb(TR_MQ *mq, void *arg)
   printf("MQ %s no longer empty.\n", s);
 }
 
-int main(void)
+static TR_MQ_MSG *make_msg(char *message, TR_MQ_PRIORITY prio, const char *text)
+{
+  TR_MQ_MSG *msg=tr_mq_msg_new(NULL, message, prio);
+
+  assert(msg!=NULL);
+  assert(asprintf((char **)&(msg->p), "%s", text)!=-1);
+  msg->p_free=free;
+  return msg;
+}
+
+static void pop_and_print(TR_MQ *mq, TR_MQ_MSG *expected)
+{
+  TR_MQ_MSG *msg=tr_mq_pop(mq, NULL);
+
+  assert(msg==expected);
+  if ((msg!=NULL) && (msg->p!=NULL)) {
+    printf("%s", (char *)msg->p);
+    assert(msg->next==NULL);
+    tr_mq_msg_free(msg);
+  } else
+    printf("no message to pop\n");
+}
+
+/* throughput benchmark: BENCH_PRODUCERS threads adding to one queue */
+#define BENCH_PRODUCERS 32
+#define BENCH_MSGS_PER_PRODUCER 20000
+
+struct bench_producer {
+  TR_MQ *mq;
+  pthread_t thread;
+  int id;
+};
+
+/* the payload pointer carries the sequence number, so no allocation beyond the message */
+static void *bench_produce(void *arg)
+{
+  struct bench_producer *prod=(struct bench_producer *)arg;
+  TR_MQ_MSG *msg=NULL;
+  long ii=0;
+
+  for (ii=0; ii<BENCH_MSGS_PER_PRODUCER; ii++) {
+    msg=tr_mq_msg_new(NULL, "bench", TR_MQ_PRIO_NORMAL);
+    assert(msg!=NULL);
+    tr_mq_msg_set_payload(msg, (void *)(ii*BENCH_PRODUCERS+prod->id), NULL);
+    tr_mq_add(prod->mq, msg);
+  }
+  return NULL;
+}
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec-start->tv_sec)+(end->tv_nsec-start->tv_nsec)/1e9;
+}
+
+static void mq_bench(void)
+{
+  TR_MQ *mq=tr_mq_new(NULL);
+  struct bench_producer prod[BENCH_PRODUCERS];
+  long next_seq[BENCH_PRODUCERS]={0};
+  long total=(long)BENCH_PRODUCERS*BENCH_MSGS_PER_PRODUCER;
+  long n_popped=0;
+  long tag=0;
+  TR_MQ_MSG *msg=NULL;
+  struct timespec start={0,0};
+  struct timespec end={0,0};
+  struct timespec ts_abort={0,0};
+  double secs=0;
+  int ii=0;
+
+  assert(mq!=NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (ii=0; ii<BENCH_PRODUCERS; ii++) {
+    prod[ii].mq=mq;
+    prod[ii].id=ii;
+    assert(0==pthread_create(&(prod[ii].thread), NULL, bench_produce, &prod[ii]));
+  }
+
+  while (n_popped<total) {
+    assert(0==tr_mq_pop_timeout(10, &ts_abort));
+    msg=tr_mq_pop(mq, &ts_abort);
+    assert(msg!=NULL); /* producers stalled */
+    tag=(long)tr_mq_msg_get_payload(msg);
+    ii=tag%BENCH_PRODUCERS;
+    /* each producer's messages must come out in the order it added them */
+    assert(tag/BENCH_PRODUCERS==next_seq[ii]);
+    next_seq[ii]++;
+    tr_mq_msg_free(msg);
+    n_popped++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (ii=0; ii<BENCH_PRODUCERS; ii++)
+    pthread_join(prod[ii].thread, NULL);
+  assert(tr_mq_pop(mq, NULL)==NULL);
+  tr_mq_free(mq);
+
+  secs=elapsed(&start, &end);
+  printf("%d producers, %ld messages in %.3f s: %.0f msgs/sec\n",
+         BENCH_PRODUCERS, total, secs, (secs>0)?(total/secs):0.0);
+}
+
+/* A consumer may free its queue as soon as it pops the last message, while
+ * the producer is still returning from tr_mq_add(). */
+#define REPLY_ROUNDS 10000
+
+static void *reply_produce(void *arg)
+{
+  TR_MQ *mq=(TR_MQ *)arg;
+
+  tr_mq_add(mq, tr_mq_msg_new(NULL, "reply", TR_MQ_PRIO_NORMAL));
+  return NULL;
+}
+
+static void mq_reply_test(void)
 {
   TR_MQ *mq=NULL;
   TR_MQ_MSG *msg=NULL;
+  pthread_t thread;
+  struct timespec ts_abort={0,0};
+  int ii=0;
+
+  for (ii=0; ii<REPLY_ROUNDS; ii++) {
+    mq=tr_mq_new(NULL);
+    assert(mq!=NULL);
+    assert(0==pthread_create(&thread, NULL, reply_produce, mq));
+    assert(0==tr_mq_pop_timeout(10, &ts_abort));
+    msg=tr_mq_pop(mq, &ts_abort);
+    assert(msg!=NULL);
+    tr_mq_msg_free(msg);
+    tr_mq_free(mq);
+    pthread_join(thread, NULL);
+  }
+  printf("%d replies through short-lived queues\n", REPLY_ROUNDS);
+}
+
+/* several threads blocked in tr_mq_pop() on one queue, as the TID forwarding
+ * threads are: every message must be taken without waiting for the timeout */
+#define SHARED_CONSUMERS 8
+#define SHARED_MSGS 20000
+
+struct shared_consumer {
+  TR_MQ *mq;
+  pthread_t thread;
+  long n_popped;
+};
+
+static void *shared_consume(void *arg)
+{
+  struct shared_consumer *cons=(struct shared_consumer *)arg;
+  TR_MQ_MSG *msg=NULL;
+  struct timespec ts_abort={0,0};
+  int done=0;
+
+  while (!done) {
+    assert(0==tr_mq_pop_timeout(10, &ts_abort));
+    msg=tr_mq_pop(cons->mq, &ts_abort);
+    assert(msg!=NULL); /* a wakeup was lost */
+    if (tr_mq_msg_get_prio(msg)==TR_MQ_PRIO_HIGH)
+      done=1;
+    else
+      cons->n_popped++;
+    tr_mq_msg_free(msg);
+  }
+  return NULL;
+}
+
+static void mq_shared_test(void)
+{
+  TR_MQ *mq=tr_mq_new(NULL);
+  struct shared_consumer cons[SHARED_CONSUMERS];
+  long total=0;
+  int ii=0;
+
+  assert(mq!=NULL);
+  for (ii=0; ii<SHARED_CONSUMERS; ii++) {
+    cons[ii].mq=mq;
+    cons[ii].n_popped=0;
+    assert(0==pthread_create(&(cons[ii].thread), NULL, shared_consume, &cons[ii]));
+  }
+  for (ii=0; ii<SHARED_MSGS; ii++) {
+    tr_mq_add(mq, tr_mq_msg_new(NULL, "job", TR_MQ_PRIO_NORMAL));
+    if (ii%100==0)
+      usleep(100); /* let the consumers go back to waiting */
+  }
+  /* wait until the jobs are taken, then tell each consumer to exit */
+  while (1) {
+    tr_mq_lock(mq);
+    ii=(mq->head==NULL) && (mq->stack==NULL);
+    tr_mq_unlock(mq);
+    if (ii)
+      break;
+    usleep(1000);
+  }
+  for (ii=0; ii<SHARED_CONSUMERS; ii++)
+    tr_mq_add(mq, tr_mq_msg_new(NULL, "exit", TR_MQ_PRIO_HIGH));
+  for (ii=0; ii<SHARED_CONSUMERS; ii++) {
+    pthread_join(cons[ii].thread, NULL);
+    total+=cons[ii].n_popped;
+  }
+  assert(total==SHARED_MSGS);
+  assert(tr_mq_pop(mq, NULL)==NULL);
+  tr_mq_free(mq);
+  printf("%d consumers shared %d messages\n", SHARED_CONSUMERS, SHARED_MSGS);
+}
+
+int main(void)
+{
+  TR_MQ *mq=NULL;
   TR_MQ_MSG *msg1=NULL;
   TR_MQ_MSG *msg2=NULL;
   TR_MQ_MSG *msg3=NULL;
   TR_MQ_MSG *msg4=NULL;
+  TR_MQ_MSG *hi1=NULL;
+  TR_MQ_MSG *hi2=NULL;
   char *mq_name="1";
+  struct timespec ts_abort={0,0};
 
   mq=tr_mq_new(NULL);
-  mq->notify_cb=notify_cb;
-  mq->notify_cb_arg=mq_name;
+  assert(mq!=NULL);
+  assert(tr_mq_get_fd(mq)>=0);
+  tr_mq_set_notify_cb(mq, notify_cb, mq_name);
 
-  msg1=tr_mq_msg_new(NULL,"Message 1", TR_MQ_PRIO_NORMAL);
-  assert(asprintf((char **)&(msg1->p), "First message.\n")!=-1);
-  msg1->p_free=free;
+  msg1=make_msg("Message 1", TR_MQ_PRIO_NORMAL, "First message.\n");
   tr_mq_add(mq, msg1);
-  assert(mq->head==msg1);
-  assert(mq->tail==msg1);
-  assert(msg1->next==NULL);
-
-  msg2=tr_mq_msg_new(NULL, "Message 2", TR_MQ_PRIO_NORMAL);
-  assert(asprintf((char **)&(msg2->p), "Second message.\n")!=-1);
-  msg2->p_free=free;
+  msg2=make_msg("Message 2", TR_MQ_PRIO_NORMAL, "Second message.\n");
   tr_mq_add(mq, msg2);
-  assert(mq->head==msg1);
-  assert(msg1->next==msg2);
-  assert(mq->tail==msg2);
-  assert(msg2->next==NULL);
-
-  msg=tr_mq_pop(mq, NULL);
-  assert(msg==msg1);
-  assert(mq->head==msg2);
-  assert(mq->tail==msg2);
-  assert(msg2->next==NULL);
-  if ((msg!=NULL) && (msg->p!=NULL)) {
-    printf("%s", (char *)msg->p);
-    tr_mq_msg_free(msg);
-  } else
-    printf("no message to pop\n");
-  
-  msg3=tr_mq_msg_new(NULL, "Message 3", TR_MQ_PRIO_NORMAL);
-  assert(asprintf((char **)&(msg3->p), "%s", "Third message.\n")!=-1);
-  msg3->p_free=free;
+  pop_and_print(mq, msg1);
+
+  msg3=make_msg("Message 3", TR_MQ_PRIO_NORMAL, "Third message.\n");
   tr_mq_add(mq, msg3);
-  assert(mq->head==msg2);
-  assert(mq->tail==msg3);
-  assert(msg2->next==msg3);
-  assert(msg3->next==NULL);
-
-  msg=tr_mq_pop(mq, NULL);
-  assert(msg==msg2);
-  assert(mq->head==msg3);
-  assert(mq->tail==msg3);
-  assert(msg3->next==NULL);
-  if ((msg!=NULL) && (msg->p!=NULL)) {
-    printf("%s",(char *)msg->p);
-    tr_mq_msg_free(msg);
-  } else
-    printf("no message to pop\n");
-  
-  msg=tr_mq_pop(mq, NULL);
-  assert(msg==msg3);
-  assert(mq->head==NULL);
-  assert(mq->tail==NULL);
-  if ((msg!=NULL) && (msg->p!=NULL)) {
-    printf("%s",(char *)msg->p);
-    tr_mq_msg_free(msg);
-  } else
-    printf("no message to pop\n");
-  
-  msg=tr_mq_pop(mq, NULL);
-  assert(msg==NULL);
-  assert(mq->head==NULL);
-  assert(mq->tail==NULL);
-  if ((msg!=NULL) && (msg->p!=NULL)) {
-    printf("%s",(char *)msg->p);
-    tr_mq_msg_free(msg);
-  } else
-    printf("no message to pop\n");
+  pop_and_print(mq, msg2);
+  pop_and_print(mq, msg3);
+  pop_and_print(mq, NULL);
 
-  msg4=tr_mq_msg_new(NULL, "Message 4", TR_MQ_PRIO_NORMAL);
-  assert(asprintf((char **)&(msg4->p), "%s", "Fourth message.\n")!=-1);
-  msg4->p_free=free;
+  msg4=make_msg("Message 4", TR_MQ_PRIO_NORMAL, "Fourth message.\n");
   tr_mq_add(mq, msg4);
-  assert(mq->head==msg4);
-  assert(mq->tail==msg4);
-  assert(msg4->next==NULL);
-
-  msg=tr_mq_pop(mq, NULL);
-  assert(msg==msg4);
-  assert(mq->head==NULL);
-  assert(mq->tail==NULL);
-  if ((msg!=NULL) && (msg->p!=NULL)) {
-    printf("%s",(char *)msg->p);
-    tr_mq_msg_free(msg);
-  } else
-    printf("no message to pop\n");
-  
-  msg=tr_mq_pop(mq, NULL);
-  assert(msg==NULL);
-  assert(mq->head==NULL);
-  assert(mq->tail==NULL);
-  if ((msg!=NULL) && (msg->p!=NULL)) {
-    printf("%s",(char *)msg->p);
-    tr_mq_msg_free(msg);
-  } else
-    printf("no message to pop\n");
+  pop_and_print(mq, msg4);
+  pop_and_print(mq, NULL);
 
+  /* high priority messages jump the queue but keep their own order */
+  msg1=make_msg("Message 1", TR_MQ_PRIO_NORMAL, "First normal message.\n");
+  tr_mq_add(mq, msg1);
+  hi1=make_msg("High 1", TR_MQ_PRIO_HIGH, "First high priority message.\n");
+  tr_mq_add(mq, hi1);
+  msg2=make_msg("Message 2", TR_MQ_PRIO_NORMAL, "Second normal message.\n");
+  tr_mq_add(mq, msg2);
+  hi2=make_msg("High 2", TR_MQ_PRIO_HIGH, "Second high priority message.\n");
+  tr_mq_add(mq, hi2);
+  pop_and_print(mq, hi1);
+  pop_and_print(mq, hi2);
+  pop_and_print(mq, msg1);
+  pop_and_print(mq, msg2);
+  pop_and_print(mq, NULL);
+
+  /* blocking pop on an empty queue times out */
+  assert(0==tr_mq_pop_timeout_ms(50, &ts_abort));
+  assert(tr_mq_pop(mq, &ts_abort)==NULL);
+
+  /* messages still queued are freed with the queue */
+  tr_mq_add(mq, make_msg("Message 5", TR_MQ_PRIO_NORMAL, "Unread message.\n"));
+  tr_mq_add(mq, make_msg("High 3", TR_MQ_PRIO_HIGH, "Unread high priority message.\n"));
   tr_mq_free(mq);
 
+  mq_reply_test();
+  mq_shared_test();
+  mq_bench();
+
   printf("success\n");
   return 0;
 }
@@ -39,6 +39,7 @@
 #include <talloc.h>
 #include <time.h>
 #include <errno.h>
+#include <poll.h>
 #include <assert.h>
 
 #include <tr_mq.h>
@@ -103,6 +104,67 @@ static void output_messages(TR_MQ *mq)
   fflush(stdout);
 }
 
+/* Throughput benchmark: BENCH_PRODUCERS threads add to one queue while the
+ * consumer waits on tr_mq_get_fd(), as the trust router's event loop does. */
+#define BENCH_PRODUCERS 32
+#define BENCH_MSGS_PER_PRODUCER 20000
+
+static void *bench_produce(void *arg)
+{
+  TR_MQ *mq=(TR_MQ *)arg;
+  TR_MQ_MSG *msg=NULL;
+  int ii=0;
+
+  for (ii=0; ii<BENCH_MSGS_PER_PRODUCER; ii++) {
+    msg=tr_mq_msg_new(NULL, "bench", (ii%16)?TR_MQ_PRIO_NORMAL:TR_MQ_PRIO_HIGH);
+    assert(msg!=NULL);
+    tr_mq_add(mq, msg);
+  }
+  return NULL;
+}
+
+static void fd_bench(void)
+{
+  TR_MQ *mq=tr_mq_new(NULL);
+  pthread_t thread[BENCH_PRODUCERS];
+  struct pollfd pfd={0};
+  TR_MQ_MSG *msg=NULL;
+  long total=(long)BENCH_PRODUCERS*BENCH_MSGS_PER_PRODUCER;
+  long n_popped=0;
+  long n_wakeups=0;
+  struct timespec start={0,0};
+  struct timespec end={0,0};
+  double secs=0;
+  int ii=0;
+
+  assert(mq!=NULL);
+  pfd.fd=tr_mq_get_fd(mq);
+  pfd.events=POLLIN;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (ii=0; ii<BENCH_PRODUCERS; ii++)
+    assert(0==pthread_create(&(thread[ii]), NULL, bench_produce, mq));
+
+  while (n_popped<total) {
+    assert(poll(&pfd, 1, 10000)==1); /* producers stalled if this times out */
+    n_wakeups++;
+    /* drain the queue, which rearms the fd */
+    for (msg=tr_mq_pop(mq, NULL); msg!=NULL; msg=tr_mq_pop(mq, NULL)) {
+      tr_mq_msg_free(msg);
+      n_popped++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (ii=0; ii<BENCH_PRODUCERS; ii++)
+    pthread_join(thread[ii], NULL);
+  tr_mq_free(mq);
+
+  secs=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+  printf("%d producers, %ld messages in %.3f s (%ld wakeups): %.0f msgs/sec\n",
+         BENCH_PRODUCERS, total, secs, n_wakeups, (secs>0)?(total/secs):0.0);
+}
+
 #define N_THREADS 2
 
 int main(void)
@@ -117,8 +179,7 @@ int main(void)
   int wait_result=0;
 
   mq=tr_mq_new(NULL);
-  mq->notify_cb=handle_messages;
-  mq->notify_cb_arg=(void *)&status;
+  tr_mq_set_notify_cb(mq, handle_messages, (void *)&status);
 
   pthread_cond_init(&(status.cond), 0);
   pthread_mutex_init(&(status.lock), 0);
@@ -153,6 +214,10 @@ int main(void)
   printf("\n*** Timeout expired with no new messages. Joining threads and terminating.\n");
   for (ii=0; ii<N_THREADS; ii++)
     pthread_join(thread[ii], NULL);
+  tr_mq_free(mq);
+
+  printf("\nStarting benchmark\n");
+  fd_bench();
 
   printf("success\n");
   return 0;
@@ -168,46 +168,23 @@ unsigned int tr_comm_get_refcount(TR_COMM *comm)
   return comm->refcount;
 }
 
-/* 0 if equivalent, nonzero if different, only considers
- * nhops last hops (nhops==0 means consider all, nhops==1
- * only considers last hop) */
-static int tr_comm_memb_provenance_cmp(TR_COMM_MEMB *m1, TR_COMM_MEMB *m2, int nhops)
-{
-  size_t ii;
-
-  if ((m1->provenance==NULL) || (m2->provenance==NULL))
-    return m1->provenance!=m2->provenance; /* return 0 if both null, 1 if only one null */
-
-  if (json_array_size(m1->provenance)!=json_array_size(m2->provenance))
-    return 1;
-
-  if (nhops==0)
-    nhops=json_array_size(m1->provenance); /* same as size(m2->provenance) */
-
-  for (ii=0; ii<json_array_size(m1->provenance); ii++) {
-    if (0==strcmp(json_string_value(json_array_get(m1->provenance, ii)),
-                  json_string_value(json_array_get(m2->provenance, ii)))) {
-      return 0;
-    }
-  }
-  return 1;
-}
-
 /* Accepts an update that either came from the same peer as the previous
  * origin, has a shorter provenance list, or can replace an expired
  * membership. Otherwise keeps the existing one.
  * On replacement, frees the old member and moves new member to ctab's
  * context. Caller should not free newmemb except by freeing its original
- * context. */
+ * context. A new membership, or a replacement that differs from the one
+ * it replaces, is marked triggered. */
 static void tr_comm_add_if_shorter(TR_COMM_TABLE *ctab, TR_COMM_MEMB *existing, TR_COMM_MEMB *newmemb)
 {
   int accept=0;
 
   if (existing==NULL) {
     /* not in the table */
+    newmemb->triggered=1;
     tr_comm_table_add_memb(ctab, newmemb);
   } else {
-    if (0==tr_comm_memb_provenance_cmp(existing, newmemb, 1))
+    if (0==tr_provenance_cmp(existing->provenance, newmemb->provenance, 1))
       accept=1; /* always accept a replacement from the same peer */
     else if (tr_comm_memb_provenance_len(newmemb) < tr_comm_memb_provenance_len(existing))
       accept=1; /* accept a shorter provenance */
@@ -217,6 +194,7 @@ static void tr_comm_add_if_shorter(TR_COMM_TABLE *ctab, TR_COMM_MEMB *existing,
       accept=0;
 
     if (accept) {
+      newmemb->triggered=existing->triggered || (0!=tr_comm_memb_cmp(existing, newmemb));
       tr_comm_table_remove_memb(ctab, existing);
       tr_comm_memb_free(existing);
       tr_comm_table_add_memb(ctab, newmemb);
@@ -229,7 +207,7 @@ void tr_comm_add_idp_realm(TR_COMM_TABLE *ctab,
                            TR_COMM *comm,
                            TR_IDP_REALM *realm,
                            unsigned int interval,
-                           json_t *provenance,
+                           TR_PROVENANCE *provenance,
                            struct timespec *expiry)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -262,7 +240,7 @@ void tr_comm_add_rp_realm(TR_COMM_TABLE *ctab,
                           TR_COMM *comm,
                           TR_RP_REALM *realm,
                           unsigned int interval,
-                          json_t *provenance,
+                          TR_PROVENANCE *provenance,
                           struct timespec *expiry)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -383,67 +361,38 @@ static TR_COMM *tr_comm_sweep_func(TR_COMM *head)
   return head;
 }
 
+/* Does not allocate, called for every TID request. */
 TR_IDP_REALM *tr_comm_find_idp(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *idp_realm)
 {
-  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  TR_COMM_ITER *iter=NULL;
-  TR_IDP_REALM *this_idp=NULL;
+  TR_COMM_MEMB *memb=NULL;
 
-  if ((NULL==ctab) || (NULL==comm) || (NULL==idp_realm)) {
-    talloc_free(tmp_ctx);
+  if ((NULL==ctab) || (NULL==comm) || (NULL==idp_realm))
     return NULL;
-  }
 
-  iter=tr_comm_iter_new(tmp_ctx);
-  for (this_idp=tr_idp_realm_iter_first(iter, ctab, tr_comm_get_id(comm));
-       this_idp!=NULL;
-       this_idp=tr_idp_realm_iter_next(iter)) {
-    if (0==tr_name_cmp(idp_realm, tr_idp_realm_get_id(this_idp))) {
-      tr_debug("tr_comm_find_idp: Found IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
-      talloc_free(tmp_ctx);
-      return this_idp;
-    }
+  memb=tr_comm_table_find_idp_memb(ctab, idp_realm, tr_comm_get_id(comm));
+  if (memb==NULL) {
+    tr_debug("tr_comm_find_idp: Unable to find IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
+    return NULL;
   }
-  tr_debug("tr_comm_find_idp: Unable to find IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
-  talloc_free(tmp_ctx);
-  return NULL;
+  tr_debug("tr_comm_find_idp: Found IdP %s in community %s.", idp_realm->buf, tr_comm_get_id(comm)->buf);
+  return tr_comm_memb_get_idp_realm(memb);
 }
 
+/* Does not allocate, called for every TID request. */
 TR_RP_REALM *tr_comm_find_rp (TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *rp_realm)
 {
-  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  TR_COMM_ITER *iter=NULL;
-  TR_RP_REALM *this_rp=NULL;
+  TR_COMM_MEMB *memb=NULL;
 
-  if ((NULL==ctab) || (NULL==comm) || (NULL==rp_realm)) {
-    talloc_free(tmp_ctx);
+  if ((NULL==ctab) || (NULL==comm) || (NULL==rp_realm))
     return NULL;
-  }
-
-  iter=tr_comm_iter_new(tmp_ctx);
-  for (this_rp=tr_rp_realm_iter_first(iter, ctab, tr_comm_get_id(comm));
-       this_rp!=NULL;
-       this_rp=tr_rp_realm_iter_next(iter)) {
-    if (0==tr_name_cmp(rp_realm, tr_rp_realm_get_id(this_rp))) {
-      tr_debug("tr_comm_find_rp: Found RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
-      talloc_free(tmp_ctx);
-      return this_rp;
-    }
-  }
-  tr_debug("tr_comm_find_rp: Unable to find RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
-  talloc_free(tmp_ctx);
-  return NULL;
-}
-
-static TR_COMM *tr_comm_lookup(TR_COMM *comms, TR_NAME *comm_name) 
-{
-  TR_COMM *cfg_comm = NULL;
 
-  for (cfg_comm = comms; NULL != cfg_comm; cfg_comm = cfg_comm->next) {
-    if (0==tr_name_cmp(cfg_comm->id, comm_name))
-      return cfg_comm;
+  memb=tr_comm_table_find_rp_memb(ctab, rp_realm, tr_comm_get_id(comm));
+  if (memb==NULL) {
+    tr_debug("tr_comm_find_rp: Unable to find RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
+    return NULL;
   }
-  return NULL;
+  tr_debug("tr_comm_find_rp: Found RP %s in community %s.", rp_realm->buf, tr_comm_get_id(comm)->buf);
+  return tr_comm_memb_get_rp_realm(memb);
 }
 
 TR_COMM_ITER *tr_comm_iter_new(TALLOC_CTX *mem_ctx)
@@ -455,6 +404,8 @@ TR_COMM_ITER *tr_comm_iter_new(TALLOC_CTX *mem_ctx)
     iter->cur_orig_head=NULL;
     iter->match=NULL;
     iter->realm=NULL;
+    iter->membs=NULL;
+    iter->memb_idx=0;
   }
   return iter;
 }
@@ -464,86 +415,71 @@ void tr_comm_iter_free(TR_COMM_ITER *iter)
   talloc_free(iter);
 }
 
-
-TR_COMM *tr_comm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
+/* Step along the index bucket in iter->membs to the next membership
+ * with the requested role. TR_ROLE_UNKNOWN matches either role. */
+static TR_COMM_MEMB *tr_comm_iter_next_memb(TR_COMM_ITER *iter, TR_REALM_ROLE role)
 {
-  iter->match=realm;
+  TR_COMM_MEMB *memb=NULL;
 
-  /* find memberships for this realm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb)))
-      return tr_comm_memb_get_comm(iter->cur_memb);
+  while ((iter->membs!=NULL) && (iter->memb_idx < iter->membs->len)) {
+    memb=g_ptr_array_index(iter->membs, iter->memb_idx++);
+    if ((role==TR_ROLE_UNKNOWN) || (role==tr_comm_memb_get_role(memb)))
+      return iter->cur_memb=memb;
   }
-  return NULL;
+  return iter->cur_memb=NULL;
+}
+
+/* Start walking the bucket for key in one of the by-comm or by-realm indexes */
+static TR_COMM_MEMB *tr_comm_iter_first_memb(TR_COMM_ITER *iter,
+                                             GHashTable *index,
+                                             TR_NAME *key,
+                                             TR_REALM_ROLE role)
+{
+  iter->match=key;
+  iter->membs=NULL;
+  iter->memb_idx=0;
+  if ((index!=NULL) && (key!=NULL))
+    iter->membs=g_hash_table_lookup(index, key);
+  return tr_comm_iter_next_memb(iter, role);
+}
+
+static TR_COMM *tr_comm_memb_comm_or_null(TR_COMM_MEMB *memb)
+{
+  if (memb==NULL)
+    return NULL;
+  return tr_comm_memb_get_comm(memb);
+}
+
+TR_COMM *tr_comm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
+{
+  return tr_comm_memb_comm_or_null(tr_comm_iter_first_memb(iter, ctab->realm_index, realm, TR_ROLE_UNKNOWN));
 }
 
 TR_COMM *tr_comm_iter_next(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb)))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_comm_memb_comm_or_null(tr_comm_iter_next_memb(iter, TR_ROLE_UNKNOWN));
 }
 
 /* iterate only over RPs */
 TR_COMM *tr_comm_iter_first_rp(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
 {
-  iter->match=realm;
-
-  /* find memberships for this realm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_comm_memb_comm_or_null(tr_comm_iter_first_memb(iter, ctab->realm_index, realm, TR_ROLE_RP));
 }
 
 TR_COMM *tr_comm_iter_next_rp(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_comm_memb_comm_or_null(tr_comm_iter_next_memb(iter, TR_ROLE_RP));
 }
 
 /* iterate only over IDPs */
 TR_COMM *tr_comm_iter_first_idp(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *realm)
 {
-  iter->match=realm;
-
-  /* find memberships for this realm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_comm_memb_comm_or_null(tr_comm_iter_first_memb(iter, ctab->realm_index, realm, TR_ROLE_IDP));
 }
 
 TR_COMM *tr_comm_iter_next_idp(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_memb_get_realm_id(iter->cur_memb))))
-      return tr_comm_memb_get_comm(iter->cur_memb);
-  }
-  return NULL;
+  return tr_comm_memb_comm_or_null(tr_comm_iter_next_memb(iter, TR_ROLE_IDP));
 }
 
 static TR_REALM *tr_realm_new(TALLOC_CTX *mem_ctx)
@@ -596,39 +532,37 @@ TR_NAME *tr_realm_dup_id(TR_REALM *realm)
   return tr_dup_name(tr_realm_get_id(realm));
 }
 
+/* Point iter->realm at the realm of memb. Frees iter->realm and returns NULL
+ * if there is no such realm. */
+static TR_REALM *tr_realm_iter_set(TR_COMM_ITER *iter, TR_COMM_MEMB *memb)
+{
+  if (memb!=NULL) {
+    /* found a match, determine whether it's an rp realm or an idp realm */
+    if (tr_comm_memb_get_rp_realm(memb)!=NULL) {
+      tr_realm_set_rp(iter->realm, tr_comm_memb_get_rp_realm(memb));
+      return iter->realm;
+    } else if (tr_comm_memb_get_idp_realm(memb)!=NULL) {
+      tr_realm_set_idp(iter->realm, tr_comm_memb_get_idp_realm(memb));
+      return iter->realm;
+    }
+  }
+  if (iter->realm!=NULL)
+    tr_realm_free(iter->realm);
+  iter->realm=NULL;
+  return NULL;
+}
+
 /* Iterate over either sort of realm. Do not free the TR_REALM returned. It becomes
  * undefined/invalid after the next operation affecting the iterator. */
 TR_REALM *tr_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *comm)
 {
-  iter->match=comm;
   if (iter->realm==NULL)
     iter->realm=tr_realm_new(iter);
   if (iter->realm==NULL)
     return NULL;
 
   /* find memberships for this comm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match,
-                       tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))) {
-      /* found a match, determine whether it's an rp realm or an idp realm */
-      if (tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_rp(iter->realm, tr_comm_memb_get_rp_realm(iter->cur_memb));
-      else if (tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_idp(iter->realm, tr_comm_memb_get_idp_realm(iter->cur_memb));
-      else {
-        if (iter->realm!=NULL)
-          tr_realm_free(iter->realm);
-        iter->realm=NULL;
-      }
-      return iter->realm;
-    }
-  }
-  if (iter->realm!=NULL)
-    tr_realm_free(iter->realm);
-  iter->realm=NULL;
-  return NULL;
+  return tr_realm_iter_set(iter, tr_comm_iter_first_memb(iter, ctab->comm_index, comm, TR_ROLE_UNKNOWN));
 }
 
 TR_REALM *tr_realm_iter_next(TR_COMM_ITER *iter)
@@ -636,83 +570,31 @@ TR_REALM *tr_realm_iter_next(TR_COMM_ITER *iter)
   if (iter->realm==NULL)
     return NULL;
 
-  /* find memberships for this comm */
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if (0==tr_name_cmp(iter->match,
-                       tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))) {
-      /* found a match, determine whether it's an rp realm or an idp realm */
-      if (tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_rp(iter->realm, tr_comm_memb_get_rp_realm(iter->cur_memb));
-      else if (tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL)
-        tr_realm_set_idp(iter->realm, tr_comm_memb_get_idp_realm(iter->cur_memb));
-      else {
-        if (iter->realm!=NULL)
-          tr_realm_free(iter->realm);
-        iter->realm=NULL;
-      }
-      return iter->realm;
-    }
-  }
-  if (iter->realm!=NULL)
-    tr_realm_free(iter->realm);
-  iter->realm=NULL;
-  return NULL;
+  return tr_realm_iter_set(iter, tr_comm_iter_next_memb(iter, TR_ROLE_UNKNOWN));
 }
 
 TR_RP_REALM *tr_rp_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *comm)
 {
-  iter->match=comm;
-
-  /* find memberships for this comm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_rp_realm(iter->cur_memb);
-  }
-  return NULL;
+  TR_COMM_MEMB *memb=tr_comm_iter_first_memb(iter, ctab->comm_index, comm, TR_ROLE_RP);
+  return (memb==NULL)?NULL:tr_comm_memb_get_rp_realm(memb);
 }
 
 TR_RP_REALM *tr_rp_realm_iter_next(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_rp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_rp_realm(iter->cur_memb);
-  }
-  return NULL;
+  TR_COMM_MEMB *memb=tr_comm_iter_next_memb(iter, TR_ROLE_RP);
+  return (memb==NULL)?NULL:tr_comm_memb_get_rp_realm(memb);
 }
 
 TR_IDP_REALM *tr_idp_realm_iter_first(TR_COMM_ITER *iter, TR_COMM_TABLE *ctab, TR_NAME *comm)
 {
-  iter->match=comm;
-
-  /* find memberships for this comm */
-  for (iter->cur_memb=ctab->memberships;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_idp_realm(iter->cur_memb);
-  }
-  return NULL;
+  TR_COMM_MEMB *memb=tr_comm_iter_first_memb(iter, ctab->comm_index, comm, TR_ROLE_IDP);
+  return (memb==NULL)?NULL:tr_comm_memb_get_idp_realm(memb);
 }
 
 TR_IDP_REALM *tr_idp_realm_iter_next(TR_COMM_ITER *iter)
 {
-  for (iter->cur_memb=iter->cur_memb->next;
-       iter->cur_memb!=NULL;
-       iter->cur_memb=iter->cur_memb->next) {
-    if ((tr_comm_memb_get_idp_realm(iter->cur_memb)!=NULL) &&
-        (0==tr_name_cmp(iter->match, tr_comm_get_id(tr_comm_memb_get_comm(iter->cur_memb)))))
-      return tr_comm_memb_get_idp_realm(iter->cur_memb);
-  }
-  return NULL;
+  TR_COMM_MEMB *memb=tr_comm_iter_next_memb(iter, TR_ROLE_IDP);
+  return (memb==NULL)?NULL:tr_comm_memb_get_idp_realm(memb);
 }
 
 /* iterators for all communities in a table */
@@ -769,18 +651,17 @@ TR_COMM_MEMB *tr_comm_memb_iter_all_first(TR_COMM_ITER *iter, TR_COMM_TABLE *cta
   return iter->cur_memb;
 }
 
+/* walks each origin list before moving on to the next main list entry */
 TR_COMM_MEMB *tr_comm_memb_iter_all_next(TR_COMM_ITER *iter)
 {
-  if (iter->cur_memb->next==NULL) {
-    if (iter->cur_orig_head->next==NULL) {
-      /* we're done */
-      return NULL;
-    } else {
-      iter->cur_memb=iter->cur_orig_head->next;
-      iter->cur_orig_head=iter->cur_orig_head->next;
-    }
-  } else {
+  if (iter->cur_memb==NULL)
+    return NULL;
+
+  if (iter->cur_memb->origin_next!=NULL)
     iter->cur_memb=iter->cur_memb->origin_next;
+  else {
+    iter->cur_orig_head=iter->cur_orig_head->next;
+    iter->cur_memb=iter->cur_orig_head;
   }
   return iter->cur_memb;
 }
@@ -808,8 +689,6 @@ static int tr_comm_memb_destructor(void *obj)
     tr_idp_realm_decref(memb->idp);
   if (memb->comm!=NULL)
     tr_comm_decref(memb->comm);
-  if (memb->provenance!=NULL)
-    json_decref(memb->provenance);
   return 0;
 }
 
@@ -818,6 +697,7 @@ TR_COMM_MEMB *tr_comm_memb_new(TALLOC_CTX *mem_ctx)
   TR_COMM_MEMB *memb=talloc(mem_ctx, TR_COMM_MEMB);
   if (memb!=NULL) {
     memb->next=NULL;
+    memb->prev=NULL;
     memb->origin_next=NULL;
     memb->idp=NULL;
     memb->rp=NULL;
@@ -850,7 +730,7 @@ int tr_comm_memb_cmp(TR_COMM_MEMB *m1, TR_COMM_MEMB *m2)
   if ((m1->idp==m2->idp) &&
       (m1->rp==m2->rp) &&
       (m1->comm==m2->comm) &&
-      (tr_comm_memb_provenance_cmp(m1, m2, 0)==0) &&
+      (tr_provenance_cmp(m1->provenance, m2->provenance, 0)==0) &&
       (m1->interval==m2->interval))
     return 0;
   return 1;
@@ -934,62 +814,51 @@ TR_NAME *tr_comm_memb_dup_origin(TR_COMM_MEMB *memb)
   return NULL;
 }
 
-json_t *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb)
+TR_PROVENANCE *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb)
 {
   if (memb!=NULL)
     return memb->provenance;
   return NULL;
 }
 
-void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, json_t *prov)
+/* Copies prov, caller keeps ownership of the original */
+void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, TR_PROVENANCE *prov)
 {
-  const char *s=NULL;
-
   if (memb->provenance)
-    json_decref(memb->provenance);
+    tr_provenance_free(memb->provenance);
 
-  memb->provenance=prov;
-  if (prov!=NULL) {
-    json_incref(prov);
+  memb->provenance=tr_provenance_dup(memb, prov);
+  if ((prov!=NULL) && (memb->provenance==NULL))
+    tr_err("tr_comm_memb_set_provenance: unable to allocate provenance list.");
 
-    /* next line sets origin to NULL if provenance is empty because jansson
-     * routines return NULL on error */
-    s=json_string_value(json_array_get(prov, 0));
-    if (s==NULL)
-      tr_comm_memb_set_origin(memb, NULL);
-    else
-      memb->origin=tr_new_name(s);
-  } else {
-    tr_comm_memb_set_origin(memb, NULL);
-  }
+  /* origin is NULL if provenance is empty */
+  tr_comm_memb_set_origin(memb, tr_dup_name(tr_provenance_get_origin(memb->provenance)));
 }
 
 void tr_comm_memb_add_to_provenance(TR_COMM_MEMB *memb, TR_NAME *hop)
 {
   if (memb->provenance==NULL) {
-    memb->provenance=json_array();
+    memb->provenance=tr_provenance_new(memb);
     if (memb->provenance==NULL) {
       tr_err("tr_comm_memb_add_to_provenance: unable to allocate provenance list.");
       return;
     }
+  }
+  if (tr_provenance_len(memb->provenance)==0) {
     /* this is the first entry in the provenance, so it is the origin */
     tr_comm_memb_set_origin(memb,tr_dup_name(hop));
     if (memb->origin==NULL) {
       tr_err("tr_comm_memb_add_to_provenance: unable to allocate origin.");
-      json_decref(memb->provenance);
-      memb->provenance=NULL;
       return;
     }
   }
-  if (0!=json_array_append_new(memb->provenance, tr_name_to_json_string(hop)))
+  if (0!=tr_provenance_add(memb->provenance, hop))
     tr_err("tr_comm_memb_add_to_provenance: unable to extend provenance list.");
 }
 
 size_t tr_comm_memb_provenance_len(TR_COMM_MEMB *memb)
 {
-  if (memb->provenance==NULL)
-    return 0;
-  return json_array_size(memb->provenance);
+  return tr_provenance_len(memb->provenance);
 }
 
 void tr_comm_memb_set_interval(TR_COMM_MEMB *memb, unsigned int interval)
@@ -1057,14 +926,111 @@ unsigned int tr_comm_memb_get_times_expired(TR_COMM_MEMB *memb)
   return memb->times_expired;
 }
 
+/* key for the (realm, comm, role) membership index; owns its names */
+typedef struct tr_comm_memb_key {
+  TR_NAME *realm;
+  TR_NAME *comm;
+  TR_REALM_ROLE role;
+} TR_COMM_MEMB_KEY;
+
+static guint tr_comm_memb_key_hash(gconstpointer key)
+{
+  const TR_COMM_MEMB_KEY *mk=(const TR_COMM_MEMB_KEY *)key;
+  return 31*(31*tr_name_hash(mk->comm) + tr_name_hash(mk->realm)) + mk->role;
+}
+
+static gboolean tr_comm_memb_key_equal(gconstpointer key1, gconstpointer key2)
+{
+  const TR_COMM_MEMB_KEY *mk1=(const TR_COMM_MEMB_KEY *)key1;
+  const TR_COMM_MEMB_KEY *mk2=(const TR_COMM_MEMB_KEY *)key2;
+  return (mk1->role==mk2->role)
+         && tr_name_equal(mk1->comm, mk2->comm)
+         && tr_name_equal(mk1->realm, mk2->realm);
+}
+
+static void tr_comm_memb_key_destroy(gpointer data)
+{
+  TR_COMM_MEMB_KEY *mk=(TR_COMM_MEMB_KEY *)data;
+  tr_free_name(mk->realm);
+  tr_free_name(mk->comm);
+  g_free(mk);
+}
+
+static TR_COMM_MEMB_KEY *tr_comm_memb_key_new(TR_COMM_MEMB *memb)
+{
+  TR_COMM_MEMB_KEY *mk=g_malloc(sizeof(TR_COMM_MEMB_KEY));
+  mk->realm=tr_dup_name(tr_comm_memb_get_realm_id(memb));
+  mk->comm=tr_comm_dup_id(tr_comm_memb_get_comm(memb));
+  mk->role=tr_comm_memb_get_role(memb);
+  return mk;
+}
+
+static guint tr_comm_name_hash(gconstpointer key)
+{
+  return tr_name_hash((TR_NAME *)key);
+}
+
+static gboolean tr_comm_name_equal(gconstpointer key1, gconstpointer key2)
+{
+  return tr_name_equal((TR_NAME *)key1, (TR_NAME *)key2);
+}
+
+static void tr_comm_name_destroy(gpointer data)
+{
+  tr_free_name((TR_NAME *)data);
+}
+
+static void tr_comm_bucket_destroy(gpointer data)
+{
+  g_ptr_array_unref((GPtrArray *)data);
+}
+
+static GHashTable *tr_comm_name_index_new(void)
+{
+  return g_hash_table_new_full(tr_comm_name_hash,
+                               tr_comm_name_equal,
+                               tr_comm_name_destroy,
+                               tr_comm_bucket_destroy);
+}
+
+static int tr_comm_table_destructor(void *obj)
+{
+  TR_COMM_TABLE *ctab=talloc_get_type_abort(obj, TR_COMM_TABLE);
+  if (ctab->memb_index!=NULL)
+    g_hash_table_destroy(ctab->memb_index);
+  if (ctab->comm_index!=NULL)
+    g_hash_table_destroy(ctab->comm_index);
+  if (ctab->realm_index!=NULL)
+    g_hash_table_destroy(ctab->realm_index);
+  if (ctab->comm_by_id!=NULL)
+    g_hash_table_destroy(ctab->comm_by_id);
+  if (ctab->idp_realm_by_id!=NULL)
+    g_hash_table_destroy(ctab->idp_realm_by_id);
+  if (ctab->rp_realm_by_id!=NULL)
+    g_hash_table_destroy(ctab->rp_realm_by_id);
+  return 0;
+}
+
 TR_COMM_TABLE *tr_comm_table_new(TALLOC_CTX *mem_ctx)
 {
   TR_COMM_TABLE *ctab=talloc(mem_ctx, TR_COMM_TABLE);
   if (ctab!=NULL) {
     ctab->comms=NULL;
     ctab->memberships=NULL;
+    ctab->memberships_tail=NULL;
     ctab->idp_realms=NULL;
     ctab->rp_realms=NULL;
+    ctab->memb_index=g_hash_table_new_full(tr_comm_memb_key_hash,
+                                           tr_comm_memb_key_equal,
+                                           tr_comm_memb_key_destroy,
+                                           NULL);
+    ctab->comm_index=tr_comm_name_index_new();
+    ctab->realm_index=tr_comm_name_index_new();
+    /* keys belong to the comm/realm records, which remove themselves before being freed */
+    ctab->comm_by_id=g_hash_table_new(tr_comm_name_hash, tr_comm_name_equal);
+    ctab->idp_realm_by_id=g_hash_table_new(tr_comm_name_hash, tr_comm_name_equal);
+    ctab->rp_realm_by_id=g_hash_table_new(tr_comm_name_hash, tr_comm_name_equal);
+    talloc_set_destructor((void *)ctab, tr_comm_table_destructor);
   }
   return ctab;
 }
@@ -1074,14 +1040,80 @@ void tr_comm_table_free(TR_COMM_TABLE *ctab)
   talloc_free(ctab);
 }
 
-static TR_REALM_ROLE tr_comm_memb_role(TR_COMM_MEMB *memb)
+/* Head of the origin list for a realm/comm/role, or NULL if none */
+static TR_COMM_MEMB *tr_comm_table_lookup_memb(TR_COMM_TABLE *ctab,
+                                               TR_NAME *realm,
+                                               TR_NAME *comm,
+                                               TR_REALM_ROLE role)
 {
-  if (memb->rp!=NULL)
-    return TR_ROLE_RP;
-  if (memb->idp!=NULL)
-    return TR_ROLE_IDP;
+  TR_COMM_MEMB_KEY key={realm, comm, role};
 
-  return TR_ROLE_UNKNOWN;
+  if ((realm==NULL) || (comm==NULL))
+    return NULL;
+  return g_hash_table_lookup(ctab->memb_index, &key);
+}
+
+/* Add memb to the bucket for name in a by-comm or by-realm index */
+static void tr_comm_name_index_add(GHashTable *index, TR_NAME *name, TR_COMM_MEMB *memb)
+{
+  GPtrArray *bucket=g_hash_table_lookup(index, name);
+
+  if (bucket==NULL) {
+    bucket=g_ptr_array_new();
+    g_hash_table_insert(index, tr_dup_name(name), bucket);
+  }
+  g_ptr_array_add(bucket, memb);
+}
+
+/* Replace memb in the bucket for name with repl, or drop it if repl is NULL.
+ * Empty buckets are removed. */
+static void tr_comm_name_index_replace(GHashTable *index, TR_NAME *name, TR_COMM_MEMB *memb, TR_COMM_MEMB *repl)
+{
+  GPtrArray *bucket=g_hash_table_lookup(index, name);
+  guint ii=0;
+
+  if (bucket==NULL)
+    return;
+
+  for (ii=0; ii<bucket->len; ii++) {
+    if (g_ptr_array_index(bucket, ii)==memb)
+      break;
+  }
+  if (ii==bucket->len)
+    return; /* not present */
+
+  if (repl!=NULL)
+    bucket->pdata[ii]=repl;
+  else {
+    g_ptr_array_remove_index(bucket, ii); /* keeps list order for iterators */
+    if (bucket->len==0)
+      g_hash_table_remove(index, name);
+  }
+}
+
+/* memb has become the head of its origin list */
+static void tr_comm_table_index_head(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb)
+{
+  g_hash_table_insert(ctab->memb_index, tr_comm_memb_key_new(memb), memb);
+  tr_comm_name_index_add(ctab->comm_index, tr_comm_get_id(tr_comm_memb_get_comm(memb)), memb);
+  tr_comm_name_index_add(ctab->realm_index, tr_comm_memb_get_realm_id(memb), memb);
+}
+
+/* memb is no longer the head of its origin list. If repl is not NULL,
+ * it takes over memb's place in the indexes. */
+static void tr_comm_table_unindex_head(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb, TR_COMM_MEMB *repl)
+{
+  TR_COMM_MEMB_KEY key={tr_comm_memb_get_realm_id(memb),
+                        tr_comm_get_id(tr_comm_memb_get_comm(memb)),
+                        tr_comm_memb_get_role(memb)};
+
+  if (repl!=NULL)
+    g_hash_table_replace(ctab->memb_index, tr_comm_memb_key_new(repl), repl);
+  else
+    g_hash_table_remove(ctab->memb_index, &key);
+
+  tr_comm_name_index_replace(ctab->comm_index, key.comm, memb, repl);
+  tr_comm_name_index_replace(ctab->realm_index, key.realm, memb, repl);
 }
 
 void tr_comm_table_add_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *new)
@@ -1093,35 +1125,25 @@ void tr_comm_table_add_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *new)
     tr_debug("tr_comm_table_add_memb: attempting to add member already in a list.");
   }
 
-  /* handle the empty list case */
-  if (ctab->memberships==NULL) {
-    ctab->memberships=new;
-    talloc_steal(ctab, new);
-    return;
-  }
-
-  /* The list was not empty. See if we already have a membership for this realm/comm/role */
-  switch (tr_comm_memb_role(new)) {
-  case TR_ROLE_RP:
-    cur=tr_comm_table_find_rp_memb(ctab,
-                                   tr_rp_realm_get_id(tr_comm_memb_get_rp_realm(new)),
-                                   tr_comm_get_id(tr_comm_memb_get_comm(new)));
-    break;
-  case TR_ROLE_IDP:
-    cur=tr_comm_table_find_idp_memb(ctab,
-                                    tr_idp_realm_get_id(tr_comm_memb_get_idp_realm(new)),
-                                    tr_comm_get_id(tr_comm_memb_get_comm(new)));
-    break;
-  case TR_ROLE_UNKNOWN:
-  default:
+  if (tr_comm_memb_get_role(new)==TR_ROLE_UNKNOWN) {
     tr_err("tr_comm_table_add_memb: realm with unknown role added.");
-    cur=NULL;
+    return;
   }
 
+  /* See if we already have a membership for this realm/comm/role */
+  cur=tr_comm_table_lookup_memb(ctab,
+                                tr_comm_memb_get_realm_id(new),
+                                tr_comm_get_id(tr_comm_memb_get_comm(new)),
+                                tr_comm_memb_get_role(new));
   if (cur==NULL) {
     /* no entry for this realm/comm/role, tack it on the end */
-    for (cur=ctab->memberships; cur->next!=NULL; cur=cur->next) { }
-    cur->next=new;
+    new->prev=ctab->memberships_tail;
+    if (ctab->memberships_tail==NULL)
+      ctab->memberships=new;
+    else
+      ctab->memberships_tail->next=new;
+    ctab->memberships_tail=new;
+    tr_comm_table_index_head(ctab, new);
   } else {
     /* Found an entry. Add to the end of its same-origin list. */
     while (cur->origin_next!=NULL) {
@@ -1136,62 +1158,55 @@ void tr_comm_table_add_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *new)
 /* Remove memb from ctab. Do not free anything. Do nothing if memb not in ctab. */
 void tr_comm_table_remove_memb(TR_COMM_TABLE *ctab, TR_COMM_MEMB *memb)
 {
-  TR_COMM_MEMB *cur=NULL; /* for walking the main list */
-  TR_COMM_MEMB *orig_cur=NULL; /* for walking the origin list */
+  TR_COMM_MEMB *head=NULL;
+  TR_COMM_MEMB *cur=NULL; /* for walking the origin list */
+  TR_COMM_MEMB *repl=NULL; /* replaces memb on the main list */
 
   if ((memb==NULL) || (ctab->memberships==NULL))
     return;
 
-  /* see if it's the first member */
-  if (ctab->memberships==memb) {
-    if (memb->origin_next!=NULL) {
-      memb->origin_next->next=memb->next;
-      ctab->memberships=memb->origin_next;
-    } else
-      ctab->memberships=memb->next;
-
+  head=tr_comm_table_lookup_memb(ctab,
+                                 tr_comm_memb_get_realm_id(memb),
+                                 tr_comm_get_id(tr_comm_memb_get_comm(memb)),
+                                 tr_comm_memb_get_role(memb));
+  if (head==NULL)
     return;
-  }
-
-  /* see if it's in first member's origin list */
-  for (orig_cur=ctab->memberships;
-       orig_cur->origin_next!=NULL;
-       orig_cur=orig_cur->origin_next) {
-    if (orig_cur->origin_next==memb) {
-      orig_cur->origin_next=memb->origin_next;
-      return;
-    }
-  }
 
-  /* now we have to walk the rest of the tree */
-  for (cur=ctab->memberships; cur->next!=NULL; cur=cur->next) {
-    if (cur->next==memb) {
-      /* it matched an entry on the main list */
-      if (memb->origin_next==NULL)
-        cur->next=memb->next; /* no origin list, just drop memb */
-      else {
-        /* replace the entry in the main list with the next element on the origin list */
-        memb->origin_next->next=memb->next;
-        cur->next=memb->origin_next;
-      }
-      return;
-    } else {
-      /* it was not on the main list, walk the origin list */
-      for (orig_cur=cur; orig_cur->origin_next!=NULL; orig_cur=orig_cur->origin_next) {
-        if (orig_cur->origin_next==memb) {
-          orig_cur->origin_next=memb->origin_next;
-          return; /* just drop the element from the origin list */
-        }
+  if (head!=memb) {
+    /* not on the main list, just drop the element from the origin list */
+    for (cur=head; cur->origin_next!=NULL; cur=cur->origin_next) {
+      if (cur->origin_next==memb) {
+        cur->origin_next=memb->origin_next;
+        memb->origin_next=NULL;
+        return;
       }
     }
+    return;
   }
-  /* if we got here, cur->next was null. Still have to check the origin_next list */
-  for (orig_cur=cur; orig_cur->origin_next!=NULL; orig_cur=orig_cur->origin_next) {
-    if (orig_cur->origin_next==memb) {
-      orig_cur->origin_next=memb->origin_next;
-      return; /* just drop the element from the origin list */
-    }
-  }
+
+  /* it matched an entry on the main list, replace it with the next element
+   * on its origin list if there is one */
+  repl=memb->origin_next;
+  if (repl!=NULL) {
+    repl->prev=memb->prev;
+    repl->next=memb->next;
+  } else
+    repl=memb->next;
+
+  if (memb->prev==NULL)
+    ctab->memberships=repl;
+  else
+    memb->prev->next=repl;
+
+  if (memb->next==NULL)
+    ctab->memberships_tail=(memb->origin_next!=NULL)?memb->origin_next:memb->prev;
+  else
+    memb->next->prev=(memb->origin_next!=NULL)?memb->origin_next:memb->prev;
+
+  tr_comm_table_unindex_head(ctab, memb, memb->origin_next);
+  memb->next=NULL;
+  memb->prev=NULL;
+  memb->origin_next=NULL;
 }
 
 TR_NAME *tr_comm_memb_get_realm_id(TR_COMM_MEMB *memb)
@@ -1202,24 +1217,14 @@ TR_NAME *tr_comm_memb_get_realm_id(TR_COMM_MEMB *memb)
     return tr_idp_realm_get_id(memb->idp);
 }
 
-/* find a membership from any origin */
+/* find a membership from any origin, prefers the IdP membership if the realm
+ * is in the community in both roles */
 TR_COMM_MEMB *tr_comm_table_find_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
 {
-  TR_COMM_MEMB *cur=NULL;
-  TR_NAME *cur_realm_name=NULL;
-
-  for (cur=ctab->memberships; cur!=NULL; cur=cur->next) {
-    cur_realm_name=tr_comm_memb_get_realm_id(cur);
-    if (cur_realm_name==NULL) {
-      tr_warning("tr_comm_table_find: encountered realm with no name.");
-      continue;
-    }
-    if ((0==tr_name_cmp(realm, cur_realm_name)) &&
-        (0==tr_name_cmp(comm, tr_comm_get_id(tr_comm_memb_get_comm(cur))))) {
-      return cur;
-    }
-  }
-  return NULL;
+  TR_COMM_MEMB *memb=tr_comm_table_find_idp_memb(ctab, realm, comm);
+  if (memb==NULL)
+    memb=tr_comm_table_find_rp_memb(ctab, realm, comm);
+  return memb;
 }
 
 /* find a membership from a particular origin */
@@ -1244,20 +1249,7 @@ TR_COMM_MEMB *tr_comm_table_find_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *realm
 /* find an idp membership regardless of its origin */
 TR_COMM_MEMB *tr_comm_table_find_idp_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
 {
-  TR_COMM_MEMB *cur=NULL;
-  TR_IDP_REALM *idp_realm=NULL;
-
-  for (cur=ctab->memberships; cur!=NULL; cur=cur->next) {
-    idp_realm=tr_comm_memb_get_idp_realm(cur);
-    if (idp_realm==NULL)
-      continue; /* was not an idp */
-
-    if ((0==tr_name_cmp(realm, idp_realm->realm_id)) &&
-        (0==tr_name_cmp(comm, tr_comm_get_id(tr_comm_memb_get_comm(cur))))) {
-      return cur;
-    }
-  }
-  return NULL;
+  return tr_comm_table_lookup_memb(ctab, realm, comm, TR_ROLE_IDP);
 }
 
 /* find an idp membership from a particular origin */
@@ -1282,20 +1274,7 @@ TR_COMM_MEMB *tr_comm_table_find_idp_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *r
 /* find an rp membership from any origin */
 TR_COMM_MEMB *tr_comm_table_find_rp_memb(TR_COMM_TABLE *ctab, TR_NAME *realm, TR_NAME *comm)
 {
-  TR_COMM_MEMB *cur=NULL;
-  TR_RP_REALM *rp_realm=NULL;
-
-  for (cur=ctab->memberships; cur!=NULL; cur=cur->next) {
-    rp_realm=tr_comm_memb_get_rp_realm(cur);
-    if (rp_realm==NULL)
-      continue; /* was not an rp */
-
-    if ((0==tr_name_cmp(realm, tr_rp_realm_get_id(rp_realm))) &&
-        (0==tr_name_cmp(comm, tr_comm_get_id(tr_comm_memb_get_comm(cur))))) {
-      return cur;
-    }
-  }
-  return NULL;
+  return tr_comm_table_lookup_memb(ctab, realm, comm, TR_ROLE_RP);
 }
 
 /* find an rp membership from a particular origin */
@@ -1317,55 +1296,121 @@ TR_COMM_MEMB *tr_comm_table_find_rp_memb_origin(TR_COMM_TABLE *ctab, TR_NAME *re
   return NULL; /* no match */
 }
 
+/* Add obj to a by-id registry unless an earlier record already has that id.
+ * The first record in the list wins, as it did for the linear lookups. */
+static void tr_comm_table_register(GHashTable *registry, TR_NAME *id, void *obj)
+{
+  if ((id!=NULL) && (NULL==g_hash_table_lookup(registry, id)))
+    g_hash_table_insert(registry, id, obj);
+}
+
+/* Remove obj from a by-id registry if it is the record registered under id */
+static void tr_comm_table_unregister(GHashTable *registry, TR_NAME *id, void *obj)
+{
+  if ((id!=NULL) && (obj==g_hash_table_lookup(registry, id)))
+    g_hash_table_remove(registry, id);
+}
+
 TR_COMM *tr_comm_table_find_comm(TR_COMM_TABLE *ctab, TR_NAME *comm_id)
 {
-  return tr_comm_lookup(ctab->comms, comm_id);
+  if (comm_id==NULL)
+    return NULL;
+  return g_hash_table_lookup(ctab->comm_by_id, comm_id);
 }
 
 void tr_comm_table_add_comm(TR_COMM_TABLE *ctab, TR_COMM *new)
 {
+  TR_COMM *this=NULL;
+
   tr_comm_add(ctab->comms, new);
   if (ctab->comms!=NULL)
     talloc_steal(ctab, ctab->comms); /* make sure it's in the right context */
+  for (this=new; this!=NULL; this=this->next)
+    tr_comm_table_register(ctab->comm_by_id, tr_comm_get_id(this), this);
 }
 
 void tr_comm_table_remove_comm(TR_COMM_TABLE *ctab, TR_COMM *comm)
 {
+  TR_NAME *id=tr_comm_get_id(comm);
+  TR_COMM *this=NULL;
+
+  tr_comm_table_unregister(ctab->comm_by_id, id, comm);
   tr_comm_remove(ctab->comms, comm);
+  /* the next record with the same id, if any, now answers for it */
+  for (this=ctab->comms; (id!=NULL) && (this!=NULL); this=this->next) {
+    if (tr_name_equal(id, tr_comm_get_id(this))) {
+      tr_comm_table_register(ctab->comm_by_id, tr_comm_get_id(this), this);
+      break;
+    }
+  }
 }
 
 TR_RP_REALM *tr_comm_table_find_rp_realm(TR_COMM_TABLE *ctab, TR_NAME *realm_id)
 {
-  return tr_rp_realm_lookup(ctab->rp_realms, realm_id);
+  if (realm_id==NULL)
+    return NULL;
+  return g_hash_table_lookup(ctab->rp_realm_by_id, realm_id);
 }
 
 void tr_comm_table_add_rp_realm(TR_COMM_TABLE *ctab, TR_RP_REALM *new)
 {
+  TR_RP_REALM *this=NULL;
+
   tr_rp_realm_add(ctab->rp_realms, new);
   if (ctab->rp_realms!=NULL)
     talloc_steal(ctab, ctab->rp_realms); /* make sure it's in the right context */
+  for (this=new; this!=NULL; this=this->next)
+    tr_comm_table_register(ctab->rp_realm_by_id, tr_rp_realm_get_id(this), this);
 }
 
 void tr_comm_table_remove_rp_realm(TR_COMM_TABLE *ctab, TR_RP_REALM *realm)
 {
+  TR_NAME *id=tr_rp_realm_get_id(realm);
+  TR_RP_REALM *this=NULL;
+
+  tr_comm_table_unregister(ctab->rp_realm_by_id, id, realm);
   tr_rp_realm_remove(ctab->rp_realms, realm);
+  /* the next record with the same id, if any, now answers for it */
+  for (this=ctab->rp_realms; (id!=NULL) && (this!=NULL); this=this->next) {
+    if (tr_name_equal(id, tr_rp_realm_get_id(this))) {
+      tr_comm_table_register(ctab->rp_realm_by_id, tr_rp_realm_get_id(this), this);
+      break;
+    }
+  }
 }
 
 TR_IDP_REALM *tr_comm_table_find_idp_realm(TR_COMM_TABLE *ctab, TR_NAME *realm_id)
 {
-  return tr_idp_realm_lookup(ctab->idp_realms, realm_id);
+  if (realm_id==NULL)
+    return NULL;
+  return g_hash_table_lookup(ctab->idp_realm_by_id, realm_id);
 }
 
 void tr_comm_table_add_idp_realm(TR_COMM_TABLE *ctab, TR_IDP_REALM *new)
 {
+  TR_IDP_REALM *this=NULL;
+
   tr_idp_realm_add(ctab->idp_realms, new);
   if (ctab->idp_realms!=NULL)
     talloc_steal(ctab, ctab->idp_realms); /* make sure it's in the right context */
+  for (this=new; this!=NULL; this=this->next)
+    tr_comm_table_register(ctab->idp_realm_by_id, tr_idp_realm_get_id(this), this);
 }
 
 void tr_comm_table_remove_idp_realm(TR_COMM_TABLE *ctab, TR_IDP_REALM *realm)
 {
+  TR_NAME *id=tr_idp_realm_get_id(realm);
+  TR_IDP_REALM *this=NULL;
+
+  tr_comm_table_unregister(ctab->idp_realm_by_id, id, realm);
   tr_idp_realm_remove(ctab->idp_realms, realm);
+  /* the next record with the same id, if any, now answers for it */
+  for (this=ctab->idp_realms; (id!=NULL) && (this!=NULL); this=this->next) {
+    if (tr_name_equal(id, tr_idp_realm_get_id(this))) {
+      tr_comm_table_register(ctab->idp_realm_by_id, tr_idp_realm_get_id(this), this);
+      break;
+    }
+  }
 }
 
 
@@ -1384,9 +1429,35 @@ size_t tr_comm_table_size(TR_COMM_TABLE *ctab)
 /* clean up unreferenced realms, etc */
 void tr_comm_table_sweep(TR_COMM_TABLE *ctab)
 {
+  TR_RP_REALM *rp=NULL;
+  TR_IDP_REALM *idp=NULL;
+  TR_COMM *comm=NULL;
+
+  /* drop the records the sweeps are about to free from the registries */
+  for (rp=ctab->rp_realms; rp!=NULL; rp=rp->next) {
+    if (rp->refcount==0)
+      tr_comm_table_unregister(ctab->rp_realm_by_id, tr_rp_realm_get_id(rp), rp);
+  }
+  for (idp=ctab->idp_realms; idp!=NULL; idp=idp->next) {
+    if (idp->refcount==0)
+      tr_comm_table_unregister(ctab->idp_realm_by_id, tr_idp_realm_get_id(idp), idp);
+  }
+  for (comm=ctab->comms; comm!=NULL; comm=comm->next) {
+    if (comm->refcount==0)
+      tr_comm_table_unregister(ctab->comm_by_id, tr_comm_get_id(comm), comm);
+  }
+
   tr_rp_realm_sweep(ctab->rp_realms);
   tr_idp_realm_sweep(ctab->idp_realms);
   tr_comm_sweep(ctab->comms);
+
+  /* records that shared an id with a swept one now answer for it */
+  for (rp=ctab->rp_realms; rp!=NULL; rp=rp->next)
+    tr_comm_table_register(ctab->rp_realm_by_id, tr_rp_realm_get_id(rp), rp);
+  for (idp=ctab->idp_realms; idp!=NULL; idp=idp->next)
+    tr_comm_table_register(ctab->idp_realm_by_id, tr_idp_realm_get_id(idp), idp);
+  for (comm=ctab->comms; comm!=NULL; comm=comm->next)
+    tr_comm_table_register(ctab->comm_by_id, tr_comm_get_id(comm), comm);
 }
 
 
@@ -1411,15 +1482,15 @@ TR_REALM_ROLE tr_realm_role_from_str(const char *s)
   return TR_ROLE_UNKNOWN;
 }
 
-static void tr_comm_table_print_provenance(FILE *f, json_t *prov)
+static void tr_comm_table_print_provenance(FILE *f, TR_PROVENANCE *prov)
 {
-  const char *s=NULL;
   size_t ii=0;
 
-  for (ii=0; ii<json_array_size(prov); ii++) {
-    s=json_string_value(json_array_get(prov, ii));
-    if (s!=NULL)
-      fprintf(f, "%s%s", s, ((ii+1)==json_array_size(prov))?"":", ");
+  for (ii=0; ii<tr_provenance_len(prov); ii++) {
+    fprintf(f, "%.*s%s",
+            tr_provenance_get_hop(prov, ii)->len,
+            tr_provenance_get_hop(prov, ii)->buf,
+            ((ii+1)==tr_provenance_len(prov))?"":", ");
   }
 }
 
@@ -121,14 +121,35 @@ void tr_print_comm_rps(TR_COMM_TABLE *ctab, TR_COMM *comm)
   talloc_free(tmp_ctx);
 }
 
+static guint tr_cfg_gss_name_hash(gconstpointer key)
+{
+  return tr_name_hash((TR_NAME *)key);
+}
+
+static gboolean tr_cfg_gss_name_equal(gconstpointer key1, gconstpointer key2)
+{
+  return tr_name_equal((TR_NAME *)key1, (TR_NAME *)key2);
+}
+
+static int tr_cfg_destructor(void *obj)
+{
+  TR_CFG *cfg=talloc_get_type_abort(obj, TR_CFG);
+  if (cfg->rp_client_by_gss_name!=NULL)
+    g_hash_table_destroy(cfg->rp_client_by_gss_name);
+  return 0;
+}
+
 TR_CFG *tr_cfg_new(TALLOC_CTX *mem_ctx)
 {
   TR_CFG *cfg=talloc(mem_ctx, TR_CFG);
   if (cfg!=NULL) {
     cfg->internal=NULL;
     cfg->rp_clients=NULL;
+    /* keys are the clients' gss names, which live as long as the configuration */
+    cfg->rp_client_by_gss_name=g_hash_table_new(tr_cfg_gss_name_hash, tr_cfg_gss_name_equal);
     cfg->peers=NULL;
     cfg->default_servers=NULL;
+    talloc_set_destructor((void *)cfg, tr_cfg_destructor);
     cfg->ctable=tr_comm_table_new(cfg);
     if (cfg->ctable==NULL) {
       talloc_free(cfg);
@@ -143,15 +164,48 @@ void tr_cfg_free (TR_CFG *cfg)
   talloc_free(cfg);
 }
 
+static int tr_cfg_mgr_destructor(void *obj)
+{
+  TR_CFG_MGR *cfg_mgr=talloc_get_type_abort(obj, TR_CFG_MGR);
+  pthread_rwlock_destroy(&(cfg_mgr->lock));
+  return 0;
+}
+
 TR_CFG_MGR *tr_cfg_mgr_new(TALLOC_CTX *mem_ctx)
 {
-  return talloc_zero(mem_ctx, TR_CFG_MGR);
+  TR_CFG_MGR *cfg_mgr=talloc_zero(mem_ctx, TR_CFG_MGR);
+  if (cfg_mgr!=NULL) {
+    if (0!=pthread_rwlock_init(&(cfg_mgr->lock), NULL)) {
+      talloc_free(cfg_mgr);
+      return NULL;
+    }
+    talloc_set_destructor((void *)cfg_mgr, tr_cfg_mgr_destructor);
+  }
+  return cfg_mgr;
 }
 
 void tr_cfg_mgr_free (TR_CFG_MGR *cfg_mgr) {
   talloc_free(cfg_mgr);
 }
 
+void tr_cfg_mgr_read_lock(TR_CFG_MGR *cfg_mgr)
+{
+  if (0!=pthread_rwlock_rdlock(&(cfg_mgr->lock)))
+    tr_crit("tr_cfg_mgr_read_lock: unable to acquire lock.");
+}
+
+void tr_cfg_mgr_write_lock(TR_CFG_MGR *cfg_mgr)
+{
+  if (0!=pthread_rwlock_wrlock(&(cfg_mgr->lock)))
+    tr_crit("tr_cfg_mgr_write_lock: unable to acquire lock.");
+}
+
+void tr_cfg_mgr_unlock(TR_CFG_MGR *cfg_mgr)
+{
+  if (0!=pthread_rwlock_unlock(&(cfg_mgr->lock)))
+    tr_crit("tr_cfg_mgr_unlock: unable to release lock.");
+}
+
 TR_CFG_RC tr_apply_new_config (TR_CFG_MGR *cfg_mgr)
 {
   /* cfg_mgr->active is allowed to be null, but new cannot be */
@@ -183,11 +237,28 @@ static TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jcfg)
   json_t *jcfgpoll = NULL;
   json_t *jcfgsettle = NULL;
   json_t *jroutesweep = NULL;
+  json_t *jrouteholddown = NULL;
+  json_t *jmaxupdbytes = NULL;
+  json_t *jflappenalty = NULL;
+  json_t *jflapsuppress = NULL;
+  json_t *jflapreuse = NULL;
+  json_t *jflaphalflife = NULL;
+  json_t *jhysteresis = NULL;
   json_t *jrouteupdate = NULL;
   json_t *jtidreq_timeout = NULL;
   json_t *jtidresp_numer = NULL;
   json_t *jtidresp_denom = NULL;
   json_t *jrouteconnect = NULL;
+  json_t *jtidsworkers = NULL;
+  json_t *jtidspending = NULL;
+  json_t *jtidsidle = NULL;
+  json_t *jtidsinflight = NULL;
+  json_t *jtidsbacklog = NULL;
+  json_t *jpoolmax = NULL;
+  json_t *jpoolidle = NULL;
+  json_t *jfwdthreads = NULL;
+  json_t *jcircfail = NULL;
+  json_t *jcircretry = NULL;
 
   if ((!trc) || (!jcfg))
     return TR_CFG_BAD_PARAMS;
@@ -285,6 +356,90 @@ static TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jcfg)
       trc->internal->trp_sweep_interval=TR_DEFAULT_TRP_SWEEP_INTERVAL;
     }
 
+    if (NULL != (jrouteholddown = json_object_get(jint, "trp_update_holddown_ms"))) {
+      if (json_is_number(jrouteholddown)) {
+        trc->internal->trp_update_holddown_ms = json_integer_value(jrouteholddown);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_update_holddown_ms is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_update_holddown_ms=TR_DEFAULT_TRP_UPDATE_HOLDDOWN_MS;
+    }
+
+    if (NULL != (jmaxupdbytes = json_object_get(jint, "trp_max_update_bytes"))) {
+      if (json_is_number(jmaxupdbytes)) {
+        trc->internal->trp_max_update_bytes = json_integer_value(jmaxupdbytes);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_max_update_bytes is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_max_update_bytes=TR_DEFAULT_TRP_MAX_UPDATE_BYTES;
+    }
+
+    if (NULL != (jflappenalty = json_object_get(jint, "trp_flap_penalty"))) {
+      if (json_is_number(jflappenalty)) {
+        trc->internal->trp_flap_penalty = json_integer_value(jflappenalty);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_flap_penalty is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_flap_penalty=TR_DEFAULT_TRP_FLAP_PENALTY;
+    }
+
+    if (NULL != (jflapsuppress = json_object_get(jint, "trp_flap_suppress"))) {
+      if (json_is_number(jflapsuppress)) {
+        trc->internal->trp_flap_suppress = json_integer_value(jflapsuppress);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_flap_suppress is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_flap_suppress=TR_DEFAULT_TRP_FLAP_SUPPRESS;
+    }
+
+    if (NULL != (jflapreuse = json_object_get(jint, "trp_flap_reuse"))) {
+      if (json_is_number(jflapreuse)) {
+        trc->internal->trp_flap_reuse = json_integer_value(jflapreuse);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_flap_reuse is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_flap_reuse=TR_DEFAULT_TRP_FLAP_REUSE;
+    }
+
+    if (NULL != (jflaphalflife = json_object_get(jint, "trp_flap_half_life"))) {
+      if (json_is_number(jflaphalflife)) {
+        trc->internal->trp_flap_half_life = json_integer_value(jflaphalflife);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_flap_half_life is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_flap_half_life=TR_DEFAULT_TRP_FLAP_HALF_LIFE;
+    }
+
+    if (NULL != (jhysteresis = json_object_get(jint, "trp_metric_hysteresis"))) {
+      if (json_is_number(jhysteresis)) {
+        trc->internal->trp_metric_hysteresis = json_integer_value(jhysteresis);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, trp_metric_hysteresis is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->trp_metric_hysteresis=TR_DEFAULT_TRP_METRIC_HYSTERESIS;
+    }
+
     if (NULL != (jrouteupdate = json_object_get(jint, "trp_update_interval"))) {
       if (json_is_number(jrouteupdate)) {
         trc->internal->trp_update_interval = json_integer_value(jrouteupdate);
@@ -333,6 +488,126 @@ static TR_CFG_RC tr_cfg_parse_internal(TR_CFG *trc, json_t *jcfg)
       trc->internal->tid_resp_denom=TR_DEFAULT_TID_RESP_DENOM;
     }
 
+    if (NULL != (jtidsworkers = json_object_get(jint, "tids_worker_threads"))) {
+      if (json_is_number(jtidsworkers)) {
+        trc->internal->tids_worker_threads = json_integer_value(jtidsworkers);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tids_worker_threads is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tids_worker_threads=TR_DEFAULT_TIDS_WORKER_THREADS;
+    }
+
+    if (NULL != (jtidspending = json_object_get(jint, "tids_max_pending"))) {
+      if (json_is_number(jtidspending)) {
+        trc->internal->tids_max_pending = json_integer_value(jtidspending);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tids_max_pending is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tids_max_pending=TR_DEFAULT_TIDS_MAX_PENDING;
+    }
+
+    if (NULL != (jtidsidle = json_object_get(jint, "tids_idle_timeout"))) {
+      if (json_is_number(jtidsidle)) {
+        trc->internal->tids_idle_timeout = json_integer_value(jtidsidle);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tids_idle_timeout is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tids_idle_timeout=TR_DEFAULT_TIDS_IDLE_TIMEOUT;
+    }
+
+    if (NULL != (jtidsinflight = json_object_get(jint, "tids_max_in_flight"))) {
+      if (json_is_number(jtidsinflight)) {
+        trc->internal->tids_max_in_flight = json_integer_value(jtidsinflight);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tids_max_in_flight is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tids_max_in_flight=TR_DEFAULT_TIDS_MAX_IN_FLIGHT;
+    }
+
+    if (NULL != (jtidsbacklog = json_object_get(jint, "tids_listen_backlog"))) {
+      if (json_is_number(jtidsbacklog)) {
+        trc->internal->tids_listen_backlog = json_integer_value(jtidsbacklog);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tids_listen_backlog is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tids_listen_backlog=TR_DEFAULT_TIDS_LISTEN_BACKLOG;
+    }
+
+    if (NULL != (jpoolmax = json_object_get(jint, "tid_pool_max_per_host"))) {
+      if (json_is_number(jpoolmax)) {
+        trc->internal->tid_pool_max_per_host = json_integer_value(jpoolmax);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tid_pool_max_per_host is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tid_pool_max_per_host=TR_DEFAULT_TID_POOL_MAX_PER_HOST;
+    }
+
+    if (NULL != (jpoolidle = json_object_get(jint, "tid_pool_idle_timeout"))) {
+      if (json_is_number(jpoolidle)) {
+        trc->internal->tid_pool_idle_timeout = json_integer_value(jpoolidle);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tid_pool_idle_timeout is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tid_pool_idle_timeout=TR_DEFAULT_TID_POOL_IDLE_TIMEOUT;
+    }
+
+    if (NULL != (jfwdthreads = json_object_get(jint, "tid_fwd_threads"))) {
+      if (json_is_number(jfwdthreads) && (json_integer_value(jfwdthreads)>0)) {
+        trc->internal->tid_fwd_threads = json_integer_value(jfwdthreads);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, tid_fwd_threads is not a positive number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->tid_fwd_threads=TR_DEFAULT_TID_FWD_THREADS;
+    }
+
+    if (NULL != (jcircfail = json_object_get(jint, "aaa_circuit_failures"))) {
+      if (json_is_number(jcircfail)) {
+        trc->internal->aaa_circuit_failures = json_integer_value(jcircfail);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, aaa_circuit_failures is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->aaa_circuit_failures=TR_DEFAULT_AAA_CIRCUIT_FAILURES;
+    }
+
+    if (NULL != (jcircretry = json_object_get(jint, "aaa_circuit_retry_interval"))) {
+      if (json_is_number(jcircretry)) {
+        trc->internal->aaa_circuit_retry_interval = json_integer_value(jcircretry);
+      } else {
+        tr_debug("tr_cfg_parse_internal: Parsing error, aaa_circuit_retry_interval is not a number.");
+        return TR_CFG_NOPARSE;
+      }
+    } else {
+      /* if not configured, use the default */
+      trc->internal->aaa_circuit_retry_interval=TR_DEFAULT_AAA_CIRCUIT_RETRY_INTERVAL;
+    }
+
     if (NULL != (jlog = json_object_get(jint, "logging"))) {
       if (NULL != (jlogthres = json_object_get(jlog, "log_threshold"))) {
         if (json_is_string(jlogthres)) {
@@ -817,6 +1092,7 @@ static TR_CFG_RC tr_cfg_parse_idp(TR_IDP_REALM *idp, json_t *jidp)
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TR_APC *apcs=NULL;
   TR_AAA_SERVER *aaa=NULL;
+  json_t *jhedge=NULL;
   TR_CFG_RC rc=TR_CFG_ERROR;
   
   if (jidp==NULL)
@@ -829,6 +1105,23 @@ static TR_CFG_RC tr_cfg_parse_idp(TR_IDP_REALM *idp, json_t *jidp)
     goto cleanup;
   }
 
+  /* optional: with a shared config, send to one AAA server at a time, hedging
+   * after this percentile of its response time */
+  if (NULL!=(jhedge=json_object_get(jidp, "hedge_percentile"))) {
+    if ((!json_is_integer(jhedge)) ||
+        (json_integer_value(jhedge)<0) ||
+        (json_integer_value(jhedge)>100)) {
+      tr_err("tr_cfg_parse_idp: hedge_percentile must be an integer from 0 to 100");
+      rc=TR_CFG_NOPARSE;
+      goto cleanup;
+    }
+    idp->hedge_percentile=json_integer_value(jhedge);
+    if ((idp->hedge_percentile>0) && (!idp->shared_config)) {
+      tr_warning("tr_cfg_parse_idp: hedge_percentile ignored without shared_config");
+      idp->hedge_percentile=0;
+    }
+  }
+
   apcs=tr_cfg_parse_apcs(tmp_ctx, json_object_get(jidp, "apcs"), &rc);
   if ((rc!=TR_CFG_SUCCESS) || (apcs==NULL)) {
     tr_err("tr_cfg_parse_idp: unable to parse APC");
@@ -1445,6 +1738,35 @@ static TR_COMM *tr_cfg_comm_idp_update(TALLOC_CTX *mem_ctx,
 }
 #endif
 
+/* Append clients to the configuration and register their GSS names. A name
+ * stays with the first client that claimed it, as with the old list walk. */
+static void tr_cfg_add_rp_clients(TR_CFG *trc, TR_RP_CLIENT *new)
+{
+  TR_RP_CLIENT *client=NULL;
+  TR_GSS_NAMES_ITER *iter=NULL;
+  TR_NAME *name=NULL;
+
+  tr_rp_client_add(trc->rp_clients, new); /* fixes talloc contexts */
+  talloc_steal(trc, trc->rp_clients); /* make sure head is in the right context */
+
+  iter=tr_gss_names_iter_new(NULL);
+  if (iter==NULL) {
+    tr_err("tr_cfg_add_rp_clients: unable to allocate GSS name iterator.");
+    return;
+  }
+  for (client=new; client!=NULL; client=client->next) {
+    if (client->gss_names==NULL)
+      continue;
+    for (name=tr_gss_names_iter_first(iter, client->gss_names);
+         name!=NULL;
+         name=tr_gss_names_iter_next(iter)) {
+      if (NULL==g_hash_table_lookup(trc->rp_client_by_gss_name, name))
+        g_hash_table_insert(trc->rp_client_by_gss_name, name, client);
+    }
+  }
+  tr_gss_names_iter_free(iter);
+}
+
 static TR_CFG_RC tr_cfg_parse_one_local_org(TR_CFG *trc, json_t *jlorg)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -1493,13 +1815,11 @@ cleanup:
   /* if we succeeded, link things to the configuration and move out of tmp context */
   if (retval==TR_CFG_SUCCESS) {
     if (new_idp_realms!=NULL) {
-      tr_idp_realm_add(trc->ctable->idp_realms, new_idp_realms); /* fixes talloc contexts except for head*/
-      talloc_steal(trc, trc->ctable->idp_realms); /* make sure the head is in the right context */
+      tr_comm_table_add_idp_realm(trc->ctable, new_idp_realms); /* fixes talloc contexts */
     }
 
     if (new_rp_clients!=NULL) {
-      tr_rp_client_add(trc->rp_clients, new_rp_clients); /* fixes talloc contexts */
-      talloc_steal(trc, trc->rp_clients); /* make sure head is in the right context */
+      tr_cfg_add_rp_clients(trc, new_rp_clients);
     }
   }
 
@@ -1723,7 +2043,7 @@ static void tr_cfg_parse_comm_rps(TR_CFG *trc, json_t *jrps, TR_COMM *comm, TR_C
     }
 
     /* Add the RP to the community, first see if we have the RP in any community */
-    found_rp=tr_rp_realm_lookup(trc->ctable->rp_realms, rp_name);
+    found_rp=tr_comm_table_find_rp_realm(trc->ctable, rp_name);
     if (found_rp!=NULL) {
       tr_debug("tr_cfg_parse_comm_rps: RP realm %s already exists.", s);
       new_rp=found_rp; /* use it rather than creating a new realm record */
@@ -1736,8 +2056,7 @@ static void tr_cfg_parse_comm_rps(TR_CFG *trc, json_t *jrps, TR_COMM *comm, TR_C
       tr_debug("tr_cfg_parse_comm_rps: setting name to %s", rp_name->buf);
       tr_rp_realm_set_id(new_rp, rp_name);
       rp_name=NULL; /* rp_name no longer belongs to us */
-      tr_rp_realm_add(trc->ctable->rp_realms, new_rp);
-      talloc_steal(trc->ctable, trc->ctable->rp_realms); /* make sure head is in the right context */
+      tr_comm_table_add_rp_realm(trc->ctable, new_rp);
     }
     tr_comm_add_rp_realm(trc->ctable, comm, new_rp, 0, NULL, NULL);
   }
@@ -2030,14 +2349,10 @@ TR_IDP_REALM *tr_cfg_find_idp (TR_CFG *tr_cfg, TR_NAME *idp_id, TR_CFG_RC *rc)
     return NULL;
   }
 
-  for (cfg_idp = tr_cfg->ctable->idp_realms; NULL != cfg_idp; cfg_idp = cfg_idp->next) {
-    if (!tr_name_cmp (idp_id, cfg_idp->realm_id)) {
-      tr_debug("tr_cfg_find_idp: Found %s.", idp_id->buf);
-      return cfg_idp;
-    }
-  }
-  /* if we didn't find one, return NULL */ 
-  return NULL;
+  cfg_idp=tr_comm_table_find_idp_realm(tr_cfg->ctable, idp_id);
+  if (cfg_idp!=NULL)
+    tr_debug("tr_cfg_find_idp: Found %s.", idp_id->buf);
+  return cfg_idp;
 }
 
 TR_RP_CLIENT *tr_cfg_find_rp (TR_CFG *tr_cfg, TR_NAME *rp_gss, TR_CFG_RC *rc)
@@ -2050,14 +2365,10 @@ TR_RP_CLIENT *tr_cfg_find_rp (TR_CFG *tr_cfg, TR_NAME *rp_gss, TR_CFG_RC *rc)
     return NULL;
   }
 
-  for (cfg_rp = tr_cfg->rp_clients; NULL != cfg_rp; cfg_rp = cfg_rp->next) {
-    if (tr_gss_names_matches(cfg_rp->gss_names, rp_gss)) {
-      tr_debug("tr_cfg_find_rp: Found %s.", rp_gss->buf);
-      return cfg_rp;
-    }
-  }
-  /* if we didn't find one, return NULL */ 
-  return NULL;
+  cfg_rp=g_hash_table_lookup(tr_cfg->rp_client_by_gss_name, rp_gss);
+  if (cfg_rp!=NULL)
+    tr_debug("tr_cfg_find_rp: Found %s.", rp_gss->buf);
+  return cfg_rp;
 }
 
 static int is_cfg_file(const struct dirent *dent) {
@@ -228,6 +228,13 @@ void tr_console_threshold(const int sev) {
   return;
 }
 
+/* Nonzero if a message of severity sev would be written to stderr. Lets callers
+ * skip building output that would be thrown away. */
+int tr_console_enabled(const int sev) {
+
+  return (sev <= console_threshold);
+}
+
 void tr_log_open() {
 
   if (!log_opened) {
@@ -136,6 +136,7 @@ TR_IDP_REALM *tr_idp_realm_new(TALLOC_CTX *mem_ctx)
     idp->comm_next=NULL;
     idp->realm_id=NULL;
     idp->shared_config=0;
+    idp->hedge_percentile=0;
     idp->aaa_servers=NULL;
     idp->apcs=NULL;
     idp->origin=TR_REALM_LOCAL;
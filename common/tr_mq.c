@@ -36,6 +36,10 @@
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #include <tr_mq.h>
 #include <tr_debug.h>
@@ -105,26 +109,68 @@ static void tr_mq_msg_set_next(TR_MQ_MSG *msg, TR_MQ_MSG *next)
   msg->next=next;
 }
 
+static void tr_mq_msg_free_list(TR_MQ_MSG *msg)
+{
+  TR_MQ_MSG *next=NULL;
+
+  for (; msg!=NULL; msg=next) {
+    next=tr_mq_msg_get_next(msg);
+    tr_mq_msg_free(msg);
+  }
+}
+
 /* Message Queues */
+static int tr_mq_destructor(void *object)
+{
+  TR_MQ *mq=talloc_get_type_abort(object, TR_MQ);
+
+  /* A producer may still be signalling a message we have already popped; it
+   * has nothing left to do but write wake_fd and run the callback. */
+  while (__atomic_load_n(&(mq->n_adding), __ATOMIC_ACQUIRE)>0)
+    sched_yield();
+
+  /* queued messages are not in mq's context, see tr_mq_add() */
+  tr_mq_msg_free_list(mq->hi_stack);
+  tr_mq_msg_free_list(mq->stack);
+  tr_mq_msg_free_list(mq->hi_head);
+  tr_mq_msg_free_list(mq->head);
+  close(mq->wake_fd);
+  pthread_cond_destroy(&(mq->have_msgs));
+  pthread_mutex_destroy(&(mq->mutex));
+  return 0;
+}
+
 TR_MQ *tr_mq_new(TALLOC_CTX *mem_ctx)
 {
   TR_MQ *mq=talloc(mem_ctx, TR_MQ);
   pthread_condattr_t cattr;
 
   if (mq!=NULL) {
+    mq->wake_fd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (mq->wake_fd<0) {
+      tr_crit("tr_mq_new: unable to create eventfd.");
+      talloc_free(mq);
+      return NULL;
+    }
     pthread_mutex_init(&(mq->mutex), 0);
+    /* tr_mq_pop() deadlines are on CLOCK_MONOTONIC */
     pthread_condattr_init(&cattr);
-
-    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC); /* use the monotonic clock for timeouts */
-    pthread_cond_init(&(mq->have_msg_cond), &cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(mq->have_msgs), &cattr);
     pthread_condattr_destroy(&cattr);
 
+    mq->hi_stack=NULL;
+    mq->stack=NULL;
+    mq->hi_head=NULL;
+    mq->hi_tail=NULL;
     mq->head=NULL;
     mq->tail=NULL;
-    mq->last_hi_prio=NULL;
+    mq->signalled=0;
+    mq->n_adding=0;
 
     mq->notify_cb=NULL;
     mq->notify_cb_arg=NULL;
+    talloc_set_destructor((void *)mq, tr_mq_destructor);
   }
   return mq;
 }
@@ -132,11 +178,16 @@ TR_MQ *tr_mq_new(TALLOC_CTX *mem_ctx)
 void tr_mq_free(TR_MQ *mq)
 {
   if (mq!=NULL) {
-    tr_mq_lock(mq); /* don't pull the rug out from under someone */
+    /* don't pull the rug out from under someone; producers also take the
+     * lock, so do not hold it while the destructor waits for them */
+    tr_mq_lock(mq);
+    tr_mq_unlock(mq);
     talloc_free(mq);
   }
 }
 
+/* Consumers hold the lock while they take messages. tr_mq_add() only takes it,
+ * briefly, to wake a waiting consumer when the queue becomes non-empty. */
 int tr_mq_lock(TR_MQ *mq)
 {
   return pthread_mutex_lock(&(mq->mutex));
@@ -147,135 +198,188 @@ int tr_mq_unlock(TR_MQ *mq)
   return pthread_mutex_unlock(&(mq->mutex));
 }
 
-static TR_MQ_MSG *tr_mq_get_head(TR_MQ *mq)
+/* Producers read the callback without the lock, so set it before they start
+ * adding messages. */
+void tr_mq_set_notify_cb(TR_MQ *mq, TR_MQ_NOTIFY_FN cb, void *arg)
 {
-  return mq->head;
+  __atomic_store_n(&(mq->notify_cb_arg), arg, __ATOMIC_RELAXED);
+  __atomic_store_n(&(mq->notify_cb), cb, __ATOMIC_RELEASE);
 }
 
-static void tr_mq_set_head(TR_MQ *mq, TR_MQ_MSG *msg)
+/* File descriptor that is readable when there may be messages to pop. Wait for
+ * it with poll() or a libevent EV_READ event, then call tr_mq_pop() until it
+ * returns NULL; that rearms it. Do not read or close it. */
+int tr_mq_get_fd(TR_MQ *mq)
 {
-  mq->head=msg;
+  return mq->wake_fd;
 }
 
-static TR_MQ_MSG *tr_mq_get_tail(TR_MQ *mq)
+/* push msg onto a producer stack without locking */
+static void tr_mq_push(TR_MQ_MSG **stack, TR_MQ_MSG *msg)
 {
-  return mq->tail;
-}
+  TR_MQ_MSG *top=__atomic_load_n(stack, __ATOMIC_RELAXED);
 
-static void tr_mq_set_tail(TR_MQ *mq, TR_MQ_MSG *msg)
-{
-  mq->tail=msg;
+  do {
+    tr_mq_msg_set_next(msg, top);
+  } while (!__atomic_compare_exchange_n(stack, &top, msg, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 }
 
-void tr_mq_set_notify_cb(TR_MQ *mq, TR_MQ_NOTIFY_FN cb, void *arg)
+/* Empty a producer stack onto the end of the list from *head to *tail, oldest
+ * message first. Call with the lock held. */
+static void tr_mq_take(TR_MQ_MSG **stack, TR_MQ_MSG **head, TR_MQ_MSG **tail)
 {
-  mq->notify_cb=cb;
-  mq->notify_cb_arg=arg;
+  TR_MQ_MSG *msg=__atomic_exchange_n(stack, NULL, __ATOMIC_SEQ_CST);
+  TR_MQ_MSG *newest=msg;
+  TR_MQ_MSG *oldest=NULL;
+  TR_MQ_MSG *next=NULL;
+
+  if (msg==NULL)
+    return;
+
+  /* reverse the stack */
+  for (; msg!=NULL; msg=next) {
+    next=tr_mq_msg_get_next(msg);
+    tr_mq_msg_set_next(msg, oldest);
+    oldest=msg;
+  }
+
+  if (*head==NULL)
+    *head=oldest;
+  else
+    tr_mq_msg_set_next(*tail, oldest);
+  *tail=newest;
 }
 
-void tr_mq_clear(TR_MQ *mq)
+/* Take the next message, high priority first. Call with the lock held. */
+static TR_MQ_MSG *tr_mq_take_next(TR_MQ *mq)
 {
-  TR_MQ_MSG *m=NULL;
-  TR_MQ_MSG *n=NULL;
+  TR_MQ_MSG *popped=NULL;
 
-  tr_mq_lock(mq);
-  m=tr_mq_get_head(mq);
-  while (m!=NULL) {
-    n=tr_mq_msg_get_next(m);
-    tr_mq_msg_free(m);
-    m=n;
+  tr_mq_take(&(mq->hi_stack), &(mq->hi_head), &(mq->hi_tail));
+  if (mq->hi_head!=NULL) {
+    popped=mq->hi_head;
+    mq->hi_head=tr_mq_msg_get_next(popped);
+    if (mq->hi_head==NULL)
+      mq->hi_tail=NULL;
+  } else {
+    if (mq->head==NULL)
+      tr_mq_take(&(mq->stack), &(mq->head), &(mq->tail));
+    if (mq->head!=NULL) {
+      popped=mq->head;
+      mq->head=tr_mq_msg_get_next(popped);
+      if (mq->head==NULL)
+        mq->tail=NULL;
+    }
   }
-  tr_mq_set_head(mq, NULL);
-  tr_mq_set_tail(mq, NULL);
-  tr_mq_unlock(mq);
+
+  if (popped!=NULL)
+    tr_mq_msg_set_next(popped, NULL); /* disconnect from list */
+  return popped;
 }
 
-static int tr_mq_empty(TR_MQ *mq)
+/* Call with the lock held. */
+static int tr_mq_has_msgs(TR_MQ *mq)
 {
-  return tr_mq_get_head(mq)==NULL;
+  return (mq->hi_head!=NULL)
+      || (mq->head!=NULL)
+      || (__atomic_load_n(&(mq->hi_stack), __ATOMIC_SEQ_CST)!=NULL)
+      || (__atomic_load_n(&(mq->stack), __ATOMIC_SEQ_CST)!=NULL);
 }
 
-/* puts msg in mq's talloc context */
-static void tr_mq_append(TR_MQ *mq, TR_MQ_MSG *msg)
+/* Make wake_fd readable unless it already is. Returns nonzero if this call did so. */
+static int tr_mq_signal(TR_MQ *mq)
 {
-  if (tr_mq_get_head(mq)==NULL) {
-    tr_mq_set_head(mq, msg);
-    tr_mq_set_tail(mq, msg);
-  } else {
-    tr_mq_msg_set_next(tr_mq_get_tail(mq), msg); /* add to list */
-    tr_mq_set_tail(mq, msg); /* update tail of list */
-  }
-  talloc_steal(mq, msg);
+  uint64_t one=1;
+
+  if (__atomic_exchange_n(&(mq->signalled), 1, __ATOMIC_SEQ_CST))
+    return 0;
+
+  /* fails only if the counter is about to overflow, when it is readable anyway */
+  if (write(mq->wake_fd, &one, sizeof(one))<0)
+    tr_debug("tr_mq_signal: eventfd write failed.");
+  return 1;
 }
 
-static void tr_mq_append_high_prio(TR_MQ *mq, TR_MQ_MSG *new)
+/* The queue was found empty; let the next tr_mq_add() signal it again. Callers
+ * must check for messages added before the signalled flag was cleared. Call with
+ * the lock held. */
+static void tr_mq_unsignal(TR_MQ *mq)
 {
-  if (tr_mq_get_head(mq)==NULL) {
-    tr_mq_set_head(mq, new);
-    tr_mq_set_tail(mq, new);
-  } else if (mq->last_hi_prio==NULL) {
-    tr_mq_msg_set_next(new, tr_mq_get_head(mq)); /* add to front of list */
-    tr_mq_set_head(mq, new); /* update head of list */
-  } else {
-    tr_mq_msg_set_next(new, tr_mq_msg_get_next(mq->last_hi_prio));
-    tr_mq_msg_set_next(mq->last_hi_prio, new); /* add to end of hi prio msgs */
-  }
-  mq->last_hi_prio=new; /* in any case, this is now the last high priority msg */
-  talloc_steal(mq,new);
+  uint64_t count=0;
+
+  /* fails with EAGAIN if there was nothing to read */
+  if (read(mq->wake_fd, &count, sizeof(count))<0)
+    count=0;
+  __atomic_store_n(&(mq->signalled), 0, __ATOMIC_SEQ_CST);
 }
 
-#define DEBUG_TR_MQ 0
-#if DEBUG_TR_MQ
-static void tr_mq_print(TR_MQ *mq)
+/* A consumer has taken a message. If that emptied the queue, clear the signal;
+ * otherwise keep wake_fd readable and pass the wakeup on to one more thread
+ * waiting in tr_mq_pop(). Call with the lock held. */
+static void tr_mq_settle(TR_MQ *mq)
 {
-  TR_MQ_MSG *m=mq->head;
-  int ii=0;
-
-  tr_debug("tr_mq_print: mq contents:");
-  while(m!=NULL) {
-    ii++;
-    tr_debug("tr_mq_print: Entry %02d: %-15s (prio %d)",
-             ii, tr_mq_msg_get_message(m), tr_mq_msg_get_prio(m));
-    m=tr_mq_msg_get_next(m);
+  if (!tr_mq_has_msgs(mq))
+    tr_mq_unsignal(mq);
+  if (tr_mq_has_msgs(mq)) { /* left over, or added before the signal was cleared */
+    tr_mq_signal(mq);
+    pthread_cond_signal(&(mq->have_msgs));
   }
 }
-#endif
+
+void tr_mq_clear(TR_MQ *mq)
+{
+  tr_mq_lock(mq);
+  tr_mq_take(&(mq->hi_stack), &(mq->hi_head), &(mq->hi_tail));
+  tr_mq_take(&(mq->stack), &(mq->head), &(mq->tail));
+  tr_mq_msg_free_list(mq->hi_head);
+  tr_mq_msg_free_list(mq->head);
+  mq->hi_head=NULL;
+  mq->hi_tail=NULL;
+  mq->head=NULL;
+  mq->tail=NULL;
+  tr_mq_unsignal(mq);
+  if (tr_mq_has_msgs(mq))
+    tr_mq_signal(mq); /* added while we were clearing */
+  tr_mq_unlock(mq);
+}
+
+/* Blocks only for the consumers' lock when the queue becomes non-empty. The
+ * message is taken out of the caller's talloc context; the queue's context
+ * belongs to its consumers, so msg is not moved into it.
+ *
+ * Once msg is pushed a consumer may pop it and free the queue while we are
+ * still signalling; n_adding makes the destructor wait for us. */
 void tr_mq_add(TR_MQ *mq, TR_MQ_MSG *msg)
 {
-  int was_empty=0;
   TR_MQ_NOTIFY_FN notify_cb=NULL;
   void *notify_cb_arg=NULL;
 
-  tr_mq_lock(mq);
-  
-  was_empty=tr_mq_empty(mq);
+  __atomic_add_fetch(&(mq->n_adding), 1, __ATOMIC_SEQ_CST);
+  talloc_steal(NULL, msg);
   switch (tr_mq_msg_get_prio(msg)) {
   case TR_MQ_PRIO_HIGH:
-    tr_mq_append_high_prio(mq, msg);
+    tr_mq_push(&(mq->hi_stack), msg);
     break;
   default:
-    tr_mq_append(mq, msg);
+    tr_mq_push(&(mq->stack), msg);
     break;
   }
-  /* before releasing the mutex, get notify_cb data out of mq */
-  notify_cb=mq->notify_cb;
-  notify_cb_arg=mq->notify_cb_arg;
-
-#if DEBUG_TR_MQ
-  tr_mq_print(mq);
-#endif 
-
-  /* Before releasing the lock, signal any waiting threads that there's now
-   * something in the queue. Used for blocking tr_mq_pop() call. */
-
-  if (was_empty)
-    pthread_cond_broadcast(&(mq->have_msg_cond));
-
-  tr_mq_unlock(mq);
+  /* msg may already have been popped and freed, do not touch it again */
 
   /* see if we need to tell someone we became non-empty */
-  if (was_empty && (notify_cb!=NULL))
-    notify_cb(mq, notify_cb_arg);
+  if (tr_mq_signal(mq)) {
+    /* Wake one thread in tr_mq_pop(). Taking the lock means a consumer that
+     * found the queue empty is already waiting, and will not miss this. */
+    tr_mq_lock(mq);
+    pthread_cond_signal(&(mq->have_msgs));
+    tr_mq_unlock(mq);
+
+    notify_cb=__atomic_load_n(&(mq->notify_cb), __ATOMIC_ACQUIRE);
+    notify_cb_arg=__atomic_load_n(&(mq->notify_cb_arg), __ATOMIC_RELAXED);
+    if (notify_cb!=NULL)
+      notify_cb(mq, notify_cb_arg);
+  }
+  __atomic_sub_fetch(&(mq->n_adding), 1, __ATOMIC_RELEASE);
 }
 
 /* Compute an absolute time from a desired timeout interval for use with tr_mq_pop().
@@ -289,6 +393,21 @@ int tr_mq_pop_timeout(time_t seconds, struct timespec *ts)
   return 0;
 }
 
+/* As tr_mq_pop_timeout(), but with the interval in milliseconds. */
+int tr_mq_pop_timeout_ms(unsigned long ms, struct timespec *ts)
+{
+  if (0!=clock_gettime(CLOCK_MONOTONIC, ts))
+    return -1;
+
+  ts->tv_sec+=ms/1000;
+  ts->tv_nsec+=(ms%1000)*1000000;
+  if (ts->tv_nsec>=1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec-=1000000000;
+  }
+  return 0;
+}
+
 /* Caller must free msg via tr_mq_msg_free, waiting until absolute
  * time ts_abort before giving up (using CLOCK_MONOTONIC). If ts_abort
  * has passed, returns an existing message but will not wait if one is
@@ -299,36 +418,29 @@ int tr_mq_pop_timeout(time_t seconds, struct timespec *ts)
 TR_MQ_MSG *tr_mq_pop(TR_MQ *mq, struct timespec *ts_abort)
 {
   TR_MQ_MSG *popped=NULL;
-  int wait_err=0;
-  
+  int rc=0;
+
+  /* Threads blocked here wait on have_msgs rather than wake_fd, so that each
+   * wakeup goes to a single thread instead of every one sharing the queue. */
   tr_mq_lock(mq);
-  if ((tr_mq_get_head(mq)==NULL) && (ts_abort!=NULL)) {
+  while (1) {
+    popped=tr_mq_take_next(mq);
+    if (popped==NULL) {
+      tr_mq_unsignal(mq);
+      popped=tr_mq_take_next(mq); /* added before we cleared the signal */
+    }
+    if ((popped!=NULL) || (ts_abort==NULL) || (rc==ETIMEDOUT))
+      break;
+
     /* No msgs yet, and blocking was requested */
-    while ((wait_err==0) && (NULL==tr_mq_get_head(mq)))
-      wait_err=pthread_cond_timedwait(&(mq->have_msg_cond),
-                                     &(mq->mutex),
-                                     ts_abort);
-    
-    if ((wait_err!=0) && (wait_err!=ETIMEDOUT)) {
+    rc=pthread_cond_timedwait(&(mq->have_msgs), &(mq->mutex), ts_abort);
+    if ((rc!=0) && (rc!=ETIMEDOUT)) {
       tr_notice("tr_mq_pop: error waiting for message.");
-      return NULL;
+      break;
     }
-    /* if it timed out, ok to go ahead and check once more for a message, so no special exit */
   }
-
-  if (tr_mq_get_head(mq)!=NULL) {
-    popped=tr_mq_get_head(mq);
-    tr_mq_set_head(mq, tr_mq_msg_get_next(popped)); /* popped is the old head */
-
-    if (popped==mq->last_hi_prio)
-      mq->last_hi_prio=NULL;
-
-    if (tr_mq_get_head(mq)==NULL)
-      tr_mq_set_tail(mq, NULL); /* just popped the last element */
-  }
-  tr_mq_unlock(mq);
   if (popped!=NULL)
-    tr_mq_msg_set_next(popped, NULL); /* disconnect from list */
+    tr_mq_settle(mq);
+  tr_mq_unlock(mq);
   return popped;
 }
-
@@ -40,6 +40,7 @@
 #include <jansson.h>
 #include <assert.h>
 #include <talloc.h>
+#include <glib.h>
 
 
 #include <tr_apc.h>
@@ -154,6 +155,19 @@ void tr_msg_set_trp_req(TR_MSG *msg, TRP_REQ *req)
   msg->msg_type=TRP_REQUEST;
 }
 
+TRP_KALIVE *tr_msg_get_trp_kalive(TR_MSG *msg)
+{
+  if (msg->msg_type == TRP_KEEPALIVE)
+    return (TRP_KALIVE *)msg->msg_rep;
+  return NULL;
+}
+
+void tr_msg_set_trp_kalive(TR_MSG *msg, TRP_KALIVE *kalive)
+{
+  msg->msg_rep=kalive;
+  msg->msg_type=TRP_KEEPALIVE;
+}
+
 static json_t *tr_msg_encode_dh(DH *dh)
 {
   json_t *jdh = NULL;
@@ -242,6 +256,14 @@ static json_t * tr_msg_encode_tidreq(TID_REQ *req)
   if (req->expiration_interval)
     json_object_set_new(jreq, "expiration_interval",
 			json_integer(req->expiration_interval));
+
+  if (req->request_id) {
+    jstr = json_string(req->request_id->buf);
+    json_object_set_new(jreq, "request_id", jstr);
+  }
+
+  if (req->timeout_ms)
+    json_object_set_new(jreq, "timeout_ms", json_integer(req->timeout_ms));
   
   return jreq;
 }
@@ -256,6 +278,8 @@ static TID_REQ *tr_msg_decode_tidreq(json_t *jreq)
   json_t *jdh = NULL;
   json_t *jpath = NULL;
   json_t *jexpire_interval = NULL;
+  json_t *jrequest_id = NULL;
+  json_t *jtimeout_ms = NULL;
 
   if (!(treq =tid_req_new())) {
     tr_crit("tr_msg_decode_tidreq(): Error allocating TID_REQ structure.");
@@ -308,6 +332,19 @@ static TID_REQ *tr_msg_decode_tidreq(json_t *jreq)
   }
   if (jexpire_interval)
     treq->expiration_interval = json_integer_value(jexpire_interval);
+
+  /* store optional "request_id" field */
+  if ((NULL != (jrequest_id = json_object_get(jreq, "request_id"))) &&
+      (json_is_string(jrequest_id))) {
+    treq->request_id = tr_new_name((char *)json_string_value(jrequest_id));
+  }
+
+  /* store optional "timeout_ms" field */
+  if ((NULL != (jtimeout_ms = json_object_get(jreq, "timeout_ms"))) &&
+      (json_is_integer(jtimeout_ms)) &&
+      (json_integer_value(jtimeout_ms) > 0)) {
+    treq->timeout_ms = json_integer_value(jtimeout_ms);
+  }
   
   return treq;
 }
@@ -478,6 +515,11 @@ static json_t * tr_msg_encode_tidresp(TID_RESP *resp)
   }
   if (resp->error_path)
     json_object_set(jresp, "error_path", resp->error_path);
+
+  if (resp->request_id) {
+    jstr = json_string(resp->request_id->buf);
+    json_object_set_new(jresp, "request_id", jstr);
+  }
   
   
   return jresp;
@@ -493,6 +535,7 @@ static TID_RESP *tr_msg_decode_tidresp(json_t *jresp)
   json_t *jorig_coi = NULL;
   json_t *jservers = NULL;
   json_t *jerr_msg = NULL;
+  json_t *jrequest_id = NULL;
 
   if (!(tresp=tid_resp_new(NULL))) {
     tr_crit("tr_msg_decode_tidresp(): Error allocating TID_RESP structure.");
@@ -548,6 +591,12 @@ static TID_RESP *tr_msg_decode_tidresp(json_t *jresp)
       (!json_is_object(jorig_coi))) {
     tresp->orig_coi = tr_new_name(json_string_value(jorig_coi));
   }
+
+  /* store optional "request_id" field */
+  if ((NULL != (jrequest_id = json_object_get(jresp, "request_id"))) &&
+      (json_is_string(jrequest_id))) {
+    tresp->request_id = tr_new_name(json_string_value(jrequest_id));
+  }
      
   return tresp;
 }
@@ -661,6 +710,7 @@ static TRP_RC tr_msg_encode_inforec_comm(json_t *jrec, TRP_INFOREC *rec)
   json_t *jstr=NULL;
   json_t *jint=NULL;
   json_t *japcs=NULL;
+  json_t *jprov=NULL;
   const char *sconst=NULL;
   TR_COMM_TYPE commtype=TR_COMM_UNKNOWN;
 
@@ -712,7 +762,12 @@ static TRP_RC tr_msg_encode_inforec_comm(json_t *jrec, TRP_INFOREC *rec)
     json_object_set_new(jrec, "owner_contact", jstr);
   }  
 
-  json_object_set(jrec, "provenance", trp_inforec_get_provenance(rec));
+  if (trp_inforec_get_provenance(rec)!=NULL) {
+    jprov=tr_provenance_to_json(trp_inforec_get_provenance(rec));
+    if(jprov==NULL)
+      return TRP_ERROR;
+    json_object_set_new(jrec, "provenance", jprov);
+  }
 
   jint=json_integer(trp_inforec_get_interval(rec));
   if(jint==NULL)
@@ -799,6 +854,8 @@ static TRP_RC tr_msg_decode_trp_inforec_comm(json_t *jrecord, TRP_INFOREC *rec)
   char *s=NULL;
   int num=0;
   TR_APC *apcs=NULL;
+  json_t *jprov=NULL;
+  TR_PROVENANCE *prov=NULL;
 
   rc=tr_msg_get_json_string(jrecord, "type", &s, tmp_ctx);
   if (rc != TRP_SUCCESS)
@@ -830,7 +887,17 @@ static TRP_RC tr_msg_decode_trp_inforec_comm(json_t *jrecord, TRP_INFOREC *rec)
   if ((rc != TRP_SUCCESS) || (TRP_SUCCESS!=trp_inforec_set_interval(rec,num)))
     goto cleanup;
 
-  trp_inforec_set_provenance(rec, json_object_get(jrecord, "provenance"));
+  /* optional, materialize it from the wire format once per record */
+  jprov=json_object_get(jrecord, "provenance");
+  if (jprov!=NULL) {
+    prov=tr_provenance_from_json(tmp_ctx, jprov);
+    if (prov==NULL) {
+      tr_debug("tr_msg_decode_trp_inforec_comm: invalid provenance.");
+      rc=TRP_ERROR;
+      goto cleanup;
+    }
+    trp_inforec_set_provenance(rec, prov);
+  }
 
   /* optional */
   rc=tr_msg_get_json_string(jrecord, "owner_realm", &s, tmp_ctx);
@@ -952,6 +1019,10 @@ static json_t *tr_msg_encode_trp_upd(TRP_UPD *update)
   }
   json_object_set_new(jupdate, "realm", jstr);
 
+  /* only sent when nonzero, older peers neither send nor expect it */
+  if (trp_upd_get_seq(update)!=0)
+    json_object_set_new(jupdate, "seq", json_integer(trp_upd_get_seq(update)));
+
   jrecords=json_array();
   if (jrecords==NULL) {
     json_decref(jupdate);
@@ -988,6 +1059,7 @@ static TRP_UPD *tr_msg_decode_trp_upd(TALLOC_CTX *mem_ctx, json_t *jupdate)
   TRP_INFOREC *list_tail=NULL;
   char *s=NULL;
   TR_NAME *name;
+  int num=0;
   TRP_RC rc=TRP_ERROR;
 
   update=trp_upd_new(tmp_ctx);
@@ -1026,6 +1098,10 @@ static TRP_UPD *tr_msg_decode_trp_upd(TALLOC_CTX *mem_ctx, json_t *jupdate)
   talloc_free(s); s=NULL;
   trp_upd_set_realm(update, name);
 
+  /* optional, absent from older peers */
+  if (TRP_SUCCESS==tr_msg_get_json_integer(jupdate, "seq", &num))
+    trp_upd_set_seq(update, (unsigned int)num);
+
   jrecords=json_object_get(jupdate, "records");
   if ((jrecords==NULL) || (!json_is_array(jrecords))) {
     rc=TRP_NOPARSE;
@@ -1144,6 +1220,168 @@ cleanup:
   return req;
 }
 
+/* Decode a trp_update message body holding several updates. They are chained
+ * with trp_upd_set_next() and all belong to the first one's talloc context. */
+static TRP_UPD *tr_msg_decode_trp_upd_list(TALLOC_CTX *mem_ctx, json_t *jupdates)
+{
+  TRP_UPD *first=NULL;
+  TRP_UPD *last=NULL;
+  TRP_UPD *upd=NULL;
+  size_t ii=0;
+
+  for (ii=0; ii<json_array_size(jupdates); ii++) {
+    upd=tr_msg_decode_trp_upd(first, json_array_get(jupdates, ii));
+    if (upd==NULL) {
+      tr_debug("tr_msg_decode_trp_upd_list: could not decode update %u, discarding message.", (unsigned) ii);
+      trp_upd_free(first);
+      return NULL;
+    }
+    if (first==NULL)
+      first=upd;
+    else
+      trp_upd_set_next(last, upd);
+    last=upd;
+  }
+
+  if (first!=NULL)
+    talloc_steal(mem_ctx, first);
+  return first;
+}
+
+/* Encode a single update as the JSON text tr_msg_pack_trp_upds() expects.
+ * Free the result with tr_msg_free_encoded(). */
+char *tr_msg_encode_trp_upd_body(TRP_UPD *upd)
+{
+  json_t *jupdate=tr_msg_encode_trp_upd(upd);
+  char *encoded=NULL;
+
+  if (jupdate==NULL)
+    return NULL;
+  encoded=json_dumps(jupdate, 0);
+  json_decref(jupdate);
+  return encoded;
+}
+
+/* Pack as many encoded updates as fit in max_len bytes (at least one) into
+ * a single trp_update message whose body is an array. The bodies are copied,
+ * not re-encoded, so the same ones can be packed for any number of peers.
+ * Sets *n_packed to the number of bodies used. Only for peers known to accept
+ * this form. */
+char *tr_msg_pack_trp_upds(GBytes **bodies, size_t n_bodies, unsigned int seq, size_t max_len, size_t *n_packed)
+{
+  static const char tail[]="]}";
+  char head[64];
+  int head_len=0;
+  const char *body=NULL;
+  gsize body_len=0;
+  char *buf=NULL;
+  char *new_buf=NULL;
+  size_t len=0;
+  size_t ii=0;
+
+  *n_packed=0;
+  if (n_bodies==0)
+    return NULL;
+
+  head_len=snprintf(head, sizeof(head), "{\"msg_type\": \"trp_update\", \"seq\": %u, \"msg_body\": [", seq);
+  buf=malloc(head_len+1);
+  if (buf==NULL)
+    return NULL;
+  memcpy(buf, head, head_len);
+  len=head_len;
+
+  for (ii=0; ii<n_bodies; ii++) {
+    body=g_bytes_get_data(bodies[ii], &body_len);
+
+    /* always take the first, however large, so the caller makes progress */
+    if ((ii>0) && (len + 2 + body_len + sizeof(tail) > max_len))
+      break;
+
+    new_buf=realloc(buf, len + 2 + body_len + sizeof(tail));
+    if (new_buf==NULL) {
+      free(buf);
+      return NULL;
+    }
+    buf=new_buf;
+    if (ii>0) {
+      memcpy(buf+len, ", ", 2);
+      len+=2;
+    }
+    memcpy(buf+len, body, body_len);
+    len+=body_len;
+  }
+
+  memcpy(buf+len, tail, sizeof(tail)); /* includes the null terminator */
+  *n_packed=ii;
+  tr_debug("tr_msg_pack_trp_upds: %u update(s) in %u bytes.", (unsigned) ii, (unsigned) (len+sizeof(tail)-1));
+  return buf;
+}
+
+static json_t *tr_msg_encode_trp_kalive(TRP_KALIVE *kalive)
+{
+  json_t *jbody=NULL;
+
+  if (kalive==NULL)
+    return NULL;
+
+  jbody=json_object();
+  if (jbody==NULL)
+    return NULL;
+
+  json_object_set_new(jbody, "seq", json_integer(trp_kalive_get_seq(kalive)));
+  json_object_set_new(jbody, "digest", json_integer(trp_kalive_get_digest(kalive)));
+  json_object_set_new(jbody, "n_routes", json_integer(trp_kalive_get_n_routes(kalive)));
+  json_object_set_new(jbody, "interval", json_integer(trp_kalive_get_interval(kalive)));
+  return jbody;
+}
+
+static TRP_KALIVE *tr_msg_decode_trp_kalive(TALLOC_CTX *mem_ctx, json_t *jkalive)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_KALIVE *kalive=NULL;
+  json_int_t digest=0;
+  int num=0;
+  TRP_RC rc=TRP_ERROR;
+
+  kalive=trp_kalive_new(tmp_ctx);
+  if (kalive==NULL) {
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  rc=tr_msg_get_json_integer(jkalive, "seq", &num);
+  if (rc!=TRP_SUCCESS)
+    goto cleanup;
+  trp_kalive_set_seq(kalive, (unsigned int)num);
+
+  /* the digest uses all 32 bits, so do not squeeze it through an int */
+  if (!json_is_integer(json_object_get(jkalive, "digest"))) {
+    rc=TRP_NOPARSE;
+    goto cleanup;
+  }
+  digest=json_integer_value(json_object_get(jkalive, "digest"));
+  trp_kalive_set_digest(kalive, (unsigned int)digest);
+
+  rc=tr_msg_get_json_integer(jkalive, "n_routes", &num);
+  if (rc!=TRP_SUCCESS)
+    goto cleanup;
+  trp_kalive_set_n_routes(kalive, (unsigned int)num);
+
+  rc=tr_msg_get_json_integer(jkalive, "interval", &num);
+  if (rc!=TRP_SUCCESS)
+    goto cleanup;
+  trp_kalive_set_interval(kalive, (unsigned int)num);
+
+  rc=TRP_SUCCESS;
+  talloc_steal(mem_ctx, kalive);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  if (rc!=TRP_SUCCESS)
+    return NULL;
+  return kalive;
+}
+
 char *tr_msg_encode(TR_MSG *msg) 
 {
   json_t *jmsg=NULL;
@@ -1153,6 +1391,7 @@ char *tr_msg_encode(TR_MSG *msg)
   TID_REQ *tidreq=NULL;
   TRP_UPD *trpupd=NULL;
   TRP_REQ *trpreq=NULL;
+  TRP_KALIVE *trpkalive=NULL;
 
   /* TBD -- add error handling */
   jmsg = json_object();
@@ -1187,6 +1426,13 @@ char *tr_msg_encode(TR_MSG *msg)
       json_object_set_new(jmsg, "msg_body", tr_msg_encode_trp_req(trpreq));
       break;
 
+    case TRP_KEEPALIVE:
+      jmsg_type = json_string("trp_keepalive");
+      json_object_set_new(jmsg, "msg_type", jmsg_type);
+      trpkalive=tr_msg_get_trp_kalive(msg);
+      json_object_set_new(jmsg, "msg_body", tr_msg_encode_trp_kalive(trpkalive));
+      break;
+
     default:
       json_decref(jmsg);
       return NULL;
@@ -1206,6 +1452,7 @@ TR_MSG *tr_msg_decode(char *jbuf, size_t buflen)
   json_t *jtype=NULL;
   json_t *jbody=NULL;
   const char *mtype = NULL;
+  TRP_UPD *upd=NULL;
 
   if (NULL == (jmsg = json_loadb(jbuf, buflen, JSON_DISABLE_EOF_CHECK, &rc))) {
     tr_debug("tr_msg_decode(): error loading object");
@@ -1240,12 +1487,23 @@ TR_MSG *tr_msg_decode(char *jbuf, size_t buflen)
   }
   else if (0 == strcmp(mtype, "trp_update")) {
     msg->msg_type = TRP_UPDATE;
-    tr_msg_set_trp_upd(msg, tr_msg_decode_trp_upd(NULL, jbody)); /* null talloc context for now */
+    if (json_is_array(jbody)) {
+      tr_msg_set_trp_upd(msg, tr_msg_decode_trp_upd_list(NULL, jbody)); /* null talloc context for now */
+      /* a packed message carries one sequence number for all its updates */
+      if (json_is_integer(json_object_get(jmsg, "seq"))) {
+        for (upd=tr_msg_get_trp_upd(msg); upd!=NULL; upd=trp_upd_get_next(upd))
+          trp_upd_set_seq(upd, (unsigned int)json_integer_value(json_object_get(jmsg, "seq")));
+      }
+    } else
+      tr_msg_set_trp_upd(msg, tr_msg_decode_trp_upd(NULL, jbody)); /* null talloc context for now */
   }
   else if (0 == strcmp(mtype, "trp_request")) {
     msg->msg_type = TRP_UPDATE;
     tr_msg_set_trp_req(msg, tr_msg_decode_trp_req(NULL, jbody)); /* null talloc context for now */
   }
+  else if (0 == strcmp(mtype, "trp_keepalive")) {
+    tr_msg_set_trp_kalive(msg, tr_msg_decode_trp_kalive(NULL, jbody)); /* null talloc context for now */
+  }
   else {
     msg->msg_type = TR_UNKNOWN;
     msg->msg_rep = NULL;
@@ -1277,6 +1535,10 @@ void tr_msg_free_decoded(TR_MSG *msg)
       break;
     case TRP_REQUEST:
       trp_req_free(tr_msg_get_trp_req(msg));
+      break;
+    case TRP_KEEPALIVE:
+      trp_kalive_free(tr_msg_get_trp_kalive(msg));
+      break;
     default:
       break;
     }
@@ -34,52 +34,168 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <jansson.h>
 
 #include <trust_router/tr_name.h>
 
-void tr_free_name (TR_NAME *name)
+/* Names are interned: every name created by tr_new_name() or tr_dup_name()
+ * is a shared, reference counted atom, so there is one copy of each distinct
+ * name and equal names have equal pointers. The atoms live in a chained hash
+ * table, linked through their next_atom pointers.
+ *
+ * Reference counts are updated atomically. The mutex is only taken to look up
+ * or add an atom, and to drop the last reference, so that a lookup never finds
+ * an atom that is being freed: the count only reaches 0 with the mutex held. */
+#define TR_NAME_ATOMS_INITIAL_SIZE 1024
+
+static pthread_mutex_t tr_name_atoms_mutex=PTHREAD_MUTEX_INITIALIZER;
+static TR_NAME **tr_name_atoms=NULL;
+static size_t tr_name_atoms_size=0; /* number of buckets, a power of 2 */
+static size_t tr_name_atoms_count=0;
+
+/* FNV-1a. Never returns 0, which marks an uncomputed hash. */
+static unsigned int tr_name_buf_hash(const char *buf, int len)
 {
-  if (name->buf) {
-    free (name->buf);
-    name->buf = NULL;
+  unsigned int hash=2166136261u;
+  int ii=0;
+
+  for (ii=0; ii<len; ii++) {
+    hash^=(unsigned char)buf[ii];
+    hash*=16777619u;
   }
+  if (hash==0)
+    hash=1;
+  return hash;
+}
 
-  free(name);
+/* Double the number of buckets. Call with the mutex held. Leaves the
+ * table as it was if memory runs out. */
+static void tr_name_atoms_grow(void)
+{
+  size_t new_size=(tr_name_atoms_size==0)?TR_NAME_ATOMS_INITIAL_SIZE:2*tr_name_atoms_size;
+  TR_NAME **new_atoms=calloc(new_size, sizeof(TR_NAME *));
+  TR_NAME *this=NULL, *next=NULL;
+  size_t ii=0;
+
+  if (new_atoms==NULL)
+    return;
+
+  for (ii=0; ii<tr_name_atoms_size; ii++) {
+    for (this=tr_name_atoms[ii]; this!=NULL; this=next) {
+      next=this->next_atom;
+      this->next_atom=new_atoms[this->hash & (new_size-1)];
+      new_atoms[this->hash & (new_size-1)]=this;
+    }
+  }
+  free(tr_name_atoms);
+  tr_name_atoms=new_atoms;
+  tr_name_atoms_size=new_size;
 }
 
-TR_NAME *tr_new_name (const char *name) 
+/* Returns a new reference to the atom for buf, creating it if needed. */
+static TR_NAME *tr_name_intern(const char *buf, int len)
 {
-  TR_NAME *new;
-
-  if (new = malloc(sizeof(TR_NAME))) {
-    new->len = strlen(name);
-    if (new->buf = malloc((new->len)+1)) {
-      strcpy(new->buf, name);
-    } else {
-      free(new);
-      new=NULL;
+  unsigned int hash=tr_name_buf_hash(buf, len);
+  TR_NAME *atom=NULL;
+
+  pthread_mutex_lock(&tr_name_atoms_mutex);
+  if (tr_name_atoms_count>=tr_name_atoms_size)
+    tr_name_atoms_grow();
+  if (tr_name_atoms==NULL)
+    goto cleanup;
+
+  for (atom=tr_name_atoms[hash & (tr_name_atoms_size-1)]; atom!=NULL; atom=atom->next_atom) {
+    if ((atom->hash==hash) && (atom->len==len) && (0==memcmp(atom->buf, buf, len))) {
+      __atomic_add_fetch(&(atom->refcount), 1, __ATOMIC_RELAXED);
+      goto cleanup;
     }
   }
-  return new;
+
+  /* not found, allocate the name and its buffer together */
+  atom=malloc(sizeof(TR_NAME)+len+1);
+  if (atom==NULL)
+    goto cleanup;
+  atom->buf=(char *)(atom+1);
+  memcpy(atom->buf, buf, len);
+  atom->buf[len]=0; /* NULL terminate for debugging printf()s */
+  atom->len=len;
+  atom->hash=hash;
+  atom->refcount=1;
+  atom->next_atom=tr_name_atoms[hash & (tr_name_atoms_size-1)];
+  tr_name_atoms[hash & (tr_name_atoms_size-1)]=atom;
+  tr_name_atoms_count++;
+
+cleanup:
+  pthread_mutex_unlock(&tr_name_atoms_mutex);
+  return atom;
 }
 
-TR_NAME *tr_dup_name (TR_NAME *from)
+void tr_free_name (TR_NAME *name)
 {
-  TR_NAME *to;
+  TR_NAME **link=NULL;
+  unsigned int refcount=0;
+
+  if (__atomic_load_n(&(name->refcount), __ATOMIC_RELAXED)==0) {
+    /* not interned */
+    if (name->buf) {
+      free (name->buf);
+      name->buf = NULL;
+    }
+    free(name);
+    return;
+  }
+
+  /* drop a reference that is not the last without taking the mutex */
+  refcount=__atomic_load_n(&(name->refcount), __ATOMIC_RELAXED);
+  while (refcount>1) {
+    if (__atomic_compare_exchange_n(&(name->refcount), &refcount, refcount-1,
+                                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+  }
 
+  pthread_mutex_lock(&tr_name_atoms_mutex);
+  if (__atomic_sub_fetch(&(name->refcount), 1, __ATOMIC_ACQ_REL)==0) {
+    for (link=&tr_name_atoms[name->hash & (tr_name_atoms_size-1)]; *link!=NULL; link=&((*link)->next_atom)) {
+      if (*link==name) {
+        *link=name->next_atom;
+        break;
+      }
+    }
+    tr_name_atoms_count--;
+    free(name); /* buffer was allocated with the name */
+  }
+  pthread_mutex_unlock(&tr_name_atoms_mutex);
+}
+
+TR_NAME *tr_new_name (const char *name) 
+{
+  return tr_name_intern(name, strlen(name));
+}
+
+TR_NAME *tr_dup_name (TR_NAME *from)
+{
   if (!from) {
     return NULL;
   }
 
-  if (NULL != (to = malloc(sizeof(TR_NAME)))) {
-    to->len = from->len;
-    if (NULL != (to->buf = malloc(to->len+1))) {
-      strncpy(to->buf, from->buf, from->len);
-      to->buf[to->len] = 0;	/* NULL terminate for debugging printf()s */
-    }
+  if (__atomic_load_n(&(from->refcount), __ATOMIC_RELAXED)>0) {
+    /* already an atom, just take another reference */
+    __atomic_add_fetch(&(from->refcount), 1, __ATOMIC_RELAXED);
+    return from;
   }
-  return to;
+  return tr_name_intern(from->buf, from->len);
+}
+
+/* Number of distinct names currently interned */
+size_t tr_name_count_atoms(void)
+{
+  size_t count=0;
+
+  pthread_mutex_lock(&tr_name_atoms_mutex);
+  count=tr_name_atoms_count;
+  pthread_mutex_unlock(&tr_name_atoms_mutex);
+  return count;
 }
 
 int tr_name_cmp(TR_NAME *one, TR_NAME *two)
@@ -87,6 +203,9 @@ int tr_name_cmp(TR_NAME *one, TR_NAME *two)
   int len=one->len;
   int cmp=0;
 
+  if (one==two)
+    return 0;
+
   if (two->len<one->len)
     len=two->len; /* len now min(one->len,two->len) */
 
@@ -102,6 +221,31 @@ int tr_name_cmp(TR_NAME *one, TR_NAME *two)
   return cmp;
 }
 
+/* Hash of the name, cached on the name. Names must not be modified once
+ * hashed. Never returns 0. */
+unsigned int tr_name_hash(TR_NAME *name)
+{
+  if (name->hash==0)
+    name->hash=tr_name_buf_hash(name->buf, name->len);
+  return name->hash;
+}
+
+/* Returns nonzero if the names are identical. Cheaper than tr_name_cmp()
+ * when only equality matters. */
+int tr_name_equal(TR_NAME *one, TR_NAME *two)
+{
+  if (one==two)
+    return 1;
+  if ((__atomic_load_n(&(one->refcount), __ATOMIC_RELAXED)>0)
+     && (__atomic_load_n(&(two->refcount), __ATOMIC_RELAXED)>0))
+    return 0; /* distinct atoms are distinct names */
+  if (one->len!=two->len)
+    return 0;
+  if ((one->hash!=0) && (two->hash!=0) && (one->hash!=two->hash))
+    return 0;
+  return (0==memcmp(one->buf, two->buf, one->len));
+}
+
 void tr_name_strlcat(char *dest, const TR_NAME *src, size_t len)
 {
   size_t used_len;
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <talloc.h>
+#include <jansson.h>
+
+#include <trust_router/tr_name.h>
+#include <tr_provenance.h>
+
+/* bits of the bloom word set for a name */
+static uint64_t tr_provenance_bloom_bits(TR_NAME *name)
+{
+  unsigned int hash=tr_name_hash(name);
+  return (((uint64_t)1)<<(hash & 63)) | (((uint64_t)1)<<((hash>>6) & 63));
+}
+
+static int tr_provenance_destructor(void *obj)
+{
+  TR_PROVENANCE *prov=talloc_get_type_abort(obj, TR_PROVENANCE);
+  size_t ii=0;
+
+  for (ii=0; ii<prov->n_hops; ii++)
+    tr_free_name(prov->hops[ii]);
+  return 0;
+}
+
+TR_PROVENANCE *tr_provenance_new(TALLOC_CTX *mem_ctx)
+{
+  TR_PROVENANCE *prov=talloc(mem_ctx, TR_PROVENANCE);
+  if (prov!=NULL) {
+    prov->hops=NULL;
+    prov->n_hops=0;
+    prov->bloom=0;
+    talloc_set_destructor((void *)prov, tr_provenance_destructor);
+  }
+  return prov;
+}
+
+void tr_provenance_free(TR_PROVENANCE *prov)
+{
+  talloc_free(prov);
+}
+
+/* Make room for n hops. Returns 0 on success. */
+static int tr_provenance_reserve(TR_PROVENANCE *prov, size_t n)
+{
+  TR_NAME **new_hops=NULL;
+
+  if ((prov->hops!=NULL) && (talloc_array_length(prov->hops)>=n))
+    return 0;
+  new_hops=talloc_realloc(prov, prov->hops, TR_NAME *, n);
+  if (new_hops==NULL)
+    return -1;
+  prov->hops=new_hops;
+  return 0;
+}
+
+TR_PROVENANCE *tr_provenance_dup(TALLOC_CTX *mem_ctx, TR_PROVENANCE *prov)
+{
+  TR_PROVENANCE *new=NULL;
+  size_t ii=0;
+
+  if (prov==NULL)
+    return NULL;
+
+  new=tr_provenance_new(mem_ctx);
+  if (new==NULL)
+    return NULL;
+  if ((prov->n_hops>0) && (0!=tr_provenance_reserve(new, prov->n_hops))) {
+    tr_provenance_free(new);
+    return NULL;
+  }
+  for (ii=0; ii<prov->n_hops; ii++)
+    new->hops[ii]=tr_dup_name(prov->hops[ii]);
+  new->n_hops=prov->n_hops;
+  new->bloom=prov->bloom;
+  return new;
+}
+
+/* Appends a reference to hop. Returns 0 on success. */
+int tr_provenance_add(TR_PROVENANCE *prov, TR_NAME *hop)
+{
+  TR_NAME *atom=NULL;
+
+  if (0!=tr_provenance_reserve(prov, prov->n_hops+1))
+    return -1;
+  atom=tr_dup_name(hop);
+  if (atom==NULL)
+    return -1;
+  prov->hops[prov->n_hops++]=atom;
+  prov->bloom|=tr_provenance_bloom_bits(atom);
+  return 0;
+}
+
+size_t tr_provenance_len(TR_PROVENANCE *prov)
+{
+  if (prov==NULL)
+    return 0;
+  return prov->n_hops;
+}
+
+/* Do not free the result */
+TR_NAME *tr_provenance_get_hop(TR_PROVENANCE *prov, size_t ii)
+{
+  if ((prov==NULL) || (ii>=prov->n_hops))
+    return NULL;
+  return prov->hops[ii];
+}
+
+/* The first hop, or NULL if the provenance is empty. Do not free the result. */
+TR_NAME *tr_provenance_get_origin(TR_PROVENANCE *prov)
+{
+  return tr_provenance_get_hop(prov, 0);
+}
+
+/* Returns nonzero if name is one of the hops */
+int tr_provenance_contains(TR_PROVENANCE *prov, TR_NAME *name)
+{
+  uint64_t bits=0;
+  size_t ii=0;
+
+  if ((prov==NULL) || (name==NULL))
+    return 0;
+
+  bits=tr_provenance_bloom_bits(name);
+  if ((prov->bloom & bits)!=bits)
+    return 0; /* definitely not there */
+
+  for (ii=0; ii<prov->n_hops; ii++) {
+    if (tr_name_equal(name, prov->hops[ii]))
+      return 1;
+  }
+  return 0;
+}
+
+/* 0 if equivalent, nonzero if different. Only considers the last
+ * nhops hops (nhops==0 means consider all, nhops==1 only considers
+ * the last hop). NULL is equivalent only to NULL. */
+int tr_provenance_cmp(TR_PROVENANCE *p1, TR_PROVENANCE *p2, size_t nhops)
+{
+  size_t ii=0;
+
+  if ((p1==NULL) || (p2==NULL))
+    return p1!=p2; /* return 0 if both null, 1 if only one null */
+
+  if ((nhops==0) || (nhops>p1->n_hops) || (nhops>p2->n_hops)) {
+    if (p1->n_hops!=p2->n_hops)
+      return 1;
+    if (p1->bloom!=p2->bloom)
+      return 1;
+    nhops=p1->n_hops;
+  }
+
+  for (ii=1; ii<=nhops; ii++) {
+    if (!tr_name_equal(p1->hops[p1->n_hops-ii], p2->hops[p2->n_hops-ii]))
+      return 1;
+  }
+  return 0;
+}
+
+/* Wire format is an array of strings. Caller must json_decref() the result. */
+json_t *tr_provenance_to_json(TR_PROVENANCE *prov)
+{
+  json_t *jprov=json_array();
+  json_t *jhop=NULL;
+  size_t ii=0;
+
+  if (jprov==NULL)
+    return NULL;
+
+  for (ii=0; ii<tr_provenance_len(prov); ii++) {
+    jhop=tr_name_to_json_string(prov->hops[ii]);
+    if ((jhop==NULL) || (0!=json_array_append_new(jprov, jhop))) {
+      json_decref(jprov);
+      return NULL;
+    }
+  }
+  return jprov;
+}
+
+/* Returns NULL if jprov is not an array of strings or on allocation failure */
+TR_PROVENANCE *tr_provenance_from_json(TALLOC_CTX *mem_ctx, json_t *jprov)
+{
+  TR_PROVENANCE *prov=NULL;
+  TR_NAME *hop=NULL;
+  const char *s=NULL;
+  size_t ii=0;
+
+  if (!json_is_array(jprov))
+    return NULL;
+
+  prov=tr_provenance_new(mem_ctx);
+  if (prov==NULL)
+    return NULL;
+  if ((json_array_size(jprov)>0) && (0!=tr_provenance_reserve(prov, json_array_size(jprov))))
+    goto error;
+
+  for (ii=0; ii<json_array_size(jprov); ii++) {
+    s=json_string_value(json_array_get(jprov, ii));
+    if (s==NULL)
+      goto error;
+    hop=tr_new_name(s); /* interned, so no per-hop allocation for names we have seen */
+    if (hop==NULL)
+      goto error;
+    prov->hops[prov->n_hops++]=hop;
+    prov->bloom|=tr_provenance_bloom_bits(hop);
+  }
+  return prov;
+
+error:
+  tr_provenance_free(prov);
+  return NULL;
+}
@@ -55,6 +55,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include <gsscon.h>
 
@@ -63,7 +66,88 @@
 
 int gsscon_connect (const char *inHost, unsigned int inPort, const char *inServiceName, int *outFD, gss_ctx_id_t *outGSSContext)
 {
+  return gsscon_connect_timeout (inHost, inPort, inServiceName, 0, outFD, outGSSContext);
+}
+
+/* ---------------------------------------------------------------------------
+ * Milliseconds left before deadline, or 0 if it has passed
+ */
+
+static int RemainingMS (const struct timespec *deadline)
+{
+  struct timespec now;
+  long ms;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &now) != 0) { return 0; }
+  ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  return (ms > 0) ? (int) ms : 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Connect fd to addr, giving up after timeoutMS milliseconds
+ */
+
+static int ConnectWithTimeout (int fd, const struct sockaddr *addr, socklen_t addrlen, int timeoutMS)
+{
+  int flags = fcntl (fd, F_GETFL, 0);
+  struct pollfd pfd = { .fd = fd, .events = POLLOUT };
   int err = 0;
+  socklen_t errlen = sizeof (err);
+  int rc;
+
+  if ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0)) { return errno; }
+
+  if (connect (fd, addr, addrlen) != 0) {
+    if (errno != EINPROGRESS) {
+      err = errno;
+    } else {
+      do {
+        rc = poll (&pfd, 1, timeoutMS);
+      } while ((rc < 0) && (errno == EINTR));
+      if (rc == 0) {
+        err = ETIMEDOUT;
+      } else if (rc < 0) {
+        err = errno;
+      } else if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0) {
+        err = errno;
+      }
+    }
+  }
+
+  if (fcntl (fd, F_SETFL, flags) != 0 && !err) { err = errno; }
+  return err;
+}
+
+/* ---------------------------------------------------------------------------
+ * Make reads and writes on inSocket fail with EAGAIN if they block for longer
+ * than inTimeoutMS milliseconds. 0 means no limit.
+ */
+
+int gsscon_set_timeout (int inSocket, int inTimeoutMS)
+{
+  struct timeval tv;
+
+  tv.tv_sec = inTimeoutMS / 1000;
+  tv.tv_usec = (inTimeoutMS % 1000) * 1000;
+  if ((setsockopt (inSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) != 0) ||
+      (setsockopt (inSocket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) != 0)) {
+    return errno;
+  }
+  return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * As gsscon_connect(), but give up if connecting and authenticating take more
+ * than inTimeoutMS milliseconds (0 for no limit). On success, reads and writes
+ * on *outFD are still limited to the time that was left; use
+ * gsscon_set_timeout() to change that.
+ */
+
+int gsscon_connect_timeout (const char *inHost, unsigned int inPort, const char *inServiceName, int inTimeoutMS, int *outFD, gss_ctx_id_t *outGSSContext)
+{
+  int err = 0;
+  int remainingMS = 0;
+  struct timespec deadline = { 0, 0 };
   int fd = -1;
   OM_uint32 majorStatus;
   OM_uint32 minorStatus = 0, minorStatusToo = 0;
@@ -86,6 +170,20 @@ int gsscon_connect (const char *inHost, unsigned int inPort, const char *inServi
 
   if (!inServiceName) { err = EINVAL; }
   if (!outGSSContext) { err = EINVAL; }
+  if (inTimeoutMS < 0) { err = EINVAL; }
+
+  if (!err && (inTimeoutMS > 0)) {
+    if (clock_gettime (CLOCK_MONOTONIC, &deadline) != 0) {
+      err = errno;
+    } else {
+      deadline.tv_sec += inTimeoutMS / 1000;
+      deadline.tv_nsec += (inTimeoutMS % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+    }
+  }
     
   if (!err) {
     /* get a string for getaddrinfo */
@@ -106,7 +204,15 @@ int gsscon_connect (const char *inHost, unsigned int inPort, const char *inServi
       }
 
       fprintf(stderr, "gss_connect: Connecting to host '%s' on port %d\n", inHost, inPort);
-      err=connect(fd, ai->ai_addr, ai->ai_addrlen);
+      if (inTimeoutMS > 0) {
+        remainingMS=RemainingMS(&deadline);
+        err=(remainingMS > 0) ? ConnectWithTimeout(fd, ai->ai_addr, ai->ai_addrlen, remainingMS) : ETIMEDOUT;
+        /* bound each read and write of the handshake too */
+        remainingMS=RemainingMS(&deadline);
+        if (err==0)
+          err=(remainingMS > 0) ? gsscon_set_timeout(fd, remainingMS) : ETIMEDOUT;
+      } else
+        err=connect(fd, ai->ai_addr, ai->ai_addrlen);
       if (err!=0) {
         close(fd);
         fd=-1;
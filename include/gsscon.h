@@ -108,6 +108,16 @@ int gsscon_connect (const char *inHost,
 		    int *outFD,
 		    gss_ctx_id_t *outGSSContext);
 
+int gsscon_connect_timeout (const char *inHost,
+			    unsigned int inPort,
+			    const char *inServiceName,
+			    int inTimeoutMS,
+			    int *outFD,
+			    gss_ctx_id_t *outGSSContext);
+
+int gsscon_set_timeout (int inSocket,
+			int inTimeoutMS);
+
 int gsscon_passive_authenticate (int           inSocket, 
 				 gss_buffer_desc inNameBuffer,
 				 gss_ctx_id_t *outGSSContext,
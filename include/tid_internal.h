@@ -35,6 +35,7 @@
 #ifndef TID_INTERNAL_H
 #define TID_INTERNAL_H
 #include <glib.h>
+#include <pthread.h>
 
 #include <tr_rp.h>
 #include <trust_router/tid.h>
@@ -59,6 +60,7 @@ struct tid_resp {
   TR_NAME *orig_coi;
   TID_SRVR_BLK *servers;       	/* array of servers */
   json_t *error_path; /**< Path that a request generating an error traveled*/
+  TR_NAME *request_id; /**< Copied from the request, so clients can match responses*/
 };
 
 struct tid_req {
@@ -79,6 +81,10 @@ struct tid_req {
   time_t expiration_interval; /**< Time to key expire in minutes*/
   json_t *json_references; /**< References to objects dereferenced on request destruction*/
   json_t *path; /**< Path of systems this request has traversed; added by receiver*/
+  TR_NAME *gss_name; /**< GSS name the request's connection authenticated as; set by receiver*/
+  TR_NAME *request_id; /**< Identifies the request among others on the same connection*/
+  unsigned int timeout_ms; /**< Time left to answer this request when it was received, in ms; 0 for no limit*/
+  struct timespec received; /**< When this hop received the request (CLOCK_MONOTONIC); set by receiver, no later than it was queued*/
 };
 
 struct tidc_instance {
@@ -87,10 +93,84 @@ struct tidc_instance {
   // char *priv_key;
   // int priv_len;
   DH *client_dh;			/* Client's DH struct with priv and pub keys */
+  unsigned int req_id; /* last request ID assigned by tidc_send_request() */
 };
 
+/* Pool of authenticated connections from a TID client to TID servers,
+ * keyed by (hostname, port). See tid/tidc_pool.c. */
+typedef struct tidc_pool_host TIDC_POOL_HOST;
+typedef struct tidc_pool_conn TIDC_POOL_CONN;
+
+struct tidc_pool_conn {
+  TIDC_POOL_CONN *next;
+  TIDC_POOL_HOST *host;
+  int conn;
+  gss_ctx_id_t gssctx;
+  time_t last_used; /* when the connection was last returned to the pool */
+  int reused; /* nonzero if this connection has served an earlier request */
+};
+
+struct tidc_pool_host {
+  TIDC_POOL_HOST *next;
+  TR_NAME *hostname;
+  unsigned int port;
+  TIDC_POOL_CONN *idle; /* idle connections, most recently used first */
+  unsigned int n_open; /* idle plus checked out */
+};
+
+typedef struct tidc_pool {
+  pthread_mutex_t mutex; /* protects everything in the pool */
+  pthread_cond_t conn_returned; /* signalled when a connection is returned or closed */
+  TIDC_POOL_HOST *hosts;
+  unsigned int max_per_host; /* 0 for no limit */
+  unsigned int idle_timeout; /* seconds; 0 to close connections after each request */
+} TIDC_POOL;
+
+/* An accepted connection, with its GSS context once it has been authenticated */
+typedef struct tids_conn {
+  int fd;
+  gss_ctx_id_t gssctx; /* GSS_C_NO_CONTEXT until authenticated */
+  TR_NAME *gss_name;
+  unsigned int n_served; /* requests served so far */
+  struct timespec idle_deadline; /* when a parked connection is closed */
+  struct timespec queued; /* when it was handed to the workers, so time waiting counts against the request; {0,0} if not queued */
+} TIDS_CONN;
+
+/* Accepted connections waiting for a worker thread. Connections are
+ * held in a fixed-size ring; when it is full, new connections are refused.
+ * Between requests, open connections are parked, and a watcher thread requeues
+ * them when the next request arrives, so an idle client does not hold a worker.
+ * Refused connections go to a separate ring, where a single shedder thread
+ * answers their request with an error. */
+typedef struct tids_worker_pool {
+  pthread_mutex_t mutex; /* protects the connection queue and parked connections */
+  pthread_cond_t have_conn; /* signalled when a connection is queued */
+  TIDS_CONN **conn_queue;
+  size_t max_pending; /* size of conn_queue */
+  size_t head; /* index of the oldest queued connection */
+  size_t n_pending; /* number of queued connections */
+  TIDS_CONN **shed_queue; /* refused connections, also max_pending long */
+  size_t shed_head;
+  size_t n_shed;
+  pthread_cond_t have_shed; /* signalled when a connection is refused */
+  pthread_t shedder;
+  int shedder_started;
+  GPtrArray *parked; /* idle connections waiting for another request */
+  int wake_pipe[2]; /* written to wake the watcher when a connection is parked */
+  pthread_t watcher;
+  int watcher_started;
+  pthread_t *threads;
+  unsigned int n_threads;
+  int shutdown; /* set to tell the workers, watcher and shedder to exit */
+} TIDS_WORKER_POOL;
+
 struct tids_instance {
   int req_count;
+  pthread_mutex_t mutex; /* protects req_count, n_in_flight and shed_count */
+  unsigned int max_in_flight; /* requests (connections handed to workers, or child processes) handled at once; 0 for no limit */
+  unsigned int n_in_flight;
+  unsigned long shed_count; /* requests refused because max_in_flight was reached */
+  int listen_backlog;
   char *priv_key;
   char *ipaddr;
   const char *hostname;
@@ -98,7 +178,11 @@ struct tids_instance {
   tids_auth_func *auth_handler;
   void *cookie;
   uint16_t tids_port;
-  struct tr_rp_client *rp_gss;		/* Client matching GSS name */
+  unsigned int idle_timeout; /* seconds to wait for another request on a connection; 0 for one request only */
+  TIDS_WORKER_POOL *workers; /* NULL to fork a process per connection */
+  unsigned int n_prefork; /* worker processes for tids_start(); 0 forks per connection */
+  unsigned int prefork_max_req; /* requests a worker process serves before exiting; 0 for no limit */
+  tids_worker_init_func *worker_init; /* called in each worker process before serving */
 };
 
 /** Decrement a reference to #json when this tid_req is cleaned up. A
@@ -107,6 +191,7 @@ struct tids_instance {
 void tid_req_cleanup_json(TID_REQ *, json_t *json);
 
 int tid_req_add_path(TID_REQ *, const char *this_system, unsigned port);
+long tid_req_get_remaining_ms(TID_REQ *req);
 
 TID_SRVR_BLK *tid_srvr_blk_new(TALLOC_CTX *mem_ctx);
 void tid_srvr_blk_free(TID_SRVR_BLK *srvr);
@@ -115,6 +200,26 @@ TID_SRVR_BLK *tid_srvr_blk_add_func(TID_SRVR_BLK *head, TID_SRVR_BLK *new);
 #define tid_srvr_blk_add(head, new) ((head)=tid_srvr_blk_add_func((head),(new)))
 void tid_srvr_blk_set_path(TID_SRVR_BLK *block, TID_PATH *path);
 
+/* returned by tidc_fwd_encoded_request() if the request could not be sent
+ * or its response could not be read */
+#define TIDC_ERR_TRANSPORT (-2)
+
+int tidc_open_connection_timeout(TIDC_INSTANCE *tidc, const char *server, unsigned int port,
+                                 int timeout_ms, gss_ctx_id_t *gssctx);
+GBytes *tidc_encode_request(TID_REQ *tid_req);
+int tidc_fwd_encoded_request(TIDC_INSTANCE *tidc, int conn, gss_ctx_id_t gssctx, GBytes *req_buf,
+                             TR_NAME *request_id, TIDC_RESP_FUNC *resp_handler, void *cookie);
+
+TIDC_POOL *tidc_pool_new(TALLOC_CTX *mem_ctx, unsigned int max_per_host, unsigned int idle_timeout);
+void tidc_pool_free(TIDC_POOL *pool);
+TIDC_POOL_CONN *tidc_pool_get(TIDC_POOL *pool, TIDC_INSTANCE *tidc, const char *hostname,
+                              unsigned int port, const struct timespec *deadline);
+void tidc_pool_put(TIDC_POOL *pool, TIDC_POOL_CONN *pc, int healthy);
+void tidc_pool_sweep(TIDC_POOL *pool);
+int tidc_pool_fwd_request(TIDC_POOL *pool, TIDC_INSTANCE *tidc, const char *hostname,
+                          unsigned int port, const struct timespec *deadline, GBytes *req_buf,
+                          TR_NAME *request_id, TIDC_RESP_FUNC *resp_handler, void *cookie);
+
 void tid_resp_set_cons(TID_RESP *resp, TR_CONSTRAINT_SET *cons);
 void tid_resp_set_error_path(TID_RESP *resp, json_t *ep);
 
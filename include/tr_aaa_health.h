@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TR_AAA_HEALTH_H
+#define TR_AAA_HEALTH_H
+
+#include <pthread.h>
+#include <time.h>
+#include <glib.h>
+#include <talloc.h>
+
+#include <trust_router/tr_name.h>
+#include <tr_idp.h>
+
+/* Circuit breaker states for an AAA server. While the circuit is open, no
+ * requests are sent to the server. After a retry interval, the circuit goes
+ * half-open and a single trial request is allowed through; its outcome
+ * closes or reopens the circuit. */
+typedef enum tr_aaa_circuit {
+  TR_AAA_CIRCUIT_CLOSED=0,
+  TR_AAA_CIRCUIT_OPEN,
+  TR_AAA_CIRCUIT_HALF_OPEN
+} TR_AAA_CIRCUIT;
+
+/* weight given to the newest sample in the moving averages */
+#define TR_AAA_HEALTH_EWMA_WEIGHT 0.2
+/* number of recent response times kept for percentile estimates */
+#define TR_AAA_HEALTH_SAMPLES 32
+
+typedef struct tr_aaa_health {
+  char *hostname;
+  double latency; /* moving average of response time, in seconds */
+  double error_rate; /* moving average of the fraction of requests that failed */
+  double samples[TR_AAA_HEALTH_SAMPLES]; /* recent response times of successful requests, in seconds */
+  unsigned int n_samples;
+  unsigned int next_sample; /* index in samples to overwrite next */
+  unsigned int consecutive_failures;
+  TR_AAA_CIRCUIT circuit;
+  time_t opened; /* when the circuit was last opened */
+  int trial_in_flight; /* half-open circuit has let its trial request through */
+} TR_AAA_HEALTH;
+
+/* Health of every AAA server the trust router has contacted, keyed by hostname. */
+typedef struct tr_aaa_scoreboard {
+  pthread_mutex_t mutex;
+  GHashTable *servers;
+  unsigned int failure_threshold; /* consecutive failures that open a circuit; 0 never opens */
+  unsigned int retry_interval; /* seconds before an open circuit goes half-open */
+} TR_AAA_SCOREBOARD;
+
+TR_AAA_SCOREBOARD *tr_aaa_scoreboard_new(TALLOC_CTX *mem_ctx,
+                                         unsigned int failure_threshold,
+                                         unsigned int retry_interval);
+void tr_aaa_scoreboard_free(TR_AAA_SCOREBOARD *sb);
+int tr_aaa_scoreboard_allow(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname);
+int tr_aaa_scoreboard_available(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname);
+void tr_aaa_scoreboard_report(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname, int success, double latency);
+double tr_aaa_scoreboard_score(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname);
+double tr_aaa_scoreboard_percentile(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname, unsigned int percentile);
+size_t tr_aaa_scoreboard_select(TR_AAA_SCOREBOARD *sb,
+                                TR_AAA_SERVER *aaa_servers,
+                                TR_AAA_SERVER **selected,
+                                size_t max_selected);
+
+#endif /* TR_AAA_HEALTH_H */
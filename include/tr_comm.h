@@ -38,10 +38,12 @@
 #include <stdio.h>
 #include <talloc.h>
 #include <time.h>
+#include <glib.h>
 
 #include <tr_idp.h>
 #include <tr_rp.h>
 #include <tr_apc.h>
+#include <tr_provenance.h>
 
 typedef struct tr_comm_table TR_COMM_TABLE;
 
@@ -65,12 +67,13 @@ typedef struct tr_comm {
 /* community membership - link realms to their communities */
 typedef struct tr_comm_memb {
   struct tr_comm_memb *next;
+  struct tr_comm_memb *prev; /* only maintained for heads of origin lists */
   struct tr_comm_memb *origin_next; /* for multiple copies from different origins */
   TR_IDP_REALM *idp; /* only set one of idp and rp, other null */
   TR_RP_REALM *rp; /* only set one of idp and rp, other null */
   TR_COMM *comm;
   TR_NAME *origin;
-  json_t *provenance; /* array of names of systems traversed */
+  TR_PROVENANCE *provenance; /* names of systems traversed */
   unsigned int interval;
   struct timespec *expiry;
   unsigned int times_expired; /* how many times has this expired? */
@@ -83,6 +86,13 @@ struct tr_comm_table {
   TR_IDP_REALM *idp_realms; /* all idp realms */
   TR_RP_REALM *rp_realms; /* all rp realms */
   TR_COMM_MEMB *memberships; /* head of the linked list of membership records */
+  TR_COMM_MEMB *memberships_tail; /* last record in the list, for appending */
+  GHashTable *comm_by_id; /* comm id -> TR_COMM in comms */
+  GHashTable *idp_realm_by_id; /* realm id -> TR_IDP_REALM in idp_realms */
+  GHashTable *rp_realm_by_id; /* realm id -> TR_RP_REALM in rp_realms */
+  GHashTable *memb_index; /* (realm, comm, role) -> head of origin list */
+  GHashTable *comm_index; /* comm id -> GPtrArray of origin list heads in the comm */
+  GHashTable *realm_index; /* realm id -> GPtrArray of origin list heads for the realm */
 }; 
 
 typedef enum tr_realm_role {
@@ -104,6 +114,8 @@ typedef struct tr_comm_iter {
   TR_COMM_MEMB *cur_orig_head; /* for iterating along orig_next list */
   TR_NAME *match; /* realm or comm to match */
   TR_REALM *realm; /* handle so caller does not have to manage memory, private */
+  GPtrArray *membs; /* index bucket being walked, private */
+  guint memb_idx; /* next position in membs, private */
 } TR_COMM_ITER;
 
 
@@ -146,8 +158,8 @@ void tr_comm_memb_set_comm(TR_COMM_MEMB *memb, TR_COMM *comm);
 TR_COMM *tr_comm_memb_get_comm(TR_COMM_MEMB *memb);
 TR_NAME *tr_comm_memb_get_origin(TR_COMM_MEMB *memb);
 TR_NAME *tr_comm_memb_dup_origin(TR_COMM_MEMB *memb);
-json_t *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb);
-void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, json_t *prov);
+TR_PROVENANCE *tr_comm_memb_get_provenance(TR_COMM_MEMB *memb);
+void tr_comm_memb_set_provenance(TR_COMM_MEMB *memb, TR_PROVENANCE *prov);
 void tr_comm_memb_add_to_provenance(TR_COMM_MEMB *memb, TR_NAME *hop);
 size_t tr_comm_memb_provenance_len(TR_COMM_MEMB *memb);
 void tr_comm_memb_set_interval(TR_COMM_MEMB *memb, unsigned int interval);
@@ -176,8 +188,8 @@ TR_NAME *tr_comm_dup_owner_realm(TR_COMM *comm);
 void tr_comm_set_owner_contact(TR_COMM *comm, TR_NAME *contact);
 TR_NAME *tr_comm_get_owner_contact(TR_COMM *comm);
 TR_NAME *tr_comm_dup_owner_contact(TR_COMM *comm);
-void tr_comm_add_idp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_IDP_REALM *realm, unsigned int interval, json_t *provenance, struct timespec *expiry);
-void tr_comm_add_rp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_RP_REALM *realm, unsigned int interval, json_t *provenance, struct timespec *expiry);
+void tr_comm_add_idp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_IDP_REALM *realm, unsigned int interval, TR_PROVENANCE *provenance, struct timespec *expiry);
+void tr_comm_add_rp_realm(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_RP_REALM *realm, unsigned int interval, TR_PROVENANCE *provenance, struct timespec *expiry);
 TR_RP_REALM *tr_comm_find_rp(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *rp_realm);
 TR_IDP_REALM *tr_comm_find_idp(TR_COMM_TABLE *ctab, TR_COMM *comm, TR_NAME *idp_realm);
 const char *tr_comm_type_to_str(TR_COMM_TYPE type);
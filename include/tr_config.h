@@ -40,6 +40,7 @@
 #include <jansson.h>
 #include <syslog.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <talloc.h>
 
 #include <tr_comm.h>
@@ -57,9 +58,26 @@
 #define TR_DEFAULT_TRP_CONNECT_INTERVAL 10
 #define TR_DEFAULT_TRP_UPDATE_INTERVAL 30
 #define TR_DEFAULT_TRP_SWEEP_INTERVAL 30
+#define TR_DEFAULT_TRP_UPDATE_HOLDDOWN_MS 0
+#define TR_DEFAULT_TRP_MAX_UPDATE_BYTES 65536
+#define TR_DEFAULT_TRP_FLAP_PENALTY 0
+#define TR_DEFAULT_TRP_FLAP_SUPPRESS 2000
+#define TR_DEFAULT_TRP_FLAP_REUSE 750
+#define TR_DEFAULT_TRP_FLAP_HALF_LIFE 300
+#define TR_DEFAULT_TRP_METRIC_HYSTERESIS 0
 #define TR_DEFAULT_TID_REQ_TIMEOUT 5
 #define TR_DEFAULT_TID_RESP_NUMER 2
 #define TR_DEFAULT_TID_RESP_DENOM 3
+#define TR_DEFAULT_TIDS_WORKER_THREADS 8
+#define TR_DEFAULT_TIDS_MAX_PENDING 128
+#define TR_DEFAULT_TIDS_IDLE_TIMEOUT 10
+#define TR_DEFAULT_TIDS_MAX_IN_FLIGHT 0
+#define TR_DEFAULT_TIDS_LISTEN_BACKLOG 512
+#define TR_DEFAULT_TID_POOL_MAX_PER_HOST 4
+#define TR_DEFAULT_TID_POOL_IDLE_TIMEOUT 5
+#define TR_DEFAULT_TID_FWD_THREADS 16
+#define TR_DEFAULT_AAA_CIRCUIT_FAILURES 3
+#define TR_DEFAULT_AAA_CIRCUIT_RETRY_INTERVAL 30
 
 typedef enum tr_cfg_rc {
   TR_CFG_SUCCESS = 0,	/* No error */
@@ -81,23 +99,45 @@ typedef struct tr_cfg_internal {
   unsigned int trp_sweep_interval;
   unsigned int trp_update_interval;
   unsigned int trp_connect_interval;
+  unsigned int trp_update_holddown_ms; /* delay before acting on received TRP updates; 0 acts once per batch */
+  unsigned int trp_max_update_bytes; /* largest multi-record TRP update message; 0 sends one record per message */
+  unsigned int trp_flap_penalty; /* route flap damping penalty per withdrawal; 0 disables damping */
+  unsigned int trp_flap_suppress; /* penalty at which a route is suppressed */
+  unsigned int trp_flap_reuse; /* penalty below which a suppressed route is reused */
+  unsigned int trp_flap_half_life; /* seconds for the penalty to halve */
+  unsigned int trp_metric_hysteresis; /* metric improvement beyond 1 needed to switch routes */
   unsigned int tid_req_timeout;
   unsigned int tid_resp_numer; /* numerator of fraction of AAA servers to wait for in unshared mode */
   unsigned int tid_resp_denom; /* denominator of fraction of AAA servers to wait for in unshared mode */
+  unsigned int tids_worker_threads; /* threads serving TID connections; 0 forks per connection */
+  unsigned int tids_max_pending; /* TID connections allowed to wait for a worker thread */
+  unsigned int tids_idle_timeout; /* seconds an incoming TID connection may wait between requests */
+  unsigned int tids_max_in_flight; /* TID requests handled at once before shedding load; 0 for no limit */
+  unsigned int tids_listen_backlog; /* connections the kernel queues for the TID server */
+  unsigned int tid_pool_max_per_host; /* outgoing TID connections kept open to each AAA server */
+  unsigned int tid_pool_idle_timeout; /* seconds an outgoing TID connection is kept idle */
+  unsigned int tid_fwd_threads; /* threads forwarding TID requests to AAA servers */
+  unsigned int aaa_circuit_failures; /* consecutive failures before an AAA server is skipped; 0 never skips */
+  unsigned int aaa_circuit_retry_interval; /* seconds before a skipped AAA server is tried again */
 } TR_CFG_INTERNAL;
 
 typedef struct tr_cfg {
   TR_CFG_INTERNAL *internal;		/* internal trust router config */
   TR_RP_CLIENT *rp_clients;		/* locally associated RP Clients */
+  GHashTable *rp_client_by_gss_name; /* gss name -> TR_RP_CLIENT in rp_clients */
   TRP_PTABLE *peers; /* TRP peer table */
   TR_COMM_TABLE *ctable; /* communities/realms */
   TR_AAA_SERVER *default_servers;	/* default server list */
   /* TBD -- Global Filters */
 } TR_CFG;
 
+/* The lock protects the active configuration and the routing state derived
+ * from it. Threads other than the main loop must hold a read lock while using
+ * them. The main loop holds a write lock while changing them. */
 typedef struct tr_cfg_mgr {
   TR_CFG *active;
   TR_CFG *new;
+  pthread_rwlock_t lock;
 } TR_CFG_MGR;
 
 int tr_find_config_files (const char *config_dir, struct dirent ***cfg_files);
@@ -110,6 +150,9 @@ TR_CFG *tr_cfg_new(TALLOC_CTX *mem_ctx);
 TR_CFG_MGR *tr_cfg_mgr_new(TALLOC_CTX *mem_ctx);
 void tr_cfg_free(TR_CFG *cfg);
 void tr_cfg_mgr_free(TR_CFG_MGR *cfg);
+void tr_cfg_mgr_read_lock(TR_CFG_MGR *cfg_mgr);
+void tr_cfg_mgr_write_lock(TR_CFG_MGR *cfg_mgr);
+void tr_cfg_mgr_unlock(TR_CFG_MGR *cfg_mgr);
 
 void tr_print_config(TR_CFG *cfg);
 void tr_print_comms(TR_COMM_TABLE *ctab);
@@ -54,6 +54,7 @@ TR_EXPORT const char *sev2str(int sev);
 TR_EXPORT int str2sev(const char *sev);
 TR_EXPORT void tr_log_threshold(const int sev);
 TR_EXPORT void tr_console_threshold(const int sev);
+TR_EXPORT int tr_console_enabled(const int sev);
 TR_EXPORT void tr_log_open(void);
 TR_EXPORT void tr_log_close(void);
 TR_EXPORT void tr_log(const int sev, const char *fmt, ...);
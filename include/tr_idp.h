@@ -63,6 +63,7 @@ typedef struct tr_idp_realm {
   struct tr_idp_realm *comm_next; /* for linked list in comm config */
   TR_NAME *realm_id;
   int shared_config;
+  unsigned int hedge_percentile; /* shared_config only: hedge after this percentile of response time; 0 to send to all */
   TR_AAA_SERVER *aaa_servers;
   TR_APC *apcs;
   TR_REALM_ORIGIN origin; /* how did we learn about this realm? */
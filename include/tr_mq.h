@@ -58,16 +58,30 @@ struct tr_mq_msg {
   void (*p_free)(void *); /* function to free payload */
 };
 
-/* message queue for inter-thread messaging */
+/* message queue for inter-thread messaging
+ *
+ * tr_mq_add() pushes onto a lock-free stack for the message's priority.
+ * Consumers hold the mutex while they move those stacks, oldest first, onto
+ * their own lists and pop from them. wake_fd is an eventfd that is readable
+ * whenever the queue may be non-empty, so a consumer can wait for it with a
+ * libevent EV_READ event; threads blocked in tr_mq_pop() wait on have_msgs,
+ * which wakes them one at a time. Producers only take the mutex to signal
+ * have_msgs when the queue becomes non-empty. */
 
 typedef struct tr_mq TR_MQ;
 typedef void (*TR_MQ_NOTIFY_FN)(TR_MQ *, void *);
 struct tr_mq {
-  pthread_mutex_t mutex;
-  pthread_cond_t have_msg_cond;
-  TR_MQ_MSG *head;
+  pthread_mutex_t mutex; /* held by consumers; producers only to signal have_msgs */
+  pthread_cond_t have_msgs; /* wakes one thread waiting in tr_mq_pop() */
+  TR_MQ_MSG *hi_stack; /* high priority messages added, newest first */
+  TR_MQ_MSG *stack; /* normal priority messages added, newest first */
+  TR_MQ_MSG *hi_head; /* high priority messages taken from hi_stack, oldest first */
+  TR_MQ_MSG *hi_tail;
+  TR_MQ_MSG *head; /* normal priority messages taken from stack, oldest first */
   TR_MQ_MSG *tail;
-  TR_MQ_MSG *last_hi_prio;
+  int signalled; /* wake_fd has been written since a consumer last found the queue empty */
+  int wake_fd;
+  int n_adding; /* producers inside tr_mq_add(); the destructor waits for them */
   TR_MQ_NOTIFY_FN notify_cb; /* callback when queue becomes non-empty */
   void *notify_cb_arg;
 };
@@ -88,8 +102,10 @@ void tr_mq_free(TR_MQ *mq);
 int tr_mq_lock(TR_MQ *mq);
 int tr_mq_unlock(TR_MQ *mq);
 void tr_mq_set_notify_cb(TR_MQ *mq, TR_MQ_NOTIFY_FN cb, void *arg);
+int tr_mq_get_fd(TR_MQ *mq);
 void tr_mq_add(TR_MQ *mq, TR_MQ_MSG *msg);
 int tr_mq_pop_timeout(time_t seconds, struct timespec *ts);
+int tr_mq_pop_timeout_ms(unsigned long ms, struct timespec *ts);
 TR_MQ_MSG *tr_mq_pop(TR_MQ *mq, struct timespec *ts_abort);
 void tr_mq_clear(TR_MQ *mq);
  
@@ -35,6 +35,7 @@
 #ifndef TR_MSG_H
 #define TR_MSG_H
 
+#include <glib.h>
 #include <jansson.h>
 #include <trust_router/tid.h>
 #include <trust_router/trp.h>
@@ -45,7 +46,8 @@ enum msg_type {
   TID_REQUEST,
   TID_RESPONSE,
   TRP_UPDATE,
-  TRP_REQUEST
+  TRP_REQUEST,
+  TRP_KEEPALIVE
 };
 
 /* Union of TR message types to hold message of any type. */
@@ -65,10 +67,14 @@ TRP_UPD *tr_msg_get_trp_upd(TR_MSG *msg);
 void tr_msg_set_trp_upd(TR_MSG *msg, TRP_UPD *req);
 TRP_REQ *tr_msg_get_trp_req(TR_MSG *msg);
 void tr_msg_set_trp_req(TR_MSG *msg, TRP_REQ *req);
+TRP_KALIVE *tr_msg_get_trp_kalive(TR_MSG *msg);
+void tr_msg_set_trp_kalive(TR_MSG *msg, TRP_KALIVE *kalive);
 
 
 /* Encoders/Decoders */
 char *tr_msg_encode(TR_MSG *msg);
+char *tr_msg_encode_trp_upd_body(TRP_UPD *upd);
+char *tr_msg_pack_trp_upds(GBytes **bodies, size_t n_bodies, unsigned int seq, size_t max_len, size_t *n_packed);
 TR_MSG *tr_msg_decode(char *jmsg, size_t len);
 void tr_msg_free_encoded(char *jmsg);
 void tr_msg_free_decoded(TR_MSG *msg);
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TR_PROVENANCE_H__
+#define __TR_PROVENANCE_H__
+
+#include <stdint.h>
+#include <talloc.h>
+#include <jansson.h>
+#include <trust_router/tr_name.h>
+
+/* The systems a community membership has passed through, origin first.
+ * Hops are interned names, so comparing hops compares pointers. The bloom
+ * word has a few bits set for each hop so most "is this name on the path"
+ * checks are answered without looking at the hops. */
+typedef struct tr_provenance {
+  TR_NAME **hops;
+  size_t n_hops;
+  uint64_t bloom;
+} TR_PROVENANCE;
+
+TR_PROVENANCE *tr_provenance_new(TALLOC_CTX *mem_ctx);
+void tr_provenance_free(TR_PROVENANCE *prov);
+TR_PROVENANCE *tr_provenance_dup(TALLOC_CTX *mem_ctx, TR_PROVENANCE *prov);
+int tr_provenance_add(TR_PROVENANCE *prov, TR_NAME *hop);
+size_t tr_provenance_len(TR_PROVENANCE *prov);
+TR_NAME *tr_provenance_get_hop(TR_PROVENANCE *prov, size_t ii);
+TR_NAME *tr_provenance_get_origin(TR_PROVENANCE *prov);
+int tr_provenance_contains(TR_PROVENANCE *prov, TR_NAME *name);
+int tr_provenance_cmp(TR_PROVENANCE *p1, TR_PROVENANCE *p2, size_t nhops);
+json_t *tr_provenance_to_json(TR_PROVENANCE *prov);
+TR_PROVENANCE *tr_provenance_from_json(TALLOC_CTX *mem_ctx, json_t *jprov);
+
+#endif /* __TR_PROVENANCE_H__ */
@@ -52,6 +52,7 @@ typedef struct tr_trps_events {
   struct event *connect_ev;
   struct event *update_ev;
   struct event *sweep_ev;
+  struct event *holddown_ev;
 } TR_TRPS_EVENTS;
 
 /* typedef'ed as TR_INSTANCE in tr.h */
@@ -69,7 +69,7 @@ typedef struct trp_inforec_comm {
   TR_NAME *owner_realm;
   TR_NAME *owner_contact;
   time_t expiration_interval; /* Minutes to key expiration; only valid for an APC */
-  json_t *provenance;
+  TR_PROVENANCE *provenance;
   unsigned int interval;
 } TRP_INFOREC_COMM;
 
@@ -89,6 +89,8 @@ struct trp_update {
   TR_NAME *comm;
   TRP_INFOREC *records;
   TR_NAME *peer; /* who did this update come from? */
+  unsigned int seq; /* sender's per-peer sequence number, 0 if not sent */
+  TRP_UPD *next; /* further updates received in the same message */
 };
 
 struct trp_req {
@@ -97,6 +99,16 @@ struct trp_req {
   TR_NAME *peer; /* who did this req come from? */
 };
 
+/* Sent in place of a scheduled full update. Summarizes the routes the
+ * sender is advertising to us so we can check that our copy is current. */
+struct trp_kalive {
+  unsigned int seq; /* sequence number of the last update sent to us */
+  unsigned int digest; /* see trps_route_digest() */
+  unsigned int n_routes; /* number of routes covered by the digest */
+  unsigned int interval; /* sender's update interval */
+  TR_NAME *peer; /* who did this keepalive come from? */
+};
+
 
 typedef struct trps_instance TRPS_INSTANCE;
 
@@ -142,6 +154,24 @@ struct trpc_instance {
   TR_MQ *mq; /* msgs from master to trpc */
 };
 
+/* Scheduled expiry of a route or community membership. Entries are not
+ * removed when the expiry changes; a new one is added and the old one is
+ * ignored when it comes due. */
+typedef struct trps_expiry {
+  struct timespec when;
+  TR_REALM_ROLE role; /* membership role, TR_ROLE_UNKNOWN for routes */
+  TR_NAME *comm;
+  TR_NAME *realm;
+  TR_NAME *peer; /* route peer or membership origin */
+} TRPS_EXPIRY;
+
+/* min-heap of TRPS_EXPIRY, soonest first */
+typedef struct trps_expiry_heap {
+  TRPS_EXPIRY *items;
+  size_t len;
+  size_t size;
+} TRPS_EXPIRY_HEAP;
+
 /* TRP Server Instance Data */
 struct trps_instance {
   char *hostname;
@@ -155,9 +185,23 @@ struct trps_instance {
   TRP_PTABLE *ptable; /* peer table */
   TRP_RTABLE *rtable; /* route table */
   TR_COMM_TABLE *ctable; /* community table */
+  GHashTable *dirty_routes; /* comm/realm pairs whose selected route must be recomputed */
+  TRPS_EXPIRY_HEAP *route_expiry; /* when routes expire */
+  TRPS_EXPIRY_HEAP *memb_expiry; /* when community memberships expire */
   struct timeval connect_interval; /* interval between connection refreshes */
   struct timeval update_interval; /* interval between scheduled updates */
   struct timeval sweep_interval; /* interval between route table sweeps */
+  struct timeval update_holddown; /* wait after a received update before selecting routes */
+  size_t max_update_bytes; /* largest message packing several updates, 0 to send one per message */
+  unsigned int flap_penalty; /* added to a route's penalty when it is withdrawn, half that for other changes; 0 disables damping */
+  unsigned int flap_suppress; /* stop selecting a route once its penalty reaches this */
+  unsigned int flap_reuse; /* select it again once the penalty decays below this */
+  unsigned int flap_half_life; /* seconds for a penalty to decay by half */
+  unsigned int metric_hysteresis; /* improvement needed beyond 1 to switch selected route */
+  GHashTable *suppressed_routes; /* comm/realm pairs with a suppressed route */
+  GHashTable *withdrawn_routes; /* comm/realm pairs that may no longer be advertised to some peer, with a retraction for them */
+  GHashTable *triggered_routes; /* comm/realm pairs with a route to send with the next triggered update */
+  GHashTable *triggered_membs; /* memberships to send with the next triggered update */
 };
 
 typedef enum trp_update_type {
@@ -227,6 +271,16 @@ void trps_set_update_interval(TRPS_INSTANCE *trps, unsigned int interval);
 unsigned int trps_get_update_interval(TRPS_INSTANCE *trps);
 void trps_set_sweep_interval(TRPS_INSTANCE *trps, unsigned int interval);
 unsigned int trps_get_sweep_interval(TRPS_INSTANCE *trps);
+void trps_set_update_holddown(TRPS_INSTANCE *trps, unsigned int msec);
+unsigned int trps_get_update_holddown(TRPS_INSTANCE *trps);
+void trps_set_max_update_bytes(TRPS_INSTANCE *trps, size_t max_bytes);
+size_t trps_get_max_update_bytes(TRPS_INSTANCE *trps);
+void trps_set_flap_damping(TRPS_INSTANCE *trps,
+                           unsigned int penalty,
+                           unsigned int suppress,
+                           unsigned int reuse,
+                           unsigned int half_life);
+void trps_set_metric_hysteresis(TRPS_INSTANCE *trps, unsigned int hysteresis);
 TRPC_INSTANCE *trps_find_trpc(TRPS_INSTANCE *trps, TRP_PEER *peer);
 TRP_RC trps_send_msg (TRPS_INSTANCE *trps, TRP_PEER *peer, const char *msg);
 void trps_add_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *new);
@@ -246,12 +300,15 @@ void trps_mq_add(TRPS_INSTANCE *trps, TR_MQ_MSG *msg);
 TRP_RC trps_authorize_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *conn);
 void trps_handle_connection(TRPS_INSTANCE *trps, TRP_CONNECTION *conn);
 TRP_RC trps_update_active_routes(TRPS_INSTANCE *trps);
+TRP_RC trps_update_dirty_routes(TRPS_INSTANCE *trps);
 TRP_RC trps_handle_tr_msg(TRPS_INSTANCE *trps, TR_MSG *tr_msg);
+TRP_RC trps_apply_updates(TRPS_INSTANCE *trps);
 TRP_ROUTE *trps_get_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm, TR_NAME *peer);
 TRP_ROUTE *trps_get_selected_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm);
 TR_NAME *trps_get_next_hop(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm);
 TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps);
 TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps);
+int trps_next_expiry(TRPS_INSTANCE *trps, struct timespec *when);
 TRP_RC trps_add_route(TRPS_INSTANCE *trps, TRP_ROUTE *route);
 TRP_RC trps_add_peer(TRPS_INSTANCE *trps, TRP_PEER *peer);
 TRP_PEER *trps_get_peer_by_gssname(TRPS_INSTANCE *trps, TR_NAME *gssname);
@@ -259,6 +316,9 @@ TRP_PEER *trps_get_peer_by_servicename(TRPS_INSTANCE *trps, TR_NAME *servicename
 TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE type);
 int trps_peer_connected(TRPS_INSTANCE *trps, TRP_PEER *peer);
 TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_gssname);
+void trps_peer_membs_stale(TRPS_INSTANCE *trps, TRP_PEER *peer);
+unsigned int trps_route_digest(TR_NAME *comm, TR_NAME *realm, TR_NAME *trust_router, unsigned int metric);
+unsigned int trps_route_penalty_now(TRPS_INSTANCE *trps, TRP_ROUTE *route, struct timespec *now);
 
 TRP_INFOREC *trp_inforec_new(TALLOC_CTX *mem_ctx, TRP_INFOREC_TYPE type);
 void trp_inforec_free(TRP_INFOREC *rec);
@@ -286,8 +346,8 @@ TR_NAME *trp_inforec_get_owner_realm(TRP_INFOREC *rec);
 TRP_RC trp_inforec_set_owner_realm(TRP_INFOREC *rec, TR_NAME *name);
 TR_NAME *trp_inforec_get_owner_contact(TRP_INFOREC *rec);
 TRP_RC trp_inforec_set_owner_contact(TRP_INFOREC *rec, TR_NAME *name);
-json_t *trp_inforec_get_provenance(TRP_INFOREC *rec);
-TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, json_t *prov);
+TR_PROVENANCE *trp_inforec_get_provenance(TRP_INFOREC *rec);
+TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, TR_PROVENANCE *prov);
 TRP_INFOREC_TYPE trp_inforec_type_from_string(const char *s);
 const char *trp_inforec_type_to_string(TRP_INFOREC_TYPE msgtype);
 time_t trp_inforec_get_exp_interval(TRP_INFOREC *rec);
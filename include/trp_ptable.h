@@ -61,6 +61,12 @@ struct trp_peer {
   TRP_PEER_CONN_STATUS incoming_status;
   void (*conn_status_cb)(TRP_PEER *, void *); /* callback for connected status change */
   void *conn_status_cookie;
+  unsigned int send_seq; /* sequence number of the last update we sent */
+  unsigned int recv_seq; /* sequence number of the last update we received */
+  int keepalive_ok; /* peer sends keepalives, so accepts them in place of full updates and packed update messages */
+  struct timespec membs_vouched; /* last keepalive, which stands in for resending the memberships we learned from the peer */
+  struct timespec routes_vouched; /* last keepalive whose digest matched the routes we learned from the peer */
+  unsigned int routes_vouched_interval; /* update interval given in that keepalive */
 };
 
 typedef struct trp_ptable {
@@ -105,6 +111,17 @@ TRP_PEER_CONN_STATUS trp_peer_get_incoming_status(TRP_PEER *peer);
 void trp_peer_set_incoming_status(TRP_PEER *peer, TRP_PEER_CONN_STATUS status);
 int trp_peer_is_connected(TRP_PEER *peer);
 void trp_peer_set_linkcost(TRP_PEER *peer, unsigned int linkcost);
+unsigned int trp_peer_next_send_seq(TRP_PEER *peer);
+unsigned int trp_peer_get_send_seq(TRP_PEER *peer);
+unsigned int trp_peer_get_recv_seq(TRP_PEER *peer);
+void trp_peer_set_recv_seq(TRP_PEER *peer, unsigned int seq);
+int trp_peer_get_keepalive_ok(TRP_PEER *peer);
+void trp_peer_set_keepalive_ok(TRP_PEER *peer, int ok);
+struct timespec *trp_peer_get_membs_vouched(TRP_PEER *peer);
+void trp_peer_set_membs_vouched(TRP_PEER *peer, struct timespec *time);
+struct timespec *trp_peer_get_routes_vouched(TRP_PEER *peer);
+unsigned int trp_peer_get_routes_vouched_interval(TRP_PEER *peer);
+void trp_peer_set_routes_vouched(TRP_PEER *peer, struct timespec *time, unsigned int interval);
 void trp_peer_set_conn_status_cb(TRP_PEER *peer, void (*cb)(TRP_PEER *, void *), void *cookie);
 char *trp_peer_to_str(TALLOC_CTX *memctx, TRP_PEER *peer, const char *sep);
 
@@ -41,6 +41,8 @@
 
 #include <trp_internal.h>
 
+struct trp_rtable_realm;
+
 typedef struct trp_route {
   TR_NAME *comm;
   TR_NAME *realm;
@@ -55,9 +57,16 @@ typedef struct trp_route {
   struct timespec *expiry;
   int local; /* is this a local route? */
   int triggered;
+  unsigned int penalty; /* flap damping penalty as of penalty_time */
+  struct timespec penalty_time;
+  int suppressed; /* flapping too much to be selected */
+  struct trp_rtable_realm *rtable_realm; /* realm table holding this route, NULL if not in a table */
 } TRP_ROUTE;
 
-typedef GHashTable TRP_RTABLE;
+typedef struct trp_rtable {
+  GHashTable *comms; /* routes by comm, then realm, then peer */
+  GHashTable *peers; /* for each peer, the set of routes learned from it */
+} TRP_RTABLE;
 
 TRP_RTABLE *trp_rtable_new(void);
 void trp_rtable_free(TRP_RTABLE *rtbl);
@@ -73,6 +82,7 @@ TRP_ROUTE **trp_rtable_get_comm_entries(TRP_RTABLE *rtbl, TR_NAME *comm, size_t
 TR_NAME **trp_rtable_get_comm_realms(TRP_RTABLE *rtbl, TR_NAME *comm, size_t *n_out);
 TRP_ROUTE **trp_rtable_get_realm_entries(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm, size_t *n_out);
 TR_NAME **trp_rtable_get_comm_realm_peers(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm, size_t *n_out);
+TRP_ROUTE **trp_rtable_get_peer_entries(TRP_RTABLE *rtbl, TR_NAME *peer, size_t *n_out);
 TRP_ROUTE *trp_rtable_get_entry(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm, TR_NAME *peer);
 TRP_ROUTE *trp_rtable_get_selected_entry(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm);
 void trp_rtable_clear_triggered(TRP_RTABLE *rtbl);
@@ -107,6 +117,11 @@ void trp_route_set_local(TRP_ROUTE *entry, int local);
 int trp_route_is_local(TRP_ROUTE *entry);
 void trp_route_set_triggered(TRP_ROUTE *entry, int trig);
 int trp_route_is_triggered(TRP_ROUTE *entry);
+void trp_route_set_penalty(TRP_ROUTE *entry, unsigned int penalty, struct timespec *when);
+unsigned int trp_route_get_penalty(TRP_ROUTE *entry);
+struct timespec *trp_route_get_penalty_time(TRP_ROUTE *entry);
+void trp_route_set_suppressed(TRP_ROUTE *entry, int suppressed);
+int trp_route_is_suppressed(TRP_ROUTE *entry);
 char *trp_route_to_str(TALLOC_CTX *mem_ctx, TRP_ROUTE *entry, const char *sep);
 
 #endif /* _TRP_RTABLE_H_ */
@@ -47,6 +47,9 @@
 
 
 #define TID_PORT	12309
+#define TIDS_DEFAULT_IDLE_TIMEOUT 10 /* seconds a TIDS connection may wait for another request */
+#define TID_HOP_MARGIN_MS 50 /* time budget each hop keeps back for returning its response */
+#define TIDS_DEFAULT_LISTEN_BACKLOG 512 /* connections the kernel queues for accept() */
 
 typedef enum tid_rc {
   TID_SUCCESS = 0,
@@ -72,6 +75,7 @@ typedef void (TIDC_RESP_FUNC)(TIDC_INSTANCE *, TID_REQ *, TID_RESP *, void *);
 
 typedef int (TIDS_REQ_FUNC)(TIDS_INSTANCE *, TID_REQ *, TID_RESP *, void *);
 typedef int (tids_auth_func)(gss_name_t client_name, TR_NAME *display_name, void *cookie);
+typedef int (tids_worker_init_func)(TIDS_INSTANCE *tids, void *cookie);
 
 
 
@@ -99,6 +103,10 @@ TR_EXPORT TIDC_RESP_FUNC *tid_req_get_resp_func(TID_REQ *req);
 void tid_req_set_resp_func(TID_REQ *req, TIDC_RESP_FUNC *resp_func);
 TR_EXPORT void *tid_req_get_cookie(TID_REQ *req);
 void tid_req_set_cookie(TID_REQ *req, void *cookie);
+TR_EXPORT TR_NAME *tid_req_get_request_id(TID_REQ *req);
+void tid_req_set_request_id(TID_REQ *req, TR_NAME *request_id);
+TR_EXPORT unsigned int tid_req_get_timeout_ms(TID_REQ *req);
+void tid_req_set_timeout_ms(TID_REQ *req, unsigned int timeout_ms);
 TR_EXPORT TID_REQ *tid_dup_req (TID_REQ *orig_req);
 TR_EXPORT void tid_req_free( TID_REQ *req);
 
@@ -119,6 +127,8 @@ TR_EXPORT TR_NAME *tid_resp_get_comm(TID_RESP *resp);
 void tid_resp_set_comm(TID_RESP *resp, TR_NAME *comm);
 TR_EXPORT TR_NAME *tid_resp_get_orig_coi(TID_RESP *resp);
 void tid_resp_set_orig_coi(TID_RESP *resp, TR_NAME *orig_coi);
+TR_EXPORT TR_NAME *tid_resp_get_request_id(TID_RESP *resp);
+void tid_resp_set_request_id(TID_RESP *resp, TR_NAME *request_id);
 TR_EXPORT TID_SRVR_BLK *tid_resp_get_server(TID_RESP *resp, size_t index);
 TR_EXPORT size_t tid_resp_get_num_servers(const TID_RESP *resp);
 TR_EXPORT const TID_PATH *tid_resp_get_error_path(const TID_RESP *);
@@ -159,6 +169,13 @@ TR_EXPORT int tids_get_listener (TIDS_INSTANCE *tids, TIDS_REQ_FUNC *req_handler
                                  tids_auth_func *auth_handler, const char *hostname, 
                                  unsigned int port, void *cookie, int *fd_out, size_t max_fd);
 TR_EXPORT int tids_accept(TIDS_INSTANCE *tids, int listen);
+TR_EXPORT int tids_start_workers(TIDS_INSTANCE *tids, unsigned int n_threads, size_t max_pending);
+TR_EXPORT void tids_set_idle_timeout(TIDS_INSTANCE *tids, unsigned int seconds);
+TR_EXPORT void tids_set_listen_backlog(TIDS_INSTANCE *tids, int backlog);
+TR_EXPORT void tids_set_max_in_flight(TIDS_INSTANCE *tids, unsigned int max_in_flight);
+TR_EXPORT unsigned long tids_get_shed_count(TIDS_INSTANCE *tids);
+TR_EXPORT int tids_set_prefork(TIDS_INSTANCE *tids, unsigned int n_workers, unsigned int max_requests,
+                               tids_worker_init_func *worker_init);
 TR_EXPORT int tids_send_response (TIDS_INSTANCE *tids, TID_REQ *req, TID_RESP *resp);
 TR_EXPORT int tids_send_err_response (TIDS_INSTANCE *tids, TID_REQ *req, const char *err_msg);
 TR_EXPORT void tids_destroy (TIDS_INSTANCE *tids);
@@ -43,15 +43,21 @@ typedef const char *tr_const_string;
 typedef struct tr__name {
   char *buf;
   int len;
+  unsigned int hash; /* cached by tr_name_hash(), 0 until computed */
+  unsigned int refcount; /* references to an interned name, 0 if not interned */
+  struct tr__name *next_atom; /* chains interned names with the same hash bucket */
 } TR_NAME;
 
 TR_EXPORT TR_NAME *tr_new_name (const char *name);
 TR_EXPORT TR_NAME *tr_dup_name (TR_NAME *from);
 TR_EXPORT void tr_free_name (TR_NAME *name);
 TR_EXPORT int tr_name_cmp (TR_NAME *one, TR_NAME *two);
+TR_EXPORT unsigned int tr_name_hash(TR_NAME *name);
+TR_EXPORT int tr_name_equal(TR_NAME *one, TR_NAME *two);
 TR_EXPORT void tr_name_strlcat(char *dest, const TR_NAME *src, size_t len);
 TR_EXPORT char *tr_name_strdup(TR_NAME *);
 TR_EXPORT json_t *tr_name_to_json_string(TR_NAME *src);
 TR_EXPORT TR_NAME *tr_name_cat(TR_NAME *n1, TR_NAME *n2);
+TR_EXPORT size_t tr_name_count_atoms(void);
 
 #endif
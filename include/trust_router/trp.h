@@ -48,6 +48,7 @@
 #define trp_metric_is_valid(x) (((x)<=TRP_METRIC_INFINITY) && ((x)!=TRP_METRIC_INVALID))
 #define trp_metric_is_invalid(x) (((x)>TRP_METRIC_INFINITY) || ((x)==TRP_METRIC_INVALID))
 #define TRP_INTERVAL_INVALID 0
+#define TRP_INTERVAL_WITHDRAWN 0 /* community inforec interval withdrawing a membership */
 
 #define TRP_LINKCOST_DEFAULT 1
 
@@ -72,6 +73,7 @@ typedef struct trp_inforec TRP_INFOREC;
 
 typedef struct trp_update TRP_UPD;
 typedef struct trp_req TRP_REQ;
+typedef struct trp_kalive TRP_KALIVE;
 
 /* Functions for TRP_UPD structures */
 TR_EXPORT TRP_UPD *trp_upd_new(TALLOC_CTX *mem_ctx);
@@ -88,6 +90,10 @@ void trp_upd_set_comm(TRP_UPD *upd, TR_NAME *comm);
 TR_EXPORT TR_NAME *trp_upd_get_peer(TRP_UPD *upd);
 TR_NAME *trp_upd_dup_peer(TRP_UPD *upd);
 void trp_upd_set_peer(TRP_UPD *upd, TR_NAME *peer);
+unsigned int trp_upd_get_seq(TRP_UPD *upd);
+void trp_upd_set_seq(TRP_UPD *upd, unsigned int seq);
+TRP_UPD *trp_upd_get_next(TRP_UPD *upd);
+void trp_upd_set_next(TRP_UPD *upd, TRP_UPD *next);
 void trp_upd_set_next_hop(TRP_UPD *upd, const char *hostname, unsigned int port);
 void trp_upd_add_to_provenance(TRP_UPD *upd, TR_NAME *name);
 
@@ -103,4 +109,18 @@ void trp_req_set_peer(TRP_REQ *req, TR_NAME *peer);
 int trp_req_is_wildcard(TRP_REQ *req);
 TRP_RC trp_req_make_wildcard(TRP_REQ *req);
 
+/* Functions for TRP_KALIVE structures */
+TRP_KALIVE *trp_kalive_new(TALLOC_CTX *mem_ctx);
+void trp_kalive_free(TRP_KALIVE *kalive);
+unsigned int trp_kalive_get_seq(TRP_KALIVE *kalive);
+void trp_kalive_set_seq(TRP_KALIVE *kalive, unsigned int seq);
+unsigned int trp_kalive_get_digest(TRP_KALIVE *kalive);
+void trp_kalive_set_digest(TRP_KALIVE *kalive, unsigned int digest);
+unsigned int trp_kalive_get_n_routes(TRP_KALIVE *kalive);
+void trp_kalive_set_n_routes(TRP_KALIVE *kalive, unsigned int n_routes);
+unsigned int trp_kalive_get_interval(TRP_KALIVE *kalive);
+void trp_kalive_set_interval(TRP_KALIVE *kalive, unsigned int interval);
+TR_NAME *trp_kalive_get_peer(TRP_KALIVE *kalive);
+void trp_kalive_set_peer(TRP_KALIVE *kalive, TR_NAME *peer);
+
 #endif /* TRP_H */
@@ -167,8 +167,6 @@ static int tids_req_handler (TIDS_INSTANCE *tids,
   
 
   tr_debug("tids_req_handler: Request received! target_realm = %s, community = %s", req->realm->buf, req->comm->buf);
-  if (tids)
-    tids->req_count++;
 
   if (!(resp) || !resp) {
     tr_debug("tids_req_handler: No response structure.");
@@ -288,9 +286,11 @@ static const char doc[]=PACKAGE_NAME " - TID Server";
 static const char arg_doc[]="<ip-address> <gss-name> <hostname> <database-name>"; /* string describing arguments, if any */
 
 /* define the options here. Fields are:
- * { long-name, short-name, variable name, options, help description } */
+ * { long-name, short-name, variable name, options, help description, group } */
 static const struct argp_option cmdline_options[] = {
-  { NULL }
+  { "prefork", 'p', "N", 0, "Serve requests from N pre-forked worker processes, each with its own listener and database connection", 0 },
+  { "max-requests", 'm', "M", 0, "Replace each pre-forked worker after it serves M requests (default is no limit)", 0 },
+  { NULL, 0, NULL, 0, NULL, 0 }
 };
 
 /* structure for communicating with option parser */
@@ -299,6 +299,8 @@ struct cmdline_args {
   char *gss_name;
   char *hostname;
   char *database_name;
+  unsigned int n_prefork;
+  unsigned int max_requests;
 };
 
 /* parser for individual options - fills in a struct cmdline_args */
@@ -308,6 +310,14 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
   struct cmdline_args *arguments=state->input;
 
   switch (key) {
+  case 'p':
+    arguments->n_prefork=strtoul(arg, NULL, 10);
+    break;
+
+  case 'm':
+    arguments->max_requests=strtoul(arg, NULL, 10);
+    break;
+
   case ARGP_KEY_ARG: /* handle argument (not option) */
     switch (state->arg_num) {
     case 0:
@@ -349,6 +359,29 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 /* assemble the argp parser */
 static struct argp argp = {cmdline_options, parse_option, arg_doc, doc};
 
+static const char *database_name = NULL;
+
+/* Open the database and prepare statements. Returns 0 on success. */
+static int open_database(void)
+{
+  if (SQLITE_OK != sqlite3_open(database_name, &db)) {
+    tr_crit("Error opening database %s", database_name);
+    return -1;
+  }
+  sqlite3_busy_timeout( db, 1000);
+  sqlite3_prepare_v2(db, "insert into psk_keys_tab (keyid, key, client_dh_pub, key_expiration) values(?, ?, ?, ?)",
+		     -1, &insert_stmt, NULL);
+  sqlite3_prepare_v2(db, "insert into authorizations (client_dh_pub, coi, acceptor_realm, hostname, apc) values(?, ?, ?, ?, ?)",
+		     -1, &authorization_insert, NULL);
+  return 0;
+}
+
+/* called in each pre-forked worker so it gets its own database connection */
+static int worker_init(TIDS_INSTANCE *tids, void *cookie)
+{
+  return open_database();
+}
+
 int main (int argc, 
           char *argv[]) 
 {
@@ -369,15 +402,7 @@ int main (int argc,
   tr_console_threshold(LOG_DEBUG);
 
   gssname = tr_new_name(opts.gss_name);
-  if (SQLITE_OK != sqlite3_open(opts.database_name, &db)) {
-    tr_crit("Error opening database %s", opts.database_name);
-    exit(1);
-  }
-  sqlite3_busy_timeout( db, 1000);
-  sqlite3_prepare_v2(db, "insert into psk_keys_tab (keyid, key, client_dh_pub, key_expiration) values(?, ?, ?, ?)",
-		     -1, &insert_stmt, NULL);
-  sqlite3_prepare_v2(db, "insert into authorizations (client_dh_pub, coi, acceptor_realm, hostname, apc) values(?, ?, ?, ?, ?)",
-		     -1, &authorization_insert, NULL);
+  database_name = opts.database_name;
 
   /* Create a TID server instance */
   if (NULL == (tids = tids_create())) {
@@ -385,6 +410,16 @@ int main (int argc,
     return 1;
   }
 
+  if (opts.n_prefork > 0) {
+    /* each worker opens the database for itself */
+    if (0 != tids_set_prefork(tids, opts.n_prefork, opts.max_requests, worker_init)) {
+      tr_crit("Unable to configure pre-forked workers, exiting.");
+      return 1;
+    }
+  } else if (0 != open_database()) {
+    exit(1);
+  }
+
   tids->ipaddr = opts.ip_address;
   (void) tids_start(tids, &tids_req_handler, auth_handler, opts.hostname, TID_PORT, gssname);
 
@@ -63,6 +63,10 @@ static int destroy_tid_req(TID_REQ *req)
     tr_free_name(req->comm);
   if (req->orig_coi!=NULL)
     tr_free_name(req->orig_coi);
+  if (req->gss_name!=NULL)
+    tr_free_name(req->gss_name);
+  if (req->request_id!=NULL)
+    tr_free_name(req->request_id);
   return 0;
 }
 
@@ -189,6 +193,48 @@ void tid_req_set_cookie(TID_REQ *req, void *cookie)
   req->cookie = cookie;
 }
 
+TR_NAME *tid_req_get_request_id(TID_REQ *req)
+{
+  return(req->request_id);
+}
+
+void tid_req_set_request_id(TID_REQ *req, TR_NAME *request_id)
+{
+  if (req->request_id!=NULL)
+    tr_free_name(req->request_id);
+  req->request_id = request_id;
+}
+
+unsigned int tid_req_get_timeout_ms(TID_REQ *req)
+{
+  return(req->timeout_ms);
+}
+
+void tid_req_set_timeout_ms(TID_REQ *req, unsigned int timeout_ms)
+{
+  req->timeout_ms = timeout_ms;
+}
+
+/* Returns the time left to answer a received request, in ms, or -1 if the
+ * request has no time limit. Never returns less than 0 for a limited request. */
+long tid_req_get_remaining_ms(TID_REQ *req)
+{
+  struct timespec now;
+  long elapsed_ms = 0;
+
+  if (req->timeout_ms == 0)
+    return -1;
+
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &now))
+    return req->timeout_ms;
+
+  elapsed_ms = (now.tv_sec - req->received.tv_sec)*1000
+             + (now.tv_nsec - req->received.tv_nsec)/1000000;
+  if (elapsed_ms >= (long) req->timeout_ms)
+    return 0;
+  return req->timeout_ms - elapsed_ms;
+}
+
 /* struct is allocated in talloc null context */
 TID_REQ *tid_dup_req (TID_REQ *orig_req) 
 {
@@ -215,6 +261,18 @@ TID_REQ *tid_dup_req (TID_REQ *orig_req)
       tr_crit("tid_dup_req: Can't duplicate request (orig_coi).");
     }
   }
+
+  if (orig_req->request_id) {
+    if (NULL == (new_req->request_id = tr_dup_name(orig_req->request_id))) {
+      tr_crit("tid_dup_req: Can't duplicate request (request_id).");
+    }
+  }
+
+  if (orig_req->gss_name) {
+    if (NULL == (new_req->gss_name = tr_dup_name(orig_req->gss_name))) {
+      tr_crit("tid_dup_req: Can't duplicate request (gss_name).");
+    }
+  }
   
   return new_req;
 }
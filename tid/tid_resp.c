@@ -53,6 +53,8 @@ static int tid_resp_destructor(void *obj)
     tr_free_name(resp->comm);
   if (resp->orig_coi!=NULL)
     tr_free_name(resp->orig_coi);
+  if (resp->request_id!=NULL)
+    tr_free_name(resp->request_id);
   return 0;
 }
 
@@ -69,6 +71,7 @@ TID_RESP *tid_resp_new(TALLOC_CTX *mem_ctx)
     resp->orig_coi=NULL;
     resp->servers=NULL;
     resp->error_path=NULL;
+    resp->request_id=NULL;
     talloc_set_destructor((void *)resp, tid_resp_destructor);
   }
   return resp;
@@ -96,6 +99,7 @@ TID_RESP *tid_resp_dup(TALLOC_CTX *mem_ctx, TID_RESP *resp)
     newresp->realm=tr_dup_name(resp->realm);
     newresp->comm=tr_dup_name(resp->comm);
     newresp->orig_coi=tr_dup_name(resp->orig_coi);
+    newresp->request_id=tr_dup_name(resp->request_id);
     newresp->servers=tid_srvr_blk_dup(newresp, resp->servers);
     tid_resp_set_cons(newresp, resp->cons);
     tid_resp_set_error_path(newresp, resp->error_path);
@@ -166,6 +170,18 @@ void tid_resp_set_orig_coi(TID_RESP *resp, TR_NAME *orig_coi)
   resp->orig_coi = orig_coi;
 }
 
+TR_EXPORT TR_NAME *tid_resp_get_request_id(TID_RESP *resp)
+{
+  return(resp->request_id);
+}
+
+void tid_resp_set_request_id(TID_RESP *resp, TR_NAME *request_id)
+{
+  if (resp->request_id!=NULL)
+    tr_free_name(resp->request_id);
+  resp->request_id = request_id;
+}
+
 TR_EXPORT TID_SRVR_BLK *tid_resp_get_server(TID_RESP *resp,
 					    size_t index)
 {
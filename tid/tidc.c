@@ -61,6 +61,7 @@ TIDC_INSTANCE *tidc_create(void)
   TIDC_INSTANCE *tidc=talloc(NULL, TIDC_INSTANCE);
   if (tidc!=NULL) {
     tidc->client_dh=NULL;
+    tidc->req_id=0;
     talloc_set_destructor((void *)tidc, tidc_destructor);
   }
   return tidc;
@@ -75,6 +76,17 @@ int tidc_open_connection (TIDC_INSTANCE *tidc,
 			  const char *server,
 			  unsigned int port,
 			  gss_ctx_id_t *gssctx)
+{
+  return tidc_open_connection_timeout(tidc, server, port, 0, gssctx);
+}
+
+/* As tidc_open_connection(), but give up if connecting and authenticating take
+ * longer than timeout_ms milliseconds (0 for no limit). */
+int tidc_open_connection_timeout (TIDC_INSTANCE *tidc,
+                                  const char *server,
+                                  unsigned int port,
+                                  int timeout_ms,
+                                  gss_ctx_id_t *gssctx)
 {
   int err = 0;
   int conn = -1;
@@ -86,7 +98,7 @@ int tidc_open_connection (TIDC_INSTANCE *tidc,
     use_port = port;
 
   tr_debug("tidc_open_connection: opening tidc connection to %s:%d", server, port);
-  err = gsscon_connect(server, use_port, "trustidentity", &conn, gssctx);
+  err = gsscon_connect_timeout(server, use_port, "trustidentity", timeout_ms, &conn, gssctx);
 
   if (!err)
     return conn;
@@ -104,6 +116,7 @@ int tidc_send_request (TIDC_INSTANCE *tidc,
 		       void *cookie)
 {
   TID_REQ *tid_req = NULL;
+  char req_id[16];
   int rc;
 
   /* Create and populate a TID req structure */
@@ -122,6 +135,13 @@ int tidc_send_request (TIDC_INSTANCE *tidc,
 
   tid_req->tidc_dh = tr_dh_dup(tidc->client_dh);
 
+  /* Number requests so responses can be matched to them */
+  snprintf(req_id, sizeof(req_id), "%u", ++(tidc->req_id));
+  if (NULL == (tid_req->request_id = tr_new_name(req_id))) {
+    tr_err ( "tidc_send_request: Error allocating request ID.\n");
+    goto error;
+  }
+
   rc = tidc_fwd_request(tidc, tid_req, resp_handler, cookie);
   goto cleanup;
  error:
@@ -131,91 +151,162 @@ int tidc_send_request (TIDC_INSTANCE *tidc,
   return rc;
 }
 
-int tidc_fwd_request(TIDC_INSTANCE *tidc,
-                     TID_REQ *tid_req,
-		     TIDC_RESP_FUNC *resp_handler,
-                     void *cookie)
+/* Send an encoded request and read the response. Returns the decoded
+ * response message, or NULL on error. Caller must free it with
+ * tr_msg_free_decoded(). If the request could not be sent or no response
+ * could be read, *transport_err is set to 1. */
+static TR_MSG *tidc_exchange(int conn,
+                             gss_ctx_id_t gssctx,
+                             const char *req_buf,
+                             size_t req_buflen,
+                             TR_NAME *request_id,
+                             int *transport_err)
 {
-  char *req_buf = NULL;
   char *resp_buf = NULL;
   size_t resp_buflen = 0;
-  TR_MSG *msg = NULL;
   TR_MSG *resp_msg = NULL;
   int err;
-  int rc = 0;
-
-  /* Create and populate a TID msg structure */
-  if (!(msg = talloc_zero(tid_req, TR_MSG)))
-    goto error;
-
-  msg->msg_type = TID_REQUEST;
-  tr_msg_set_req(msg, tid_req);
-
-  /* store the response function and cookie */
-  // tid_req->resp_func = resp_handler;
-  // tid_req->cookie = cookie;
 
-
-  /* Encode the request into a json string */
-  if (!(req_buf = tr_msg_encode(msg))) {
-    tr_err("tidc_fwd_request: Error encoding TID request.\n");
-    goto error;
-  }
-
-  tr_debug( "tidc_fwd_request: Sending TID request:\n");
-  tr_debug( "%s\n", req_buf);
+  *transport_err = 0;
+  tr_debug( "tidc_exchange: Sending TID request:\n");
+  tr_debug( "%.*s\n", (int) req_buflen, req_buf);
 
   /* Send the request over the connection */
-  if (err = gsscon_write_encrypted_token (tid_req->conn, tid_req->gssctx, req_buf,
-					  strlen(req_buf))) {
-    tr_err( "tidc_fwd_request: Error sending request over connection.\n");
+  if (err = gsscon_write_encrypted_token (conn, gssctx, req_buf, req_buflen)) {
+    tr_err( "tidc_exchange: Error sending request over connection.\n");
+    *transport_err = 1;
     goto error;
   }
 
   /* TBD -- queue request on instance, read resps in separate thread */
 
-  /* Read the response from the connection */
-  /* TBD -- timeout? */
-  if (err = gsscon_read_encrypted_token(tid_req->conn, tid_req->gssctx, &resp_buf, &resp_buflen)) {
-    if (resp_buf)
-      free(resp_buf);
+  /* Read the response from the connection. Callers that need a deadline set
+   * one on the socket with gsscon_set_timeout(). */
+  if (err = gsscon_read_encrypted_token(conn, gssctx, &resp_buf, &resp_buflen)) {
+    *transport_err = 1;
     goto error;
   }
 
-  tr_debug( "tidc_fwd_request: Response Received (%u bytes).\n", (unsigned) resp_buflen);
+  tr_debug( "tidc_exchange: Response Received (%u bytes).\n", (unsigned) resp_buflen);
   tr_debug( "%s\n", resp_buf);
 
   if (NULL == (resp_msg = tr_msg_decode(resp_buf, resp_buflen))) {
-    tr_err( "tidc_fwd_request: Error decoding response.\n");
+    tr_err( "tidc_exchange: Error decoding response.\n");
     goto error;
   }
 
   /* TBD -- Check if this is actually a valid response */
   if (TID_RESPONSE != tr_msg_get_msg_type(resp_msg)) {
-    tr_err( "tidc_fwd_request: Error, no response in the response!\n");
+    tr_err( "tidc_exchange: Error, no response in the response!\n");
     goto error;
   }
 
-  if (resp_handler) {
-    /* Call the caller's response function. It must copy any data it needs before returning. */
-    tr_debug("tidc_fwd_request: calling response callback function.");
-    (*resp_handler)(tidc, tid_req, tr_msg_get_resp(resp_msg), cookie);
+  /* If we sent a request ID and the server echoed one, make sure this is the
+   * response to our request. Servers that predate request IDs leave it out. */
+  if ((request_id != NULL) &&
+      (tr_msg_get_resp(resp_msg)->request_id != NULL) &&
+      (0 != tr_name_cmp(request_id, tr_msg_get_resp(resp_msg)->request_id))) {
+    tr_err( "tidc_exchange: Error, response does not match request ID %.*s.\n",
+            request_id->len, request_id->buf);
+    goto error;
   }
 
   goto cleanup;
 
  error:
-  rc = -1;
+  if (resp_msg)
+    tr_msg_free_decoded(resp_msg);
+  resp_msg = NULL;
  cleanup:
-  if (msg)
-    talloc_free(msg);
-  if (req_buf)
-    free(req_buf);
   if (resp_buf)
     free(resp_buf);
-  if (resp_msg)
-    tr_msg_free_decoded(resp_msg);
-  return rc;
+  return resp_msg;
+}
+
+/* Encode a request so it can be sent to several servers with
+ * tidc_fwd_encoded_request(). Returns NULL on error. Release the
+ * result with g_bytes_unref(). */
+GBytes *tidc_encode_request(TID_REQ *tid_req)
+{
+  TR_MSG *msg = NULL;
+  char *req_buf = NULL;
+
+  if (!(msg = talloc_zero(NULL, TR_MSG)))
+    return NULL;
+
+  msg->msg_type = TID_REQUEST;
+  tr_msg_set_req(msg, tid_req);
+  req_buf = tr_msg_encode(msg);
+  talloc_free(msg);
+
+  if (!req_buf) {
+    tr_err("tidc_encode_request: Error encoding TID request.\n");
+    return NULL;
+  }
+  return g_bytes_new_with_free_func(req_buf, strlen(req_buf), free, req_buf);
+}
+
+/* Send a request encoded by tidc_encode_request(). The response handler
+ * is called with a NULL request. Returns 0 on success, TIDC_ERR_TRANSPORT
+ * if the connection failed, or -1 on any other error. */
+int tidc_fwd_encoded_request(TIDC_INSTANCE *tidc,
+                             int conn,
+                             gss_ctx_id_t gssctx,
+                             GBytes *req_buf,
+                             TR_NAME *request_id,
+                             TIDC_RESP_FUNC *resp_handler,
+                             void *cookie)
+{
+  TR_MSG *resp_msg = NULL;
+  gsize req_buflen = 0;
+  const char *buf = g_bytes_get_data(req_buf, &req_buflen);
+  int transport_err = 0;
+
+  if (NULL == (resp_msg = tidc_exchange(conn, gssctx, buf, req_buflen, request_id, &transport_err)))
+    return transport_err ? TIDC_ERR_TRANSPORT : -1;
+
+  if (resp_handler) {
+    /* Call the caller's response function. It must copy any data it needs before returning. */
+    tr_debug("tidc_fwd_encoded_request: calling response callback function.");
+    (*resp_handler)(tidc, NULL, tr_msg_get_resp(resp_msg), cookie);
+  }
+  tr_msg_free_decoded(resp_msg);
+  return 0;
+}
+
+int tidc_fwd_request(TIDC_INSTANCE *tidc,
+                     TID_REQ *tid_req,
+		     TIDC_RESP_FUNC *resp_handler,
+                     void *cookie)
+{
+  GBytes *req_buf = NULL;
+  gsize req_buflen = 0;
+  const char *buf = NULL;
+  TR_MSG *resp_msg = NULL;
+  int transport_err = 0;
+
+  /* store the response function and cookie */
+  // tid_req->resp_func = resp_handler;
+  // tid_req->cookie = cookie;
+
+  /* Encode the request into a json string */
+  if (NULL == (req_buf = tidc_encode_request(tid_req)))
+    return -1;
+
+  buf = g_bytes_get_data(req_buf, &req_buflen);
+  resp_msg = tidc_exchange(tid_req->conn, tid_req->gssctx, buf, req_buflen, tid_req->request_id,
+                           &transport_err);
+  g_bytes_unref(req_buf);
+  if (NULL == resp_msg)
+    return -1;
+
+  if (resp_handler) {
+    /* Call the caller's response function. It must copy any data it needs before returning. */
+    tr_debug("tidc_fwd_request: calling response callback function.");
+    (*resp_handler)(tidc, tid_req, tr_msg_get_resp(resp_msg), cookie);
+  }
+  tr_msg_free_decoded(resp_msg);
+  return 0;
 }
 
 
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include <tid_internal.h>
+#include <gsscon.h>
+#include <tr_debug.h>
+
+/* Connections from a TID client to TID servers are expensive to set up (TCP
+ * connection plus a full GSS handshake), so keep them around for reuse. The
+ * pool is shared by all forwarding threads. All talloc operations on the pool
+ * and its children happen while holding pool->mutex. */
+
+static int tidc_pool_conn_destructor(void *obj)
+{
+  TIDC_POOL_CONN *pc=talloc_get_type_abort(obj, TIDC_POOL_CONN);
+  OM_uint32 minor;
+
+  if (pc->conn>=0)
+    close(pc->conn);
+  if (pc->gssctx!=GSS_C_NO_CONTEXT)
+    gss_delete_sec_context(&minor, &pc->gssctx, NULL);
+  return 0;
+}
+
+static int tidc_pool_host_destructor(void *obj)
+{
+  TIDC_POOL_HOST *host=talloc_get_type_abort(obj, TIDC_POOL_HOST);
+  if (host->hostname!=NULL)
+    tr_free_name(host->hostname);
+  return 0;
+}
+
+static int tidc_pool_destructor(void *obj)
+{
+  TIDC_POOL *pool=talloc_get_type_abort(obj, TIDC_POOL);
+  pthread_cond_destroy(&(pool->conn_returned));
+  pthread_mutex_destroy(&(pool->mutex));
+  return 0;
+}
+
+/* Create a connection pool. Keeps at most max_per_host connections open
+ * to each server (0 for no limit). Idle connections are closed after
+ * idle_timeout seconds; if idle_timeout is 0, connections are not reused. */
+TIDC_POOL *tidc_pool_new(TALLOC_CTX *mem_ctx, unsigned int max_per_host, unsigned int idle_timeout)
+{
+  TIDC_POOL *pool=talloc(mem_ctx, TIDC_POOL);
+
+  if (pool==NULL)
+    return NULL;
+
+  if (0!=pthread_mutex_init(&(pool->mutex), NULL)) {
+    talloc_free(pool);
+    return NULL;
+  }
+  if (0!=pthread_cond_init(&(pool->conn_returned), NULL)) {
+    pthread_mutex_destroy(&(pool->mutex));
+    talloc_free(pool);
+    return NULL;
+  }
+  pool->hosts=NULL;
+  pool->max_per_host=max_per_host;
+  pool->idle_timeout=idle_timeout;
+  talloc_set_destructor((void *)pool, tidc_pool_destructor);
+  return pool;
+}
+
+void tidc_pool_free(TIDC_POOL *pool)
+{
+  talloc_free(pool);
+}
+
+/* Must hold the pool mutex. Returns NULL if allocation fails. */
+static TIDC_POOL_HOST *tidc_pool_get_host(TIDC_POOL *pool, const char *hostname, unsigned int port)
+{
+  TIDC_POOL_HOST *host=NULL;
+
+  for (host=pool->hosts; host!=NULL; host=host->next) {
+    if ((host->port==port) && (0==strcmp(host->hostname->buf, hostname)))
+      return host;
+  }
+
+  host=talloc(pool, TIDC_POOL_HOST);
+  if (host==NULL)
+    return NULL;
+  if (NULL==(host->hostname=tr_new_name(hostname))) {
+    talloc_free(host);
+    return NULL;
+  }
+  host->port=port;
+  host->idle=NULL;
+  host->n_open=0;
+  talloc_set_destructor((void *)host, tidc_pool_host_destructor);
+  host->next=pool->hosts;
+  pool->hosts=host;
+  return host;
+}
+
+/* An idle connection should have nothing to read. If it is readable, the
+ * server has closed it (or sent something we did not ask for). */
+static int tidc_pool_conn_healthy(TIDC_POOL_CONN *pc)
+{
+  struct pollfd pfd;
+
+  pfd.fd=pc->conn;
+  pfd.events=POLLIN;
+  pfd.revents=0;
+  return (0==poll(&pfd, 1, 0));
+}
+
+/* Must hold the pool mutex. Closes a connection that is no longer wanted. */
+static void tidc_pool_close(TIDC_POOL_HOST *host, TIDC_POOL_CONN *pc)
+{
+  host->n_open--;
+  talloc_free(pc);
+}
+
+/* Must hold the pool mutex. Closes idle connections to host that
+ * have timed out or failed their health check. */
+static void tidc_pool_evict(TIDC_POOL *pool, TIDC_POOL_HOST *host, time_t now)
+{
+  TIDC_POOL_CONN **pc=&(host->idle);
+  TIDC_POOL_CONN *dead=NULL;
+
+  while (*pc!=NULL) {
+    if (((*pc)->last_used+pool->idle_timeout <= now) || (!tidc_pool_conn_healthy(*pc))) {
+      tr_debug("tidc_pool_evict: closing idle connection to %s:%u.", host->hostname->buf, host->port);
+      dead=*pc;
+      *pc=dead->next;
+      tidc_pool_close(host, dead);
+      pthread_cond_broadcast(&(pool->conn_returned));
+    } else
+      pc=&((*pc)->next);
+  }
+}
+
+/* Close idle connections that have timed out. Call periodically. */
+void tidc_pool_sweep(TIDC_POOL *pool)
+{
+  TIDC_POOL_HOST *host=NULL;
+  time_t now=time(NULL);
+
+  pthread_mutex_lock(&(pool->mutex));
+  for (host=pool->hosts; host!=NULL; host=host->next)
+    tidc_pool_evict(pool, host, now);
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Milliseconds until deadline (CLOCK_MONOTONIC), or 0 if it has passed */
+static int tidc_pool_ms_until(const struct timespec *deadline)
+{
+  struct timespec now={0};
+  long ms=0;
+
+  if (0!=clock_gettime(CLOCK_MONOTONIC, &now))
+    return 0;
+  ms=(deadline->tv_sec-now.tv_sec)*1000+(deadline->tv_nsec-now.tv_nsec)/1000000;
+  return (ms>0)?(int)ms:0;
+}
+
+/* Check out a connection to hostname:port, reusing an idle one if possible.
+ * If max_per_host connections are already open, waits for one to be returned.
+ * Gives up at deadline (CLOCK_MONOTONIC), including while opening a new
+ * connection. Returns NULL on failure. The connection must be given back
+ * with tidc_pool_put(). */
+TIDC_POOL_CONN *tidc_pool_get(TIDC_POOL *pool,
+                              TIDC_INSTANCE *tidc,
+                              const char *hostname,
+                              unsigned int port,
+                              const struct timespec *deadline)
+{
+  TIDC_POOL_HOST *host=NULL;
+  TIDC_POOL_CONN *pc=NULL;
+  struct timespec cond_deadline={0};
+  gss_ctx_id_t gssctx=GSS_C_NO_CONTEXT;
+  int conn=-1;
+  int wait_ms=0;
+  OM_uint32 minor;
+
+  if (0==port)
+    port=TID_PORT;
+
+  /* the condition variable uses the realtime clock */
+  if (0==(wait_ms=tidc_pool_ms_until(deadline))) {
+    tr_notice("tidc_pool_get: deadline passed before connecting to %s:%u.", hostname, port);
+    return NULL;
+  }
+  clock_gettime(CLOCK_REALTIME, &cond_deadline);
+  cond_deadline.tv_sec+=wait_ms/1000;
+  cond_deadline.tv_nsec+=(wait_ms%1000)*1000000L;
+  if (cond_deadline.tv_nsec>=1000000000L) {
+    cond_deadline.tv_sec++;
+    cond_deadline.tv_nsec-=1000000000L;
+  }
+
+  pthread_mutex_lock(&(pool->mutex));
+  if (NULL==(host=tidc_pool_get_host(pool, hostname, port))) {
+    tr_notice("tidc_pool_get: unable to allocate pool entry for %s.", hostname);
+    pthread_mutex_unlock(&(pool->mutex));
+    return NULL;
+  }
+
+  for (;;) {
+    tidc_pool_evict(pool, host, time(NULL));
+    if (host->idle!=NULL) {
+      /* most recently used connection is at the head of the list */
+      pc=host->idle;
+      host->idle=pc->next;
+      pc->next=NULL;
+      pc->reused=1;
+      pthread_mutex_unlock(&(pool->mutex));
+      tr_debug("tidc_pool_get: reusing connection to %s:%u.", hostname, port);
+      return pc;
+    }
+    if ((pool->max_per_host==0) || (host->n_open<pool->max_per_host))
+      break;
+    /* wait for another thread to give back or close a connection */
+    if (ETIMEDOUT==pthread_cond_timedwait(&(pool->conn_returned), &(pool->mutex), &cond_deadline)) {
+      tr_notice("tidc_pool_get: timed out waiting for a connection to %s:%u.", hostname, port);
+      pthread_mutex_unlock(&(pool->mutex));
+      return NULL;
+    }
+  }
+
+  /* reserve a slot, then connect without holding the lock */
+  host->n_open++;
+  pthread_mutex_unlock(&(pool->mutex));
+
+  if ((0==(wait_ms=tidc_pool_ms_until(deadline))) ||
+      (-1==(conn=tidc_open_connection_timeout(tidc, hostname, port, wait_ms, &gssctx)))) {
+    pthread_mutex_lock(&(pool->mutex));
+    host->n_open--;
+    pthread_cond_broadcast(&(pool->conn_returned));
+    pthread_mutex_unlock(&(pool->mutex));
+    return NULL;
+  }
+
+  pthread_mutex_lock(&(pool->mutex));
+  pc=talloc(host, TIDC_POOL_CONN);
+  if (pc==NULL) {
+    host->n_open--;
+    pthread_cond_broadcast(&(pool->conn_returned));
+    pthread_mutex_unlock(&(pool->mutex));
+    close(conn);
+    gss_delete_sec_context(&minor, &gssctx, NULL);
+    return NULL;
+  }
+  pc->next=NULL;
+  pc->host=host;
+  pc->conn=conn;
+  pc->gssctx=gssctx;
+  pc->last_used=time(NULL);
+  pc->reused=0;
+  talloc_set_destructor((void *)pc, tidc_pool_conn_destructor);
+  pthread_mutex_unlock(&(pool->mutex));
+  return pc;
+}
+
+/* Give a connection back to the pool. If healthy is 0, or the pool does not
+ * keep idle connections, the connection is closed. */
+void tidc_pool_put(TIDC_POOL *pool, TIDC_POOL_CONN *pc, int healthy)
+{
+  TIDC_POOL_HOST *host=pc->host;
+
+  pthread_mutex_lock(&(pool->mutex));
+  if (healthy && (pool->idle_timeout>0)) {
+    pc->last_used=time(NULL);
+    pc->next=host->idle;
+    host->idle=pc;
+  } else
+    tidc_pool_close(host, pc);
+  pthread_cond_broadcast(&(pool->conn_returned));
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+/* Forward an encoded request (see tidc_encode_request()) to hostname:port
+ * over a pooled connection. If a reused connection fails to carry the request
+ * (e.g., the server closed it while idle), retries once. Error responses and
+ * failures on a new connection are not retried. Gives up at deadline
+ * (CLOCK_MONOTONIC); a connection that times out is closed rather than
+ * returned to the pool. Returns 0 on success. */
+int tidc_pool_fwd_request(TIDC_POOL *pool,
+                          TIDC_INSTANCE *tidc,
+                          const char *hostname,
+                          unsigned int port,
+                          const struct timespec *deadline,
+                          GBytes *req_buf,
+                          TR_NAME *request_id,
+                          TIDC_RESP_FUNC *resp_handler,
+                          void *cookie)
+{
+  TIDC_POOL_CONN *pc=NULL;
+  int retry=0;
+  int wait_ms=0;
+  int rc=-1;
+
+  do {
+    if (NULL==(pc=tidc_pool_get(pool, tidc, hostname, port, deadline))) {
+      tr_notice("tidc_pool_fwd_request: unable to get connection to %s.", hostname);
+      return -1;
+    }
+
+    /* Don't let a hung server keep this thread past the deadline */
+    if ((0==(wait_ms=tidc_pool_ms_until(deadline))) ||
+        (0!=gsscon_set_timeout(pc->conn, wait_ms))) {
+      tr_notice("tidc_pool_fwd_request: no time left to send request to %s.", hostname);
+      tidc_pool_put(pool, pc, 1); /* connection was not used */
+      return -1;
+    }
+
+    /* Only one request is outstanding on a connection at a time, and a connection
+     * is closed rather than reused if its response is not read, so the request ID
+     * only needs to be unique among requests sent by this client. */
+    rc=tidc_fwd_encoded_request(tidc, pc->conn, pc->gssctx, req_buf, request_id, resp_handler, cookie);
+
+    /* retry only on the first attempt, and only if a stale connection may be to blame */
+    retry=(!retry) && (rc==TIDC_ERR_TRANSPORT) && pc->reused;
+    tidc_pool_put(pool, pc, (rc==0));
+
+    if (retry)
+      tr_debug("tidc_pool_fwd_request: reused connection to %s failed, retrying.", hostname);
+  } while (retry);
+
+  return (rc==0)?0:-1;
+}
@@ -45,6 +45,7 @@
 #include <jansson.h>
 #include <talloc.h>
 #include <poll.h>
+#include <pthread.h>
 #include <tid_internal.h>
 #include <gsscon.h>
 #include <tr_debug.h>
@@ -73,6 +74,12 @@ static TID_RESP *tids_create_response (TIDS_INSTANCE *tids, TID_REQ *req)
       goto cleanup;
     }
   }
+  if (req->request_id) {
+    if (NULL == (resp->request_id = tr_dup_name(req->request_id))) {
+      tr_crit("tids_create_response: Error allocating fields in response.");
+      goto cleanup;
+    }
+  }
 
   success=1;
 
@@ -84,7 +91,9 @@ cleanup:
   return resp;
 }
 
-static int tids_listen(TIDS_INSTANCE *tids, int port, int *fd_out, size_t max_fd) 
+/* If reuseport is nonzero, sets SO_REUSEPORT so that several processes
+ * can each hold their own listener on the port. */
+static int tids_listen(TIDS_INSTANCE *tids, int port, int *fd_out, size_t max_fd, int reuseport) 
 {
   int rc = 0;
   int conn = -1;
@@ -120,6 +129,20 @@ static int tids_listen(TIDS_INSTANCE *tids, int port, int *fd_out, size_t max_fd
     if (0!=setsockopt(conn, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)))
       tr_debug("tids_listen: unable to set SO_REUSEADDR."); /* not fatal? */
 
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+      if (0!=setsockopt(conn, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) {
+        tr_debug("tids_listen: unable to set SO_REUSEPORT. Skipping interface.");
+        close(conn);
+        continue;
+      }
+#else
+      tr_debug("tids_listen: SO_REUSEPORT not supported. Skipping interface.");
+      close(conn);
+      continue;
+#endif
+    }
+
     if (ai->ai_family==AF_INET6) {
       /* don't allow IPv4-mapped IPv6 addresses (per RFC4942, not sure
        * if still relevant) */
@@ -137,7 +160,7 @@ static int tids_listen(TIDS_INSTANCE *tids, int port, int *fd_out, size_t max_fd
       continue;
     }
 
-    if (0>listen(conn, 512)) {
+    if (0>listen(conn, tids->listen_backlog)) {
       tr_debug("tids_listen: unable to listen on bound socket.");
       close(conn);
       continue;
@@ -161,41 +184,57 @@ static int tids_listen(TIDS_INSTANCE *tids, int port, int *fd_out, size_t max_fd
   return n_opened;
 }
 
+/* per-connection data for the GSS authorization callback */
+struct tids_auth_cookie {
+  TIDS_INSTANCE *tids;
+  TR_NAME *gss_name; /* set to the client's GSS name if authorized */
+};
+
 /* returns EACCES if authorization is denied */
 static int tids_auth_cb(gss_name_t clientName, gss_buffer_t displayName,
 			void *data)
 {
-  struct tids_instance *inst = (struct tids_instance *) data;
+  struct tids_auth_cookie *cookie = (struct tids_auth_cookie *) data;
+  struct tids_instance *inst = cookie->tids;
   TR_NAME name ={(char *) displayName->value,
-		 displayName->length};
+		 displayName->length,
+		 0, 0, NULL}; /* not interned */
   int result=0;
 
   if (0!=inst->auth_handler(clientName, &name, inst->cookie)) {
     tr_debug("tids_auth_cb: client '%.*s' denied authorization.", name.len, name.buf);
     result=EACCES; /* denied */
+  } else if (NULL == (cookie->gss_name = tr_dup_name(&name))) {
+    tr_crit("tids_auth_cb: unable to allocate client GSS name.");
+    result=ENOMEM;
   }
 
   return result;
 }
 
-/* returns 0 on authorization success, 1 on failure, or -1 in case of error */
+/* returns 0 on authorization success, 1 on failure, or -1 in case of error.
+ * On success, *gss_name is set to the client's GSS name, which the caller must free. */
 static int tids_auth_connection (TIDS_INSTANCE *inst,
 				 int conn,
-                                 gss_ctx_id_t *gssctx)
+                                 gss_ctx_id_t *gssctx,
+                                 TR_NAME **gss_name)
 {
   int rc = 0;
   int auth, autherr = 0;
   gss_buffer_desc nameBuffer = {0, NULL};
   char *name = 0;
   int nameLen = 0;
+  struct tids_auth_cookie cookie = {inst, NULL};
 
   nameLen = asprintf(&name, "trustidentity@%s", inst->hostname);
   nameBuffer.length = nameLen;
   nameBuffer.value = name;
 
-  if (rc = gsscon_passive_authenticate(conn, nameBuffer, gssctx, tids_auth_cb, inst)) {
+  if (rc = gsscon_passive_authenticate(conn, nameBuffer, gssctx, tids_auth_cb, &cookie)) {
     tr_debug("tids_auth_connection: Error from gsscon_passive_authenticate(), rc = %d.", rc);
     free(name);
+    if (cookie.gss_name)
+      tr_free_name(cookie.gss_name);
     return -1;
   }
   free(name);
@@ -204,6 +243,8 @@ static int tids_auth_connection (TIDS_INSTANCE *inst,
   if (rc = gsscon_authorize(*gssctx, &auth, &autherr)) {
     tr_debug("tids_auth_connection: Error from gsscon_authorize, rc = %d, autherr = %d.", 
 	    rc, autherr);
+    if (cookie.gss_name)
+      tr_free_name(cookie.gss_name);
     return -1;
   }
 
@@ -212,6 +253,11 @@ static int tids_auth_connection (TIDS_INSTANCE *inst,
   else
     tr_debug("tids_auth_connection: Authentication failed, conn %d.", conn);
 
+  if (auth && (cookie.gss_name!=NULL))
+    *gss_name = cookie.gss_name;
+  else if (cookie.gss_name)
+    tr_free_name(cookie.gss_name);
+
   return !auth;
 }
 
@@ -246,9 +292,52 @@ static int tids_read_request (TIDS_INSTANCE *tids, int conn, gss_ctx_id_t *gssct
   return buflen;
 }
 
+/* error message for requests refused because of load */
+#define TIDS_BUSY_MSG "Server busy, try again later"
+
+/* milliseconds the shedder thread gives a refused client to authenticate and send its request */
+#define TIDS_SHED_TIMEOUT_MS 2000
+
+/* milliseconds a worker thread waits on any one read or write to its client */
+#define TIDS_WORKER_TIMEOUT_MS 10000
+
+/* Count a request or connection refused because of load. */
+static void tids_count_shed(TIDS_INSTANCE *tids, const char *why)
+{
+  unsigned long shed_count=0;
+
+  pthread_mutex_lock(&(tids->mutex));
+  shed_count=++(tids->shed_count);
+  pthread_mutex_unlock(&(tids->mutex));
+  tr_notice("tids: overloaded, %s (%lu shed so far).", why, shed_count);
+}
+
+/* Returns nonzero if there is room for another request. If so, the caller
+ * must call tids_release() when it is done. */
+static int tids_admit(TIDS_INSTANCE *tids)
+{
+  int admit=0;
+
+  pthread_mutex_lock(&(tids->mutex));
+  if ((tids->max_in_flight==0) || (tids->n_in_flight<tids->max_in_flight)) {
+    tids->n_in_flight++;
+    admit=1;
+  }
+  pthread_mutex_unlock(&(tids->mutex));
+  return admit;
+}
+
+static void tids_release(TIDS_INSTANCE *tids)
+{
+  pthread_mutex_lock(&(tids->mutex));
+  tids->n_in_flight--;
+  pthread_mutex_unlock(&(tids->mutex));
+}
+
 static int tids_handle_request (TIDS_INSTANCE *tids, TR_MSG *mreq, TID_RESP *resp) 
 {
   int rc=-1;
+  int admitted=0;
 
   /* Check that this is a valid TID Request.  If not, send an error return. */
   if ((!tr_msg_get_req(mreq)) ||
@@ -261,12 +350,47 @@ static int tids_handle_request (TIDS_INSTANCE *tids, TR_MSG *mreq, TID_RESP *res
     return -1;
   }
 
+  pthread_mutex_lock(&(tids->mutex));
+  tids->req_count++;
+  pthread_mutex_unlock(&(tids->mutex));
+
+  /* Start the clock on the request's time budget, keeping back enough to get
+   * our response to the previous hop. If nothing is left, don't bother. A request
+   * that waited for a worker was stamped when it was queued. */
+  if ((tr_msg_get_req(mreq)->received.tv_sec==0) && (tr_msg_get_req(mreq)->received.tv_nsec==0))
+    clock_gettime(CLOCK_MONOTONIC, &(tr_msg_get_req(mreq)->received));
+  if (tr_msg_get_req(mreq)->timeout_ms > 0) {
+    if (tr_msg_get_req(mreq)->timeout_ms <= TID_HOP_MARGIN_MS) {
+      tr_notice("tids_handle_request(): Request arrived with no time left (%u ms).",
+                tr_msg_get_req(mreq)->timeout_ms);
+      resp->result = TID_ERROR;
+      resp->err_msg = tr_new_name("Request deadline exceeded");
+      return -1;
+    }
+    tr_msg_get_req(mreq)->timeout_ms -= TID_HOP_MARGIN_MS;
+  }
+
+  /* Refuse quickly rather than queueing work we cannot finish in time. With
+   * worker threads, this was done before the connection was handed to one. */
+  if (tids->workers==NULL) {
+    if (!tids_admit(tids)) {
+      tids_count_shed(tids, "refusing request");
+      resp->result = TID_ERROR;
+      resp->err_msg = tr_new_name(TIDS_BUSY_MSG);
+      return -1;
+    }
+    admitted=1;
+  }
+
   tr_debug("tids_handle_request: adding self to req path.");
   tid_req_add_path(tr_msg_get_req(mreq), tids->hostname, tids->tids_port);
   
   /* Call the caller's request handler */
   /* TBD -- Handle different error returns/msgs */
-  if (0 > (rc = (*tids->req_handler)(tids, tr_msg_get_req(mreq), resp, tids->cookie))) {
+  rc = (*tids->req_handler)(tids, tr_msg_get_req(mreq), resp, tids->cookie);
+  if (admitted)
+    tids_release(tids);
+  if (0 > rc) {
     /* set-up an error response */
     tr_debug("tids_handle_request: req_handler returned error.");
     resp->result = TID_ERROR;
@@ -320,6 +444,11 @@ int tids_send_response (TIDS_INSTANCE *tids, TID_REQ *req, TID_RESP *resp)
   if (req->resp_sent)
     return 0;
 
+  /* A response relayed from another server carries that server's request ID. */
+  if ((req->request_id!=NULL) &&
+      ((resp->request_id==NULL) || (0!=tr_name_cmp(req->request_id, resp->request_id))))
+    tid_resp_set_request_id(resp, tr_dup_name(req->request_id));
+
   mresp.msg_type = TID_RESPONSE;
   tr_msg_set_resp(&mresp, resp);
 
@@ -355,82 +484,654 @@ int tids_send_response (TIDS_INSTANCE *tids, TID_REQ *req, TID_RESP *resp)
   return 0;
 }
 
-static void tids_handle_connection (TIDS_INSTANCE *tids, int conn)
+/* Wait up to timeout seconds for something to read on conn. Returns nonzero if
+ * there is data (or the peer closed the connection), 0 on timeout or error. */
+static int tids_conn_readable(int conn, unsigned int timeout)
+{
+  struct pollfd pfd={.fd=conn, .events=POLLIN};
+  int rc=0;
+
+  do {
+    rc=poll(&pfd, 1, timeout*1000);
+  } while ((rc<0) && (errno==EINTR));
+
+  return (rc>0);
+}
+
+/* Release a connection's GSS context and client name, leaving the socket open */
+static void tids_conn_release_gss(TIDS_CONN *tc)
+{
+  OM_uint32 minor;
+
+  if (tc->gssctx != GSS_C_NO_CONTEXT)
+    gss_delete_sec_context(&minor, &(tc->gssctx), NULL);
+  tc->gssctx = GSS_C_NO_CONTEXT;
+  if (tc->gss_name != NULL)
+    tr_free_name(tc->gss_name);
+  tc->gss_name = NULL;
+}
+
+static int tids_conn_destructor(void *obj)
+{
+  TIDS_CONN *tc=talloc_get_type_abort(obj, TIDS_CONN);
+
+  tids_conn_release_gss(tc);
+  if (tc->fd >= 0)
+    close(tc->fd);
+  return 0;
+}
+
+/* Wrap an accepted socket for the worker threads. Freeing the result closes the socket. */
+static TIDS_CONN *tids_conn_new(int fd)
+{
+  TIDS_CONN *tc=talloc(NULL, TIDS_CONN);
+
+  if (tc!=NULL) {
+    tc->fd=fd;
+    tc->gssctx=GSS_C_NO_CONTEXT;
+    tc->gss_name=NULL;
+    tc->n_served=0;
+    tc->idle_deadline.tv_sec=0;
+    tc->idle_deadline.tv_nsec=0;
+    tc->queued.tv_sec=0;
+    tc->queued.tv_nsec=0;
+    talloc_set_destructor((void *)tc, tids_conn_destructor);
+  }
+  return tc;
+}
+
+/* Read one request from an authenticated connection, handle it, and send the response.
+ * Responses carry the request's ID, if it had one. Returns 0 if the connection may be
+ * kept open for another request, -1 if it should be closed. */
+static int tids_serve_request (TIDS_INSTANCE *tids, TIDS_CONN *tc)
 {
   TR_MSG *mreq = NULL;
   TID_RESP *resp = NULL;
   int rc = 0;
-  gss_ctx_id_t gssctx = GSS_C_NO_CONTEXT;
 
-  if (tids_auth_connection(tids, conn, &gssctx)) {
+  if (0 > (rc = tids_read_request(tids, tc->fd, &(tc->gssctx), &mreq))) {
+    tr_debug("tids_serve_request: Error from tids_read_request(), rc = %d.", rc);
+    return -1;
+  } else if (0 == rc) {
+    return 0;
+  }
+
+  /* Put connection information into the request structure. The connection
+   * and GSS context stay ours, so do not let the request free them. */
+  tr_msg_get_req(mreq)->conn = tc->fd;
+  tr_msg_get_req(mreq)->gssctx = tc->gssctx;
+  tr_msg_get_req(mreq)->free_conn = 0;
+  tr_msg_get_req(mreq)->gss_name = tr_dup_name(tc->gss_name);
+  tr_msg_get_req(mreq)->received = tc->queued;
+  tc->queued.tv_sec = 0;
+  tc->queued.tv_nsec = 0;
+
+  /* Allocate a response structure and populate common fields */
+  if (NULL == (resp = tids_create_response (tids, tr_msg_get_req(mreq)))) {
+    tr_crit("tids_serve_request: Error creating response structure.");
+    /* try to send an error */
+    tids_send_err_response(tids, tr_msg_get_req(mreq), "Error creating response.");
+    tr_msg_free_decoded(mreq);
+    return -1;
+  }
+
+  if (0 > (rc = tids_handle_request(tids, mreq, resp))) {
+    tr_debug("tids_serve_request: Error from tids_handle_request(), rc = %d.", rc);
+    /* Fall through, to send the response, either way */
+  }
+
+  if (0 > (rc = tids_send_response(tids, tr_msg_get_req(mreq), resp))) {
+    tr_debug("tids_serve_request: Error from tids_send_response(), rc = %d.", rc);
+    /* if we didn't already send a response, try to send a generic error. */
+    if (!tr_msg_get_req(mreq)->resp_sent)
+      tids_send_err_response(tids, tr_msg_get_req(mreq), "Error sending response.");
+    /* Fall through to free the response, either way. */
+  }
+
+  tr_msg_free_decoded(mreq); /* takes resp with it */
+  tc->n_served++;
+
+  if (tids->idle_timeout == 0)
+    return -1; /* one request per connection */
+  return 0;
+}
+
+/* Authenticate and serve a connection in this process. Does not close conn; the caller is
+ * responsible for that. Requests are served one at a time, in order, until the client closes
+ * the connection or sends nothing for tids->idle_timeout seconds. Used when forking, where
+ * the process belongs to the connection anyway; worker threads use tids_worker_serve(). */
+static void tids_handle_connection (TIDS_INSTANCE *tids, int conn)
+{
+  TIDS_CONN tc = {conn, GSS_C_NO_CONTEXT, NULL, 0, {0, 0}, {0, 0}};
+
+  if (tids_auth_connection(tids, conn, &(tc.gssctx), &(tc.gss_name))) {
     tr_notice("tids_handle_connection: Error authorizing TID Server connection.");
-    close(conn);
-    return;
+    goto cleanup;
   }
 
   tr_debug("tids_handle_connection: Connection authorized!");
 
-  while (1) {	/* continue until an error breaks us out */
+  while (0 == tids_serve_request(tids, &tc)) {
+    if (!tids_conn_readable(conn, tids->idle_timeout)) {
+      tr_debug("tids_handle_connection: Connection idle after %u requests, closing.", tc.n_served);
+      break;
+    }
+  }
 
-    if (0 > (rc = tids_read_request(tids, conn, &gssctx, &mreq))) {
-      tr_debug("tids_handle_connection: Error from tids_read_request(), rc = %d.", rc);
-      return;
-    } else if (0 == rc) {
-      continue;
+cleanup:
+  tids_conn_release_gss(&tc);
+}
+
+static int tids_destructor(void *obj)
+{
+  TIDS_INSTANCE *tids=talloc_get_type_abort(obj, TIDS_INSTANCE);
+
+  /* stop the workers before anything they use goes away */
+  if (tids->workers!=NULL)
+    talloc_free(tids->workers);
+  pthread_mutex_destroy(&(tids->mutex));
+  return 0;
+}
+
+TIDS_INSTANCE *tids_create (void)
+{
+  TIDS_INSTANCE *tids=talloc_zero(NULL, TIDS_INSTANCE);
+  if (tids!=NULL) {
+    if (0!=pthread_mutex_init(&(tids->mutex), NULL)) {
+      talloc_free(tids);
+      return NULL;
     }
+    tids->idle_timeout = TIDS_DEFAULT_IDLE_TIMEOUT;
+    tids->listen_backlog = TIDS_DEFAULT_LISTEN_BACKLOG;
+    talloc_set_destructor((void *)tids, tids_destructor);
+  }
+  return tids;
+}
 
-    /* Put connection information into the request structure */
-    tr_msg_get_req(mreq)->conn = conn;
-    tr_msg_get_req(mreq)->gssctx = gssctx;
-
-    /* Allocate a response structure and populate common fields */
-    if (NULL == (resp = tids_create_response (tids, tr_msg_get_req(mreq)))) {
-      tr_crit("tids_handle_connection: Error creating response structure.");
-      /* try to send an error */
-      tids_send_err_response(tids, tr_msg_get_req(mreq), "Error creating response.");
-      tr_msg_free_decoded(mreq);
-      return;
+/* How long a connection may sit idle between requests before it is closed.
+ * Set to 0 to close every connection after a single request. With worker threads,
+ * an idle connection is parked and does not hold a thread; when forking, it keeps
+ * its process until it is closed. */
+void tids_set_idle_timeout(TIDS_INSTANCE *tids, unsigned int seconds)
+{
+  tids->idle_timeout = seconds;
+}
+
+/* Length of the kernel's queue of connections waiting for accept(). Must be
+ * called before the listener is opened. */
+void tids_set_listen_backlog(TIDS_INSTANCE *tids, int backlog)
+{
+  tids->listen_backlog = backlog;
+}
+
+/* Limit the number of requests handled at once; 0 for no limit. With worker
+ * threads, this counts connections queued for or being served by a worker, and
+ * is checked before a connection is handed off; connections over the limit get
+ * an error response from a separate thread. When forking a process per
+ * connection, this limits the number of child processes instead, and
+ * connections over the limit are closed without a response. */
+void tids_set_max_in_flight(TIDS_INSTANCE *tids, unsigned int max_in_flight)
+{
+  tids->max_in_flight = max_in_flight;
+}
+
+/* Number of requests or connections refused because of the limit above */
+unsigned long tids_get_shed_count(TIDS_INSTANCE *tids)
+{
+  unsigned long shed_count=0;
+
+  pthread_mutex_lock(&(tids->mutex));
+  shed_count=tids->shed_count;
+  pthread_mutex_unlock(&(tids->mutex));
+  return shed_count;
+}
+
+/* Add a connection to the worker queue. Call with the pool mutex held.
+ * Returns 0 on success, -1 if the queue is full. */
+static int tids_worker_push_conn(TIDS_WORKER_POOL *pool, TIDS_CONN *tc)
+{
+  if (pool->n_pending>=pool->max_pending)
+    return -1;
+
+  pool->conn_queue[(pool->head+pool->n_pending)%pool->max_pending]=tc;
+  pool->n_pending++;
+  pthread_cond_signal(&(pool->have_conn));
+  return 0;
+}
+
+/* Give a refused connection to the shedder thread, or close it if the shedder
+ * is too far behind. Call with the pool mutex held. */
+static void tids_worker_shed_conn(TIDS_WORKER_POOL *pool, TIDS_CONN *tc)
+{
+  if (pool->n_shed>=pool->max_pending) {
+    tr_notice("tids_worker_shed_conn: too many refused connections to answer, closing one.");
+    talloc_free(tc);
+    return;
+  }
+
+  pool->shed_queue[(pool->shed_head+pool->n_shed)%pool->max_pending]=tc;
+  pool->n_shed++;
+  pthread_cond_signal(&(pool->have_shed));
+}
+
+/* Hand a connection with a request to serve to the worker threads if it is admitted
+ * and there is room, otherwise to the shedder. Call with the pool mutex held. */
+static void tids_worker_dispatch(TIDS_INSTANCE *tids, TIDS_CONN *tc)
+{
+  TIDS_WORKER_POOL *pool=tids->workers;
+
+  clock_gettime(CLOCK_MONOTONIC, &(tc->queued)); /* the request's clock runs from here */
+  if (!tids_admit(tids))
+    tids_count_shed(tids, "too many requests in progress, refusing connection");
+  else if (0!=tids_worker_push_conn(pool, tc)) {
+    tids_release(tids);
+    tids_count_shed(tids, "all worker threads busy and queue full, refusing connection");
+  } else
+    return; /* admitted; the worker releases it */
+
+  tids_worker_shed_conn(pool, tc);
+}
+
+/* As tids_worker_dispatch(), for callers not holding the pool mutex */
+static void tids_worker_queue_conn(TIDS_INSTANCE *tids, TIDS_CONN *tc)
+{
+  pthread_mutex_lock(&(tids->workers->mutex));
+  tids_worker_dispatch(tids, tc);
+  pthread_mutex_unlock(&(tids->workers->mutex));
+}
+
+/* Leave a connection with the watcher thread until its next request arrives or it has
+ * been idle for idle_timeout seconds. Returns 0 on success, -1 if the caller should close
+ * the connection instead. */
+static int tids_worker_park_conn(TIDS_WORKER_POOL *pool, TIDS_CONN *tc, unsigned int idle_timeout)
+{
+  char wake=0;
+
+  if (idle_timeout==0)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &(tc->idle_deadline));
+  tc->idle_deadline.tv_sec+=idle_timeout;
+
+  pthread_mutex_lock(&(pool->mutex));
+  if (pool->shutdown) {
+    pthread_mutex_unlock(&(pool->mutex));
+    return -1;
+  }
+  g_ptr_array_add(pool->parked, tc);
+  pthread_mutex_unlock(&(pool->mutex));
+
+  /* a full pipe already means the watcher will wake */
+  if (write(pool->wake_pipe[1], &wake, 1)<0)
+    tr_debug("tids_worker_park_conn: wake pipe full.");
+  return 0;
+}
+
+/* Serve a queued connection: authenticate it if it is new, then handle its next request
+ * if one has arrived. The connection is then parked until the next request, or closed.
+ * Releases the admission taken by tids_worker_dispatch(). */
+static void tids_worker_serve(TIDS_INSTANCE *tids, TIDS_CONN *tc)
+{
+  int keep=0;
+
+  /* a client that stalls mid-message must not keep this thread */
+  if (0!=gsscon_set_timeout(tc->fd, TIDS_WORKER_TIMEOUT_MS))
+    goto cleanup;
+
+  if (tc->gssctx==GSS_C_NO_CONTEXT) {
+    if (tids_auth_connection(tids, tc->fd, &(tc->gssctx), &(tc->gss_name))) {
+      tr_notice("tids_worker_serve: Error authorizing TID Server connection.");
+      goto cleanup;
     }
+    tr_debug("tids_worker_serve: Connection authorized!");
+  }
+
+  /* don't wait here for a client that has not sent its request yet */
+  if ((tids->idle_timeout==0) || tids_conn_readable(tc->fd, 0)) {
+    if (0!=tids_serve_request(tids, tc))
+      goto cleanup;
+  }
+  /* parked connections are watched with poll(), not read with a timeout */
+  keep=(0==gsscon_set_timeout(tc->fd, 0));
+
+cleanup:
+  tids_release(tids);
+  if ((!keep) || (0!=tids_worker_park_conn(tids->workers, tc, tids->idle_timeout)))
+    talloc_free(tc);
+}
+
+/* Answer the next request on a refused connection with an error, so the client can
+ * go elsewhere rather than wait. The connection is parked afterward if possible. */
+static void tids_shed_serve(TIDS_INSTANCE *tids, TIDS_CONN *tc)
+{
+  TR_MSG *mreq=NULL;
+  int keep=0;
+
+  /* one slow client must not hold up answers to the others */
+  if (0!=gsscon_set_timeout(tc->fd, TIDS_SHED_TIMEOUT_MS))
+    goto cleanup;
+
+  if ((tc->gssctx==GSS_C_NO_CONTEXT) &&
+      tids_auth_connection(tids, tc->fd, &(tc->gssctx), &(tc->gss_name))) {
+    tr_notice("tids_shed_serve: Error authorizing TID Server connection.");
+    goto cleanup;
+  }
+
+  if (0>=tids_read_request(tids, tc->fd, &(tc->gssctx), &mreq))
+    goto cleanup;
+
+  tr_msg_get_req(mreq)->conn=tc->fd;
+  tr_msg_get_req(mreq)->gssctx=tc->gssctx;
+  tr_msg_get_req(mreq)->free_conn=0;
+  keep=(0==tids_send_err_response(tids, tr_msg_get_req(mreq), TIDS_BUSY_MSG));
+  tr_msg_free_decoded(mreq);
+  keep=keep && (0==gsscon_set_timeout(tc->fd, 0));
+
+cleanup:
+  if ((!keep) || (0!=tids_worker_park_conn(tids->workers, tc, tids->idle_timeout)))
+    talloc_free(tc);
+}
 
-    if (0 > (rc = tids_handle_request(tids, mreq, resp))) {
-      tr_debug("tids_handle_connection: Error from tids_handle_request(), rc = %d.", rc);
-      /* Fall through, to send the response, either way */
+/* Shedder thread main. Answers refused connections until the pool is shut down. */
+static void *tids_shed_thread(void *arg)
+{
+  TIDS_INSTANCE *tids=(TIDS_INSTANCE *)arg;
+  TIDS_WORKER_POOL *pool=tids->workers;
+  TIDS_CONN *tc=NULL;
+
+  while (1) {
+    pthread_mutex_lock(&(pool->mutex));
+    while ((pool->n_shed==0) && (!pool->shutdown))
+      pthread_cond_wait(&(pool->have_shed), &(pool->mutex));
+
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&(pool->mutex));
+      break;
     }
 
-    if (0 > (rc = tids_send_response(tids, tr_msg_get_req(mreq), resp))) {
-      tr_debug("tids_handle_connection: Error from tids_send_response(), rc = %d.", rc);
-      /* if we didn't already send a response, try to send a generic error. */
-      if (!tr_msg_get_req(mreq)->resp_sent)
-        tids_send_err_response(tids, tr_msg_get_req(mreq), "Error sending response.");
-      /* Fall through to free the response, either way. */
+    tc=pool->shed_queue[pool->shed_head];
+    pool->shed_head=(pool->shed_head+1)%pool->max_pending;
+    pool->n_shed--;
+    pthread_mutex_unlock(&(pool->mutex));
+
+    tids_shed_serve(tids, tc);
+  }
+  return NULL;
+}
+
+/* Worker thread main. Serves queued connections until the pool is shut down. */
+static void *tids_worker_thread(void *arg)
+{
+  TIDS_INSTANCE *tids=(TIDS_INSTANCE *)arg;
+  TIDS_WORKER_POOL *pool=tids->workers;
+  TIDS_CONN *tc=NULL;
+
+  while (1) {
+    pthread_mutex_lock(&(pool->mutex));
+    while ((pool->n_pending==0) && (!pool->shutdown))
+      pthread_cond_wait(&(pool->have_conn), &(pool->mutex));
+
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&(pool->mutex));
+      break;
     }
-    
-    tr_msg_free_decoded(mreq); /* takes resp with it */
-    return;
-  } 
+
+    tc=pool->conn_queue[pool->head];
+    pool->head=(pool->head+1)%pool->max_pending;
+    pool->n_pending--;
+    pthread_mutex_unlock(&(pool->mutex));
+
+    tids_worker_serve(tids, tc);
+  }
+  return NULL;
 }
 
-TIDS_INSTANCE *tids_create (void)
+/* milliseconds from now until when, rounded up; 0 if it has passed */
+static int tids_ms_until(struct timespec *now, struct timespec *when)
 {
-  return talloc_zero(NULL, TIDS_INSTANCE);
+  long ms=(when->tv_sec-now->tv_sec)*1000 + (when->tv_nsec-now->tv_nsec+999999)/1000000;
+
+  return (ms<0)?0:(int)ms;
 }
 
-/* Get a listener for tids requests, returns its socket fd. Accept
- * connections with tids_accept() */
-int tids_get_listener(TIDS_INSTANCE *tids, 
-                      TIDS_REQ_FUNC *req_handler,
-                      tids_auth_func *auth_handler,
-                      const char *hostname,
-                      unsigned int port,
-                      void *cookie,
-                      int *fd_out,
-                      size_t max_fd)
+/* Watcher thread main. Polls the parked connections, handing each back to the
+ * workers when its next request arrives and closing it when it has been idle too long. */
+static void *tids_watcher_thread(void *arg)
+{
+  TIDS_INSTANCE *tids=(TIDS_INSTANCE *)arg;
+  TIDS_WORKER_POOL *pool=tids->workers;
+  struct pollfd *pfd=NULL;
+  guint n_parked=0;
+  guint ii=0;
+  TIDS_CONN *tc=NULL;
+  struct timespec now={0,0};
+  int timeout_ms=0;
+  int ms=0;
+  char buf[64];
+
+  while (1) {
+    pthread_mutex_lock(&(pool->mutex));
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&(pool->mutex));
+      break;
+    }
+
+    /* Only this thread removes parked connections, so the first n_parked stay put
+     * while we poll; workers may add more, and will wake us when they do. */
+    n_parked=pool->parked->len;
+    pfd=talloc_realloc(NULL, pfd, struct pollfd, n_parked+1);
+    if (pfd==NULL) {
+      pthread_mutex_unlock(&(pool->mutex));
+      tr_crit("tids_watcher_thread: unable to allocate poll list, idle connections will not be served.");
+      break;
+    }
+    pfd[0].fd=pool->wake_pipe[0];
+    pfd[0].events=POLLIN;
+    pfd[0].revents=0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout_ms=-1;
+    for (ii=0; ii<n_parked; ii++) {
+      tc=g_ptr_array_index(pool->parked, ii);
+      pfd[ii+1].fd=tc->fd;
+      pfd[ii+1].events=POLLIN;
+      pfd[ii+1].revents=0;
+      ms=tids_ms_until(&now, &(tc->idle_deadline));
+      if ((timeout_ms<0) || (ms<timeout_ms))
+        timeout_ms=ms;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if ((poll(pfd, n_parked+1, timeout_ms)<0) && (errno!=EINTR)) {
+      tr_err("tids_watcher_thread: error from poll().");
+      continue;
+    }
+    if (pfd[0].revents & POLLIN) {
+      while (read(pool->wake_pipe[0], buf, sizeof(buf))>0)
+        ; /* empty the pipe */
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&(pool->mutex));
+    /* go backward so removing an entry does not move any we have yet to check */
+    for (ii=n_parked; ii-->0; ) {
+      tc=g_ptr_array_index(pool->parked, ii);
+      if (pfd[ii+1].revents!=0) {
+        g_ptr_array_remove_index_fast(pool->parked, ii);
+        tids_worker_dispatch(tids, tc);
+      } else if (0==tids_ms_until(&now, &(tc->idle_deadline))) {
+        tr_debug("tids_watcher_thread: Connection idle after %u requests, closing.", tc->n_served);
+        g_ptr_array_remove_index_fast(pool->parked, ii);
+        talloc_free(tc);
+      }
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+  }
+
+  talloc_free(pfd);
+  return NULL;
+}
+
+/* Stops the workers, waiting for any requests in progress to finish. Connections
+ * still queued or parked are closed without being served. */
+static int tids_worker_pool_destructor(void *obj)
+{
+  TIDS_WORKER_POOL *pool=talloc_get_type_abort(obj, TIDS_WORKER_POOL);
+  unsigned int ii=0;
+  char wake=0;
+
+  pthread_mutex_lock(&(pool->mutex));
+  pool->shutdown=1;
+  pthread_cond_broadcast(&(pool->have_conn));
+  pthread_cond_broadcast(&(pool->have_shed));
+  pthread_mutex_unlock(&(pool->mutex));
+  if (write(pool->wake_pipe[1], &wake, 1)<0)
+    tr_debug("tids_worker_pool_destructor: wake pipe full.");
+
+  for (ii=0; ii<pool->n_threads; ii++)
+    pthread_join(pool->threads[ii], NULL);
+  if (pool->watcher_started)
+    pthread_join(pool->watcher, NULL);
+  if (pool->shedder_started)
+    pthread_join(pool->shedder, NULL);
+
+  for (; pool->n_pending>0; pool->n_pending--) {
+    talloc_free(pool->conn_queue[pool->head]);
+    pool->head=(pool->head+1)%pool->max_pending;
+  }
+  for (; pool->n_shed>0; pool->n_shed--) {
+    talloc_free(pool->shed_queue[pool->shed_head]);
+    pool->shed_head=(pool->shed_head+1)%pool->max_pending;
+  }
+  for (ii=0; ii<pool->parked->len; ii++)
+    talloc_free(g_ptr_array_index(pool->parked, ii));
+  g_ptr_array_unref(pool->parked);
+
+  close(pool->wake_pipe[0]);
+  close(pool->wake_pipe[1]);
+  pthread_cond_destroy(&(pool->have_shed));
+  pthread_cond_destroy(&(pool->have_conn));
+  pthread_mutex_destroy(&(pool->mutex));
+  return 0;
+}
+
+/* Serve connections with a pool of n_threads worker threads instead of forking a
+ * process per connection. Up to max_pending accepted connections wait for a free
+ * worker; connections beyond that, or over the limit set with tids_set_max_in_flight(),
+ * are answered with an error response by a separate thread. A worker serves one
+ * request at a time; between requests, open connections are watched by a separate
+ * thread, so idle clients do not tie up workers. The request handler
+ * will be called from the worker threads, so it must be thread-safe. Call before
+ * accepting any connections. If n_threads is 0, connections are handled by forking.
+ * Returns 0 on success, -1 on error. */
+int tids_start_workers(TIDS_INSTANCE *tids, unsigned int n_threads, size_t max_pending)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TIDS_WORKER_POOL *pool=NULL;
+  int retval=-1;
+
+  if ((tids==NULL) || (tids->workers!=NULL) || ((n_threads>0) && (max_pending==0))) {
+    tr_debug("tids_start_workers: bad parameters.");
+    goto cleanup;
+  }
+
+  if (n_threads==0) {
+    retval=0; /* fork per connection */
+    goto cleanup;
+  }
+
+  pool=talloc_zero(tmp_ctx, TIDS_WORKER_POOL);
+  if (pool==NULL) {
+    tr_crit("tids_start_workers: unable to allocate worker pool.");
+    goto cleanup;
+  }
+  pool->conn_queue=talloc_array(pool, TIDS_CONN *, max_pending);
+  pool->shed_queue=talloc_array(pool, TIDS_CONN *, max_pending);
+  pool->threads=talloc_array(pool, pthread_t, n_threads);
+  if ((pool->conn_queue==NULL) || (pool->shed_queue==NULL) || (pool->threads==NULL)) {
+    tr_crit("tids_start_workers: unable to allocate worker pool.");
+    goto cleanup;
+  }
+  pool->max_pending=max_pending;
+  if (0!=pipe(pool->wake_pipe)) {
+    tr_crit("tids_start_workers: unable to create wake pipe.");
+    goto cleanup;
+  }
+  if ((0!=fcntl(pool->wake_pipe[0], F_SETFL, O_NONBLOCK))
+      || (0!=fcntl(pool->wake_pipe[1], F_SETFL, O_NONBLOCK))) {
+    tr_crit("tids_start_workers: unable to set O_NONBLOCK on wake pipe.");
+    close(pool->wake_pipe[0]);
+    close(pool->wake_pipe[1]);
+    goto cleanup;
+  }
+  if (0!=pthread_mutex_init(&(pool->mutex), NULL)) {
+    tr_crit("tids_start_workers: unable to initialize mutex.");
+    close(pool->wake_pipe[0]);
+    close(pool->wake_pipe[1]);
+    goto cleanup;
+  }
+  if (0!=pthread_cond_init(&(pool->have_conn), NULL)) {
+    tr_crit("tids_start_workers: unable to initialize condition variable.");
+    pthread_mutex_destroy(&(pool->mutex));
+    close(pool->wake_pipe[0]);
+    close(pool->wake_pipe[1]);
+    goto cleanup;
+  }
+  if (0!=pthread_cond_init(&(pool->have_shed), NULL)) {
+    tr_crit("tids_start_workers: unable to initialize condition variable.");
+    pthread_cond_destroy(&(pool->have_conn));
+    pthread_mutex_destroy(&(pool->mutex));
+    close(pool->wake_pipe[0]);
+    close(pool->wake_pipe[1]);
+    goto cleanup;
+  }
+  pool->parked=g_ptr_array_new();
+  /* from here on, the destructor will stop any threads we start */
+  talloc_set_destructor((void *)pool, tids_worker_pool_destructor);
+  tids->workers=pool;
+
+  for (pool->n_threads=0; pool->n_threads<n_threads; pool->n_threads++) {
+    if (0!=pthread_create(&(pool->threads[pool->n_threads]), NULL, tids_worker_thread, tids)) {
+      tr_crit("tids_start_workers: unable to start worker thread %u.", pool->n_threads);
+      tids->workers=NULL; /* the pool will be freed with tmp_ctx */
+      goto cleanup;
+    }
+  }
+  if (0!=pthread_create(&(pool->watcher), NULL, tids_watcher_thread, tids)) {
+    tr_crit("tids_start_workers: unable to start idle connection watcher thread.");
+    tids->workers=NULL;
+    goto cleanup;
+  }
+  pool->watcher_started=1;
+  if (0!=pthread_create(&(pool->shedder), NULL, tids_shed_thread, tids)) {
+    tr_crit("tids_start_workers: unable to start load shedding thread.");
+    tids->workers=NULL;
+    goto cleanup;
+  }
+  pool->shedder_started=1;
+  talloc_steal(tids, pool);
+  tr_info("tids_start_workers: started %u worker threads.", n_threads);
+  retval=0;
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return retval;
+}
+
+static int tids_open_listener(TIDS_INSTANCE *tids, 
+                              TIDS_REQ_FUNC *req_handler,
+                              tids_auth_func *auth_handler,
+                              const char *hostname,
+                              unsigned int port,
+                              void *cookie,
+                              int *fd_out,
+                              size_t max_fd,
+                              int reuseport)
 {
   size_t n_fd=0;
   size_t ii=0;
 
   tids->tids_port = port;
-  n_fd=tids_listen(tids, port, fd_out, max_fd);
+  n_fd=tids_listen(tids, port, fd_out, max_fd, reuseport);
   if (n_fd<=0)
     tr_debug("tids_get_listener: Error opening port %d");
   else {
@@ -462,9 +1163,26 @@ int tids_get_listener(TIDS_INSTANCE *tids,
   return n_fd;
 }
 
-/* Accept and process a connection on a port opened with tids_get_listener() */
+/* Get a listener for tids requests, returns its socket fd. Accept
+ * connections with tids_accept() */
+int tids_get_listener(TIDS_INSTANCE *tids, 
+                      TIDS_REQ_FUNC *req_handler,
+                      tids_auth_func *auth_handler,
+                      const char *hostname,
+                      unsigned int port,
+                      void *cookie,
+                      int *fd_out,
+                      size_t max_fd)
+{
+  return tids_open_listener(tids, req_handler, auth_handler, hostname, port, cookie, fd_out, max_fd, 0);
+}
+
+/* Accept and process a connection on a port opened with tids_get_listener(). If
+ * worker threads were started with tids_start_workers(), the connection is queued
+ * for them. Otherwise, a process is forked to handle it. */
 int tids_accept(TIDS_INSTANCE *tids, int listen)
 {
+  TIDS_CONN *tc=NULL;
   int conn=-1;
   int pid=-1;
 
@@ -473,13 +1191,38 @@ int tids_accept(TIDS_INSTANCE *tids, int listen)
     return 1;
   }
 
+  if (tids->workers!=NULL) {
+    if (NULL==(tc=tids_conn_new(conn))) {
+      tr_crit("tids_accept: unable to allocate connection.");
+      close(conn);
+      return 1;
+    }
+    tids_worker_queue_conn(tids, tc);
+    return 0;
+  }
+
+  /* clean up any processes that have completed  (TBD: move to main loop?) */
+  while (waitpid(-1, 0, WNOHANG) > 0)
+    tids_release(tids);
+
+  /* In the parent, n_in_flight counts child processes. Answering a refused
+   * connection would mean a GSS handshake here, so just close it. */
+  if (!tids_admit(tids)) {
+    tids_count_shed(tids, "too many connections, dropping connection");
+    close(conn);
+    return 1;
+  }
+
   if (0 > (pid = fork())) {
     perror("Error on fork()");
+    tids_release(tids);
+    close(conn);
     return 1;
   }
 
   if (pid == 0) {
     close(listen);
+    tids->n_in_flight = 0; /* the child's count covers only its own requests */
     tids_handle_connection(tids, conn);
     close(conn);
     exit(0); /* exit to kill forked child process */
@@ -487,33 +1230,37 @@ int tids_accept(TIDS_INSTANCE *tids, int listen)
     close(conn);
   }
 
-  /* clean up any processes that have completed  (TBD: move to main loop?) */
-  while (waitpid(-1, 0, WNOHANG) > 0);
-
   return 0;
 }
 
-/* Process tids requests forever. Should not return except on error. */
-#define MAX_SOCKETS 10
-int tids_start (TIDS_INSTANCE *tids, 
-                TIDS_REQ_FUNC *req_handler,
-                tids_auth_func *auth_handler,
-                const char *hostname,
-                unsigned int port,
-                void *cookie)
+/* Accept a connection and handle it in this process. Used by pre-forked workers. */
+static int tids_accept_inline(TIDS_INSTANCE *tids, int listen)
 {
-  int fd[MAX_SOCKETS]={0};
-  size_t n_fd=0;
-  struct pollfd poll_fd[MAX_SOCKETS]={{0}};
-  int ii=0;
+  int conn=-1;
 
-  n_fd=tids_get_listener(tids, req_handler, auth_handler, hostname, port, cookie, fd, MAX_SOCKETS);
-  if (n_fd <= 0) {
-    perror ("Error from tids_listen()");
+  if (0 > (conn = accept(listen, NULL, NULL))) {
+    if ((errno==EAGAIN) || (errno==EWOULDBLOCK))
+      return 0; /* nothing waiting after all */
+    perror("Error from TIDS Server accept()");
     return 1;
   }
 
-  tr_info("Trust Path Query Server starting on host %s:%d.", hostname, port);
+  tids_handle_connection(tids, conn);
+  close(conn);
+  return 0;
+}
+
+/* Poll the listeners and accept connections with accept_func. Returns 0 once
+ * max_req requests have been handled (never, if max_req is 0), 1 on error. */
+#define MAX_SOCKETS 10
+static int tids_poll_loop(TIDS_INSTANCE *tids,
+                          int *fd,
+                          size_t n_fd,
+                          int (*accept_func)(TIDS_INSTANCE *, int),
+                          unsigned int max_req)
+{
+  struct pollfd poll_fd[MAX_SOCKETS]={{0}};
+  int ii=0;
 
   /* set up the poll structs */
   for (ii=0; ii<n_fd; ii++) {
@@ -521,18 +1268,20 @@ int tids_start (TIDS_INSTANCE *tids,
     poll_fd[ii].events=POLLIN;
   }
 
-  while(1) {	/* accept incoming conns until we are stopped */
+  while((max_req==0) || (tids->req_count<max_req)) {	/* accept incoming conns until we are stopped */
     /* clear out events from previous iteration */
     for (ii=0; ii<n_fd; ii++)
       poll_fd[ii].revents=0;
 
     /* wait indefinitely for a connection */
     if (poll(poll_fd, n_fd, -1) < 0) {
+      if (errno==EINTR)
+        continue;
       perror("Error from poll()");
       return 1;
     }
 
-    /* fork handlers for any sockets that have data */
+    /* handle any sockets that have data */
     for (ii=0; ii<n_fd; ii++) {
       if (poll_fd[ii].revents == 0)
         continue;
@@ -543,12 +1292,162 @@ int tids_start (TIDS_INSTANCE *tids,
       }
 
       if (poll_fd[ii].revents & POLLIN) {
-        if (tids_accept(tids, poll_fd[ii].fd))
-          tr_err("tids_start: error in tids_accept().");
+        if (accept_func(tids, poll_fd[ii].fd))
+          tr_err("tids_poll_loop: error accepting connection.");
       }
     }
   }
 
+  return 0;
+}
+
+/* Main for a pre-forked worker process. Opens its own listener, initializes, and serves
+ * requests until it has handled its quota. Never returns. */
+static void tids_prefork_worker(TIDS_INSTANCE *tids,
+                                TIDS_REQ_FUNC *req_handler,
+                                tids_auth_func *auth_handler,
+                                const char *hostname,
+                                unsigned int port,
+                                void *cookie)
+{
+  int fd[MAX_SOCKETS]={0};
+  size_t n_fd=0;
+  int rc=0;
+
+  /* This process also accepts the next connection, so it must not sit waiting
+   * for an idle client to send another request. One request per connection. */
+  tids->idle_timeout=0;
+
+  n_fd=tids_open_listener(tids, req_handler, auth_handler, hostname, port, cookie, fd, MAX_SOCKETS, 1);
+  if (n_fd <= 0) {
+    tr_crit("tids_prefork_worker: unable to open listener.");
+    exit(1);
+  }
+
+  if ((tids->worker_init!=NULL) && (0!=tids->worker_init(tids, cookie))) {
+    tr_crit("tids_prefork_worker: worker initialization failed.");
+    exit(1);
+  }
+
+  tr_debug("tids_prefork_worker: worker %d ready.", getpid());
+  rc=tids_poll_loop(tids, fd, n_fd, tids_accept_inline, tids->prefork_max_req);
+  tr_debug("tids_prefork_worker: worker %d exiting after %d requests.", getpid(), tids->req_count);
+  exit(rc);
+}
+
+/* Keep tids->n_prefork worker processes running, replacing them as they exit. Should not
+ * return except on error. */
+static int tids_prefork_start(TIDS_INSTANCE *tids,
+                              TIDS_REQ_FUNC *req_handler,
+                              tids_auth_func *auth_handler,
+                              const char *hostname,
+                              unsigned int port,
+                              void *cookie)
+{
+  pid_t *workers=talloc_array(NULL, pid_t, tids->n_prefork);
+  pid_t pid=-1;
+  int status=0;
+  unsigned int ii=0;
+
+  if (workers==NULL) {
+    tr_crit("tids_prefork_start: unable to allocate worker list.");
+    return 1;
+  }
+
+  tr_info("Trust Path Query Server starting %u workers on host %s:%d.", tids->n_prefork, hostname, port);
+
+  for (ii=0; ii<tids->n_prefork; ii++)
+    workers[ii]=-1;
+
+  while (1) {
+    /* start any workers that are not running */
+    for (ii=0; ii<tids->n_prefork; ii++) {
+      if (workers[ii]>0)
+        continue;
+
+      if (0 > (workers[ii] = fork())) {
+        perror("Error on fork()");
+        continue;
+      }
+      if (workers[ii] == 0)
+        tids_prefork_worker(tids, req_handler, auth_handler, hostname, port, cookie); /* does not return */
+    }
+
+    /* wait for one to exit */
+    if (0 > (pid = waitpid(-1, &status, 0))) {
+      if (errno==EINTR)
+        continue;
+      perror("Error from waitpid()");
+      break;
+    }
+
+    for (ii=0; ii<tids->n_prefork; ii++) {
+      if (workers[ii]==pid)
+        workers[ii]=-1;
+    }
+
+    /* Workers exit with status 0 when they reach their request limit. Otherwise, something
+     * went wrong; pause so a persistent failure does not turn into a fork loop. */
+    if ((!WIFEXITED(status)) || (WEXITSTATUS(status)!=0)) {
+      tr_notice("tids_prefork_start: worker %d exited abnormally, restarting.", pid);
+      sleep(1);
+    }
+  }
+
+  talloc_free(workers);
+  return 1;
+}
+
+/* Use pre-forked worker processes in tids_start(). Each of the n_workers processes opens its
+ * own listener with SO_REUSEPORT, calls worker_init (if not NULL) with the tids_start() cookie,
+ * then serves connections itself, one request per connection (the idle timeout is ignored).
+ * A worker is replaced after it serves max_requests requests (0 for no limit). Connections
+ * still in a retiring worker's accept queue are dropped. Set n_workers to 0 to fork a process
+ * per connection. Returns 0 on success, -1 on error. */
+int tids_set_prefork(TIDS_INSTANCE *tids,
+                     unsigned int n_workers,
+                     unsigned int max_requests,
+                     tids_worker_init_func *worker_init)
+{
+  if (tids==NULL)
+    return -1;
+
+#ifndef SO_REUSEPORT
+  if (n_workers>0) {
+    tr_err("tids_set_prefork: SO_REUSEPORT not supported on this platform.");
+    return -1;
+  }
+#endif
+
+  tids->n_prefork=n_workers;
+  tids->prefork_max_req=max_requests;
+  tids->worker_init=worker_init;
+  return 0;
+}
+
+/* Process tids requests forever. Should not return except on error. */
+int tids_start (TIDS_INSTANCE *tids, 
+                TIDS_REQ_FUNC *req_handler,
+                tids_auth_func *auth_handler,
+                const char *hostname,
+                unsigned int port,
+                void *cookie)
+{
+  int fd[MAX_SOCKETS]={0};
+  size_t n_fd=0;
+
+  if (tids->n_prefork>0)
+    return tids_prefork_start(tids, req_handler, auth_handler, hostname, port, cookie);
+
+  n_fd=tids_get_listener(tids, req_handler, auth_handler, hostname, port, cookie, fd, MAX_SOCKETS);
+  if (n_fd <= 0) {
+    perror ("Error from tids_listen()");
+    return 1;
+  }
+
+  tr_info("Trust Path Query Server starting on host %s:%d.", hostname, port);
+
+  tids_poll_loop(tids, fd, n_fd, tids_accept, 0);
   return 1;	/* should never get here, loops "forever" */
 }
 #undef MAX_SOCKETS
@@ -559,5 +1458,5 @@ void tids_destroy (TIDS_INSTANCE *tids)
   tr_log_close();
 
   if (tids)
-    free(tids);
+    talloc_free(tids);
 }
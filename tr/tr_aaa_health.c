@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <glib.h>
+
+#include <tr_aaa_health.h>
+#include <tr_debug.h>
+
+static int tr_aaa_scoreboard_destructor(void *obj)
+{
+  TR_AAA_SCOREBOARD *sb=talloc_get_type_abort(obj, TR_AAA_SCOREBOARD);
+  if (sb->servers!=NULL)
+    g_hash_table_destroy(sb->servers);
+  pthread_mutex_destroy(&(sb->mutex));
+  return 0;
+}
+
+TR_AAA_SCOREBOARD *tr_aaa_scoreboard_new(TALLOC_CTX *mem_ctx,
+                                         unsigned int failure_threshold,
+                                         unsigned int retry_interval)
+{
+  TR_AAA_SCOREBOARD *sb=talloc(mem_ctx, TR_AAA_SCOREBOARD);
+
+  if (sb==NULL)
+    return NULL;
+
+  /* entries are talloc children of sb, so the table does not free them */
+  sb->servers=g_hash_table_new(g_str_hash, g_str_equal);
+  if ((sb->servers==NULL) || (0!=pthread_mutex_init(&(sb->mutex), NULL))) {
+    if (sb->servers!=NULL)
+      g_hash_table_destroy(sb->servers);
+    talloc_free(sb);
+    return NULL;
+  }
+  sb->failure_threshold=failure_threshold;
+  sb->retry_interval=retry_interval;
+  talloc_set_destructor((void *)sb, tr_aaa_scoreboard_destructor);
+  return sb;
+}
+
+void tr_aaa_scoreboard_free(TR_AAA_SCOREBOARD *sb)
+{
+  talloc_free(sb);
+}
+
+/* Must hold the scoreboard mutex. Returns NULL if the server is unknown and create is 0,
+ * or if allocation fails. */
+static TR_AAA_HEALTH *tr_aaa_scoreboard_get(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname, int create)
+{
+  TR_AAA_HEALTH *health=NULL;
+  char *key=talloc_strndup(NULL, hostname->buf, hostname->len);
+
+  if (key==NULL)
+    return NULL;
+
+  health=g_hash_table_lookup(sb->servers, key);
+  if ((health==NULL) && create) {
+    health=talloc(sb, TR_AAA_HEALTH);
+    if (health!=NULL) {
+      health->hostname=talloc_steal(health, key);
+      key=NULL;
+      health->latency=0;
+      health->error_rate=0;
+      health->n_samples=0;
+      health->next_sample=0;
+      health->consecutive_failures=0;
+      health->circuit=TR_AAA_CIRCUIT_CLOSED;
+      health->opened=0;
+      health->trial_in_flight=0;
+      g_hash_table_insert(sb->servers, health->hostname, health);
+    }
+  }
+  talloc_free(key);
+  return health;
+}
+
+/* Returns nonzero if a request may be sent to the server now. If this lets the
+ * trial request through a half-open circuit, the caller must send it and report
+ * the outcome. */
+int tr_aaa_scoreboard_allow(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname)
+{
+  TR_AAA_HEALTH *health=NULL;
+  time_t now=time(NULL);
+  int allow=1;
+
+  pthread_mutex_lock(&(sb->mutex));
+  health=tr_aaa_scoreboard_get(sb, hostname, 0);
+  if (health!=NULL) {
+    switch (health->circuit) {
+    case TR_AAA_CIRCUIT_CLOSED:
+      allow=1;
+      break;
+
+    case TR_AAA_CIRCUIT_OPEN:
+      if (now < health->opened+sb->retry_interval) {
+        allow=0;
+        break;
+      }
+      tr_notice("tr_aaa_scoreboard_allow: circuit for AAA server %s half-open, sending trial request.",
+                health->hostname);
+      health->circuit=TR_AAA_CIRCUIT_HALF_OPEN;
+      /* fall through */
+
+    case TR_AAA_CIRCUIT_HALF_OPEN:
+      /* Allow one trial at a time. If its outcome is never reported (e.g., the
+       * request was dropped), allow another after the retry interval. */
+      if (health->trial_in_flight && (now < health->opened+sb->retry_interval)) {
+        allow=0;
+      } else {
+        health->trial_in_flight=1;
+        health->opened=now;
+        allow=1;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(sb->mutex));
+  return allow;
+}
+
+/* Returns nonzero if tr_aaa_scoreboard_allow() would let a request through to
+ * the server now. Unlike that function, does not take a half-open circuit's
+ * trial slot, so it is safe to use for servers that might not be contacted. */
+int tr_aaa_scoreboard_available(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname)
+{
+  TR_AAA_HEALTH *health=NULL;
+  time_t now=time(NULL);
+  int available=1;
+
+  pthread_mutex_lock(&(sb->mutex));
+  health=tr_aaa_scoreboard_get(sb, hostname, 0);
+  if (health!=NULL) {
+    switch (health->circuit) {
+    case TR_AAA_CIRCUIT_CLOSED:
+      available=1;
+      break;
+
+    case TR_AAA_CIRCUIT_OPEN:
+      available=(now >= health->opened+sb->retry_interval);
+      break;
+
+    case TR_AAA_CIRCUIT_HALF_OPEN:
+      available=!(health->trial_in_flight && (now < health->opened+sb->retry_interval));
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(sb->mutex));
+  return available;
+}
+
+/* Record the outcome of a request to the server. Latency is in seconds. */
+void tr_aaa_scoreboard_report(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname, int success, double latency)
+{
+  TR_AAA_HEALTH *health=NULL;
+
+  pthread_mutex_lock(&(sb->mutex));
+  if (NULL==(health=tr_aaa_scoreboard_get(sb, hostname, 1))) {
+    pthread_mutex_unlock(&(sb->mutex));
+    tr_notice("tr_aaa_scoreboard_report: unable to allocate scoreboard entry.");
+    return;
+  }
+
+  health->latency+=TR_AAA_HEALTH_EWMA_WEIGHT*(latency-health->latency);
+  health->error_rate+=TR_AAA_HEALTH_EWMA_WEIGHT*((success?0.0:1.0)-health->error_rate);
+
+  if (success) {
+    health->samples[health->next_sample]=latency;
+    health->next_sample=(health->next_sample+1)%TR_AAA_HEALTH_SAMPLES;
+    if (health->n_samples<TR_AAA_HEALTH_SAMPLES)
+      health->n_samples++;
+
+    health->consecutive_failures=0;
+    if (health->circuit!=TR_AAA_CIRCUIT_CLOSED)
+      tr_notice("tr_aaa_scoreboard_report: circuit for AAA server %s closed.", health->hostname);
+    health->circuit=TR_AAA_CIRCUIT_CLOSED;
+    health->trial_in_flight=0;
+  } else {
+    health->consecutive_failures++;
+    if ((health->circuit==TR_AAA_CIRCUIT_HALF_OPEN) ||
+        ((health->circuit==TR_AAA_CIRCUIT_CLOSED) &&
+         (sb->failure_threshold>0) &&
+         (health->consecutive_failures>=sb->failure_threshold))) {
+      tr_notice("tr_aaa_scoreboard_report: circuit for AAA server %s opened after %u failures.",
+                health->hostname, health->consecutive_failures);
+      health->circuit=TR_AAA_CIRCUIT_OPEN;
+      health->opened=time(NULL);
+      health->trial_in_flight=0;
+    }
+  }
+  pthread_mutex_unlock(&(sb->mutex));
+}
+
+/* Lower is better. Servers we have not heard from yet score 0 so they get tried. */
+double tr_aaa_scoreboard_score(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname)
+{
+  TR_AAA_HEALTH *health=NULL;
+  double score=0;
+
+  pthread_mutex_lock(&(sb->mutex));
+  health=tr_aaa_scoreboard_get(sb, hostname, 0);
+  if (health!=NULL)
+    score=health->latency*(1.0+4.0*health->error_rate);
+  pthread_mutex_unlock(&(sb->mutex));
+  return score;
+}
+
+static int tr_aaa_health_cmp_double(const void *a, const void *b)
+{
+  double da=*(const double *)a;
+  double db=*(const double *)b;
+  return (da>db)-(da<db);
+}
+
+/* Estimate the given percentile (0-100) of the server's recent response times,
+ * in seconds. Returns a negative value if there are no samples yet. */
+double tr_aaa_scoreboard_percentile(TR_AAA_SCOREBOARD *sb, TR_NAME *hostname, unsigned int percentile)
+{
+  TR_AAA_HEALTH *health=NULL;
+  double sorted[TR_AAA_HEALTH_SAMPLES];
+  unsigned int n=0;
+  unsigned int idx=0;
+
+  pthread_mutex_lock(&(sb->mutex));
+  health=tr_aaa_scoreboard_get(sb, hostname, 0);
+  if (health!=NULL) {
+    n=health->n_samples;
+    memcpy(sorted, health->samples, n*sizeof(double));
+  }
+  pthread_mutex_unlock(&(sb->mutex));
+
+  if (n==0)
+    return -1;
+
+  if (percentile>100)
+    percentile=100;
+  qsort(sorted, n, sizeof(double), tr_aaa_health_cmp_double);
+  idx=(percentile*n+99)/100; /* nearest rank */
+  if (idx>0)
+    idx--;
+  return sorted[idx];
+}
+
+/* Fill in selected with the servers from aaa_servers that should be contacted,
+ * best first, skipping servers whose circuit is open. Returns the number of
+ * servers selected, at most max_selected. Call tr_aaa_scoreboard_allow() for
+ * each server just before actually sending it a request. */
+size_t tr_aaa_scoreboard_select(TR_AAA_SCOREBOARD *sb,
+                                TR_AAA_SERVER *aaa_servers,
+                                TR_AAA_SERVER **selected,
+                                size_t max_selected)
+{
+  double *score=talloc_array(NULL, double, max_selected);
+  double this_score=0;
+  TR_AAA_SERVER_ITER *iter=tr_aaa_server_iter_new(score);
+  TR_AAA_SERVER *aaa=NULL;
+  size_t n_selected=0;
+  size_t ii=0;
+
+  if ((score==NULL) || (iter==NULL)) {
+    talloc_free(score);
+    return 0;
+  }
+
+  for (aaa=tr_aaa_server_iter_first(iter, aaa_servers);
+       (aaa!=NULL) && (n_selected<max_selected);
+       aaa=tr_aaa_server_iter_next(iter)) {
+    if (!tr_aaa_scoreboard_available(sb, aaa->hostname)) {
+      tr_debug("tr_aaa_scoreboard_select: skipping AAA server %.*s, circuit open.",
+               aaa->hostname->len, aaa->hostname->buf);
+      continue;
+    }
+
+    /* insertion sort, these lists are short */
+    this_score=tr_aaa_scoreboard_score(sb, aaa->hostname);
+    for (ii=n_selected; (ii>0) && (score[ii-1]>this_score); ii--) {
+      selected[ii]=selected[ii-1];
+      score[ii]=score[ii-1];
+    }
+    selected[ii]=aaa;
+    score[ii]=this_score;
+    n_selected++;
+  }
+  talloc_free(score); /* also frees iter */
+  return n_selected;
+}
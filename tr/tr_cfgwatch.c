@@ -221,8 +221,11 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
     retval=1; goto cleanup;
   }
 
-  /* apply new configuration (nulls new, manages context ownership) */
+  /* apply new configuration (nulls new, manages context ownership). Hold the
+   * lock until the callback has brought everything in line with the new config. */
+  tr_cfg_mgr_write_lock(cfgwatch->cfg_mgr);
   if (TR_CFG_SUCCESS != (rc = tr_apply_new_config(cfgwatch->cfg_mgr))) {
+    tr_cfg_mgr_unlock(cfgwatch->cfg_mgr);
     tr_debug("tr_read_and_apply_config: Error applying configuration, rc = %d.", rc);
     retval=1; goto cleanup;
   }
@@ -231,6 +234,7 @@ int tr_read_and_apply_config(TR_CFGWATCH *cfgwatch)
   tr_debug("tr_read_and_apply_config: calling update callback function.");
   if (cfgwatch->update_cb!=NULL)
     cfgwatch->update_cb(cfgwatch->cfg_mgr->active, cfgwatch->update_cookie);
+  tr_cfg_mgr_unlock(cfgwatch->cfg_mgr);
 
   /* give ownership of the new_fstat_list to caller's context */
   if (cfgwatch->fstat_list != NULL) {
@@ -48,6 +48,7 @@
 #include <tr_mq.h>
 #include <tr_util.h>
 #include <tr_tid.h>
+#include <tr_aaa_health.h>
 
 /* Structure to hold data for the tid response callback */
 typedef struct tr_resp_cookie {
@@ -55,11 +56,25 @@ typedef struct tr_resp_cookie {
   TID_RESP *resp;
 } TR_RESP_COOKIE;
 
+/* Fixed set of threads that forward requests to AAA servers. Jobs
+ * are queued on an mq and picked up by whichever thread is free. A
+ * pool with no threads starts a thread for each job instead; see
+ * tr_tids_fwd_queue(). */
+typedef struct tr_tids_fwd_pool {
+  TR_MQ *jobs;
+  pthread_t *threads;
+  unsigned int n_threads;
+} TR_TIDS_FWD_POOL;
+
 /* hold a tids instance and a config manager */
 struct tr_tids_event_cookie {
   TIDS_INSTANCE *tids;
   TR_CFG_MGR *cfg_mgr;
   TRPS_INSTANCE *trps;
+  TIDC_POOL *pool; /* connections to AAA servers */
+  struct event *pool_sweep_ev;
+  TR_TIDS_FWD_POOL *fwd_pool;
+  TR_AAA_SCOREBOARD *scoreboard; /* health of the AAA servers */
 };
 
 static void tr_tidc_resp_handler(TIDC_INSTANCE *tidc, 
@@ -79,14 +94,17 @@ static void tr_tidc_resp_handler(TIDC_INSTANCE *tidc,
   cookie->resp=tid_resp_dup(cookie, resp);
 }
 
-/* data for AAA req forwarding threads */
+/* data for a request to a single AAA server, handled by a forwarding thread */
 struct tr_tids_fwd_cookie {
   int thread_id;
   pthread_mutex_t mutex; /* lock on the mq (separate from the locking within the mq, see below) */
   TR_MQ *mq; /* messages from thread to main process; set to NULL to disable response */
   TR_NAME *aaa_hostname;
-  DH *dh_params;
-  TID_REQ *fwd_req; /* the req to duplicate */
+  TIDC_POOL *pool; /* shared with other threads, do not free */
+  struct timespec deadline; /* give up on the AAA server at this time (CLOCK_MONOTONIC) */
+  GBytes *req_buf; /* encoded request, shared by all the AAA servers' cookies */
+  TR_NAME *request_id;
+  TR_AAA_SCOREBOARD *scoreboard; /* shared with other threads, do not free */
 };
 
 static int tr_tids_fwd_cookie_destructor(void *obj)
@@ -94,11 +112,28 @@ static int tr_tids_fwd_cookie_destructor(void *obj)
   struct tr_tids_fwd_cookie *c=talloc_get_type_abort(obj, struct tr_tids_fwd_cookie);
   if (c->aaa_hostname!=NULL)
     tr_free_name(c->aaa_hostname);
-  if (c->dh_params!=NULL)
-    tr_destroy_dh_params(c->dh_params);
+  if (c->req_buf!=NULL)
+    g_bytes_unref(c->req_buf);
+  if (c->request_id!=NULL)
+    tr_free_name(c->request_id);
   return 0;
 }
 
+/* Request IDs for forwarded requests. These must differ from request to
+ * request, but are shared by the copies sent to each AAA server. */
+static unsigned int tr_tids_fwd_req_id=0;
+static pthread_mutex_t tr_tids_fwd_req_id_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static TR_NAME *tr_tids_fwd_next_req_id(void)
+{
+  char req_id[16];
+
+  pthread_mutex_lock(&tr_tids_fwd_req_id_mutex);
+  snprintf(req_id, sizeof(req_id), "%u", ++tr_tids_fwd_req_id);
+  pthread_mutex_unlock(&tr_tids_fwd_req_id_mutex);
+  return tr_new_name(req_id);
+}
+
 /* Block until we get the lock, returns 0 on success.
  * The mutex is used to protect changes to the mq pointer in
  * a thread's cookie. The master thread sets this to null to indicate
@@ -124,96 +159,321 @@ static int tr_tids_fwd_release_mutex(struct tr_tids_fwd_cookie *cookie)
 /* values for messages */
 #define TR_TID_MQMSG_SUCCESS "tid success"
 #define TR_TID_MQMSG_FAILURE "tid failure"
+#define TR_TID_MQMSG_FWD_JOB "tid fwd job"
+#define TR_TID_MQMSG_FWD_EXIT "tid fwd exit"
+
+/* seconds an idle forwarding thread waits for a job before checking again */
+#define TR_TID_FWD_IDLE_WAIT 60
+
+/* seconds to wait before hedging to another AAA server if we know nothing
+ * about the first one's response time */
+#define TR_TID_HEDGE_DEFAULT_DELAY 0.5
 
-/* Thread main for sending and receiving a request to a single AAA server */
-static void *tr_tids_req_fwd_thread(void *arg)
+/* Compare two times, returns <0, 0, or >0 like strcmp */
+static int tr_tids_ts_cmp(struct timespec *t1, struct timespec *t2)
+{
+  if (t1->tv_sec!=t2->tv_sec)
+    return (t1->tv_sec<t2->tv_sec)?-1:1;
+  if (t1->tv_nsec!=t2->tv_nsec)
+    return (t1->tv_nsec<t2->tv_nsec)?-1:1;
+  return 0;
+}
+
+/* Send a request to a single AAA server and receive the response. Takes
+ * responsibility for freeing args. */
+static void tr_tids_req_fwd(struct tr_tids_fwd_cookie *args)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  struct tr_tids_fwd_cookie *args=talloc_get_type_abort(arg, struct tr_tids_fwd_cookie);
-  TIDC_INSTANCE *tidc=tidc_create();
+  TIDC_INSTANCE *tidc=NULL;
   TR_MQ_MSG *msg=NULL;
   TR_RESP_COOKIE *cookie=NULL;
+  struct timespec ts_start={0}, ts_end={0};
+  int abandoned=0;
   int rc=0;
   int success=0;
 
   talloc_steal(tmp_ctx, args); /* take responsibility for the cookie */
 
+  /* If the request handler has already given up on this request (e.g., it
+   * waited in the job queue past the timeout), don't bother sending it. */
+  if (0==tr_tids_fwd_get_mutex(args)) {
+    abandoned=(args->mq==NULL);
+    tr_tids_fwd_release_mutex(args);
+  }
+  if (abandoned) {
+    tr_debug("tr_tids_req_fwd: request to AAA server %d abandoned, not sending.", args->thread_id);
+    talloc_free(tmp_ctx);
+    return;
+  }
+
+  tidc=tidc_create();
   if (tidc!=NULL)
     talloc_steal(tmp_ctx, tidc);
 
   /* create the cookie we will use for our response */
   cookie=talloc(tmp_ctx, TR_RESP_COOKIE);
   if (cookie==NULL) {
-    tr_notice("tr_tids_req_fwd_thread: unable to allocate response cookie.");
+    tr_notice("tr_tids_req_fwd: unable to allocate response cookie.");
     success=0;
     goto cleanup;
   }
   cookie->thread_id=args->thread_id;
-  tr_debug("tr_tids_req_fwd_thread: thread %d started.", cookie->thread_id);
+  tr_debug("tr_tids_req_fwd: forwarding to AAA server %d.", cookie->thread_id);
 
   /* Create a TID client instance */
   if (tidc==NULL) {
-    tr_crit("tr_tids_req_fwd_thread: Unable to allocate TIDC instance.");
+    tr_crit("tr_tids_req_fwd: Unable to allocate TIDC instance.");
     /*tids_send_err_response(tids, orig_req, "Memory allocation failure");*/
     /* TODO: encode reason for failure */
     success=0;
     goto cleanup;
   }
 
-  /* Set-up TID connection */
-  if (-1==(args->fwd_req->conn = tidc_open_connection(tidc, 
-                                                      args->aaa_hostname->buf,
-                                                      TID_PORT, /* TODO: make this configurable */
-                                                     &(args->fwd_req->gssctx)))) {
-    tr_notice("tr_tids_req_fwd_thread: Error in tidc_open_connection.");
-    /* tids_send_err_response(tids, orig_req, "Can't open connection to next hop TIDS"); */
-    /* TODO: encode reason for failure */
+  /* Send a TID request over a pooled connection. The deadline bounds the
+   * connect and every read and write, so a hung server cannot keep this thread. */
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  if (tr_tids_ts_cmp(&ts_start, &(args->deadline))>=0) {
+    /* expired while queued; that says nothing about the server */
+    tr_notice("tr_tids_req_fwd: request to AAA server %d expired before it was sent.", cookie->thread_id);
     success=0;
     goto cleanup;
-  };
-  tr_debug("tr_tids_req_fwd_thread: thread %d opened TID connection to %s.",
-           cookie->thread_id,
-           args->aaa_hostname->buf);
-
-  /* Send a TID request. */
-  if (0 > (rc = tidc_fwd_request(tidc, args->fwd_req, tr_tidc_resp_handler, (void *)cookie))) {
-    tr_notice("Error from tidc_fwd_request, rc = %d.", rc);
+  }
+  rc = tidc_pool_fwd_request(args->pool,
+                             tidc,
+                             args->aaa_hostname->buf,
+                             TID_PORT, /* TODO: make this configurable */
+                             &(args->deadline),
+                             args->req_buf,
+                             args->request_id,
+                             tr_tidc_resp_handler,
+                             (void *)cookie);
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  /* Any response, even an error, means the server is up. */
+  tr_aaa_scoreboard_report(args->scoreboard,
+                           args->aaa_hostname,
+                           (rc>=0),
+                           (ts_end.tv_sec-ts_start.tv_sec)+(ts_end.tv_nsec-ts_start.tv_nsec)/1e9);
+  if (rc < 0) {
+    tr_notice("Error from tidc_pool_fwd_request, rc = %d.", rc);
+    /* TODO: encode reason for failure */
     success=0;
     goto cleanup;
   }
   /* cookie->resp should now contain our copy of the response */
   success=1;
-  tr_debug("tr_tids_req_fwd_thread: thread %d received response.");
+  tr_debug("tr_tids_req_fwd: AAA server %d sent response.", cookie->thread_id);
 
 cleanup:
   /* Notify parent thread of the response, if it's still listening. */
   if (0!=tr_tids_fwd_get_mutex(args)) {
-    tr_notice("tr_tids_req_fwd_thread: thread %d unable to acquire mutex.", cookie->thread_id);
+    tr_notice("tr_tids_req_fwd: job %d unable to acquire mutex.", cookie->thread_id);
   } else if (NULL!=args->mq) {
     /* mq is still valid, so we can queue our response */
-    tr_debug("tr_tids_req_fwd_thread: thread %d using valid msg queue.", cookie->thread_id);
+    tr_debug("tr_tids_req_fwd: job %d using valid msg queue.", cookie->thread_id);
     if (success)
       msg=tr_mq_msg_new(tmp_ctx, TR_TID_MQMSG_SUCCESS, TR_MQ_PRIO_NORMAL);
     else
       msg=tr_mq_msg_new(tmp_ctx, TR_TID_MQMSG_FAILURE, TR_MQ_PRIO_NORMAL);
 
     if (msg==NULL)
-      tr_notice("tr_tids_req_fwd_thread: thread %d unable to allocate response msg.", cookie->thread_id);
+      tr_notice("tr_tids_req_fwd: job %d unable to allocate response msg.", cookie->thread_id);
 
     tr_mq_msg_set_payload(msg, (void *)cookie, NULL);
     if (NULL!=cookie)
       talloc_steal(msg, cookie); /* attach this to the msg so we can forget about it */
     tr_mq_add(args->mq, msg);
     talloc_steal(NULL, args); /* take out of our tmp_ctx; master thread now responsible for freeing */
-    tr_debug("tr_tids_req_fwd_thread: thread %d queued response message.", cookie->thread_id);
+    tr_debug("tr_tids_req_fwd: job %d queued response message.", cookie->thread_id);
     if (0!=tr_tids_fwd_release_mutex(args))
-      tr_notice("tr_tids_req_fwd_thread: Error releasing mutex.");
+      tr_notice("tr_tids_req_fwd: Error releasing mutex.");
   }
 
   talloc_free(tmp_ctx);
+}
+
+/* Thread main for the forwarding threads */
+static void *tr_tids_fwd_thread(void *arg)
+{
+  TR_MQ *jobs=(TR_MQ *)arg;
+  TR_MQ_MSG *msg=NULL;
+  struct tr_tids_fwd_cookie *job=NULL;
+  struct timespec ts_abort={0};
+
+  while (1) {
+    if (0!=tr_mq_pop_timeout(TR_TID_FWD_IDLE_WAIT, &ts_abort)) {
+      tr_crit("tr_tids_fwd_thread: unable to read clock, exiting.");
+      break;
+    }
+    if (NULL==(msg=tr_mq_pop(jobs, &ts_abort)))
+      continue;
+
+    if (0==strcmp(tr_mq_msg_get_message(msg), TR_TID_MQMSG_FWD_EXIT)) {
+      tr_mq_msg_free(msg);
+      break;
+    }
+
+    job=talloc_get_type_abort(tr_mq_msg_get_payload(msg), struct tr_tids_fwd_cookie);
+    talloc_steal(NULL, job); /* take the job out of the msg before freeing it */
+    tr_mq_msg_free(msg);
+    tr_tids_req_fwd(job);
+  }
+  return NULL;
+}
+
+/* Thread main for a single job, when the pool has no threads of its own */
+static void *tr_tids_fwd_job_thread(void *arg)
+{
+  tr_tids_req_fwd(talloc_get_type_abort(arg, struct tr_tids_fwd_cookie));
   return NULL;
 }
 
+/* Tell the forwarding threads to exit, and wait for them. Jobs queued
+ * ahead of the exit messages are still handled. */
+static int tr_tids_fwd_pool_destructor(void *obj)
+{
+  TR_TIDS_FWD_POOL *pool=talloc_get_type_abort(obj, TR_TIDS_FWD_POOL);
+  TR_MQ_MSG *msg=NULL;
+  unsigned int ii=0;
+
+  for (ii=0; ii<pool->n_threads; ii++) {
+    if (NULL!=(msg=tr_mq_msg_new(NULL, TR_TID_MQMSG_FWD_EXIT, TR_MQ_PRIO_NORMAL)))
+      tr_mq_add(pool->jobs, msg);
+  }
+  for (ii=0; ii<pool->n_threads; ii++)
+    pthread_join(pool->threads[ii], NULL);
+  return 0;
+}
+
+/* Start n_threads forwarding threads. Returns NULL on failure. */
+static TR_TIDS_FWD_POOL *tr_tids_fwd_pool_new(TALLOC_CTX *mem_ctx, unsigned int n_threads)
+{
+  TR_TIDS_FWD_POOL *pool=talloc(mem_ctx, TR_TIDS_FWD_POOL);
+
+  if (pool==NULL)
+    return NULL;
+
+  pool->n_threads=0;
+  pool->jobs=tr_mq_new(pool);
+  pool->threads=talloc_array(pool, pthread_t, n_threads);
+  if ((pool->jobs==NULL) || (pool->threads==NULL)) {
+    talloc_free(pool);
+    return NULL;
+  }
+  talloc_set_destructor((void *)pool, tr_tids_fwd_pool_destructor);
+
+  for (pool->n_threads=0; pool->n_threads<n_threads; pool->n_threads++) {
+    if (0!=pthread_create(&(pool->threads[pool->n_threads]), NULL, tr_tids_fwd_thread, (void *)(pool->jobs))) {
+      tr_crit("tr_tids_fwd_pool_new: unable to start forwarding thread %d.", pool->n_threads);
+      talloc_free(pool); /* stops the threads we did start */
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+/* Queue a request to a single AAA server for the forwarding threads. The
+ * returned cookie belongs to the job; the caller may only touch it as described
+ * for tr_tids_fwd_get_mutex(). Returns NULL on failure. */
+static struct tr_tids_fwd_cookie *tr_tids_fwd_queue(TALLOC_CTX *mem_ctx,
+                                                    struct tr_tids_event_cookie *event_cookie,
+                                                    int thread_id,
+                                                    TR_MQ *mq,
+                                                    TR_NAME *aaa_hostname,
+                                                    GBytes *req_buf,
+                                                    TR_NAME *request_id,
+                                                    struct timespec *deadline)
+{
+  struct tr_tids_fwd_cookie *fwd_cookie=NULL;
+  TR_MQ_MSG *msg=NULL;
+  pthread_t thread;
+
+  tr_debug("tr_tids_fwd_queue: Preparing to forward to AAA server %d.", thread_id);
+
+  fwd_cookie=talloc_zero(mem_ctx, struct tr_tids_fwd_cookie);
+  if (fwd_cookie==NULL) {
+    tr_notice("tr_tids_fwd_queue: unable to allocate cookie for AAA server %d.", thread_id);
+    return NULL;
+  }
+  talloc_set_destructor((void *)fwd_cookie, tr_tids_fwd_cookie_destructor);
+  /* fill in the cookie. To ensure the forwarding thread has valid data even if we exit
+   * first and abandon it, duplicate anything pointed to (except the mq and pool). */
+  fwd_cookie->thread_id=thread_id;
+  if (0!=pthread_mutex_init(&(fwd_cookie->mutex), NULL)) {
+    tr_notice("tr_tids_fwd_queue: unable to init mutex for AAA server %d.", thread_id);
+    talloc_free(fwd_cookie);
+    return NULL;
+  }
+  fwd_cookie->mq=mq;
+  fwd_cookie->aaa_hostname=tr_dup_name(aaa_hostname);
+  fwd_cookie->pool=event_cookie->pool;
+  fwd_cookie->deadline=*deadline;
+  fwd_cookie->req_buf=g_bytes_ref(req_buf);
+  fwd_cookie->request_id=tr_dup_name(request_id);
+  fwd_cookie->scoreboard=event_cookie->scoreboard;
+  tr_debug("tr_tids_fwd_queue: cookie %d initialized.", thread_id);
+
+  /* A forked TID server process has none of the pool's threads, only the one
+   * that called fork(). Give the job a thread of its own, which also keeps it
+   * away from the job queue's lock, whose state was copied from the parent. */
+  if (event_cookie->fwd_pool->n_threads==0) {
+    talloc_steal(NULL, fwd_cookie); /* the job thread takes responsibility for it */
+    if ((0!=pthread_create(&thread, NULL, tr_tids_fwd_job_thread, (void *)fwd_cookie))
+        || (0!=pthread_detach(thread))) {
+      tr_notice("tr_tids_fwd_queue: unable to start thread for AAA server %d.", thread_id);
+      talloc_free(fwd_cookie);
+      return NULL;
+    }
+    tr_debug("tr_tids_fwd_queue: request for AAA server %d started.", thread_id);
+    return fwd_cookie;
+  }
+
+  msg=tr_mq_msg_new(NULL, TR_TID_MQMSG_FWD_JOB, TR_MQ_PRIO_NORMAL);
+  if (msg==NULL) {
+    tr_notice("tr_tids_fwd_queue: unable to allocate job for AAA server %d.", thread_id);
+    talloc_free(fwd_cookie);
+    return NULL;
+  }
+  /* Move the cookie into the job. Once queued, the forwarding thread that picks it
+   * up is responsible for freeing it until it queues a response. If we did not do
+   * this, the possibility exists that the request handler exits, freeing the cookie,
+   * while a forwarding thread is using it. */
+  tr_mq_msg_set_payload(msg, (void *)fwd_cookie, NULL);
+  talloc_steal(msg, fwd_cookie);
+  tr_mq_add(event_cookie->fwd_pool->jobs, msg);
+  tr_debug("tr_tids_fwd_queue: request for AAA server %d queued.", thread_id);
+  return fwd_cookie;
+}
+
+/* Set *ts_hedge to delay seconds from now, but no later than *ts_abort.
+ * Uses the same clock as tr_mq_pop(). */
+static void tr_tids_hedge_deadline(double delay, struct timespec *ts_abort, struct timespec *ts_hedge)
+{
+  if (0!=tr_mq_pop_timeout_ms((unsigned long)(delay*1000), ts_hedge)) {
+    *ts_hedge=*ts_abort;
+    return;
+  }
+  if (tr_tids_ts_cmp(ts_hedge, ts_abort)>0)
+    *ts_hedge=*ts_abort;
+}
+
+/* Before sending to selected[idx], take its circuit's half-open trial slot if it
+ * needs one. Servers that no longer let a request through (e.g., another request
+ * took the trial) are dropped from the list and their names freed. Returns nonzero
+ * if selected[idx] may be sent the request. */
+static int tr_tids_claim_aaa(TR_AAA_SCOREBOARD *sb, TR_NAME **selected, size_t idx, size_t *n_selected)
+{
+  while (idx<*n_selected) {
+    if (tr_aaa_scoreboard_allow(sb, selected[idx]))
+      return 1;
+    tr_debug("tr_tids_claim_aaa: skipping AAA server %.*s, circuit open.",
+             selected[idx]->len, selected[idx]->buf);
+    tr_free_name(selected[idx]);
+    memmove(&(selected[idx]), &(selected[idx+1]), (*n_selected-idx-1)*sizeof(*selected));
+    (*n_selected)--;
+  }
+  return 0;
+}
+
 /* Merges r2 into r1 if they are compatible. */
 static TID_RC tr_tids_merge_resps(TID_RESP *r1, TID_RESP *r2)
 {
@@ -236,15 +496,17 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
                                void *cookie_in)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
-  TR_AAA_SERVER *aaa_servers=NULL, *this_aaa=NULL;
+  TR_AAA_SERVER *aaa_servers=NULL;
+  TR_AAA_SERVER *selected_aaa[TR_TID_MAX_AAA_SERVERS]={NULL};
+  TR_NAME *selected_host[TR_TID_MAX_AAA_SERVERS]={NULL}; /* our own copies of their hostnames */
+  TR_IDP_REALM *idp_realm=NULL;
   int n_aaa=0;
   int idp_shared=0;
-  TR_AAA_SERVER_ITER *aaa_iter=NULL;
-  pthread_t aaa_thread[TR_TID_MAX_AAA_SERVERS];
   struct tr_tids_fwd_cookie *aaa_cookie[TR_TID_MAX_AAA_SERVERS]={NULL};
   TID_RESP *aaa_resp[TR_TID_MAX_AAA_SERVERS]={NULL};
   TR_NAME *apc = NULL;
   TID_REQ *fwd_req = NULL;
+  GBytes *req_buf = NULL;
   TR_COMM *cfg_comm = NULL;
   TR_COMM *cfg_apc = NULL;
   int oaction = TR_FILTER_ACTION_REJECT;
@@ -255,12 +517,23 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   TRP_ROUTE *route=NULL;
   TR_MQ *mq=NULL;
   TR_MQ_MSG *msg=NULL;
+  size_t n_selected=0;
   unsigned int n_responses=0;
   unsigned int n_failed=0;
+  unsigned int hedge_percentile=0;
+  double hedge_delay=-1; /* seconds; negative if not hedging */
+  struct timespec ts_hedge={0};
+  size_t n_start=0;
   struct timespec ts_abort={0};
-  unsigned int resp_frac_numer=cfg_mgr->active->internal->tid_resp_numer;
-  unsigned int resp_frac_denom=cfg_mgr->active->internal->tid_resp_denom;
+  unsigned int resp_frac_numer=0;
+  unsigned int resp_frac_denom=0;
+  unsigned int req_timeout=0;
+  long budget_ms=0; /* time we will wait for the AAA servers */
+  long remaining_ms=0;
+  TR_RP_CLIENT *rp_client=NULL;
   TR_RESP_COOKIE *payload=NULL;
+  const char *err_msg=NULL; /* sent once the lock is released */
+  int locked=0;
   int ii=0;
   int retval=-1;
 
@@ -272,7 +545,14 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
 
   tr_debug("tr_tids_req_handler: Request received (conn = %d)! Realm = %s, Comm = %s", orig_req->conn, 
            orig_req->realm->buf, orig_req->comm->buf);
-  tids->req_count++;
+
+  /* This may run in a worker thread. Hold the read lock until we have copied
+   * everything we need from the configuration and route table. */
+  tr_cfg_mgr_read_lock(cfg_mgr);
+  locked=1;
+  resp_frac_numer=cfg_mgr->active->internal->tid_resp_numer;
+  resp_frac_denom=cfg_mgr->active->internal->tid_resp_denom;
+  req_timeout=cfg_mgr->active->internal->tid_req_timeout;
 
   /* Duplicate the request, so we can modify and forward it */
   if (NULL == (fwd_req=tid_dup_req(orig_req))) {
@@ -284,39 +564,41 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
 
   if (NULL == (cfg_comm=tr_comm_table_find_comm(cfg_mgr->active->ctable, orig_req->comm))) {
     tr_notice("tr_tids_req_hander: Request for unknown comm: %s.", orig_req->comm->buf);
-    tids_send_err_response(tids, orig_req, "Unknown community");
+    err_msg="Unknown community";
     retval=-1;
     goto cleanup;
   }
 
   /* Check that the rp_realm matches the filter for the GSS name that 
-   * was received. N.B. that tids->rp_gss was pointed at the correct
-   * rp_client when we received its GSS name. It is only set within
-   * the TIDS handler subprocess. */
-
-  if ((!tids->rp_gss) || 
-      (!tids->rp_gss->filter)) {
+   * was received. Look up the rp_client here rather than when the
+   * connection was authorized, since the configuration may have
+   * changed in the meantime. */
+  if (orig_req->gss_name!=NULL)
+    rp_client=tr_cfg_find_rp(cfg_mgr->active, orig_req->gss_name, NULL);
+
+  if ((!rp_client) || 
+      (!rp_client->filter)) {
     tr_notice("tr_tids_req_handler: No GSS name for incoming request.");
-    tids_send_err_response(tids, orig_req, "No GSS name for request");
+    err_msg="No GSS name for request";
     retval=-1;
     goto cleanup;
   }
 
   if ((TR_FILTER_NO_MATCH == tr_filter_process_rp_permitted(orig_req->rp_realm,
-                                                            tids->rp_gss->filter,
+                                                            rp_client->filter,
                                                             orig_req->cons,
                                                            &fwd_req->cons,
                                                            &oaction)) ||
       (TR_FILTER_ACTION_REJECT == oaction)) {
     tr_notice("tr_tids_req_handler: RP realm (%s) does not match RP Realm filter for GSS name", orig_req->rp_realm->buf);
-    tids_send_err_response(tids, orig_req, "RP Realm filter error");
+    err_msg="RP Realm filter error";
     retval=-1;
     goto cleanup;
   }
   /* Check that the rp_realm is a member of the community in the request */
   if (NULL == tr_comm_find_rp(cfg_mgr->active->ctable, cfg_comm, orig_req->rp_realm)) {
     tr_notice("tr_tids_req_handler: RP Realm (%s) not member of community (%s).", orig_req->rp_realm->buf, orig_req->comm->buf);
-    tids_send_err_response(tids, orig_req, "RP COI membership error");
+    err_msg="RP COI membership error";
     retval=-1;
     goto cleanup;
   }
@@ -326,7 +608,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     if (orig_req->orig_coi!=NULL) {
       tr_notice("tr_tids_req_handler: community %s is COI but COI to APC mapping already occurred. Dropping request.",
                orig_req->comm->buf);
-      tids_send_err_response(tids, orig_req, "Second COI to APC mapping would result, permitted only once.");
+      err_msg="Second COI to APC mapping would result, permitted only once.";
       retval=-1;
       goto cleanup;
     }
@@ -335,7 +617,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     /* TBD -- In theory there can be more than one?  How would that work? */
     if ((!cfg_comm->apcs) || (!cfg_comm->apcs->id)) {
       tr_notice("No valid APC for COI %s.", orig_req->comm->buf);
-      tids_send_err_response(tids, orig_req, "No valid APC for community");
+      err_msg="No valid APC for community";
       retval=-1;
       goto cleanup;
     }
@@ -344,7 +626,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     /* Check that the APC is configured */
     if (NULL == (cfg_apc = tr_comm_table_find_comm(cfg_mgr->active->ctable, apc))) {
       tr_notice("tr_tids_req_hander: Request for unknown comm: %s.", apc->buf);
-      tids_send_err_response(tids, orig_req, "Unknown APC");
+      err_msg="Unknown APC";
       retval=-1;
       goto cleanup;
     }
@@ -355,7 +637,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     /* Check that rp_realm is a  member of this APC */
     if (NULL == (tr_comm_find_rp(cfg_mgr->active->ctable, cfg_apc, orig_req->rp_realm))) {
       tr_notice("tr_tids_req_hander: RP Realm (%s) not member of community (%s).", orig_req->rp_realm->buf, orig_req->comm->buf);
-      tids_send_err_response(tids, orig_req, "RP APC membership error");
+      err_msg="RP APC membership error";
       retval=-1;
       goto cleanup;
     }
@@ -367,17 +649,19 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   if (route==NULL) {
     tr_notice("tr_tids_req_handler: no route table entry found for realm (%s) in community (%s).",
               orig_req->realm->buf, orig_req->comm->buf);
-    tids_send_err_response(tids, orig_req, "Missing trust route error");
+    err_msg="Missing trust route error";
     retval=-1;
     goto cleanup;
   }
   tr_debug("tr_tids_req_handler: found route.");
   if (trp_route_is_local(route)) {
     tr_debug("tr_tids_req_handler: route is local.");
-    aaa_servers = tr_idp_aaa_server_lookup(cfg_mgr->active->ctable->idp_realms, 
-                                           orig_req->realm, 
-                                           orig_req->comm,
-                                          &idp_shared);
+    /* TBD -- check that the community is one of the APCs for the IDP */
+    if (NULL != (idp_realm=tr_comm_table_find_idp_realm(cfg_mgr->active->ctable, orig_req->realm))) {
+      aaa_servers=idp_realm->aaa_servers;
+      idp_shared=idp_realm->shared_config;
+      hedge_percentile=idp_realm->hedge_percentile;
+    }
   } else {
     tr_debug("tr_tids_req_handler: route not local.");
     aaa_servers = tr_aaa_server_new(tmp_ctx, trp_route_get_next_hop(route));
@@ -390,7 +674,7 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     if (NULL == (aaa_servers = tr_default_server_lookup (cfg_mgr->active->default_servers,
                                                          orig_req->comm))) {
       tr_notice("tr_tids_req_handler: No default AAA servers, discarded.");
-      tids_send_err_response(tids, orig_req, "No path to AAA Server(s) for realm");
+      err_msg="No path to AAA Server(s) for realm";
       retval=-1;
       goto cleanup;
     }
@@ -399,13 +683,13 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     /* if we aren't defaulting, check idp coi and apc membership */
     if (NULL == (tr_comm_find_idp(cfg_mgr->active->ctable, cfg_comm, fwd_req->realm))) {
       tr_notice("tr_tids_req_handler: IDP Realm (%s) not member of community (%s).", orig_req->realm->buf, orig_req->comm->buf);
-      tids_send_err_response(tids, orig_req, "IDP community membership error");
+      err_msg="IDP community membership error";
       retval=-1;
       goto cleanup;
     }
     if ( cfg_apc && (NULL == (tr_comm_find_idp(cfg_mgr->active->ctable, cfg_apc, fwd_req->realm)))) {
       tr_notice("tr_tids_req_handler: IDP Realm (%s) not member of APC (%s).", orig_req->realm->buf, orig_req->comm->buf);
-      tids_send_err_response(tids, orig_req, "IDP APC membership error");
+      err_msg="IDP APC membership error";
       retval=-1;
       goto cleanup;
     }
@@ -420,6 +704,36 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
     fwd_req->expiration_interval =  (expiration_interval < fwd_req->expiration_interval) ? expiration_interval : fwd_req->expiration_interval;
   else fwd_req->expiration_interval = expiration_interval;
 
+  /* Use whatever is left of the request's time budget, if that is less than our
+   * own timeout, and pass the rest along to the next hop. */
+  budget_ms=req_timeout*1000;
+  remaining_ms=tid_req_get_remaining_ms(orig_req);
+  if ((remaining_ms>=0) && (remaining_ms<budget_ms))
+    budget_ms=remaining_ms;
+  if (budget_ms==0) {
+    tr_notice("tr_tids_req_handler: request deadline passed before forwarding.");
+    err_msg="Request deadline exceeded";
+    retval=-1;
+    goto cleanup;
+  }
+  fwd_req->timeout_ms=budget_ms;
+
+  /* determine expiration time, which also bounds the forwarding threads */
+  if (0!=tr_mq_pop_timeout_ms(budget_ms, &ts_abort)) {
+    tr_notice("tr_tids_req_handler: unable to read clock for timeout.");
+    retval=-1;
+    goto cleanup;
+  }
+
+  /* Encode the request once; every AAA server gets the same bytes. */
+  tid_req_set_request_id(fwd_req, tr_tids_fwd_next_req_id());
+  if ((NULL == fwd_req->request_id) ||
+      (NULL == (req_buf=tidc_encode_request(fwd_req)))) {
+    tr_notice("tr_tids_req_handler: unable to encode request for forwarding.");
+    retval=-1;
+    goto cleanup;
+  }
+
   /* Set up message queue for replies from req forwarding threads */
   mq=tr_mq_new(tmp_ctx);
   if (mq==NULL) {
@@ -429,67 +743,88 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   }
   tr_debug("tr_tids_req_handler: message queue allocated.");
 
-  /* start threads */
-  aaa_iter=tr_aaa_server_iter_new(tmp_ctx);
-  if (aaa_iter==NULL) {
-    tr_notice("tr_tids_req_handler: unable to allocate AAA server iterator.");
+  /* Pick the AAA servers to contact, best first. Servers whose circuit is open
+   * are skipped, and do not count toward the fraction of responses we wait for. */
+  n_selected=tr_aaa_scoreboard_select(cookie->scoreboard, aaa_servers, selected_aaa, TR_TID_MAX_AAA_SERVERS);
+  if (n_selected==0) {
+    tr_notice("tr_tids_req_handler: no AAA server available for realm %s.", orig_req->realm->buf);
+    err_msg="AAA server(s) unavailable";
     retval=-1;
     goto cleanup;
   }
-  for (n_aaa=0, this_aaa=tr_aaa_server_iter_first(aaa_iter, aaa_servers);
-       this_aaa!=NULL;
-       n_aaa++, this_aaa=tr_aaa_server_iter_next(aaa_iter)) {
-    tr_debug("tr_tids_req_handler: Preparing to start thread %d.", n_aaa);
 
-    aaa_cookie[n_aaa]=talloc(tmp_ctx, struct tr_tids_fwd_cookie);
-    if (aaa_cookie[n_aaa]==NULL) {
-      tr_notice("tr_tids_req_handler: unable to allocate cookie for AAA thread %d.", n_aaa);
+  /* For local realms, the servers belong to the configuration, which may be
+   * freed once we drop the lock. Keep the hostnames, which is all we need. */
+  for (ii=0; ii<n_selected; ii++) {
+    if (NULL==(selected_host[ii]=tr_dup_name(selected_aaa[ii]->hostname))) {
+      tr_crit("tr_tids_req_handler: unable to copy AAA server hostname.");
+      n_selected=ii;
       retval=-1;
       goto cleanup;
     }
-    talloc_set_destructor((void *)(aaa_cookie[n_aaa]), tr_tids_fwd_cookie_destructor);
-    /* fill in the cookie. To ensure the thread has valid data even if we exit first and
-     * abandon it, duplicate anything pointed to (except the mq). */
-    aaa_cookie[n_aaa]->thread_id=n_aaa;
-    if (0!=pthread_mutex_init(&(aaa_cookie[n_aaa]->mutex), NULL)) {
-      tr_notice("tr_tids_req_handler: unable to init mutex for AAA thread %d.", n_aaa);
-      retval=-1;
-      goto cleanup;
-    }
-    aaa_cookie[n_aaa]->mq=mq;
-    aaa_cookie[n_aaa]->aaa_hostname=tr_dup_name(this_aaa->hostname);
-    aaa_cookie[n_aaa]->dh_params=tr_dh_dup(orig_req->tidc_dh);
-    aaa_cookie[n_aaa]->fwd_req=tid_dup_req(fwd_req);
-    talloc_steal(aaa_cookie[n_aaa], aaa_cookie[n_aaa]->fwd_req);
-    tr_debug("tr_tids_req_handler: cookie %d initialized.", n_aaa);
-
-    /* Take the cookie out of tmp_ctx before starting thread. If thread starts, it becomes
-     * responsible for freeing it until it queues a response. If we did not do this, the possibility
-     * exists that this function exits, freeing the cookie, before the thread takes the cookie
-     * out of our tmp_ctx. This would cause a segfault or talloc error in the thread. */
-    talloc_steal(NULL, aaa_cookie[n_aaa]);
-    if (0!=pthread_create(&(aaa_thread[n_aaa]), NULL, tr_tids_req_fwd_thread, aaa_cookie[n_aaa])) {
-      talloc_steal(tmp_ctx, aaa_cookie[n_aaa]); /* thread start failed; steal this back */
-      tr_notice("tr_tids_req_handler: unable to start AAA thread %d.", n_aaa);
+  }
+
+  /* When hedging, start with the best server only and add the others as
+   * the hedge delay passes. Otherwise, send to all of them at once. */
+  if (idp_shared && (hedge_percentile>0) && (n_selected>1)) {
+    hedge_delay=tr_aaa_scoreboard_percentile(cookie->scoreboard, selected_host[0], hedge_percentile);
+    if (hedge_delay<0)
+      hedge_delay=TR_TID_HEDGE_DEFAULT_DELAY; /* no data for this server yet */
+    tr_debug("tr_tids_req_handler: hedging, delay %f seconds.", hedge_delay);
+    n_start=1;
+  } else {
+    hedge_delay=-1;
+    n_start=n_selected;
+  }
+
+  /* queue a job for each AAA server */
+  for (n_aaa=0; (n_aaa<n_start) && tr_tids_claim_aaa(cookie->scoreboard, selected_host, n_aaa, &n_selected); n_aaa++) {
+    if (NULL==(aaa_cookie[n_aaa]=tr_tids_fwd_queue(tmp_ctx, cookie, n_aaa, mq, selected_host[n_aaa],
+                                                   req_buf, fwd_req->request_id, &ts_abort))) {
       retval=-1;
       goto cleanup;
     }
-    tr_debug("tr_tids_req_handler: thread %d started.", n_aaa);
   }
-
-  /* determine expiration time */
-  if (0!=tr_mq_pop_timeout(cfg_mgr->active->internal->tid_req_timeout, &ts_abort)) {
-    tr_notice("tr_tids_req_handler: unable to read clock for timeout.");
+  if (n_aaa==0) {
+    tr_notice("tr_tids_req_handler: no AAA server available for realm %s.", orig_req->realm->buf);
+    err_msg="AAA server(s) unavailable";
     retval=-1;
     goto cleanup;
   }
 
+  /* The forwarding jobs have their own copies of everything they need. */
+  tr_cfg_mgr_unlock(cfg_mgr);
+  locked=0;
+
   /* wait for responses */
   tr_debug("tr_tids_req_handler: waiting for response(s).");
   n_responses=0;
   n_failed=0;
-  while (((n_responses+n_failed)<n_aaa) &&
-         (NULL!=(msg=tr_mq_pop(mq, &ts_abort)))) {
+  if (hedge_delay>=0)
+    tr_tids_hedge_deadline(hedge_delay, &ts_abort, &ts_hedge);
+  while ((n_responses+n_failed)<n_aaa) {
+    /* while there are servers left to hedge to, wake up at the hedge deadline */
+    if (n_aaa<n_selected)
+      msg=tr_mq_pop(mq, &ts_hedge);
+    else
+      msg=tr_mq_pop(mq, &ts_abort);
+
+    if (msg==NULL) {
+      if ((n_aaa>=n_selected) || (0==tr_tids_ts_cmp(&ts_hedge, &ts_abort)))
+        break; /* timed out */
+
+      /* no answer within the hedge delay, try the next server too */
+      if (!tr_tids_claim_aaa(cookie->scoreboard, selected_host, n_aaa, &n_selected))
+        continue; /* nothing left to hedge to, wait for the ones we started */
+      tr_debug("tr_tids_req_handler: hedging to AAA server %d.", n_aaa);
+      if (NULL==(aaa_cookie[n_aaa]=tr_tids_fwd_queue(tmp_ctx, cookie, n_aaa, mq, selected_host[n_aaa],
+                                                     req_buf, fwd_req->request_id, &ts_abort)))
+        break;
+      n_aaa++;
+      tr_tids_hedge_deadline(hedge_delay, &ts_abort, &ts_hedge);
+      continue;
+    }
+
     /* process message */
     if (0==strcmp(tr_mq_msg_get_message(msg), TR_TID_MQMSG_SUCCESS)) {
       payload=talloc_get_type_abort(tr_mq_msg_get_payload(msg), TR_RESP_COOKIE);
@@ -536,8 +871,19 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
 
     /* check whether we've received enough responses to exit */
     if ((idp_shared && (n_responses>0)) ||
-        (resp_frac_denom*n_responses>=resp_frac_numer*n_aaa))
+        ((hedge_delay<0) && (resp_frac_denom*n_responses>=resp_frac_numer*n_aaa)))
       break;
+
+    /* when hedging, a failure moves on to the next server without waiting */
+    if ((hedge_delay>=0) && ((n_responses+n_failed)==n_aaa)
+        && tr_tids_claim_aaa(cookie->scoreboard, selected_host, n_aaa, &n_selected)) {
+      tr_debug("tr_tids_req_handler: hedging to AAA server %d after failure.", n_aaa);
+      if (NULL==(aaa_cookie[n_aaa]=tr_tids_fwd_queue(tmp_ctx, cookie, n_aaa, mq, selected_host[n_aaa],
+                                                     req_buf, fwd_req->request_id, &ts_abort)))
+        break;
+      n_aaa++;
+      tr_tids_hedge_deadline(hedge_delay, &ts_abort, &ts_hedge);
+    }
   }
 
   tr_debug("tr_tids_req_handler: done waiting for responses. %d responses, %d failures.",
@@ -548,7 +894,10 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
       if (0!=tr_tids_fwd_get_mutex(aaa_cookie[ii]))
         tr_notice("tr_tids_req_handler: unable to get mutex for AAA thread %d.", ii);
 
-      aaa_cookie[ii]->mq=NULL; /* threads will not try to respond through a null mq */
+      /* Threads will not try to respond through a null mq. A thread that has already
+       * sent the request still reports the outcome to the scoreboard itself; the
+       * request's deadline bounds how long that takes. */
+      aaa_cookie[ii]->mq=NULL;
 
       if (0!=tr_tids_fwd_release_mutex(aaa_cookie[ii]))
         tr_notice("tr_tids_req_handler: unable to release mutex for AAA thread %d.", ii);
@@ -584,6 +933,15 @@ static int tr_tids_req_handler(TIDS_INSTANCE *tids,
   retval=0;
     
 cleanup:
+  if (locked)
+    tr_cfg_mgr_unlock(cfg_mgr);
+  /* sending can block on the client, so never while holding the lock */
+  if (err_msg!=NULL)
+    tids_send_err_response(tids, orig_req, err_msg);
+  for (ii=0; ii<n_selected; ii++)
+    tr_free_name(selected_host[ii]);
+  if (req_buf!=NULL)
+    g_bytes_unref(req_buf);
   talloc_free(tmp_ctx);
   return retval;
 }
@@ -601,14 +959,17 @@ static int tr_tids_gss_handler(gss_name_t client_name, TR_NAME *gss_name,
     return -1;
   }
 
-  /* look up the RP client matching the GSS name */
-  if ((NULL == (rp = tr_rp_client_lookup(cfg_mgr->active->rp_clients, gss_name)))) {
+  /* look up the RP client matching the GSS name. The request handler looks
+   * it up again, since this may run in a worker thread while the
+   * configuration is changing. */
+  tr_cfg_mgr_read_lock(cfg_mgr);
+  rp = tr_cfg_find_rp(cfg_mgr->active, gss_name, NULL);
+  tr_cfg_mgr_unlock(cfg_mgr);
+  if (NULL == rp) {
     tr_debug("tr_tids_gss_handler: Unknown GSS name %s", gss_name->buf);
     return -1;
   }
 
-  /* Store the rp client */
-  tids->rp_gss = rp;
   tr_debug("Client's GSS Name: %s", gss_name->buf);
 
   return 0;
@@ -617,6 +978,13 @@ static int tr_tids_gss_handler(gss_name_t client_name, TR_NAME *gss_name,
 
 /***** TIDS event handling *****/
 
+/* called periodically to close idle connections to AAA servers */
+static void tr_tids_pool_sweep_cb(int fd, short event, void *arg)
+{
+  TIDC_POOL *pool=talloc_get_type_abort(arg, TIDC_POOL);
+  tidc_pool_sweep(pool);
+}
+
 /* called when a connection to the TIDS port is received */
 static void tr_tids_event_cb(int listener, short event, void *arg)
 {
@@ -639,6 +1007,7 @@ int tr_tids_event_init(struct event_base *base,
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   struct tr_tids_event_cookie *cookie=NULL;
+  struct timeval sweep_interval={0};
   int retval=0;
   size_t ii=0;
 
@@ -659,8 +1028,40 @@ int tr_tids_event_init(struct event_base *base,
   cookie->tids=tids;
   cookie->cfg_mgr=cfg_mgr;
   cookie->trps=trps;
+  cookie->pool_sweep_ev=NULL;
+  cookie->scoreboard=tr_aaa_scoreboard_new(cookie,
+                                           cfg_mgr->active->internal->aaa_circuit_failures,
+                                           cfg_mgr->active->internal->aaa_circuit_retry_interval);
+  if (cookie->scoreboard == NULL) {
+    tr_debug("tr_tids_event_init: Unable to allocate AAA server scoreboard.");
+    retval=1;
+    goto cleanup;
+  }
+  /* Without worker threads the TID server forks for each connection, and the
+   * children would not inherit the forwarding threads. */
+  if (cfg_mgr->active->internal->tids_worker_threads>0)
+    cookie->fwd_pool=tr_tids_fwd_pool_new(cookie, cfg_mgr->active->internal->tid_fwd_threads);
+  else
+    cookie->fwd_pool=tr_tids_fwd_pool_new(cookie, 0);
+  if (cookie->fwd_pool == NULL) {
+    tr_crit("tr_tids_event_init: Unable to start TID forwarding threads.");
+    retval=1;
+    goto cleanup;
+  }
+  cookie->pool=tidc_pool_new(cookie,
+                             cfg_mgr->active->internal->tid_pool_max_per_host,
+                             cfg_mgr->active->internal->tid_pool_idle_timeout);
+  if (cookie->pool == NULL) {
+    tr_debug("tr_tids_event_init: Unable to allocate TID connection pool.");
+    retval=1;
+    goto cleanup;
+  }
   talloc_steal(tids, cookie);
 
+  /* shed load early rather than letting requests time out in queues */
+  tids_set_listen_backlog(tids, cfg_mgr->active->internal->tids_listen_backlog);
+  tids_set_max_in_flight(tids, cfg_mgr->active->internal->tids_max_in_flight);
+
   /* get a tids listener */
   tids_ev->n_sock_fd=tids_get_listener(tids,
                                        tr_tids_req_handler,
@@ -676,6 +1077,16 @@ int tr_tids_event_init(struct event_base *base,
     goto cleanup;
   }
 
+  /* serve connections from worker threads rather than forking */
+  if (0!=tids_start_workers(tids,
+                            cfg_mgr->active->internal->tids_worker_threads,
+                            cfg_mgr->active->internal->tids_max_pending)) {
+    tr_crit("Error starting TID server worker threads.");
+    retval=1;
+    goto cleanup;
+  }
+  tids_set_idle_timeout(tids, cfg_mgr->active->internal->tids_idle_timeout);
+
   /* Set up events */
   for (ii=0; ii<tids_ev->n_sock_fd; ii++) {
     tids_ev->ev[ii]=event_new(base,
@@ -686,6 +1097,13 @@ int tr_tids_event_init(struct event_base *base,
     event_add(tids_ev->ev[ii], NULL);
   }
 
+  /* close idle connections to AAA servers even if no requests arrive */
+  if (cfg_mgr->active->internal->tid_pool_idle_timeout>0) {
+    cookie->pool_sweep_ev=event_new(base, -1, EV_PERSIST, tr_tids_pool_sweep_cb, (void *)(cookie->pool));
+    sweep_interval.tv_sec=cfg_mgr->active->internal->tid_pool_idle_timeout;
+    event_add(cookie->pool_sweep_ev, &sweep_interval);
+  }
+
 cleanup:
   talloc_free(tmp_ctx);
   return retval;
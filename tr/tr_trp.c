@@ -55,6 +55,7 @@
 #include <tr_msg.h>
 #include <tr_trp.h>
 #include <tr_debug.h>
+#include <tr_util.h>
 
 /* data for event callbacks */
 struct tr_trps_event_cookie {
@@ -63,13 +64,6 @@ struct tr_trps_event_cookie {
   struct event *ev;
 };
 
-/* callback to schedule event to process messages */
-static void tr_trps_mq_cb(TR_MQ *mq, void *arg)
-{
-  struct event *mq_ev=(struct event *)arg;
-  event_active(mq_ev, 0, 0);
-}
-
 static void msg_free_helper(void *p)
 {
   tr_msg_free_decoded((TR_MSG *)p);
@@ -108,7 +102,7 @@ static int tr_trps_gss_handler(gss_name_t client_name, gss_buffer_t gss_name,
   struct tr_trps_event_cookie *cookie=(struct tr_trps_event_cookie *)cookie_in;
   TRPS_INSTANCE *trps = cookie->trps;
   TR_CFG_MGR *cfg_mgr = cookie->cfg_mgr;
-  TR_NAME name={gss_name->value, gss_name->length};
+  TR_NAME name={gss_name->value, gss_name->length, 0, 0, NULL}; /* not interned */
 
   tr_debug("tr_trps_gss_handler()");
 
@@ -226,9 +220,15 @@ static void tr_trps_cleanup_trpc(TRPS_INSTANCE *trps, TRPC_INSTANCE *trpc)
   tr_debug("tr_trps_cleanup_trpc: deleted connection");
 }
 
+/* Formatting the whole table is expensive, so only do it when debugging. */
 static void tr_trps_print_route_table(TRPS_INSTANCE *trps, FILE *f)
 {
-  char *table=trp_rtable_to_str(NULL, trps->rtable, " | ", NULL);
+  char *table=NULL;
+
+  if (!tr_console_enabled(LOG_DEBUG))
+    return;
+
+  table=trp_rtable_to_str(NULL, trps->rtable, " | ", NULL);
   if (table==NULL)
     fprintf(f, "Unable to print route table.\n");
   else {
@@ -237,12 +237,21 @@ static void tr_trps_print_route_table(TRPS_INSTANCE *trps, FILE *f)
   }
 }
 
+/* Most messages handled per call of tr_trps_process_mq(), so that TID requests
+ * waiting for the configuration lock are not starved by a flood of messages. */
+#define TR_TRPS_MQ_BATCH 100
+
 static void tr_trps_process_mq(int socket, short event, void *arg)
 {
-  TRPS_INSTANCE *trps=talloc_get_type_abort(arg, TRPS_INSTANCE);
+  struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
+  TRPS_INSTANCE *trps=cookie->trps;
   TR_MQ_MSG *msg=NULL;
   const char *s=NULL;
+  unsigned int n_msgs=0;
+  unsigned int n_updates=0;
 
+  /* keep TID worker threads out of the tables while we change them */
+  tr_cfg_mgr_write_lock(cookie->cfg_mgr);
   msg=trps_mq_pop(trps);
   while (msg!=NULL) {
     s=tr_mq_msg_get_message(msg);
@@ -296,16 +305,48 @@ static void tr_trps_process_mq(int socket, short event, void *arg)
     else if (0==strcmp(s, TR_MQMSG_MSG_RECEIVED)) {
       if (trps_handle_tr_msg(trps, tr_mq_msg_get_payload(msg))!=TRP_SUCCESS)
         tr_notice("tr_trps_process_mq: error handling message.");
-      else {
-        tr_trps_print_route_table(trps, stderr);
-      }
+      /* Only updates change the tables. Count them even if some of their
+       * routes were rejected, the rest may have been recorded. */
+      if (tr_msg_get_msg_type(tr_mq_msg_get_payload(msg))==TRP_UPDATE)
+        n_updates++;
     }
     else
       tr_notice("tr_trps_process_mq: unknown message '%s' received.", tr_mq_msg_get_message(msg));
 
     tr_mq_msg_free(msg);
+    /* Anything left keeps the queue's fd readable, so the event loop calls
+     * us again once other events have had their turn. */
+    if (++n_msgs>=TR_TRPS_MQ_BATCH)
+      break;
     msg=trps_mq_pop(trps);
   }
+
+  /* Act on the whole batch at once. With a hold-down, wait for more to
+   * arrive; the holddown event applies everything received by then. */
+  if (n_updates>0) {
+    if (trps_get_update_holddown(trps)==0) {
+      tr_debug("tr_trps_process_mq: applying %u update(s).", n_updates);
+      trps_apply_updates(trps);
+      tr_cfg_mgr_unlock(cookie->cfg_mgr);
+      tr_trps_print_route_table(trps, stderr);
+      return;
+    }
+    if (!event_pending(cookie->ev, EV_TIMEOUT, NULL))
+      event_add(cookie->ev, &(trps->update_holddown));
+  }
+  tr_cfg_mgr_unlock(cookie->cfg_mgr);
+}
+
+static void tr_trps_holddown(int listener, short event, void *arg)
+{
+  struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
+  TRPS_INSTANCE *trps=cookie->trps;
+
+  tr_debug("tr_trps_holddown: applying received route updates.");
+  tr_cfg_mgr_write_lock(cookie->cfg_mgr);
+  trps_apply_updates(trps);
+  tr_cfg_mgr_unlock(cookie->cfg_mgr);
+  tr_trps_print_route_table(trps, stderr);
 }
 
 static void tr_trps_update(int listener, short event, void *arg)
@@ -315,7 +356,9 @@ static void tr_trps_update(int listener, short event, void *arg)
   struct event *ev=cookie->ev;
 
   tr_debug("tr_trps_update: sending scheduled route/community updates.");
+  tr_cfg_mgr_write_lock(cookie->cfg_mgr);
   trps_update(trps, TRP_UPDATE_SCHEDULED);
+  tr_cfg_mgr_unlock(cookie->cfg_mgr);
   event_add(ev, &(trps->update_interval));
   tr_debug("tr_trps_update: update interval=%d", trps->update_interval.tv_sec);
 }
@@ -325,14 +368,36 @@ static void tr_trps_sweep(int listener, short event, void *arg)
   struct tr_trps_event_cookie *cookie=talloc_get_type_abort(arg, struct tr_trps_event_cookie);
   TRPS_INSTANCE *trps=cookie->trps;
   struct event *ev=cookie->ev;
+  struct timespec now={0,0};
+  struct timespec next={0,0};
+  struct timeval delay={0,0};
 
+  tr_cfg_mgr_write_lock(cookie->cfg_mgr);
   tr_debug("tr_trps_sweep: sweeping routes.");
   trps_sweep_routes(trps);
   tr_debug("tr_trps_sweep: sweeping communities.");
   trps_sweep_ctable(trps);
+  /* reselect routes for realms whose routes expired or were released, and
+   * send triggered updates for those and for flushed memberships */
+  trps_apply_updates(trps);
+
+  /* Run again at the sweep interval, or sooner if something expires before then */
+  delay=trps->sweep_interval;
+  if ((0==trps_next_expiry(trps, &next)) && (0==clock_gettime(TRP_CLOCK, &now))) {
+    if (tr_cmp_timespec(&next, &now) <= 0)
+      delay=(struct timeval){0,0};
+    else if (next.tv_sec-now.tv_sec < delay.tv_sec) {
+      delay.tv_sec=next.tv_sec-now.tv_sec;
+      delay.tv_usec=(next.tv_nsec-now.tv_nsec)/1000;
+      if (delay.tv_usec<0) {
+        delay.tv_sec--;
+        delay.tv_usec+=1000000;
+      }
+    }
+  }
+  tr_cfg_mgr_unlock(cookie->cfg_mgr);
   tr_trps_print_route_table(trps, stderr);
-  /* schedule the event to run again */
-  event_add(ev, &(trps->sweep_interval));
+  event_add(ev, &delay);
 }
 
 static void tr_connection_update(int listener, short event, void *arg)
@@ -358,6 +423,8 @@ static int tr_trps_events_destructor(void *obj)
     event_free(ev->update_ev);
   if (ev->sweep_ev!=NULL)
     event_free(ev->sweep_ev);
+  if (ev->holddown_ev!=NULL)
+    event_free(ev->holddown_ev);
   return 0;
 }
 static TR_TRPS_EVENTS *tr_trps_events_new(TALLOC_CTX *mem_ctx)
@@ -369,6 +436,7 @@ static TR_TRPS_EVENTS *tr_trps_events_new(TALLOC_CTX *mem_ctx)
     ev->connect_ev=NULL;
     ev->update_ev=NULL;
     ev->sweep_ev=NULL;
+    ev->holddown_ev=NULL;
     if (ev->listen_ev==NULL) {
       talloc_free(ev);
       ev=NULL;
@@ -425,6 +493,7 @@ TRP_RC tr_trps_event_init(struct event_base *base, TR_INSTANCE *tr)
   }
   trps_cookie->trps=tr->trps;
   trps_cookie->cfg_mgr=tr->cfg_mgr;
+  trps_cookie->ev=NULL; /* the holddown event, set below */
 
   /* get a trps listener */
   listen_ev->n_sock_fd=trps_get_listener(tr->trps,
@@ -453,14 +522,18 @@ TRP_RC tr_trps_event_init(struct event_base *base, TR_INSTANCE *tr)
     event_add(listen_ev->ev[ii], NULL);
   }
   
-  /* now set up message queue processing event, only triggered by
-   * tr_trps_mq_cb() */
+  /* now set up message queue processing event, triggered when the
+   * queue's eventfd becomes readable */
   tr->events->mq_ev=event_new(base,
-                              0,
-                              EV_PERSIST,
+                              tr_mq_get_fd(tr->trps->mq),
+                              EV_READ|EV_PERSIST,
                               tr_trps_process_mq,
-                              (void *)(tr->trps));
-  tr_mq_set_notify_cb(tr->trps->mq, tr_trps_mq_cb, tr->events->mq_ev);
+                              (void *)trps_cookie);
+  event_add(tr->events->mq_ev, NULL);
+
+  /* hold-down timer for received route updates, armed by tr_trps_process_mq() */
+  tr->events->holddown_ev=event_new(base, -1, EV_TIMEOUT, tr_trps_holddown, (void *)trps_cookie);
+  trps_cookie->ev=tr->events->holddown_ev;
 
   /* now set up the peer connection timer event */
   connection_cookie=talloc(tr->events, struct tr_trps_event_cookie);
@@ -691,6 +764,7 @@ void tr_peer_status_change(TRP_PEER *peer, void *cookie)
 {
   TRPS_INSTANCE *trps=talloc_get_type_abort(cookie, TRPS_INSTANCE);
 
+  trps_peer_membs_stale(trps, peer);
   if (TRP_SUCCESS!=trps_wildcard_route_req(trps, trp_peer_get_servicename(peer)))
     tr_err("tr_send_wildcard: error sending wildcard route request.");
 }
@@ -840,6 +914,14 @@ void tr_config_changed(TR_CFG *new_cfg, void *cookie)
   trps_set_connect_interval(trps, new_cfg->internal->trp_connect_interval);
   trps_set_update_interval(trps, new_cfg->internal->trp_update_interval);
   trps_set_sweep_interval(trps, new_cfg->internal->trp_sweep_interval);
+  trps_set_update_holddown(trps, new_cfg->internal->trp_update_holddown_ms);
+  trps_set_max_update_bytes(trps, new_cfg->internal->trp_max_update_bytes);
+  trps_set_flap_damping(trps,
+                        new_cfg->internal->trp_flap_penalty,
+                        new_cfg->internal->trp_flap_suppress,
+                        new_cfg->internal->trp_flap_reuse,
+                        new_cfg->internal->trp_flap_half_life);
+  trps_set_metric_hysteresis(trps, new_cfg->internal->trp_metric_hysteresis);
   trps_set_ctable(trps, new_cfg->ctable);
   trps_set_ptable(trps, new_cfg->peers);
   trps_set_peer_status_callback(trps, tr_peer_status_change, (void *)trps);
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <talloc.h>
+
+#include <trust_router/tr_name.h>
+#include <trp_internal.h>
+#include <trp_rtable.h>
+#include <tr_msg.h>
+
+#define FLAP_PENALTY 1000
+#define FLAP_SUPPRESS 2000
+#define FLAP_REUSE 750
+#define FLAP_HALF_LIFE 3600 /* long enough that nothing decays while the test runs */
+
+static unsigned int penalty_after(TRPS_INSTANCE *trps, TRP_ROUTE *route, struct timespec *start, time_t elapsed)
+{
+  struct timespec now={start->tv_sec+elapsed, start->tv_nsec};
+  return trps_route_penalty_now(trps, route, &now);
+}
+
+/* The penalty halves every half-life, decaying linearly in between */
+static void test_decay(void)
+{
+  TRPS_INSTANCE *trps=trps_new(NULL);
+  TRP_ROUTE *route=trp_route_new(NULL);
+  struct timespec start={1000, 0};
+
+  assert((trps!=NULL) && (route!=NULL));
+  trps_set_flap_damping(trps, FLAP_PENALTY, FLAP_SUPPRESS, FLAP_REUSE, 60);
+  trp_route_set_penalty(route, 1600, &start);
+
+  assert(penalty_after(trps, route, &start, 0)==1600);
+  assert(penalty_after(trps, route, &start, -10)==1600); /* no decay backward */
+  assert(penalty_after(trps, route, &start, 30)==1200);
+  assert(penalty_after(trps, route, &start, 60)==800);
+  assert(penalty_after(trps, route, &start, 90)==600);
+  assert(penalty_after(trps, route, &start, 120)==400);
+  assert(penalty_after(trps, route, &start, 60*32)==0);
+
+  trps_set_flap_damping(trps, FLAP_PENALTY, FLAP_SUPPRESS, FLAP_REUSE, 0);
+  assert(penalty_after(trps, route, &start, 1)==0); /* no half-life, no memory */
+
+  trp_route_set_penalty(route, 0, &start);
+  trps_set_flap_damping(trps, FLAP_PENALTY, FLAP_SUPPRESS, FLAP_REUSE, 60);
+  assert(penalty_after(trps, route, &start, 30)==0);
+
+  trp_route_free(route);
+  trps_free(trps);
+}
+
+/* Receive a route to comm.example/realm.example from peer1 and act on it */
+static void receive_route(TRPS_INSTANCE *trps, unsigned int metric)
+{
+  TRP_UPD *upd=trp_upd_new(NULL);
+  TRP_INFOREC *rec=NULL;
+  TR_MSG msg; /* not a pointer */
+  TRP_RC rc=TRP_ERROR;
+
+  assert(upd!=NULL);
+  rec=trp_inforec_new(upd, TRP_INFOREC_TYPE_ROUTE);
+  assert(rec!=NULL);
+  trp_upd_set_comm(upd, tr_new_name("comm.example"));
+  trp_upd_set_realm(upd, tr_new_name("realm.example"));
+  rc=trp_inforec_set_trust_router(rec, tr_new_name("tr.example"));
+  assert(rc==TRP_SUCCESS);
+  rc=trp_inforec_set_metric(rec, metric);
+  assert(rc==TRP_SUCCESS);
+  rc=trp_inforec_set_interval(rec, 30);
+  assert(rc==TRP_SUCCESS);
+  trp_upd_add_inforec(upd, rec);
+  /* as trps_read_message() would */
+  trp_upd_set_peer(upd, tr_new_name("peer1"));
+  trp_upd_set_next_hop(upd, "peer1.example", 0);
+
+  tr_msg_set_trp_upd(&msg, upd);
+  rc=trps_handle_tr_msg(trps, &msg);
+  assert(rc==TRP_SUCCESS);
+  trps_apply_updates(trps);
+  trp_upd_free(upd);
+}
+
+/* A route is suppressed once its penalty reaches the suppress threshold, and
+ * reused once it decays below the reuse threshold */
+static void test_suppress_reuse(void)
+{
+  TRPS_INSTANCE *trps=trps_new(NULL);
+  TR_NAME *comm=tr_new_name("comm.example");
+  TR_NAME *realm=tr_new_name("realm.example");
+  TR_NAME *peer=tr_new_name("peer1");
+  TRP_ROUTE *route=NULL;
+  struct timespec now={0, 0};
+  struct timespec before={0, 0};
+
+  assert(trps!=NULL);
+  trps_set_flap_damping(trps, FLAP_PENALTY, FLAP_SUPPRESS, FLAP_REUSE, FLAP_HALF_LIFE);
+
+  /* a new route is not a flap */
+  receive_route(trps, 1);
+  route=trps_get_route(trps, comm, realm, peer);
+  assert(route!=NULL);
+  assert(trp_route_get_penalty(route)==0);
+  assert(trps_get_selected_route(trps, comm, realm)==route);
+
+  /* a metric change is charged half the penalty, and the route stays in use */
+  receive_route(trps, 2);
+  assert(trp_route_get_penalty(route)==FLAP_PENALTY/2);
+  assert(!trp_route_is_suppressed(route));
+  assert(trps_get_selected_route(trps, comm, realm)==route);
+
+  /* a withdrawal is charged in full */
+  receive_route(trps, TRP_METRIC_INFINITY);
+  assert(trp_route_get_penalty(route)==FLAP_PENALTY/2+FLAP_PENALTY);
+  assert(!trp_route_is_suppressed(route));
+
+  /* coming back after it is free */
+  receive_route(trps, 1);
+  assert(trp_route_get_penalty(route)==FLAP_PENALTY/2+FLAP_PENALTY);
+  assert(!trp_route_is_suppressed(route));
+  assert(trps_get_selected_route(trps, comm, realm)==route);
+
+  /* the next change reaches the threshold; with no alternative, nothing is selected */
+  receive_route(trps, 2);
+  assert(trp_route_get_penalty(route)==2*FLAP_PENALTY);
+  assert(trp_route_is_suppressed(route));
+  assert(trps_get_selected_route(trps, comm, realm)==NULL);
+
+  /* the penalty is capped at twice the suppress threshold */
+  receive_route(trps, TRP_METRIC_INFINITY);
+  receive_route(trps, 1);
+  receive_route(trps, TRP_METRIC_INFINITY);
+  receive_route(trps, 1);
+  assert(trp_route_get_penalty(route)==2*FLAP_SUPPRESS);
+
+  /* still above the reuse threshold, stays suppressed */
+  trps_sweep_routes(trps);
+  trps_update_dirty_routes(trps);
+  assert(trp_route_is_suppressed(route));
+  assert(trps_get_selected_route(trps, comm, realm)==NULL);
+
+  /* two half-lives later, the penalty is a quarter of what it was, below the reuse threshold */
+  assert(0==clock_gettime(TRP_CLOCK, &now));
+  before.tv_sec=now.tv_sec-2*FLAP_HALF_LIFE;
+  trp_route_set_penalty(route, 2*FLAP_PENALTY, &before);
+  trps_sweep_routes(trps);
+  trps_update_dirty_routes(trps);
+  assert(!trp_route_is_suppressed(route));
+  assert(trp_route_get_penalty(route)<FLAP_REUSE);
+  assert(trps_get_selected_route(trps, comm, realm)==route);
+
+  tr_free_name(peer);
+  tr_free_name(realm);
+  tr_free_name(comm);
+  trps_free(trps);
+}
+
+int main(void)
+{
+  printf("Verifying penalty decay...\n");
+  test_decay();
+  printf("                        ...success!\n");
+
+  printf("\nVerifying suppression and reuse...\n");
+  test_suppress_reuse();
+  printf("                                ...success!\n");
+
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <talloc.h>
+
+#include <trust_router/tr_name.h>
+#include <trp_internal.h>
+#include <tr_msg.h>
+
+/* A keepalive survives encoding and decoding, including a digest that needs all 32 bits */
+static void test_kalive_round_trip(void)
+{
+  TRP_KALIVE *kalive=trp_kalive_new(NULL);
+  TRP_KALIVE *out=NULL;
+  TR_MSG msg; /* not a pointer */
+  TR_MSG *decoded=NULL;
+  char *encoded=NULL;
+
+  assert(kalive!=NULL);
+  trp_kalive_set_seq(kalive, 42);
+  trp_kalive_set_digest(kalive, 0xfedcba98);
+  trp_kalive_set_n_routes(kalive, 1234);
+  trp_kalive_set_interval(kalive, 30);
+
+  tr_msg_set_trp_kalive(&msg, kalive);
+  encoded=tr_msg_encode(&msg);
+  assert(encoded!=NULL);
+  decoded=tr_msg_decode(encoded, strlen(encoded));
+  assert(decoded!=NULL);
+  assert(tr_msg_get_msg_type(decoded)==TRP_KEEPALIVE);
+
+  out=tr_msg_get_trp_kalive(decoded);
+  assert(out!=NULL);
+  assert(trp_kalive_get_seq(out)==42);
+  assert(trp_kalive_get_digest(out)==0xfedcba98);
+  assert(trp_kalive_get_n_routes(out)==1234);
+  assert(trp_kalive_get_interval(out)==30);
+  assert(trp_kalive_get_peer(out)==NULL); /* filled in by the receiver */
+
+  tr_msg_free_decoded(decoded);
+  tr_msg_free_encoded(encoded);
+  trp_kalive_free(kalive);
+}
+
+/* A keepalive without a digest is rejected */
+static void test_kalive_no_digest(void)
+{
+  char encoded[]="{\"msg_type\": \"trp_keepalive\", "
+                  "\"msg_body\": {\"seq\": 1, \"n_routes\": 0, \"interval\": 30}}";
+  TR_MSG *decoded=tr_msg_decode(encoded, strlen(encoded));
+
+  assert(decoded!=NULL);
+  assert(tr_msg_get_trp_kalive(decoded)==NULL);
+  tr_msg_free_decoded(decoded);
+}
+
+/* The digest of a route depends on the contents of its names, not on which
+ * copies are used, and on every field. */
+static void test_route_digest(void)
+{
+  TR_NAME *comm=tr_new_name("comm.example");
+  TR_NAME *realm=tr_new_name("realm.example");
+  TR_NAME *trust_router=tr_new_name("tr.example");
+  TR_NAME *other=tr_new_name("other.example");
+  char plain_buf[]="realm.example";
+  TR_NAME plain_realm={plain_buf, sizeof(plain_buf)-1, 0, 0, NULL}; /* not interned */
+  unsigned int digest=trps_route_digest(comm, realm, trust_router, 1);
+
+  assert(digest==trps_route_digest(comm, realm, trust_router, 1));
+  assert(digest==trps_route_digest(comm, &plain_realm, trust_router, 1));
+
+  assert(digest!=trps_route_digest(comm, realm, trust_router, 2));
+  assert(digest!=trps_route_digest(other, realm, trust_router, 1));
+  assert(digest!=trps_route_digest(comm, other, trust_router, 1));
+  assert(digest!=trps_route_digest(comm, realm, other, 1));
+  assert(digest!=trps_route_digest(realm, comm, trust_router, 1)); /* fields are not interchangeable */
+
+  tr_free_name(other);
+  tr_free_name(trust_router);
+  tr_free_name(realm);
+  tr_free_name(comm);
+}
+
+int main(void)
+{
+  printf("Verifying keepalive encoding and decoding...\n");
+  test_kalive_round_trip();
+  test_kalive_no_digest();
+  printf("                                        ...success!\n");
+
+  printf("\nVerifying route digests...\n");
+  test_route_digest();
+  printf("                         ...success!\n");
+
+  return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <trust_router/tr_name.h>
+
+#define N_THREADS 4
+#define N_REFS 10000
+
+/* Equal strings share one atom, and each name holds a reference to it. */
+static void test_shared_atoms(void)
+{
+  size_t n_atoms=tr_name_count_atoms();
+  TR_NAME *one=tr_new_name("realm.example");
+  TR_NAME *two=tr_new_name("realm.example");
+  TR_NAME *other=tr_new_name("other.example");
+  TR_NAME *dup=NULL;
+
+  assert(one!=NULL);
+  assert(one==two);
+  assert(one!=other);
+  assert(one->refcount==2);
+  assert(other->refcount==1);
+  assert(tr_name_count_atoms()==n_atoms+2);
+
+  dup=tr_dup_name(one);
+  assert(dup==one);
+  assert(one->refcount==3);
+
+  tr_free_name(dup);
+  tr_free_name(two);
+  assert(one->refcount==1);
+  assert(tr_name_count_atoms()==n_atoms+2);
+
+  /* the last reference frees the atom */
+  tr_free_name(one);
+  assert(tr_name_count_atoms()==n_atoms+1);
+  tr_free_name(other);
+  assert(tr_name_count_atoms()==n_atoms);
+}
+
+/* A name not created by tr_new_name(), e.g., filled in by hand */
+static TR_NAME *make_plain_name(const char *s)
+{
+  TR_NAME *name=calloc(1, sizeof(TR_NAME));
+
+  assert(name!=NULL);
+  name->buf=strdup(s);
+  assert(name->buf!=NULL);
+  name->len=strlen(s);
+  return name;
+}
+
+/* tr_dup_name() interns names that were not atoms, and tr_free_name() frees those */
+static void test_dup_plain(void)
+{
+  size_t n_atoms=tr_name_count_atoms();
+  TR_NAME *plain=make_plain_name("plain.example");
+  TR_NAME *atom=tr_new_name("plain.example");
+  TR_NAME *dup=tr_dup_name(plain);
+
+  assert(dup==atom);
+  assert(atom->refcount==2);
+  assert(plain->refcount==0);
+  assert(tr_name_count_atoms()==n_atoms+1);
+
+  tr_free_name(plain);
+  tr_free_name(dup);
+  tr_free_name(atom);
+  assert(tr_name_count_atoms()==n_atoms);
+}
+
+/* tr_name_equal() compares atoms by pointer, and falls back to the contents otherwise */
+static void test_equal(void)
+{
+  TR_NAME *atom=tr_new_name("equal.example");
+  TR_NAME *plain=make_plain_name("equal.example");
+  TR_NAME *differ=make_plain_name("equal.exampl_");
+  TR_NAME fake_one={"same", 4, 0, 1, NULL};
+  TR_NAME fake_two={"same", 4, 0, 1, NULL};
+
+  assert(tr_name_equal(atom, atom));
+  assert(tr_name_equal(atom, plain));
+  assert(tr_name_equal(plain, atom));
+  assert(!tr_name_equal(atom, differ));
+  assert(!tr_name_equal(plain, differ));
+
+  /* two atoms are never compared by contents: distinct atoms are distinct names */
+  assert(!tr_name_equal(&fake_one, &fake_two));
+  assert(0==tr_name_cmp(&fake_one, &fake_two));
+
+  tr_free_name(differ);
+  tr_free_name(plain);
+  tr_free_name(atom);
+}
+
+static void *ref_thread(void *arg)
+{
+  TR_NAME *name=(TR_NAME *)arg;
+  TR_NAME *refs[100];
+  size_t ii=0, jj=0;
+
+  for (ii=0; ii<N_REFS/100; ii++) {
+    for (jj=0; jj<100; jj++) {
+      if (jj%2)
+        refs[jj]=tr_dup_name(name);
+      else
+        refs[jj]=tr_new_name("shared.example");
+      assert(refs[jj]==name);
+    }
+    for (jj=0; jj<100; jj++)
+      tr_free_name(refs[jj]);
+  }
+  return NULL;
+}
+
+/* References taken and dropped concurrently are all accounted for */
+static void test_threads(void)
+{
+  size_t n_atoms=tr_name_count_atoms();
+  TR_NAME *name=tr_new_name("shared.example");
+  pthread_t threads[N_THREADS];
+  size_t ii=0;
+
+  for (ii=0; ii<N_THREADS; ii++)
+    assert(0==pthread_create(&threads[ii], NULL, ref_thread, name));
+  for (ii=0; ii<N_THREADS; ii++)
+    assert(0==pthread_join(threads[ii], NULL));
+
+  assert(name->refcount==1);
+  assert(tr_name_count_atoms()==n_atoms+1);
+  tr_free_name(name);
+  assert(tr_name_count_atoms()==n_atoms);
+}
+
+int main(void)
+{
+  printf("Verifying shared atoms...\n");
+  test_shared_atoms();
+  printf("                      ...success!\n");
+
+  printf("\nVerifying duplication of names that are not atoms...\n");
+  test_dup_plain();
+  printf("                                                 ...success!\n");
+
+  printf("\nVerifying name equality...\n");
+  test_equal();
+  printf("                        ...success!\n");
+
+  printf("\nVerifying concurrent references...\n");
+  test_threads();
+  printf("                                ...success!\n");
+
+  return 0;
+}
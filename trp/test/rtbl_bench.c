@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2017, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Route table lookup benchmark. Times trp_rtable_get_entry() on a table of
+ * 100k routes against the same three-level lookup using the old hash
+ * functions, which copied each TR_NAME to a C string on every hash and
+ * comparison. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <glib.h>
+#include <talloc.h>
+
+#include <trust_router/tr_name.h>
+#include <trp_internal.h>
+#include <trp_rtable.h>
+
+#define N_COMM 100
+#define N_REALM 250
+#define N_PEER 4 /* N_COMM*N_REALM*N_PEER routes */
+#define N_LOOKUPS 1000000
+
+/* hash functions as used by the route table before TR_NAME hashes were cached */
+static guint legacy_name_hash(gconstpointer key)
+{
+  const TR_NAME *name=(TR_NAME *)key;
+  gchar *s=g_strndup(name->buf, name->len);
+  guint hash=g_str_hash(s);
+  g_free(s);
+  return hash;
+}
+
+static gboolean legacy_name_equal(gconstpointer key1, gconstpointer key2)
+{
+  const TR_NAME *n1=(TR_NAME *)key1;
+  const TR_NAME *n2=(TR_NAME *)key2;
+  gchar *s1=g_strndup(n1->buf, n1->len);
+  gchar *s2=g_strndup(n2->buf, n2->len);
+  gboolean equal=g_str_equal(s1, s2);
+  g_free(s1);
+  g_free(s2);
+  return equal;
+}
+
+static GHashTable *legacy_get_or_add(GHashTable *tbl, TR_NAME *key)
+{
+  GHashTable *val=g_hash_table_lookup(tbl, key);
+  if (val==NULL) {
+    val=g_hash_table_new_full(legacy_name_hash, legacy_name_equal, NULL, (GDestroyNotify)g_hash_table_destroy);
+    g_hash_table_insert(tbl, key, val);
+  }
+  return val;
+}
+
+static TR_NAME *make_name(const char *prefix, size_t ii)
+{
+  char s[64];
+  snprintf(s, sizeof(s), "%s%zu.example.org", prefix, ii);
+  return tr_new_name(s);
+}
+
+/* point key at a copy of name that is neither interned nor hashed */
+static void set_key(TR_NAME *key, TR_NAME *name)
+{
+  memset(key, 0, sizeof(*key));
+  key->buf=name->buf;
+  key->len=name->len;
+}
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec-start->tv_sec)+(end->tv_nsec-start->tv_nsec)/1e9;
+}
+
+int main(void)
+{
+  TR_NAME *comm[N_COMM];
+  TR_NAME *realm[N_REALM];
+  TR_NAME *peer[N_PEER];
+  TR_NAME key_comm, key_realm, key_peer;
+  TRP_RTABLE *table=trp_rtable_new();
+  GHashTable *legacy=g_hash_table_new_full(legacy_name_hash, legacy_name_equal, NULL, (GDestroyNotify)g_hash_table_destroy);
+  GHashTable *tbl=NULL;
+  TRP_ROUTE *route=NULL;
+  struct timespec start, end;
+  double t_legacy=0, t_new=0;
+  size_t ii=0, jj=0, kk=0;
+  unsigned long found=0;
+
+  for (ii=0; ii<N_COMM; ii++)
+    comm[ii]=make_name("comm", ii);
+  for (ii=0; ii<N_REALM; ii++)
+    realm[ii]=make_name("realm", ii);
+  for (ii=0; ii<N_PEER; ii++)
+    peer[ii]=make_name("peer", ii);
+
+  for (ii=0; ii<N_COMM; ii++) {
+    for (jj=0; jj<N_REALM; jj++) {
+      for (kk=0; kk<N_PEER; kk++) {
+        route=trp_route_new(NULL);
+        trp_route_set_comm(route, tr_dup_name(comm[ii]));
+        trp_route_set_realm(route, tr_dup_name(realm[jj]));
+        trp_route_set_trust_router(route, tr_dup_name(realm[jj]));
+        trp_route_set_peer(route, tr_dup_name(peer[kk]));
+        trp_route_set_metric(route, ii+jj+kk);
+        trp_rtable_add(table, route);
+
+        tbl=legacy_get_or_add(legacy, comm[ii]);
+        tbl=legacy_get_or_add(tbl, realm[jj]);
+        g_hash_table_insert(tbl, peer[kk], route);
+      }
+    }
+  }
+  printf("Route table populated with %d routes.\n", N_COMM*N_REALM*N_PEER);
+
+  /* Lookup keys are names that are not interned and have no cached hash,
+   * as they would be when first decoded from a request. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (ii=0; ii<N_LOOKUPS; ii++) {
+    set_key(&key_comm, comm[ii%N_COMM]);
+    set_key(&key_realm, realm[(ii/N_COMM)%N_REALM]);
+    set_key(&key_peer, peer[ii%N_PEER]);
+    tbl=g_hash_table_lookup(legacy, &key_comm);
+    tbl=g_hash_table_lookup(tbl, &key_realm);
+    if (NULL!=g_hash_table_lookup(tbl, &key_peer))
+      found++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  t_legacy=elapsed(&start, &end);
+  assert(found==N_LOOKUPS);
+
+  found=0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (ii=0; ii<N_LOOKUPS; ii++) {
+    set_key(&key_comm, comm[ii%N_COMM]);
+    set_key(&key_realm, realm[(ii/N_COMM)%N_REALM]);
+    set_key(&key_peer, peer[ii%N_PEER]);
+    if (NULL!=trp_rtable_get_entry(table, &key_comm, &key_realm, &key_peer))
+      found++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  t_new=elapsed(&start, &end);
+  assert(found==N_LOOKUPS);
+
+  printf("%d lookups, copying names:  %.3f s (%.0f ns/lookup)\n",
+         N_LOOKUPS, t_legacy, 1e9*t_legacy/N_LOOKUPS);
+  printf("%d lookups, cached hashes: %.3f s (%.0f ns/lookup)\n",
+         N_LOOKUPS, t_new, 1e9*t_new/N_LOOKUPS);
+  printf("Speedup: %.2fx\n", t_legacy/t_new);
+
+  g_hash_table_destroy(legacy);
+  trp_rtable_free(table);
+  for (ii=0; ii<N_COMM; ii++)
+    tr_free_name(comm[ii]);
+  for (ii=0; ii<N_REALM; ii++)
+    tr_free_name(realm[ii]);
+  for (ii=0; ii<N_PEER; ii++)
+    tr_free_name(peer[ii]);
+  return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+#include <talloc.h>
+
+#include <trust_router/tr_name.h>
+#include <trp_internal.h>
+#include <tr_msg.h>
+
+#define N_UPDS 3
+
+static const char *realm[N_UPDS]={"realm1.example", "realm2.example", "realm3.example"};
+
+static TRP_UPD *make_upd(const char *realm_name, unsigned int metric, unsigned int seq)
+{
+  TRP_UPD *upd=trp_upd_new(NULL);
+  TRP_INFOREC *rec=NULL;
+  TRP_RC rc=TRP_ERROR;
+
+  assert(upd!=NULL);
+  rec=trp_inforec_new(upd, TRP_INFOREC_TYPE_ROUTE);
+  assert(rec!=NULL);
+  trp_upd_set_comm(upd, tr_new_name("comm.example"));
+  trp_upd_set_realm(upd, tr_new_name(realm_name));
+  trp_upd_set_seq(upd, seq);
+  rc=trp_inforec_set_trust_router(rec, tr_new_name("tr.example"));
+  assert(rc==TRP_SUCCESS);
+  rc=trp_inforec_set_metric(rec, metric);
+  assert(rc==TRP_SUCCESS);
+  rc=trp_inforec_set_interval(rec, 30);
+  assert(rc==TRP_SUCCESS);
+  trp_upd_add_inforec(upd, rec);
+  return upd;
+}
+
+static GBytes *make_body(const char *realm_name, unsigned int metric, unsigned int seq)
+{
+  TRP_UPD *upd=make_upd(realm_name, metric, seq);
+  char *encoded=tr_msg_encode_trp_upd_body(upd);
+  GBytes *body=NULL;
+
+  assert(encoded!=NULL);
+  body=g_bytes_new(encoded, strlen(encoded));
+  tr_msg_free_encoded(encoded);
+  trp_upd_free(upd);
+  return body;
+}
+
+/* Decodes msg, which must hold n_upds updates to realm[0..n_upds-1] with metrics 1, 2, ...,
+ * each with sequence number seq. */
+static void verify_decoded(char *encoded, size_t n_upds, unsigned int seq)
+{
+  TR_MSG *msg=tr_msg_decode(encoded, strlen(encoded));
+  TRP_UPD *upd=NULL;
+  TRP_INFOREC *rec=NULL;
+  size_t ii=0;
+
+  assert(msg!=NULL);
+  assert(tr_msg_get_msg_type(msg)==TRP_UPDATE);
+  for (upd=tr_msg_get_trp_upd(msg); upd!=NULL; upd=trp_upd_get_next(upd), ii++) {
+    assert(ii<n_upds);
+    assert(0==strcmp(trp_upd_get_comm(upd)->buf, "comm.example"));
+    assert(0==strcmp(trp_upd_get_realm(upd)->buf, realm[ii]));
+    assert(trp_upd_get_seq(upd)==seq);
+    rec=trp_upd_get_inforec(upd);
+    assert(rec!=NULL);
+    assert(trp_inforec_get_type(rec)==TRP_INFOREC_TYPE_ROUTE);
+    assert(trp_inforec_get_metric(rec)==ii+1);
+    assert(0==strcmp(trp_inforec_get_trust_router(rec)->buf, "tr.example"));
+  }
+  assert(ii==n_upds);
+  tr_msg_free_decoded(msg);
+}
+
+/* Several updates packed into one message decode to a chain, all taking the
+ * message's sequence number */
+static void test_pack(void)
+{
+  GBytes *bodies[N_UPDS];
+  char *encoded=NULL;
+  size_t n_packed=0;
+  size_t ii=0;
+
+  for (ii=0; ii<N_UPDS; ii++)
+    bodies[ii]=make_body(realm[ii], ii+1, 0);
+
+  encoded=tr_msg_pack_trp_upds(bodies, N_UPDS, 7, 65536, &n_packed);
+  assert(encoded!=NULL);
+  assert(n_packed==N_UPDS);
+  verify_decoded(encoded, N_UPDS, 7);
+  tr_msg_free_encoded(encoded);
+
+  /* the first update is always taken, however small the limit */
+  encoded=tr_msg_pack_trp_upds(bodies, N_UPDS, 8, 1, &n_packed);
+  assert(encoded!=NULL);
+  assert(n_packed==1);
+  verify_decoded(encoded, 1, 8);
+  tr_msg_free_encoded(encoded);
+
+  assert(NULL==tr_msg_pack_trp_upds(bodies, 0, 9, 65536, &n_packed));
+  assert(n_packed==0);
+
+  for (ii=0; ii<N_UPDS; ii++)
+    g_bytes_unref(bodies[ii]);
+}
+
+/* The message's sequence number replaces the updates' own; without one, they keep theirs */
+static void test_envelope_seq(void)
+{
+  GBytes *body=make_body(realm[0], 1, 5);
+  char *encoded=NULL;
+  size_t n_packed=0;
+
+  encoded=tr_msg_pack_trp_upds(&body, 1, 9, 65536, &n_packed);
+  assert(encoded!=NULL);
+  verify_decoded(encoded, 1, 9);
+  tr_msg_free_encoded(encoded);
+
+  encoded=g_strdup_printf("{\"msg_type\": \"trp_update\", \"msg_body\": [%.*s]}",
+                          (int)g_bytes_get_size(body), (const char *)g_bytes_get_data(body, NULL));
+  verify_decoded(encoded, 1, 5);
+  g_free(encoded);
+
+  g_bytes_unref(body);
+}
+
+/* An array body with no updates, or with any that cannot be decoded, yields no updates */
+static void test_bad_array(void)
+{
+  GBytes *body=make_body(realm[0], 1, 0);
+  char *bad[3]={NULL, NULL, NULL};
+  TR_MSG *msg=NULL;
+  size_t ii=0;
+
+  bad[0]=g_strdup("{\"msg_type\": \"trp_update\", \"seq\": 3, \"msg_body\": []}");
+  bad[1]=g_strdup_printf("{\"msg_type\": \"trp_update\", \"seq\": 3, \"msg_body\": [%.*s, 17]}",
+                         (int)g_bytes_get_size(body), (const char *)g_bytes_get_data(body, NULL));
+  bad[2]=g_strdup_printf("{\"msg_type\": \"trp_update\", \"seq\": 3, \"msg_body\": [{\"realm\": \"x\"}, %.*s]}",
+                         (int)g_bytes_get_size(body), (const char *)g_bytes_get_data(body, NULL));
+
+  for (ii=0; ii<sizeof(bad)/sizeof(bad[0]); ii++) {
+    msg=tr_msg_decode(bad[ii], strlen(bad[ii]));
+    assert(msg!=NULL);
+    assert(tr_msg_get_msg_type(msg)==TRP_UPDATE);
+    assert(tr_msg_get_trp_upd(msg)==NULL);
+    tr_msg_free_decoded(msg);
+    g_free(bad[ii]);
+  }
+
+  g_bytes_unref(body);
+}
+
+int main(void)
+{
+  printf("Verifying packed updates...\n");
+  test_pack();
+  printf("                         ...success!\n");
+
+  printf("\nVerifying message sequence numbers...\n");
+  test_envelope_seq();
+  printf("                                   ...success!\n");
+
+  printf("\nVerifying empty and invalid arrays...\n");
+  test_bad_array();
+  printf("                                   ...success!\n");
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <jansson.h>
+#include <talloc.h>
+
+#include <trust_router/tr_name.h>
+#include <trp_internal.h>
+#include <tr_debug.h>
+
+static int trp_kalive_destructor(void *object)
+{
+  TRP_KALIVE *kalive=talloc_get_type_abort(object, TRP_KALIVE);
+
+  /* clean up TR_NAME data, which are not managed by talloc */
+  if (kalive->peer != NULL)
+    tr_free_name(kalive->peer);
+
+  return 0;
+}
+
+TRP_KALIVE *trp_kalive_new(TALLOC_CTX *mem_ctx)
+{
+  TRP_KALIVE *new_kalive=talloc(mem_ctx, TRP_KALIVE);
+
+  if (new_kalive != NULL) {
+    new_kalive->seq=0;
+    new_kalive->digest=0;
+    new_kalive->n_routes=0;
+    new_kalive->interval=0;
+    new_kalive->peer=NULL;
+    talloc_set_destructor((void *)new_kalive, trp_kalive_destructor);
+  }
+  return new_kalive;
+}
+
+void trp_kalive_free(TRP_KALIVE *kalive)
+{
+  if (kalive!=NULL)
+    talloc_free(kalive);
+}
+
+unsigned int trp_kalive_get_seq(TRP_KALIVE *kalive)
+{
+  return kalive->seq;
+}
+
+void trp_kalive_set_seq(TRP_KALIVE *kalive, unsigned int seq)
+{
+  kalive->seq=seq;
+}
+
+unsigned int trp_kalive_get_digest(TRP_KALIVE *kalive)
+{
+  return kalive->digest;
+}
+
+void trp_kalive_set_digest(TRP_KALIVE *kalive, unsigned int digest)
+{
+  kalive->digest=digest;
+}
+
+unsigned int trp_kalive_get_n_routes(TRP_KALIVE *kalive)
+{
+  return kalive->n_routes;
+}
+
+void trp_kalive_set_n_routes(TRP_KALIVE *kalive, unsigned int n_routes)
+{
+  kalive->n_routes=n_routes;
+}
+
+unsigned int trp_kalive_get_interval(TRP_KALIVE *kalive)
+{
+  return kalive->interval;
+}
+
+void trp_kalive_set_interval(TRP_KALIVE *kalive, unsigned int interval)
+{
+  kalive->interval=interval;
+}
+
+TR_NAME *trp_kalive_get_peer(TRP_KALIVE *kalive)
+{
+  if (kalive!=NULL)
+    return kalive->peer;
+  else
+    return NULL;
+}
+
+void trp_kalive_set_peer(TRP_KALIVE *kalive, TR_NAME *peer)
+{
+  if (kalive)
+    kalive->peer=peer;
+}
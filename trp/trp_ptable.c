@@ -66,6 +66,12 @@ TRP_PEER *trp_peer_new(TALLOC_CTX *memctx)
     peer->incoming_status=PEER_DISCONNECTED;
     peer->conn_status_cb=NULL;
     peer->conn_status_cookie=NULL;
+    peer->send_seq=0;
+    peer->recv_seq=0;
+    peer->keepalive_ok=0;
+    peer->membs_vouched=(struct timespec){0,0};
+    peer->routes_vouched=(struct timespec){0,0};
+    peer->routes_vouched_interval=0;
     talloc_set_destructor((void *)peer, trp_peer_destructor);
   }
   return peer;
@@ -200,6 +206,66 @@ void trp_peer_set_linkcost(TRP_PEER *peer, unsigned int linkcost)
   peer->linkcost=linkcost;
 }
 
+/* Advance and return the sequence number for the next update to this peer.
+ * Never returns 0, which means "no sequence number" on the wire. */
+unsigned int trp_peer_next_send_seq(TRP_PEER *peer)
+{
+  if (++(peer->send_seq)==0)
+    peer->send_seq=1;
+  return peer->send_seq;
+}
+
+unsigned int trp_peer_get_send_seq(TRP_PEER *peer)
+{
+  return peer->send_seq;
+}
+
+unsigned int trp_peer_get_recv_seq(TRP_PEER *peer)
+{
+  return peer->recv_seq;
+}
+
+void trp_peer_set_recv_seq(TRP_PEER *peer, unsigned int seq)
+{
+  peer->recv_seq=seq;
+}
+
+int trp_peer_get_keepalive_ok(TRP_PEER *peer)
+{
+  return peer->keepalive_ok;
+}
+
+void trp_peer_set_keepalive_ok(TRP_PEER *peer, int ok)
+{
+  peer->keepalive_ok=ok;
+}
+
+struct timespec *trp_peer_get_membs_vouched(TRP_PEER *peer)
+{
+  return &(peer->membs_vouched);
+}
+
+void trp_peer_set_membs_vouched(TRP_PEER *peer, struct timespec *time)
+{
+  peer->membs_vouched=*time;
+}
+
+struct timespec *trp_peer_get_routes_vouched(TRP_PEER *peer)
+{
+  return &(peer->routes_vouched);
+}
+
+unsigned int trp_peer_get_routes_vouched_interval(TRP_PEER *peer)
+{
+  return peer->routes_vouched_interval;
+}
+
+void trp_peer_set_routes_vouched(TRP_PEER *peer, struct timespec *time, unsigned int interval)
+{
+  peer->routes_vouched=*time;
+  peer->routes_vouched_interval=interval;
+}
+
 void trp_peer_set_conn_status_cb(TRP_PEER *peer, void (*cb)(TRP_PEER *, void *), void *cookie)
 {
   peer->conn_status_cb=cb;
@@ -230,6 +296,8 @@ void trp_peer_set_outgoing_status(TRP_PEER *peer, TRP_PEER_CONN_STATUS status)
   TR_NAME *peer_label=trp_peer_get_label(peer);
   int was_connected=trp_peer_is_connected(peer);
   peer->outgoing_status=status;
+  if (was_connected && !trp_peer_is_connected(peer))
+    peer->keepalive_ok=0; /* it may come back as a peer that does not understand keepalives */
   tr_debug("trp_peer_set_outgoing_status: %s: status=%d peer connected was %d now %d.",
            peer_label->buf, status, was_connected, trp_peer_is_connected(peer));
   if ((trp_peer_is_connected(peer) != was_connected) && (peer->conn_status_cb!=NULL))
@@ -246,6 +314,8 @@ void trp_peer_set_incoming_status(TRP_PEER *peer, TRP_PEER_CONN_STATUS status)
   TR_NAME *peer_label=trp_peer_get_label(peer);
   int was_connected=trp_peer_is_connected(peer);
   peer->incoming_status=status;
+  if (was_connected && !trp_peer_is_connected(peer))
+    peer->keepalive_ok=0; /* it may come back as a peer that does not understand keepalives */
   tr_debug("trp_peer_set_incoming_status: %s: status=%d peer connected was %d now %d.",
            peer_label->buf, status, was_connected, trp_peer_is_connected(peer));
   if ((trp_peer_is_connected(peer) != was_connected) && (peer->conn_status_cb!=NULL))
@@ -47,6 +47,16 @@
 
 /* Note: be careful mixing talloc with glib. */
 
+/* The table is a hash of comms, each a hash of realms. Each realm holds a
+ * hash of routes, keyed by peer, and a pointer to its selected route. The
+ * table also indexes its routes by peer, so the routes learned from one
+ * peer can be found without walking the whole table. */
+typedef struct trp_rtable_realm {
+  GHashTable *routes;
+  TRP_ROUTE *selected;
+  GHashTable *peers; /* the table's index by peer, kept up to date as routes are freed */
+} TRP_RTABLE_REALM;
+
 static int trp_route_destructor(void *obj)
 {
   TRP_ROUTE *entry=talloc_get_type_abort(obj, TRP_ROUTE);
@@ -84,6 +94,10 @@ TRP_ROUTE *trp_route_new(TALLOC_CTX *mem_ctx)
     *(entry->expiry)=(struct timespec){0,0};
     entry->local=0;
     entry->triggered=0;
+    entry->penalty=0;
+    entry->penalty_time=(struct timespec){0,0};
+    entry->suppressed=0;
+    entry->rtable_realm=NULL;
     talloc_set_destructor((void *)entry, trp_route_destructor);
   }
   return entry;
@@ -194,6 +208,12 @@ TR_NAME *trp_route_dup_next_hop(TRP_ROUTE *entry)
 void trp_route_set_selected(TRP_ROUTE *entry, int sel)
 {
   entry->selected=sel;
+  if (entry->rtable_realm!=NULL) {
+    if (sel)
+      entry->rtable_realm->selected=entry;
+    else if (entry->rtable_realm->selected==entry)
+      entry->rtable_realm->selected=NULL;
+  }
 }
 
 int trp_route_is_selected(TRP_ROUTE *entry)
@@ -248,37 +268,43 @@ int trp_route_is_triggered(TRP_ROUTE *entry)
   return entry->triggered;
 }
 
+void trp_route_set_penalty(TRP_ROUTE *entry, unsigned int penalty, struct timespec *when)
+{
+  entry->penalty=penalty;
+  entry->penalty_time=*when;
+}
 
-/* result must be freed with g_free */
-static gchar *tr_name_to_g_str(const TR_NAME *n)
+unsigned int trp_route_get_penalty(TRP_ROUTE *entry)
 {
-  gchar *s=g_strndup(n->buf, n->len);
-  if (s==NULL)
-    tr_debug("tr_name_to_g_str: allocation failure.");
-  return s;
+  return entry->penalty;
+}
+
+struct timespec *trp_route_get_penalty_time(TRP_ROUTE *entry)
+{
+  return &(entry->penalty_time);
 }
 
-/* hash function for TR_NAME keys */
+void trp_route_set_suppressed(TRP_ROUTE *entry, int suppressed)
+{
+  entry->suppressed=suppressed;
+}
+
+int trp_route_is_suppressed(TRP_ROUTE *entry)
+{
+  return entry->suppressed;
+}
+
+
+/* hash function for TR_NAME keys (caches the hash on the key, no allocation) */
 static guint trp_tr_name_hash(gconstpointer key)
 {
-  const TR_NAME *name=(TR_NAME *)key;
-  gchar *s=tr_name_to_g_str(name);
-  guint hash=g_str_hash(s);
-  g_free(s);
-  return hash;
+  return tr_name_hash((TR_NAME *)key);
 }
 
 /* hash equality function for TR_NAME keys */
 static gboolean trp_tr_name_equal(gconstpointer key1, gconstpointer key2)
 {
-  const TR_NAME *n1=(TR_NAME *)key1;
-  const TR_NAME *n2=(TR_NAME *)key2;
-  gchar *s1=tr_name_to_g_str(n1);
-  gchar *s2=tr_name_to_g_str(n2);
-  gboolean equal=g_str_equal(s1, s2);
-  g_free(s1);
-  g_free(s2);
-  return equal;
+  return tr_name_equal((TR_NAME *)key1, (TR_NAME *)key2);
 }
 
 /* free a value to the top level rtable (a hash of all entries in the comm) */
@@ -287,9 +313,37 @@ static void trp_rtable_destroy_table(gpointer data)
   g_hash_table_destroy(data);
 }
 
+/* take an entry out of the index by peer */
+static void trp_rtable_unindex(GHashTable *peers, TRP_ROUTE *entry)
+{
+  GHashTable *peer_routes=g_hash_table_lookup(peers, entry->peer);
+
+  if (peer_routes==NULL)
+    return;
+  g_hash_table_remove(peer_routes, entry);
+  if (g_hash_table_size(peer_routes)==0)
+    g_hash_table_remove(peers, entry->peer);
+}
+
 static void trp_rtable_destroy_rentry(gpointer data)
 {
-  trp_route_free(data);
+  TRP_ROUTE *entry=(TRP_ROUTE *)data;
+
+  if (entry->rtable_realm!=NULL) {
+    if (entry->rtable_realm->selected==entry)
+      entry->rtable_realm->selected=NULL;
+    trp_rtable_unindex(entry->rtable_realm->peers, entry);
+  }
+  trp_route_free(entry);
+}
+
+/* free a value in a comm table */
+static void trp_rtable_destroy_realm(gpointer data)
+{
+  TRP_RTABLE_REALM *realm=(TRP_RTABLE_REALM *)data;
+
+  g_hash_table_destroy(realm->routes); /* clears realm->selected */
+  g_free(realm);
 }
 
 static void trp_rtable_destroy_tr_name(gpointer data)
@@ -299,16 +353,24 @@ static void trp_rtable_destroy_tr_name(gpointer data)
 
 TRP_RTABLE *trp_rtable_new(void)
 {
-  GHashTable *new=g_hash_table_new_full(trp_tr_name_hash,
-                                        trp_tr_name_equal,
-                                        trp_rtable_destroy_tr_name,
-                                        trp_rtable_destroy_table);
+  TRP_RTABLE *new=g_new0(TRP_RTABLE, 1);
+
+  new->comms=g_hash_table_new_full(trp_tr_name_hash,
+                                   trp_tr_name_equal,
+                                   trp_rtable_destroy_tr_name,
+                                   trp_rtable_destroy_table);
+  new->peers=g_hash_table_new_full(trp_tr_name_hash,
+                                   trp_tr_name_equal,
+                                   trp_rtable_destroy_tr_name,
+                                   trp_rtable_destroy_table);
   return new;
 }
 
 void trp_rtable_free(TRP_RTABLE *rtbl)
 {
-  g_hash_table_destroy(rtbl);
+  g_hash_table_destroy(rtbl->comms); /* takes the routes out of rtbl->peers */
+  g_hash_table_destroy(rtbl->peers);
+  g_free(rtbl);
 }
 
 static GHashTable *trp_rtbl_get_or_add_table(GHashTable *tbl, TR_NAME *key, GDestroyNotify destroy)
@@ -326,14 +388,41 @@ static GHashTable *trp_rtbl_get_or_add_table(GHashTable *tbl, TR_NAME *key, GDes
   return val_tbl;
 }
 
+static TRP_RTABLE_REALM *trp_rtbl_get_or_add_realm(TRP_RTABLE *rtbl, GHashTable *comm_tbl, TR_NAME *key)
+{
+  TRP_RTABLE_REALM *realm=NULL;
+
+  realm=g_hash_table_lookup(comm_tbl, key);
+  if (realm==NULL) {
+    realm=g_new0(TRP_RTABLE_REALM, 1);
+    realm->peers=rtbl->peers;
+    realm->routes=g_hash_table_new_full(trp_tr_name_hash,
+                                        trp_tr_name_equal,
+                                        trp_rtable_destroy_tr_name,
+                                        trp_rtable_destroy_rentry);
+    g_hash_table_insert(comm_tbl, tr_dup_name(key), realm);
+  }
+  return realm;
+}
+
 void trp_rtable_add(TRP_RTABLE *rtbl, TRP_ROUTE *entry)
 {
   GHashTable *comm_tbl=NULL;
-  GHashTable *realm_tbl=NULL;
-
-  comm_tbl=trp_rtbl_get_or_add_table(rtbl, entry->comm, trp_rtable_destroy_table);
-  realm_tbl=trp_rtbl_get_or_add_table(comm_tbl, entry->realm, trp_rtable_destroy_rentry);
-  g_hash_table_insert(realm_tbl, tr_dup_name(entry->peer), entry); /* destroys and replaces a duplicate */
+  TRP_RTABLE_REALM *realm=NULL;
+  GHashTable *peer_routes=NULL;
+
+  comm_tbl=trp_rtbl_get_or_add_table(rtbl->comms, entry->comm, trp_rtable_destroy_realm);
+  realm=trp_rtbl_get_or_add_realm(rtbl, comm_tbl, entry->realm);
+  g_hash_table_insert(realm->routes, tr_dup_name(entry->peer), entry); /* destroys and replaces a duplicate */
+  entry->rtable_realm=realm;
+  peer_routes=g_hash_table_lookup(rtbl->peers, entry->peer);
+  if (peer_routes==NULL) {
+    peer_routes=g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(rtbl->peers, tr_dup_name(entry->peer), peer_routes);
+  }
+  g_hash_table_add(peer_routes, entry);
+  if (entry->selected)
+    realm->selected=entry;
   /* the route entry should not belong to any context, we will manage it ourselves */
   talloc_steal(NULL, entry);
 }
@@ -342,39 +431,40 @@ void trp_rtable_add(TRP_RTABLE *rtbl, TRP_ROUTE *entry)
 void trp_rtable_remove(TRP_RTABLE *rtbl, TRP_ROUTE *entry)
 {
   GHashTable *comm_tbl=NULL;
-  GHashTable *realm_tbl=NULL;
+  TRP_RTABLE_REALM *realm=NULL;
 
-  comm_tbl=g_hash_table_lookup(rtbl, entry->comm);
+  comm_tbl=g_hash_table_lookup(rtbl->comms, entry->comm);
   if (comm_tbl==NULL)
     return;
 
-  realm_tbl=g_hash_table_lookup(comm_tbl, entry->realm);
-  if (realm_tbl==NULL)
+  realm=g_hash_table_lookup(comm_tbl, entry->realm);
+  if (realm==NULL)
     return;
 
   /* remove the element */
-  g_hash_table_remove(realm_tbl, entry->peer);
+  g_hash_table_remove(realm->routes, entry->peer);
   /* if that was the last entry in the realm, remove the realm table */
-  if (g_hash_table_size(realm_tbl)==0)
+  if (g_hash_table_size(realm->routes)==0)
     g_hash_table_remove(comm_tbl, entry->realm);
   /* if that was the last realm in the comm, remove the comm table */
   if (g_hash_table_size(comm_tbl)==0)
-    g_hash_table_remove(rtbl, entry->comm);
+    g_hash_table_remove(rtbl->comms, entry->comm);
 }
 
 void trp_rtable_clear(TRP_RTABLE *rtbl)
 {
-  g_hash_table_remove_all(rtbl); /* destructors should do all the cleanup */
+  g_hash_table_remove_all(rtbl->comms); /* destructors should do all the cleanup */
+  g_hash_table_remove_all(rtbl->peers); /* should be empty by now */
 }
 
 /* gets the actual hash table, for internal use only */
 static GHashTable *trp_rtable_get_comm_table(TRP_RTABLE *rtbl, TR_NAME *comm)
 {
-  return g_hash_table_lookup(rtbl, comm);
+  return g_hash_table_lookup(rtbl->comms, comm);
 }
 
-/* gets the actual hash table, for internal use only */
-static GHashTable *trp_rtable_get_realm_table(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm)
+/* for internal use only */
+static TRP_RTABLE_REALM *trp_rtable_get_realm(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm)
 {
   GHashTable *comm_tbl=trp_rtable_get_comm_table(rtbl, comm);
   if (comm_tbl==NULL)
@@ -383,6 +473,16 @@ static GHashTable *trp_rtable_get_realm_table(TRP_RTABLE *rtbl, TR_NAME *comm, T
     return g_hash_table_lookup(comm_tbl, realm);
 }
 
+/* gets the actual hash table, for internal use only */
+static GHashTable *trp_rtable_get_realm_table(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm)
+{
+  TRP_RTABLE_REALM *realm_entry=trp_rtable_get_realm(rtbl, comm, realm);
+  if (realm_entry==NULL)
+    return NULL;
+  else
+    return realm_entry->routes;
+}
+
 struct table_size_cookie {
   TRP_RTABLE *rtbl;
   size_t size;
@@ -395,7 +495,7 @@ static void trp_rtable_size_helper(gpointer key, gpointer value, gpointer user_d
 size_t trp_rtable_size(TRP_RTABLE *rtbl)
 {
   struct table_size_cookie data={rtbl, 0};
-  g_hash_table_foreach(rtbl, trp_rtable_size_helper, &data);
+  g_hash_table_foreach(rtbl->comms, trp_rtable_size_helper, &data);
   return data.size;
 }
 
@@ -425,9 +525,7 @@ size_t trp_rtable_realm_size(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm)
   if (realm_tbl==NULL)
     return 0;
   else
-    return g_hash_table_size(g_hash_table_lookup(
-                               g_hash_table_lookup(rtbl, comm),
-                               realm));
+    return g_hash_table_size(realm_tbl);
 }
 
 /* Returns an array of pointers to TRP_ROUTE, length of array in n_out.
@@ -476,7 +574,7 @@ TRP_ROUTE **trp_rtable_get_entries(TRP_RTABLE *rtbl, size_t *n_out)
  * Caller must free the array (in the talloc NULL context). */
 TR_NAME **trp_rtable_get_comms(TRP_RTABLE *rtbl, size_t *n_out)
 {
-  size_t len=g_hash_table_size(rtbl); /* known comms are keys in top level hash table */
+  size_t len=g_hash_table_size(rtbl->comms); /* known comms are keys in top level hash table */
   size_t ii=0;
   GList *comms=NULL;;
   GList *p=NULL;
@@ -493,7 +591,7 @@ TR_NAME **trp_rtable_get_comms(TRP_RTABLE *rtbl, size_t *n_out)
     *n_out=0;
     return NULL;
   }
-  comms=g_hash_table_get_keys(rtbl);
+  comms=g_hash_table_get_keys(rtbl->comms);
   for (ii=0,p=comms; p!=NULL; ii++,p=g_list_next(p))
     ret[ii]=(TR_NAME *)p->data;
 
@@ -508,7 +606,7 @@ TR_NAME **trp_rtable_get_comms(TRP_RTABLE *rtbl, size_t *n_out)
 TR_NAME **trp_rtable_get_comm_realms(TRP_RTABLE *rtbl, TR_NAME *comm, size_t *n_out)
 {
   size_t ii=0;
-  TRP_RTABLE *comm_tbl=g_hash_table_lookup(rtbl, comm);;
+  GHashTable *comm_tbl=g_hash_table_lookup(rtbl->comms, comm);
   GList *entries=NULL;
   GList *p=NULL;
   TR_NAME **ret=NULL;
@@ -620,6 +718,34 @@ TR_NAME **trp_rtable_get_comm_realm_peers(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NA
   return ret;
 }
 
+/* Returns an array of pointers to the routes learned from peer, length of array
+ * in n_out. Caller must free the array (in the talloc NULL context), but must not
+ * free its contents. */
+TRP_ROUTE **trp_rtable_get_peer_entries(TRP_RTABLE *rtbl, TR_NAME *peer, size_t *n_out)
+{
+  GHashTable *peer_routes=g_hash_table_lookup(rtbl->peers, peer);
+  GHashTableIter iter;
+  TRP_ROUTE *entry=NULL;
+  TRP_ROUTE **ret=NULL;
+  size_t ii=0;
+
+  *n_out=0;
+  if (peer_routes==NULL)
+    return NULL;
+
+  ret=talloc_array(NULL, TRP_ROUTE *, g_hash_table_size(peer_routes));
+  if (ret==NULL) {
+    tr_crit("trp_rtable_get_peer_entries: unable to allocate return array.");
+    return NULL;
+  }
+  g_hash_table_iter_init(&iter, peer_routes);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&entry, NULL))
+    ret[ii++]=entry;
+
+  *n_out=ii;
+  return ret;
+}
+
 /* Gets a single entry. Do not free it. */
 TRP_ROUTE *trp_rtable_get_entry(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm, TR_NAME *peer)
 {
@@ -651,28 +777,14 @@ static char *timespec_to_str(struct timespec *ts)
   return s;
 }
 
+/* Gets the selected route for a realm, or NULL if none. Do not free it. */
 TRP_ROUTE *trp_rtable_get_selected_entry(TRP_RTABLE *rtbl, TR_NAME *comm, TR_NAME *realm)
 {
-  size_t n=0;
-  int ii=0;
-  TRP_ROUTE **entry=trp_rtable_get_realm_entries(rtbl, comm, realm, &n);
-  TRP_ROUTE *selected=NULL;
+  TRP_RTABLE_REALM *realm_entry=trp_rtable_get_realm(rtbl, comm, realm);
 
-  if (n==0)
+  if (realm_entry==NULL)
     return NULL;
-
-  tr_debug("trp_rtable_get_selected_entry: looking through route table entries for realm %.*s.",
-           realm->len, realm->buf);
-  for(ii=0; ii<n; ii++) {
-    if (trp_route_is_selected(entry[ii])) {
-      selected=entry[ii];
-      break;
-    }
-  }
-  tr_debug("trp_rtable_get_selected_entry: ii=%d.", ii);
-
-  talloc_free(entry);
-  return selected;
+  return realm_entry->selected;
 }
 
 /* Pretty print a route table entry to a newly allocated string. If sep is NULL,
@@ -139,8 +139,6 @@ static int trp_inforec_comm_destructor(void *obj)
     tr_free_name(rec->owner_realm);
   if (rec->owner_contact!=NULL)
     tr_free_name(rec->owner_contact);
-  if (rec->provenance!=NULL)
-    json_decref(rec->provenance);
   return 0;
 }
 
@@ -511,8 +509,8 @@ TRP_RC trp_inforec_set_owner_contact(TRP_INFOREC *rec, TR_NAME *name)
   return TRP_ERROR;
 }
 
-/* caller needs to incref the output if they're going to hang on to it */
-json_t *trp_inforec_get_provenance(TRP_INFOREC *rec)
+/* caller must dup the output if they're going to hang on to it */
+TR_PROVENANCE *trp_inforec_get_provenance(TRP_INFOREC *rec)
 {
   switch (rec->type) {
   case TRP_INFOREC_TYPE_COMMUNITY:
@@ -525,16 +523,17 @@ json_t *trp_inforec_get_provenance(TRP_INFOREC *rec)
   return NULL;
 }
 
-/* increments the reference count */
-TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, json_t *prov)
+/* takes ownership of prov, moves it into the record's context */
+TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, TR_PROVENANCE *prov)
 {
   switch (rec->type) {
   case TRP_INFOREC_TYPE_COMMUNITY:
     if (rec->data->comm!=NULL) {
       if (rec->data->comm->provenance!=NULL)
-        json_decref(rec->data->comm->provenance);
+        tr_provenance_free(rec->data->comm->provenance);
       rec->data->comm->provenance=prov;
-      json_incref(prov);
+      if (prov!=NULL)
+        talloc_steal(rec->data->comm, prov);
       return TRP_SUCCESS;
     }
     break;
@@ -546,27 +545,18 @@ TRP_RC trp_inforec_set_provenance(TRP_INFOREC *rec, json_t *prov)
 
 static TRP_RC trp_inforec_add_to_provenance(TRP_INFOREC *rec, TR_NAME *name)
 {
-  json_t *jname=NULL;
-
   switch (rec->type) {
   case TRP_INFOREC_TYPE_ROUTE:
     /* no provenance list */
     break;
   case TRP_INFOREC_TYPE_COMMUNITY:
-    jname=tr_name_to_json_string(name);
-    if (jname==NULL)
-      return TRP_ERROR;
     if (rec->data->comm->provenance==NULL) {
-      rec->data->comm->provenance=json_array();
-      if (rec->data->comm->provenance==NULL) {
-        json_decref(jname);
+      rec->data->comm->provenance=tr_provenance_new(rec->data->comm);
+      if (rec->data->comm->provenance==NULL)
         return TRP_ERROR;
-      }
     }
-    if (0!=json_array_append_new(rec->data->comm->provenance, jname)) {
-      json_decref(jname);
+    if (0!=tr_provenance_add(rec->data->comm->provenance, name))
       return TRP_ERROR;
-    }
     break;
   default:
     break;
@@ -576,20 +566,16 @@ static TRP_RC trp_inforec_add_to_provenance(TRP_INFOREC *rec, TR_NAME *name)
 
 TR_NAME *trp_inforec_dup_origin(TRP_INFOREC *rec)
 {
-  TR_NAME *origin=NULL;
-  json_t *prov=trp_inforec_get_provenance(rec);
-  const char *s=NULL;
+  TR_PROVENANCE *prov=trp_inforec_get_provenance(rec);
 
   if (prov==NULL)
     return NULL;
 
-  s=json_string_value(json_array_get(prov, 0));
-  if (s==NULL) {
+  if (tr_provenance_len(prov)==0) {
     tr_debug("trp_inforec_dup_origin: empty origin in provenance list.");
     return NULL;
   }
-  origin=tr_new_name(s);
-  return origin;
+  return tr_dup_name(tr_provenance_get_origin(prov));
 }
 
 /* generic record type */
@@ -642,6 +628,8 @@ TRP_UPD *trp_upd_new(TALLOC_CTX *mem_ctx)
     new_body->comm=NULL;
     new_body->records=NULL;
     new_body->peer=NULL;
+    new_body->seq=0;
+    new_body->next=NULL;
     talloc_set_destructor((void *)new_body, trp_upd_destructor);
   }
   return new_body;
@@ -726,6 +714,28 @@ void trp_upd_set_peer(TRP_UPD *upd, TR_NAME *peer)
   upd->peer=peer;
 }
 
+unsigned int trp_upd_get_seq(TRP_UPD *upd)
+{
+  return upd->seq;
+}
+
+void trp_upd_set_seq(TRP_UPD *upd, unsigned int seq)
+{
+  upd->seq=seq;
+}
+
+TRP_UPD *trp_upd_get_next(TRP_UPD *upd)
+{
+  return upd->next;
+}
+
+/* Does not take ownership of next. When decoding, later updates are
+ * allocated in the first one's talloc context so they are freed with it. */
+void trp_upd_set_next(TRP_UPD *upd, TRP_UPD *next)
+{
+  upd->next=next;
+}
+
 void trp_upd_set_next_hop(TRP_UPD *upd, const char *hostname, unsigned int port)
 {
   TRP_INFOREC *rec=NULL;
@@ -52,11 +52,192 @@
 #include <tr_debug.h>
 #include <tr_util.h>
 
+static TRP_RC trps_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename, TR_NAME *comm, TR_NAME *realm);
+
+/* key for the set of comm/realm pairs needing route selection */
+typedef struct trps_route_key {
+  TR_NAME *comm;
+  TR_NAME *realm;
+} TRPS_ROUTE_KEY;
+
+static guint trps_route_key_hash(gconstpointer key)
+{
+  const TRPS_ROUTE_KEY *rk=(const TRPS_ROUTE_KEY *)key;
+  return 31*tr_name_hash(rk->comm) + tr_name_hash(rk->realm);
+}
+
+static gboolean trps_route_key_equal(gconstpointer key1, gconstpointer key2)
+{
+  const TRPS_ROUTE_KEY *rk1=(const TRPS_ROUTE_KEY *)key1;
+  const TRPS_ROUTE_KEY *rk2=(const TRPS_ROUTE_KEY *)key2;
+  return tr_name_equal(rk1->comm, rk2->comm) && tr_name_equal(rk1->realm, rk2->realm);
+}
+
+static void trps_route_key_destroy(gpointer data)
+{
+  TRPS_ROUTE_KEY *rk=(TRPS_ROUTE_KEY *)data;
+  tr_free_name(rk->comm);
+  tr_free_name(rk->realm);
+  g_free(rk);
+}
+
+static void trps_retraction_destroy(gpointer data)
+{
+  talloc_free(data);
+}
+
+/* key for the set of memberships awaiting a triggered update */
+typedef struct trps_memb_key {
+  TR_NAME *comm;
+  TR_NAME *realm;
+  TR_NAME *origin;
+  TR_REALM_ROLE role;
+  TR_COMM_TYPE comm_type; /* not part of the key, needed to withdraw the membership */
+} TRPS_MEMB_KEY;
+
+static guint trps_memb_key_hash(gconstpointer key)
+{
+  const TRPS_MEMB_KEY *mk=(const TRPS_MEMB_KEY *)key;
+  return 31*(31*(31*tr_name_hash(mk->comm) + tr_name_hash(mk->realm)) + tr_name_hash(mk->origin)) + mk->role;
+}
+
+static gboolean trps_memb_key_equal(gconstpointer key1, gconstpointer key2)
+{
+  const TRPS_MEMB_KEY *mk1=(const TRPS_MEMB_KEY *)key1;
+  const TRPS_MEMB_KEY *mk2=(const TRPS_MEMB_KEY *)key2;
+  return (mk1->role==mk2->role)
+    && tr_name_equal(mk1->comm, mk2->comm)
+    && tr_name_equal(mk1->realm, mk2->realm)
+    && tr_name_equal(mk1->origin, mk2->origin);
+}
+
+static void trps_memb_key_destroy(gpointer data)
+{
+  TRPS_MEMB_KEY *mk=(TRPS_MEMB_KEY *)data;
+  tr_free_name(mk->comm);
+  tr_free_name(mk->realm);
+  tr_free_name(mk->origin);
+  g_free(mk);
+}
+
+static void trps_expiry_free_names(TRPS_EXPIRY *exp)
+{
+  if (exp->comm!=NULL)
+    tr_free_name(exp->comm);
+  if (exp->realm!=NULL)
+    tr_free_name(exp->realm);
+  if (exp->peer!=NULL)
+    tr_free_name(exp->peer);
+}
+
+static void trps_expiry_heap_clear(TRPS_EXPIRY_HEAP *heap)
+{
+  size_t ii=0;
+
+  for (ii=0; ii<heap->len; ii++)
+    trps_expiry_free_names(heap->items+ii);
+  heap->len=0;
+}
+
+static int trps_expiry_heap_destructor(void *object)
+{
+  trps_expiry_heap_clear(talloc_get_type_abort(object, TRPS_EXPIRY_HEAP));
+  return 0;
+}
+
+static TRPS_EXPIRY_HEAP *trps_expiry_heap_new(TALLOC_CTX *mem_ctx)
+{
+  TRPS_EXPIRY_HEAP *heap=talloc_zero(mem_ctx, TRPS_EXPIRY_HEAP);
+  if (heap!=NULL)
+    talloc_set_destructor((void *)heap, trps_expiry_heap_destructor);
+  return heap;
+}
+
+static int trps_expiry_before(TRPS_EXPIRY_HEAP *heap, size_t ii, size_t jj)
+{
+  return (tr_cmp_timespec(&(heap->items[ii].when), &(heap->items[jj].when)) < 0);
+}
+
+static void trps_expiry_swap(TRPS_EXPIRY_HEAP *heap, size_t ii, size_t jj)
+{
+  TRPS_EXPIRY tmp=heap->items[ii];
+  heap->items[ii]=heap->items[jj];
+  heap->items[jj]=tmp;
+}
+
+/* Schedule an expiry. Takes new references to the names. */
+static TRP_RC trps_expiry_push(TRPS_EXPIRY_HEAP *heap,
+                               struct timespec *when,
+                               TR_REALM_ROLE role,
+                               TR_NAME *comm,
+                               TR_NAME *realm,
+                               TR_NAME *peer)
+{
+  TRPS_EXPIRY *new_items=NULL;
+  size_t ii=0;
+
+  if (heap->len==heap->size) {
+    new_items=talloc_realloc(heap, heap->items, TRPS_EXPIRY, (heap->size==0)?64:2*heap->size);
+    if (new_items==NULL) {
+      tr_err("trps_expiry_push: unable to grow expiry heap.");
+      return TRP_NOMEM;
+    }
+    heap->items=new_items;
+    heap->size=(heap->size==0)?64:2*heap->size;
+  }
+
+  ii=heap->len++;
+  heap->items[ii].when=*when;
+  heap->items[ii].role=role;
+  heap->items[ii].comm=tr_dup_name(comm);
+  heap->items[ii].realm=tr_dup_name(realm);
+  heap->items[ii].peer=tr_dup_name(peer);
+  /* sift up */
+  while ((ii>0) && trps_expiry_before(heap, ii, (ii-1)/2)) {
+    trps_expiry_swap(heap, ii, (ii-1)/2);
+    ii=(ii-1)/2;
+  }
+  return TRP_SUCCESS;
+}
+
+/* Removes the soonest expiry into *out if it is due at now. Caller must
+ * free its names with trps_expiry_free_names(). Returns 0 if nothing is due. */
+static int trps_expiry_pop_due(TRPS_EXPIRY_HEAP *heap, struct timespec *now, TRPS_EXPIRY *out)
+{
+  size_t ii=0, child=0;
+
+  if ((heap->len==0) || (tr_cmp_timespec(now, &(heap->items[0].when)) < 0))
+    return 0;
+
+  *out=heap->items[0];
+  heap->items[0]=heap->items[--heap->len];
+  /* sift down */
+  while ((child=2*ii+1) < heap->len) {
+    if ((child+1 < heap->len) && trps_expiry_before(heap, child+1, child))
+      child++;
+    if (!trps_expiry_before(heap, child, ii))
+      break;
+    trps_expiry_swap(heap, ii, child);
+    ii=child;
+  }
+  return 1;
+}
+
 static int trps_destructor(void *object)
 {
   TRPS_INSTANCE *trps=talloc_get_type_abort(object, TRPS_INSTANCE);
   if (trps->rtable!=NULL)
     trp_rtable_free(trps->rtable);
+  if (trps->dirty_routes!=NULL)
+    g_hash_table_destroy(trps->dirty_routes);
+  if (trps->suppressed_routes!=NULL)
+    g_hash_table_destroy(trps->suppressed_routes);
+  if (trps->withdrawn_routes!=NULL)
+    g_hash_table_destroy(trps->withdrawn_routes);
+  if (trps->triggered_routes!=NULL)
+    g_hash_table_destroy(trps->triggered_routes);
+  if (trps->triggered_membs!=NULL)
+    g_hash_table_destroy(trps->triggered_membs);
   return 0;
 }
 
@@ -71,7 +252,21 @@ TRPS_INSTANCE *trps_new (TALLOC_CTX *mem_ctx)
     trps->trpc=NULL;
     trps->update_interval=(struct timeval){0,0};
     trps->sweep_interval=(struct timeval){0,0};
+    trps->update_holddown=(struct timeval){0,0};
+    trps->max_update_bytes=0;
+    trps->flap_penalty=0;
+    trps->flap_suppress=0;
+    trps->flap_reuse=0;
+    trps->flap_half_life=0;
+    trps->metric_hysteresis=0;
     trps->ptable=NULL;
+    trps->dirty_routes=NULL;
+    trps->suppressed_routes=NULL;
+    trps->withdrawn_routes=NULL;
+    trps->triggered_routes=NULL;
+    trps->triggered_membs=NULL;
+    trps->route_expiry=NULL;
+    trps->memb_expiry=NULL;
 
     trps->mq=tr_mq_new(trps);
     if (trps->mq==NULL) {
@@ -81,13 +276,40 @@ TRPS_INSTANCE *trps_new (TALLOC_CTX *mem_ctx)
     }
 
     trps->rtable=NULL;
+    talloc_set_destructor((void *)trps, trps_destructor);
     if (trps_init_rtable(trps) != TRP_SUCCESS) {
       /* failed to allocate rtable */
       talloc_free(trps);
       return NULL;
     }
 
-    talloc_set_destructor((void *)trps, trps_destructor);
+    trps->dirty_routes=g_hash_table_new_full(trps_route_key_hash,
+                                             trps_route_key_equal,
+                                             trps_route_key_destroy,
+                                             NULL);
+    trps->suppressed_routes=g_hash_table_new_full(trps_route_key_hash,
+                                                  trps_route_key_equal,
+                                                  trps_route_key_destroy,
+                                                  NULL);
+    trps->withdrawn_routes=g_hash_table_new_full(trps_route_key_hash,
+                                                 trps_route_key_equal,
+                                                 trps_route_key_destroy,
+                                                 trps_retraction_destroy);
+    trps->triggered_routes=g_hash_table_new_full(trps_route_key_hash,
+                                                 trps_route_key_equal,
+                                                 trps_route_key_destroy,
+                                                 NULL);
+    trps->triggered_membs=g_hash_table_new_full(trps_memb_key_hash,
+                                                trps_memb_key_equal,
+                                                trps_memb_key_destroy,
+                                                NULL);
+
+    trps->route_expiry=trps_expiry_heap_new(trps);
+    trps->memb_expiry=trps_expiry_heap_new(trps);
+    if ((trps->route_expiry==NULL) || (trps->memb_expiry==NULL)) {
+      talloc_free(trps);
+      return NULL;
+    }
   }
   return trps;
 }
@@ -104,12 +326,161 @@ TRP_RC trps_init_rtable(TRPS_INSTANCE *trps)
   if (trps->rtable==NULL) {
     return TRP_NOMEM;
   }
+  if (trps->dirty_routes!=NULL)
+    g_hash_table_remove_all(trps->dirty_routes);
+  if (trps->suppressed_routes!=NULL)
+    g_hash_table_remove_all(trps->suppressed_routes);
+  if (trps->triggered_routes!=NULL)
+    g_hash_table_remove_all(trps->triggered_routes);
   return TRP_SUCCESS;
 }
 
 void trps_clear_rtable(TRPS_INSTANCE *trps)
 {
   trp_rtable_clear(trps->rtable);
+  g_hash_table_remove_all(trps->dirty_routes);
+  g_hash_table_remove_all(trps->suppressed_routes);
+  g_hash_table_remove_all(trps->triggered_routes);
+  trps_expiry_heap_clear(trps->route_expiry);
+}
+
+/* add comm/realm to a set keyed by TRPS_ROUTE_KEY */
+static void trps_route_set_add(GHashTable *set, TR_NAME *comm, TR_NAME *realm)
+{
+  TRPS_ROUTE_KEY key={comm, realm};
+  TRPS_ROUTE_KEY *new_key=NULL;
+
+  if (g_hash_table_contains(set, &key))
+    return;
+
+  new_key=g_new(TRPS_ROUTE_KEY, 1);
+  new_key->comm=tr_dup_name(comm);
+  new_key->realm=tr_dup_name(realm);
+  g_hash_table_add(set, new_key);
+}
+
+/* Note that the selected route for comm/realm must be recomputed. Call this
+ * whenever a route's metric changes or a route is added or removed. */
+static void trps_mark_dirty(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
+{
+  trps_route_set_add(trps->dirty_routes, comm, realm);
+}
+
+/* Note that route must go out with the next triggered update. Triggered updates
+ * only look at the comm/realm pairs noted here. */
+static void trps_mark_route_triggered(TRPS_INSTANCE *trps, TRP_ROUTE *route)
+{
+  trp_route_set_triggered(route, 1);
+  trps_route_set_add(trps->triggered_routes, trp_route_get_comm(route), trp_route_get_realm(route));
+}
+
+/* Triggered routes have been sent; stop tracking them. */
+static void trps_clear_triggered_routes(TRPS_INSTANCE *trps)
+{
+  GHashTableIter iter;
+  TRPS_ROUTE_KEY *key=NULL;
+  TRP_ROUTE **entry=NULL;
+  size_t n_entry=0;
+  size_t ii=0;
+
+  g_hash_table_iter_init(&iter, trps->triggered_routes);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL)) {
+    entry=trp_rtable_get_realm_entries(trps->rtable, key->comm, key->realm, &n_entry);
+    for (ii=0; ii<n_entry; ii++)
+      trp_route_set_triggered(entry[ii], 0);
+    if (entry!=NULL)
+      talloc_free(entry);
+  }
+  g_hash_table_remove_all(trps->triggered_routes);
+}
+
+/* Note that memb must go out with the next triggered update. Call this
+ * before a membership is removed as well as when it changes, so that its
+ * removal is sent. */
+static void trps_mark_memb_triggered(TRPS_INSTANCE *trps, TR_COMM_MEMB *memb)
+{
+  TR_COMM *comm=tr_comm_memb_get_comm(memb);
+  TRPS_MEMB_KEY key={tr_comm_get_id(comm),
+                     tr_comm_memb_get_realm_id(memb),
+                     tr_comm_memb_get_origin(memb),
+                     tr_comm_memb_get_role(memb),
+                     tr_comm_get_type(comm)};
+  TRPS_MEMB_KEY *new_key=NULL;
+
+  tr_comm_memb_set_triggered(memb, 1);
+  if ((key.origin==NULL) || g_hash_table_contains(trps->triggered_membs, &key))
+    return; /* local memberships are not withdrawn this way */
+
+  new_key=g_new(TRPS_MEMB_KEY, 1);
+  *new_key=key;
+  new_key->comm=tr_dup_name(key.comm);
+  new_key->realm=tr_dup_name(key.realm);
+  new_key->origin=tr_dup_name(key.origin);
+  g_hash_table_add(trps->triggered_membs, new_key);
+}
+
+/* A route advertising comm/realm as unreachable, not in the routing table. */
+static TRP_ROUTE *trps_new_retraction(TALLOC_CTX *mem_ctx, TR_NAME *comm, TR_NAME *realm)
+{
+  TRP_ROUTE *route=trp_route_new(mem_ctx);
+
+  if (route==NULL)
+    return NULL;
+  trp_route_set_comm(route, tr_dup_name(comm));
+  trp_route_set_realm(route, tr_dup_name(realm));
+  trp_route_set_peer(route, tr_new_name(""));
+  trp_route_set_metric(route, TRP_METRIC_INFINITY);
+  trp_route_set_trust_router(route, tr_new_name(""));
+  trp_route_set_next_hop(route, tr_new_name(""));
+  return route;
+}
+
+/* Note that a peer may have lost its advertised route to comm/realm, because
+ * the selected route was withdrawn or suppressed, or because it now goes through
+ * that peer. The next triggered update tells each peer what it should now use,
+ * see trps_select_withdrawn_for_peer(). */
+static void trps_mark_withdrawn(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
+{
+  TRPS_ROUTE_KEY key={comm, realm};
+  TRPS_ROUTE_KEY *new_key=NULL;
+  TRP_ROUTE *retraction=NULL;
+
+  if (g_hash_table_contains(trps->withdrawn_routes, &key))
+    return;
+
+  retraction=trps_new_retraction(NULL, comm, realm);
+  if (retraction==NULL) {
+    tr_err("trps_mark_withdrawn: unable to allocate retraction for %.*s/%.*s.",
+           comm->len, comm->buf, realm->len, realm->buf);
+    return;
+  }
+  new_key=g_new(TRPS_ROUTE_KEY, 1);
+  new_key->comm=tr_dup_name(comm);
+  new_key->realm=tr_dup_name(realm);
+  g_hash_table_insert(trps->withdrawn_routes, new_key, retraction);
+}
+
+/* membership of realm in comm with role, from origin */
+static TR_COMM_MEMB *trps_find_memb(TRPS_INSTANCE *trps, TR_REALM_ROLE role, TR_NAME *comm, TR_NAME *realm, TR_NAME *origin)
+{
+  switch (role) {
+  case TR_ROLE_IDP:
+    return tr_comm_table_find_idp_memb_origin(trps->ctable, realm, comm, origin);
+  case TR_ROLE_RP:
+    return tr_comm_table_find_rp_memb_origin(trps->ctable, realm, comm, origin);
+  default:
+    return NULL;
+  }
+}
+
+/* The peer we learned memb from, NULL for local memberships. Do not free the result. */
+static TR_NAME *trps_memb_learned_from(TR_COMM_MEMB *memb)
+{
+  TR_PROVENANCE *prov=tr_comm_memb_get_provenance(memb);
+
+  if ((tr_comm_memb_get_origin(memb)==NULL) || (tr_provenance_len(prov)==0))
+    return NULL;
+  return tr_provenance_get_hop(prov, tr_provenance_len(prov)-1);
 }
 
 void trps_free (TRPS_INSTANCE *trps)
@@ -161,6 +532,45 @@ void trps_set_sweep_interval(TRPS_INSTANCE *trps, unsigned int interval)
   trps->sweep_interval.tv_usec=0;
 }
 
+unsigned int trps_get_update_holddown(TRPS_INSTANCE *trps)
+{
+  return trps->update_holddown.tv_sec*1000 + trps->update_holddown.tv_usec/1000;
+}
+
+void trps_set_update_holddown(TRPS_INSTANCE *trps, unsigned int msec)
+{
+  trps->update_holddown.tv_sec=msec/1000;
+  trps->update_holddown.tv_usec=1000*(msec%1000);
+}
+
+size_t trps_get_max_update_bytes(TRPS_INSTANCE *trps)
+{
+  return trps->max_update_bytes;
+}
+
+void trps_set_max_update_bytes(TRPS_INSTANCE *trps, size_t max_bytes)
+{
+  trps->max_update_bytes=max_bytes;
+}
+
+/* A penalty of 0 turns flap damping off. */
+void trps_set_flap_damping(TRPS_INSTANCE *trps,
+                           unsigned int penalty,
+                           unsigned int suppress,
+                           unsigned int reuse,
+                           unsigned int half_life)
+{
+  trps->flap_penalty=penalty;
+  trps->flap_suppress=suppress;
+  trps->flap_reuse=reuse;
+  trps->flap_half_life=half_life;
+}
+
+void trps_set_metric_hysteresis(TRPS_INSTANCE *trps, unsigned int hysteresis)
+{
+  trps->metric_hysteresis=hysteresis;
+}
+
 void trps_set_ctable(TRPS_INSTANCE *trps, TR_COMM_TABLE *comm)
 {
   trps->ctable=comm;
@@ -375,11 +785,106 @@ TR_NAME *trps_get_next_hop(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
 }
 
 
+/* A route's flap damping penalty decayed to now. Halves every flap_half_life
+ * seconds; between whole half-lives it decays linearly, which is close enough. */
+unsigned int trps_route_penalty_now(TRPS_INSTANCE *trps, TRP_ROUTE *route, struct timespec *now)
+{
+  unsigned int penalty=trp_route_get_penalty(route);
+  time_t elapsed=now->tv_sec - trp_route_get_penalty_time(route)->tv_sec;
+  time_t half_lives=0;
+
+  if ((penalty==0) || (elapsed<=0))
+    return penalty;
+  if (trps->flap_half_life==0)
+    return 0;
+
+  half_lives=elapsed/trps->flap_half_life;
+  if (half_lives>=32)
+    return 0;
+  penalty >>= half_lives;
+  penalty-=(unsigned int)(((unsigned long long)penalty * (elapsed % trps->flap_half_life))
+                          / (2*trps->flap_half_life));
+  return penalty;
+}
+
+/* Charge a route for changing, suppressing it if it has changed too often.
+ * Withdrawals are charged the full flap_penalty, other changes less. */
+static void trps_route_flapped(TRPS_INSTANCE *trps, TRP_ROUTE *route, unsigned int charge)
+{
+  const unsigned int max_penalty=2*trps->flap_suppress; /* bounds how long a route stays suppressed */
+  struct timespec now={0,0};
+  unsigned int penalty=0;
+
+  if (trps->flap_penalty==0)
+    return; /* damping disabled */
+
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_route_flapped: could not read clock.");
+    return;
+  }
+  penalty=trps_route_penalty_now(trps, route, &now) + charge;
+  if (penalty>max_penalty)
+    penalty=max_penalty;
+  trp_route_set_penalty(route, penalty, &now);
+
+  if ((!trp_route_is_suppressed(route)) && (penalty>=trps->flap_suppress)) {
+    tr_notice("trps_route_flapped: suppressing flapping route to %.*s/%.*s through %.*s.",
+              trp_route_get_comm(route)->len, trp_route_get_comm(route)->buf,
+              trp_route_get_realm(route)->len, trp_route_get_realm(route)->buf,
+              trp_route_get_peer(route)->len, trp_route_get_peer(route)->buf);
+    trp_route_set_suppressed(route, 1);
+  }
+}
+
+/* Release suppressed routes to comm/realm whose penalty has decayed enough.
+ * Realms still holding suppressed routes are remembered so trps_sweep_routes()
+ * can check them again later. */
+static void trps_update_suppression(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
+{
+  TRP_ROUTE **entry=NULL;
+  size_t n_entry=0;
+  size_t ii=0;
+  struct timespec now={0,0};
+  unsigned int penalty=0;
+  int still_suppressed=0;
+
+  if (trps->flap_penalty==0)
+    return;
+
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_update_suppression: could not read clock.");
+    return;
+  }
+
+  entry=trp_rtable_get_realm_entries(trps->rtable, comm, realm, &n_entry);
+  for (ii=0; ii<n_entry; ii++) {
+    if (!trp_route_is_suppressed(entry[ii]))
+      continue;
+    penalty=trps_route_penalty_now(trps, entry[ii], &now);
+    trp_route_set_penalty(entry[ii], penalty, &now);
+    if (penalty<trps->flap_reuse) {
+      tr_notice("trps_update_suppression: reusing route to %.*s/%.*s through %.*s.",
+                comm->len, comm->buf, realm->len, realm->buf,
+                trp_route_get_peer(entry[ii])->len, trp_route_get_peer(entry[ii])->buf);
+      trp_route_set_suppressed(entry[ii], 0);
+    } else
+      still_suppressed=1;
+  }
+  if (entry!=NULL)
+    talloc_free(entry);
+
+  if (still_suppressed)
+    trps_route_set_add(trps->suppressed_routes, comm, realm);
+}
+
 /* mark a route as retracted */
 static void trps_retract_route(TRPS_INSTANCE *trps, TRP_ROUTE *entry)
 {
+  if (trp_metric_is_finite(trp_route_get_metric(entry)))
+    trps_route_flapped(trps, entry, trps->flap_penalty);
   trp_route_set_metric(entry, TRP_METRIC_INFINITY);
-  trp_route_set_triggered(entry, 1);
+  trps_mark_route_triggered(trps, entry);
+  trps_mark_dirty(trps, trp_route_get_comm(entry), trp_route_get_realm(entry));
 }
 
 /* is this route retracted? */
@@ -395,6 +900,7 @@ static TRP_RC trps_read_message(TRPS_INSTANCE *trps, TRP_CONNECTION *conn, TR_MS
   size_t buflen = 0;
   TRP_PEER *peer=NULL; /* entry in the peer table */
   TR_NAME *conn_peer=NULL; /* name from the TRP_CONN, which comes from the gss context */
+  TRP_UPD *upd=NULL;
 
   tr_debug("trps_read_message: started");
   if (err = gsscon_read_encrypted_token(trp_connection_get_fd(conn),
@@ -430,16 +936,23 @@ static TRP_RC trps_read_message(TRPS_INSTANCE *trps, TRP_CONNECTION *conn, TR_MS
   /* verify we received a message we support, otherwise drop it now */
   switch (tr_msg_get_msg_type(*msg)) {
   case TRP_UPDATE:
-    trp_upd_set_peer(tr_msg_get_trp_upd(*msg), tr_dup_name(conn_peer));
-    trp_upd_set_next_hop(tr_msg_get_trp_upd(*msg), trp_peer_get_server(peer), 0); /* TODO: 0 should be the configured TID port */
-    /* update provenance if necessary */
-    trp_upd_add_to_provenance(tr_msg_get_trp_upd(*msg), trp_peer_get_label(peer));
+    /* a message may carry several updates */
+    for (upd=tr_msg_get_trp_upd(*msg); upd!=NULL; upd=trp_upd_get_next(upd)) {
+      trp_upd_set_peer(upd, tr_dup_name(conn_peer));
+      trp_upd_set_next_hop(upd, trp_peer_get_server(peer), 0); /* TODO: 0 should be the configured TID port */
+      /* update provenance if necessary */
+      trp_upd_add_to_provenance(upd, trp_peer_get_label(peer));
+    }
     break;
 
   case TRP_REQUEST:
     trp_req_set_peer(tr_msg_get_trp_req(*msg), tr_dup_name(conn_peer));
     break;
 
+  case TRP_KEEPALIVE:
+    trp_kalive_set_peer(tr_msg_get_trp_kalive(*msg), tr_dup_name(conn_peer));
+    break;
+
   default:
     tr_debug("trps_read_message: received unsupported message from %.*s", conn_peer->len, conn_peer->buf);
     tr_msg_free_decoded(*msg);
@@ -647,28 +1160,52 @@ static int trps_check_feasibility(TRPS_INSTANCE *trps, TR_NAME *realm, TR_NAME *
     return 0;
 }
 
+/* how many intervals we wait before expiring */
+#define TRPS_EXPIRY_FACTOR 3
+
 /* uses memory pointed to by *ts, also returns that value. On error, its contents are {0,0} */
 static struct timespec *trps_compute_expiry(TRPS_INSTANCE *trps, unsigned int interval, struct timespec *ts)
 {
-  const unsigned int small_factor=3; /* how many intervals we wait before expiring */
   if (0!=clock_gettime(TRP_CLOCK, ts)) {
     tr_err("trps_compute_expiry: could not read realtime clock.");
     ts->tv_sec=0;
     ts->tv_nsec=0;
   }
-  tr_debug("trps_compute_expiry: tv_sec=%u, interval=%u, small_factor*interval=%u", ts->tv_sec, interval, small_factor*interval);
-  ts->tv_sec += small_factor*interval;
+  tr_debug("trps_compute_expiry: tv_sec=%u, interval=%u, small_factor*interval=%u", ts->tv_sec, interval, TRPS_EXPIRY_FACTOR*interval);
+  ts->tv_sec += TRPS_EXPIRY_FACTOR*interval;
   return ts;
 }
 
+/* If a peer's keepalive at *vouched vouches for something it sends every interval
+ * seconds beyond now, move *expiry to match and return nonzero. Keepalives only
+ * record when they arrived; the sweeps call this when something comes due, so a
+ * keepalive costs the same however much we learned from the peer. */
+static int trps_vouched_expiry(struct timespec *vouched,
+                               unsigned int interval,
+                               struct timespec *now,
+                               struct timespec *expiry)
+{
+  struct timespec until=*vouched;
+
+  if ((vouched->tv_sec==0) && (vouched->tv_nsec==0))
+    return 0; /* never vouched for */
+  until.tv_sec += TRPS_EXPIRY_FACTOR*interval;
+  if (tr_cmp_timespec(&until, now) <= 0)
+    return 0;
+  *expiry=until;
+  return 1;
+}
+
 static TRP_RC trps_accept_update(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC *rec)
 {
   TRP_ROUTE *entry=NULL;
+  int changed=0;
 
+  /* routes are keyed by the peer they came from, see trps_handle_inforec_route() */
   entry=trp_rtable_get_entry(trps->rtable,
                              trp_upd_get_comm(upd),
                              trp_upd_get_realm(upd),
-                             trp_inforec_get_next_hop(rec));
+                             trp_upd_get_peer(upd));
   if (entry==NULL) {
     entry=trp_route_new(NULL);
     if (entry==NULL) {
@@ -693,6 +1230,15 @@ static TRP_RC trps_accept_update(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC
       return TRP_NOMEM;
     }
     trp_rtable_add(trps->rtable, entry);
+    changed=1;
+  } else if (trp_route_get_metric(entry)!=trp_inforec_get_metric(rec)) {
+    changed=1;
+    /* Only withdrawals are charged in full. Coming back after one is free; the
+     * withdrawal has already been paid for. */
+    if (!trp_metric_is_finite(trp_inforec_get_metric(rec)))
+      trps_route_flapped(trps, entry, trps->flap_penalty);
+    else if (trp_metric_is_finite(trp_route_get_metric(entry)))
+      trps_route_flapped(trps, entry, trps->flap_penalty/2);
   }
 
   /* We now have an entry in the table, whether it's new or not. Update metric and expiry, unless
@@ -702,13 +1248,19 @@ static TRP_RC trps_accept_update(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC
   tr_debug("trps_accept_update: accepting route update.");
   trp_route_set_metric(entry, trp_inforec_get_metric(rec));
   trp_route_set_interval(entry, trp_inforec_get_interval(rec));
+  trps_mark_dirty(trps, trp_route_get_comm(entry), trp_route_get_realm(entry));
+
+  /* Peers only hear about routes when they change (see trps_update_one_peer()),
+   * so new routes and metric changes must go out as triggered updates. */
+  if (changed)
+    trps_mark_route_triggered(trps, entry);
 
   /* check whether the trust router has changed */
   if (0!=tr_name_cmp(trp_route_get_trust_router(entry),
                      trp_inforec_get_trust_router(rec))) {
     /* The name changed. Set this route as triggered. */
     tr_debug("trps_accept_update: trust router for route changed.");
-    trp_route_set_triggered(entry, 1);
+    trps_mark_route_triggered(trps, entry);
     trp_route_set_trust_router(entry, trp_inforec_dup_trust_router(rec)); /* frees old name */
   }
   if (!trps_route_retracted(trps, entry)) {
@@ -716,6 +1268,12 @@ static TRP_RC trps_accept_update(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC
     trp_route_set_expiry(entry, trps_compute_expiry(trps,
                                                      trp_route_get_interval(entry),
                                                      trp_route_get_expiry(entry)));
+    trps_expiry_push(trps->route_expiry,
+                     trp_route_get_expiry(entry),
+                     TR_ROLE_UNKNOWN,
+                     trp_route_get_comm(entry),
+                     trp_route_get_realm(entry),
+                     trp_route_get_peer(entry));
   }
   return TRP_SUCCESS;
 }
@@ -759,37 +1317,6 @@ static TRP_RC trps_handle_inforec_route(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_I
   return TRP_SUCCESS;
 }
 
-static int trps_name_in_provenance(TR_NAME *name, json_t *prov)
-{
-  size_t ii=0;
-  TR_NAME *this_name=NULL;
-  const char *s=NULL;
-
-  if (prov==NULL)
-    return 0; /* no provenance list, so it has no names in it */
-
-  /* now check to see if name is in the provenance */
-  for (ii=0; ii<json_array_size(prov); ii++) {
-    s=json_string_value(json_array_get(prov, ii));
-    if (s==NULL) {
-      tr_debug("trps_name_in_provenance: empty entry in provenance list.");
-      continue;
-    }
-
-    this_name=tr_new_name(s);
-    if (this_name==NULL) {
-      tr_debug("trps_name_in_provenance: unable to allocate name.");
-      return -1;
-    }
-    if (0==tr_name_cmp(name, this_name)) {
-      tr_free_name(this_name);
-      return 1;
-    }
-    tr_free_name(this_name);
-  }
-  return 0;
-}
-
 static TR_COMM *trps_create_new_comm(TALLOC_CTX *mem_ctx, TR_NAME *comm_id, TRP_INFOREC *rec)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -895,6 +1422,58 @@ cleanup:
   return idp;
 }
 
+/* Ask every connected peer except the one named for its memberships of realm
+ * in comm, in case one of them still has a path to a membership just withdrawn. */
+static void trps_request_memb(TRPS_INSTANCE *trps, TR_NAME *comm_id, TR_NAME *realm_id, TR_NAME *except_label)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_PTABLE_ITER *iter=trp_ptable_iter_new(tmp_ctx);
+  TRP_PEER *peer=NULL;
+
+  if ((trps->ptable==NULL) || (iter==NULL))
+    goto cleanup;
+
+  for (peer=trp_ptable_iter_first(iter, trps->ptable);
+       peer!=NULL;
+       peer=trp_ptable_iter_next(iter)) {
+    if (tr_name_equal(trp_peer_get_label(peer), except_label) || !trps_peer_connected(trps, peer))
+      continue;
+    if (TRP_SUCCESS!=trps_route_req(trps, trp_peer_get_servicename(peer), comm_id, realm_id))
+      tr_notice("trps_request_memb: unable to send request to peer.");
+  }
+  trp_ptable_iter_free(iter);
+
+cleanup:
+  talloc_free(tmp_ctx);
+}
+
+/* Remove the membership a community inforec withdraws. Only the peer we learned
+ * the membership from can withdraw it; withdrawals from other peers are ignored. */
+static void trps_withdraw_memb(TRPS_INSTANCE *trps, TRP_INFOREC *rec, TR_NAME *comm_id, TR_NAME *realm_id, TR_NAME *origin_id)
+{
+  TR_NAME *from=tr_provenance_get_hop(trp_inforec_get_provenance(rec),
+                                      tr_provenance_len(trp_inforec_get_provenance(rec))-1);
+  TR_COMM_MEMB *memb=trps_find_memb(trps, trp_inforec_get_role(rec), comm_id, realm_id, origin_id);
+  TR_NAME *learned_from=(memb==NULL)?NULL:trps_memb_learned_from(memb);
+
+  if ((from==NULL) || (learned_from==NULL) || !tr_name_equal(learned_from, from)) {
+    tr_debug("trps_withdraw_memb: no matching membership of %.*s in %.*s (origin %.*s), ignoring withdrawal.",
+             realm_id->len, realm_id->buf,
+             comm_id->len, comm_id->buf,
+             origin_id->len, origin_id->buf);
+    return;
+  }
+
+  tr_debug("trps_withdraw_memb: withdrawing membership of %.*s in %.*s (origin %.*s).",
+           realm_id->len, realm_id->buf,
+           comm_id->len, comm_id->buf,
+           origin_id->len, origin_id->buf);
+  trps_mark_memb_triggered(trps, memb);
+  tr_comm_table_remove_memb(trps->ctable, memb);
+  tr_comm_memb_free(memb);
+  trps_request_memb(trps, comm_id, realm_id, from);
+}
+
 static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_INFOREC *rec)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -905,6 +1484,7 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
   TR_COMM *comm=NULL;
   TR_RP_REALM *rp_realm=NULL;
   TR_IDP_REALM *idp_realm=NULL;
+  TR_COMM_MEMB *memb=NULL;
   struct timespec expiry={0,0};
   TRP_RC rc=TRP_ERROR;
 
@@ -922,8 +1502,10 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
     goto cleanup;
   }
 
-  if (trps_name_in_provenance(our_peer_label, trp_inforec_get_provenance(rec)))
+  if (tr_provenance_contains(trp_inforec_get_provenance(rec), our_peer_label))
     tr_debug("trps_handle_inforec_comm: rejecting community inforec to avoid provenance loop.");
+  else if (trp_inforec_get_interval(rec)==TRP_INTERVAL_WITHDRAWN)
+    trps_withdraw_memb(trps, rec, comm_id, realm_id, origin_id);
   else {
     /* no loop occurring, accept the update */
     comm=tr_comm_table_find_comm(trps->ctable, comm_id);
@@ -945,7 +1527,7 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
 
     switch (trp_inforec_get_role(rec)) {
     case TR_ROLE_RP:
-      rp_realm=tr_rp_realm_lookup(trps->ctable->rp_realms, realm_id);
+      rp_realm=tr_comm_table_find_rp_realm(trps->ctable, realm_id);
       if (rp_realm==NULL) {
         tr_debug("trps_handle_inforec_comm: unknown RP realm %.*s in inforec, creating it.",
                  realm_id->len, realm_id->buf);
@@ -960,13 +1542,14 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
       }
       /* TODO: if realm existed, see if data match the new inforec and update or complain */
       tr_comm_add_rp_realm(trps->ctable, comm, rp_realm, trp_inforec_get_interval(rec), trp_inforec_get_provenance(rec), &expiry);
+      trps_expiry_push(trps->memb_expiry, &expiry, TR_ROLE_RP, comm_id, realm_id, origin_id);
       tr_debug("trps_handle_inforec_comm: added RP realm %.*s to comm %.*s (origin %.*s).",
                realm_id->len, realm_id->buf,
                comm_id->len, comm_id->buf,
                origin_id->len, origin_id->buf);
       break;
     case TR_ROLE_IDP:
-      idp_realm=tr_idp_realm_lookup(trps->ctable->idp_realms, realm_id);
+      idp_realm=tr_comm_table_find_idp_realm(trps->ctable, realm_id);
       if (idp_realm==NULL) {
         tr_debug("trps_handle_inforec_comm: unknown IDP realm %.*s in inforec, creating it.",
                  realm_id->len, realm_id->buf);
@@ -981,6 +1564,7 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
       }
       /* TODO: if realm existed, see if data match the new inforec and update or complain */
       tr_comm_add_idp_realm(trps->ctable, comm, idp_realm, trp_inforec_get_interval(rec), trp_inforec_get_provenance(rec), &expiry);
+      trps_expiry_push(trps->memb_expiry, &expiry, TR_ROLE_IDP, comm_id, realm_id, origin_id);
       tr_debug("trps_handle_inforec_comm: added IDP realm %.*s to comm %.*s (origin %.*s).",
                realm_id->len, realm_id->buf,
                comm_id->len, comm_id->buf,
@@ -990,6 +1574,11 @@ static TRP_RC trps_handle_inforec_comm(TRPS_INSTANCE *trps, TRP_UPD *upd, TRP_IN
       tr_debug("trps_handle_inforec_comm: unable to add realm.");
       goto cleanup;
     }
+
+    /* pass new or changed memberships on with the next triggered update */
+    memb=trps_find_memb(trps, trp_inforec_get_role(rec), comm_id, realm_id, origin_id);
+    if ((memb!=NULL) && tr_comm_memb_is_triggered(memb))
+      trps_mark_memb_triggered(trps, memb);
   } 
 
   rc=TRP_SUCCESS;
@@ -1006,12 +1595,20 @@ cleanup:
 static TRP_RC trps_handle_update(TRPS_INSTANCE *trps, TRP_UPD *upd)
 {
   TRP_INFOREC *rec=NULL;
+  TRP_PEER *peer=NULL;
 
   if (trps_validate_update(trps, upd) != TRP_SUCCESS) {
     tr_notice("trps_handle_update: received invalid TRP update.");
     return TRP_ERROR;
   }
 
+  /* remember how far we are through the peer's updates, checked by its next keepalive */
+  if (trp_upd_get_seq(upd)!=0) {
+    peer=trps_get_peer_by_gssname(trps, trp_upd_get_peer(upd));
+    if (peer!=NULL)
+      trp_peer_set_recv_seq(peer, trp_upd_get_seq(upd));
+  }
+
   for (rec=trp_upd_get_inforec(upd); rec!=NULL; rec=trp_inforec_get_next(rec)) {
     /* validate/sanity check the record update */
     if (trps_validate_inforec(trps, rec) != TRP_SUCCESS) {
@@ -1081,6 +1678,8 @@ static TRP_ROUTE *trps_find_best_route(TRPS_INSTANCE *trps,
 
   entry=trp_rtable_get_realm_entries(trps->rtable, comm, realm, &n_entry);
   for (kk=0; kk<n_entry; kk++) {
+    if (trp_route_is_suppressed(entry[kk]))
+      continue; /* damped, see trps_route_flapped() */
     if (trp_route_get_metric(entry[kk]) < min_metric) {
       if ((exclude_peer==NULL) || (0!=tr_name_cmp(trp_route_get_peer(entry[kk]),
                                                   exclude_peer))) {
@@ -1096,39 +1695,58 @@ static TRP_ROUTE *trps_find_best_route(TRPS_INSTANCE *trps,
   return best;
 }
 
-/* TODO: think this through more carefully. At least ought to add hysteresis
- * to avoid flapping between routers or routes. */
+/* Recompute the selected route for one comm/realm. Flapping routes are
+ * suppressed (see trps_route_flapped()), and a usable selected route is only
+ * replaced by one better by more than metric_hysteresis. */
+static void trps_update_active_route(TRPS_INSTANCE *trps, TR_NAME *comm, TR_NAME *realm)
+{
+  TRP_ROUTE *best_route=NULL, *cur_route=NULL;
+  unsigned int best_metric=0, cur_metric=0;
+
+  trps_update_suppression(trps, comm, realm);
+  best_route=trps_find_best_route(trps, comm, realm, NULL);
+  if (best_route==NULL)
+    best_metric=TRP_METRIC_INFINITY;
+  else
+    best_metric=trp_route_get_metric(best_route);
+
+  cur_route=trps_get_selected_route(trps, comm, realm);
+  if (cur_route!=NULL) {
+    if (trp_route_is_suppressed(cur_route))
+      cur_metric=TRP_METRIC_INFINITY; /* must be replaced or withdrawn */
+    else
+      cur_metric=trp_route_get_metric(cur_route);
+    if ((best_route!=cur_route)
+       && (trp_metric_is_finite(best_metric))
+       && ((!trp_metric_is_finite(cur_metric))
+          || (best_metric + trps->metric_hysteresis < cur_metric))) {
+      /* The new route is finite and enough better than the previous. Accept. */
+      trp_route_set_selected(cur_route, 0);
+      trp_route_set_selected(best_route, 1);
+      trps_mark_route_triggered(trps, best_route);
+      trps_mark_withdrawn(trps, comm, realm); /* split horizon hides it from its next hop */
+    } else if (!trp_metric_is_finite(cur_metric)) { /* rejects infinite or invalid metrics */
+      trp_route_set_selected(cur_route, 0);
+      trps_mark_withdrawn(trps, comm, realm); /* nothing left to advertise */
+    }
+  } else if (trp_metric_is_finite(best_metric)) {
+    trp_route_set_selected(best_route, 1);
+    trps_mark_route_triggered(trps, best_route);
+  }
+}
+
+/* Recompute the selected route for every comm/realm in the table. */
 TRP_RC trps_update_active_routes(TRPS_INSTANCE *trps)
 {
   size_t n_comm=0, ii=0;
   TR_NAME **comm=trp_rtable_get_comms(trps->rtable, &n_comm);
   size_t n_realm=0, jj=0;
   TR_NAME **realm=NULL;
-  TRP_ROUTE *best_route=NULL, *cur_route=NULL;
-  unsigned int best_metric=0, cur_metric=0;
 
   for (ii=0; ii<n_comm; ii++) {
     realm=trp_rtable_get_comm_realms(trps->rtable, comm[ii], &n_realm);
-    for (jj=0; jj<n_realm; jj++) {
-      best_route=trps_find_best_route(trps, comm[ii], realm[jj], NULL);
-      if (best_route==NULL)
-        best_metric=TRP_METRIC_INFINITY;
-      else
-        best_metric=trp_route_get_metric(best_route);
-
-      cur_route=trps_get_selected_route(trps, comm[ii], realm[jj]);
-      if (cur_route!=NULL) {
-        cur_metric=trp_route_get_metric(cur_route);
-        if ((best_metric < cur_metric) && (trp_metric_is_finite(best_metric))) {
-          /* The new route has a lower metric than the previous, and is finite. Accept. */
-          trp_route_set_selected(cur_route, 0);
-          trp_route_set_selected(best_route, 1);
-        } else if (!trp_metric_is_finite(cur_metric)) /* rejects infinite or invalid metrics */
-          trp_route_set_selected(cur_route, 0);
-      } else if (trp_metric_is_finite(best_metric)) {
-        trp_route_set_selected(best_route, 1);
-      }
-    }
+    for (jj=0; jj<n_realm; jj++)
+      trps_update_active_route(trps, comm[ii], realm[jj]);
     if (realm!=NULL)
       talloc_free(realm);
     realm=NULL; n_realm=0;
@@ -1137,6 +1755,24 @@ TRP_RC trps_update_active_routes(TRPS_INSTANCE *trps)
     talloc_free(comm);
   comm=NULL; n_comm=0;
 
+  g_hash_table_remove_all(trps->dirty_routes); /* everything is up to date */
+  return TRP_SUCCESS;
+}
+
+/* Recompute the selected route only for comm/realms whose routes changed
+ * since the last update. */
+TRP_RC trps_update_dirty_routes(TRPS_INSTANCE *trps)
+{
+  GHashTableIter iter;
+  TRPS_ROUTE_KEY *key=NULL;
+
+  tr_debug("trps_update_dirty_routes: %u realm(s) to update.",
+           g_hash_table_size(trps->dirty_routes));
+  g_hash_table_iter_init(&iter, trps->dirty_routes);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL))
+    trps_update_active_route(trps, key->comm, key->realm);
+
+  g_hash_table_remove_all(trps->dirty_routes);
   return TRP_SUCCESS;
 }
 
@@ -1146,14 +1782,40 @@ static int trps_expired(struct timespec *expiry, struct timespec *curtime)
   return (tr_cmp_timespec(curtime, expiry) >= 0);
 }
 
+/* A route the peer's keepalives still vouch for gets a new expiry instead of
+ * expiring. Returns nonzero if so. */
+static int trps_route_vouched(TRPS_INSTANCE *trps, TRP_ROUTE *route, struct timespec *now)
+{
+  TRP_PEER *peer=trps_get_peer_by_gssname(trps, trp_route_get_peer(route));
+
+  if ((peer==NULL)
+     || (!trp_metric_is_finite(trp_route_get_metric(route)))
+     || (!trps_vouched_expiry(trp_peer_get_routes_vouched(peer),
+                              trp_peer_get_routes_vouched_interval(peer),
+                              now,
+                              trp_route_get_expiry(route))))
+    return 0;
+
+  trp_route_set_interval(route, trp_peer_get_routes_vouched_interval(peer));
+  trps_expiry_push(trps->route_expiry,
+                   trp_route_get_expiry(route),
+                   TR_ROLE_UNKNOWN,
+                   trp_route_get_comm(route),
+                   trp_route_get_realm(route),
+                   trp_route_get_peer(route));
+  return 1;
+}
+
 /* Sweep for expired routes. For each expired route, if its metric is infinite, the route is flushed.
- * If its metric is finite, the metric is set to infinite and the route's expiration time is updated. */
+ * If its metric is finite, the metric is set to infinite and the route's expiration time is updated.
+ * Only routes scheduled to expire by now are examined. */
 TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps)
 {
   struct timespec sweep_time={0,0};
-  TRP_ROUTE **entry=NULL;
-  size_t n_entry=0;
-  size_t ii=0;
+  TRPS_EXPIRY exp;
+  TRP_ROUTE *entry=NULL;
+  GHashTableIter iter;
+  TRPS_ROUTE_KEY *key=NULL;
 
   /* use a single time for the entire sweep */
   if (0!=clock_gettime(TRP_CLOCK, &sweep_time)) {
@@ -1163,32 +1825,62 @@ TRP_RC trps_sweep_routes(TRPS_INSTANCE *trps)
     return TRP_ERROR;
   }
 
-  entry=trp_rtable_get_entries(trps->rtable, &n_entry); /* must talloc_free *entry */
-
-  /* loop over the entries */
-  for (ii=0; ii<n_entry; ii++) {
-    if (!trp_route_is_local(entry[ii]) && trps_expired(trp_route_get_expiry(entry[ii]), &sweep_time)) {
+  while (trps_expiry_pop_due(trps->route_expiry, &sweep_time, &exp)) {
+    entry=trp_rtable_get_entry(trps->rtable, exp.comm, exp.realm, exp.peer);
+    /* skip routes that are gone or whose expiry was pushed back since this was scheduled */
+    if ((entry!=NULL)
+       && !trp_route_is_local(entry)
+       && trps_expired(trp_route_get_expiry(entry), &sweep_time)
+       && !trps_route_vouched(trps, entry, &sweep_time)) {
       tr_debug("trps_sweep_routes: route expired.");
-      if (!trp_metric_is_finite(trp_route_get_metric(entry[ii]))) {
+      if (!trp_metric_is_finite(trp_route_get_metric(entry))) {
         /* flush route */
         tr_debug("trps_sweep_routes: metric was infinity, flushing route.");
-        trp_rtable_remove(trps->rtable, entry[ii]); /* entry[ii] is no longer valid */
-        entry[ii]=NULL;
+        trps_mark_dirty(trps, trp_route_get_comm(entry), trp_route_get_realm(entry));
+        trp_rtable_remove(trps->rtable, entry); /* entry is no longer valid */
+        entry=NULL;
       } else {
         /* set metric to infinity and reset timer */
         tr_debug("trps_sweep_routes: setting metric to infinity and resetting expiry.");
-        trp_route_set_metric(entry[ii], TRP_METRIC_INFINITY);
-        trp_route_set_expiry(entry[ii], trps_compute_expiry(trps,
-                                                             trp_route_get_interval(entry[ii]),
-                                                             trp_route_get_expiry(entry[ii])));
+        trp_route_set_metric(entry, TRP_METRIC_INFINITY);
+        trps_mark_dirty(trps, trp_route_get_comm(entry), trp_route_get_realm(entry));
+        trp_route_set_expiry(entry, trps_compute_expiry(trps,
+                                                         trp_route_get_interval(entry),
+                                                         trp_route_get_expiry(entry)));
+        trps_expiry_push(trps->route_expiry, trp_route_get_expiry(entry), TR_ROLE_UNKNOWN,
+                         exp.comm, exp.realm, exp.peer);
       }
     }
+    trps_expiry_free_names(&exp);
   }
 
-  talloc_free(entry);
+  /* give suppressed routes a chance to be reused */
+  g_hash_table_iter_init(&iter, trps->suppressed_routes);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL))
+    trps_mark_dirty(trps, key->comm, key->realm);
+  g_hash_table_remove_all(trps->suppressed_routes);
+
   return TRP_SUCCESS;
 }
 
+/* Earliest scheduled route or membership expiry. Returns 0 and fills in *when
+ * if there is one, otherwise returns -1. */
+int trps_next_expiry(TRPS_INSTANCE *trps, struct timespec *when)
+{
+  TRPS_EXPIRY_HEAP *heap[2]={trps->route_expiry, trps->memb_expiry};
+  int found=-1;
+  size_t ii=0;
+
+  for (ii=0; ii<2; ii++) {
+    if (heap[ii]->len==0)
+      continue;
+    if ((found!=0) || (tr_cmp_timespec(&(heap[ii]->items[0].when), when) < 0)) {
+      *when=heap[ii]->items[0].when;
+      found=0;
+    }
+  }
+  return found;
+}
 
 static char *timespec_to_str(struct timespec *ts)
 {
@@ -1210,13 +1902,44 @@ static char *timespec_to_str(struct timespec *ts)
 }
 
 
-/* Sweep for expired communities/realms/memberships. */
+static TRP_PEER *trps_get_peer_by_label(TRPS_INSTANCE *trps, TR_NAME *label)
+{
+  TRP_PEER *peer=NULL;
+
+  if (trps->ptable==NULL)
+    return NULL;
+
+  for (peer=trps->ptable->head; peer!=NULL; peer=peer->next) {
+    if (tr_name_equal(trp_peer_get_label(peer), label))
+      break;
+  }
+  return peer;
+}
+
+/* As trps_route_vouched(), for memberships. Memberships already expired once are
+ * left alone; they stay only if the peer sends them again. */
+static int trps_memb_vouched(TRPS_INSTANCE *trps, TR_COMM_MEMB *memb, struct timespec *now)
+{
+  TR_NAME *learned_from=trps_memb_learned_from(memb);
+  TRP_PEER *peer=NULL;
+
+  if ((learned_from==NULL) || (tr_comm_memb_get_times_expired(memb)>0))
+    return 0;
+
+  peer=trps_get_peer_by_label(trps, learned_from);
+  return (peer!=NULL) && trps_vouched_expiry(trp_peer_get_membs_vouched(peer),
+                                             tr_comm_memb_get_interval(memb),
+                                             now,
+                                             tr_comm_memb_get_expiry(memb));
+}
+
+/* Sweep for expired communities/realms/memberships. Only memberships
+ * scheduled to expire by now are examined. */
 TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps)
 {
-  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   struct timespec sweep_time={0,0};
+  TRPS_EXPIRY exp;
   TR_COMM_MEMB *memb=NULL;
-  TR_COMM_ITER *iter=NULL;
   TRP_RC rc=TRP_ERROR;
 
   /* use a single time for the entire sweep */
@@ -1227,48 +1950,56 @@ TRP_RC trps_sweep_ctable(TRPS_INSTANCE *trps)
     goto cleanup;
   }
 
-  /* iterate all memberships */
-  iter=tr_comm_iter_new(tmp_ctx);
-  if (iter==NULL) {
-    tr_err("trps_sweep_ctable: unable to allocate iterator.");
-    rc=TRP_NOMEM;
-    goto cleanup;
-  }
-  for (memb=tr_comm_memb_iter_all_first(iter, trps->ctable);
-       memb!=NULL;
-       memb=tr_comm_memb_iter_all_next(iter)) {
-    if (tr_comm_memb_get_origin(memb)==NULL)
-      continue; /* do not expire local entries */
-
-    if (tr_comm_memb_is_expired(memb, &sweep_time)) {
-      if (tr_comm_memb_get_times_expired(memb)>0) {
-        /* Already expired once; flush. */
-        tr_debug("trps_sweep_ctable: flushing expired community membership (%.*s in %.*s, origin %.*s, expired %s).",
-                 tr_comm_memb_get_realm_id(memb)->len, tr_comm_memb_get_realm_id(memb)->buf,
-                 tr_comm_get_id(tr_comm_memb_get_comm(memb))->len, tr_comm_get_id(tr_comm_memb_get_comm(memb))->buf,
-                 tr_comm_memb_get_origin(memb)->len, tr_comm_memb_get_origin(memb)->buf,
-                 timespec_to_str(tr_comm_memb_get_expiry(memb)));
-        tr_comm_table_remove_memb(trps->ctable, memb);
-        tr_comm_memb_free(memb);
-      } else {
-        /* This is the first expiration. Note this and reset the expiry time. */
-        tr_comm_memb_expire(memb);
-        trps_compute_expiry(trps, tr_comm_memb_get_interval(memb), tr_comm_memb_get_expiry(memb));
-        tr_debug("trps_sweep_ctable: community membership expired at %s, resetting expiry to %s (%.*s in %.*s, origin %.*s).",
-                 timespec_to_str(&sweep_time),
-                 timespec_to_str(tr_comm_memb_get_expiry(memb)),
-                 tr_comm_memb_get_realm_id(memb)->len, tr_comm_memb_get_realm_id(memb)->buf,
-                 tr_comm_get_id(tr_comm_memb_get_comm(memb))->len, tr_comm_get_id(tr_comm_memb_get_comm(memb))->buf,
-                 tr_comm_memb_get_origin(memb)->len, tr_comm_memb_get_origin(memb)->buf);
-      }
+  while (trps_expiry_pop_due(trps->memb_expiry, &sweep_time, &exp)) {
+    memb=trps_find_memb(trps, exp.role, exp.comm, exp.realm, exp.peer);
+
+    /* skip memberships that are gone, local, or refreshed since this was scheduled */
+    if ((memb==NULL)
+       || (tr_comm_memb_get_origin(memb)==NULL)
+       || !tr_comm_memb_is_expired(memb, &sweep_time)) {
+      trps_expiry_free_names(&exp);
+      continue;
     }
+
+    /* keepalives from the peer we learned it from stand in for resending it */
+    if (trps_memb_vouched(trps, memb, &sweep_time)) {
+      trps_expiry_push(trps->memb_expiry, tr_comm_memb_get_expiry(memb), exp.role,
+                       exp.comm, exp.realm, exp.peer);
+      trps_expiry_free_names(&exp);
+      continue;
+    }
+
+    if (tr_comm_memb_get_times_expired(memb)>0) {
+      /* Already expired once; flush. */
+      tr_debug("trps_sweep_ctable: flushing expired community membership (%.*s in %.*s, origin %.*s, expired %s).",
+               tr_comm_memb_get_realm_id(memb)->len, tr_comm_memb_get_realm_id(memb)->buf,
+               tr_comm_get_id(tr_comm_memb_get_comm(memb))->len, tr_comm_get_id(tr_comm_memb_get_comm(memb))->buf,
+               tr_comm_memb_get_origin(memb)->len, tr_comm_memb_get_origin(memb)->buf,
+               timespec_to_str(tr_comm_memb_get_expiry(memb)));
+      trps_mark_memb_triggered(trps, memb); /* withdraw it from our peers */
+      tr_comm_table_remove_memb(trps->ctable, memb);
+      tr_comm_memb_free(memb);
+    } else {
+      /* This is the first expiration. Note this and reset the expiry time. */
+      tr_comm_memb_expire(memb);
+      trps_compute_expiry(trps, tr_comm_memb_get_interval(memb), tr_comm_memb_get_expiry(memb));
+      trps_expiry_push(trps->memb_expiry, tr_comm_memb_get_expiry(memb), exp.role,
+                       exp.comm, exp.realm, exp.peer);
+      tr_debug("trps_sweep_ctable: community membership expired at %s, resetting expiry to %s (%.*s in %.*s, origin %.*s).",
+               timespec_to_str(&sweep_time),
+               timespec_to_str(tr_comm_memb_get_expiry(memb)),
+               tr_comm_memb_get_realm_id(memb)->len, tr_comm_memb_get_realm_id(memb)->buf,
+               tr_comm_get_id(tr_comm_memb_get_comm(memb))->len, tr_comm_get_id(tr_comm_memb_get_comm(memb))->buf,
+               tr_comm_memb_get_origin(memb)->len, tr_comm_memb_get_origin(memb)->buf);
+    }
+    trps_expiry_free_names(&exp);
   }
 
   /* get rid of any unreferenced realms, etc */
   tr_comm_table_sweep(trps->ctable);
+  rc=TRP_SUCCESS;
 
 cleanup:
-  talloc_free(tmp_ctx);
   return rc;
 }
 
@@ -1287,26 +2018,30 @@ static unsigned int trps_metric_add(unsigned int m1, unsigned int m2)
     return TRP_METRIC_INFINITY;
 }
 
+/* metric we advertise for a route, including the link cost to the peer we learned it from */
+static unsigned int trps_route_advertised_metric(TRPS_INSTANCE *trps, TRP_ROUTE *route)
+{
+  unsigned int linkcost=0;
+
+  if (trp_route_is_local(route))
+    linkcost=0;
+  else {
+    linkcost=trp_peer_get_linkcost(trps_get_peer_by_gssname(trps,
+                                                            trp_route_get_peer(route)));
+  }
+  return trps_metric_add(trp_route_get_metric(route), linkcost);
+}
+
 /* convert an rentry into a new trp update info record */
 static TRP_INFOREC *trps_route_to_inforec(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TRP_ROUTE *route)
 {
   TRP_INFOREC *rec=trp_inforec_new(mem_ctx, TRP_INFOREC_TYPE_ROUTE);
-  unsigned int linkcost=0;
 
   if (rec!=NULL) {
-    if (trp_route_is_local(route))
-      linkcost=0;
-    else {
-      linkcost=trp_peer_get_linkcost(trps_get_peer_by_gssname(trps,
-                                                              trp_route_get_peer(route)));
-    }
-
     /* Note that we leave the next hop empty since the recipient fills that in.
      * This is where we add the link cost (currently always 1) to the next peer. */
     if ((trp_inforec_set_trust_router(rec, trp_route_dup_trust_router(route)) != TRP_SUCCESS)
-       ||(trp_inforec_set_metric(rec,
-                                 trps_metric_add(trp_route_get_metric(route),
-                                                 linkcost)) != TRP_SUCCESS)
+       ||(trp_inforec_set_metric(rec, trps_route_advertised_metric(trps, route)) != TRP_SUCCESS)
        ||(trp_inforec_set_interval(rec, trps_get_update_interval(trps)) != TRP_SUCCESS)) {
       tr_err("trps_route_to_inforec: error creating route update.");
       talloc_free(rec);
@@ -1381,38 +2116,77 @@ static TRP_ROUTE *trps_select_realm_update(TRPS_INSTANCE *trps, TR_NAME *comm, T
   return route;
 }
 
-/* Add TRP_UPD msgs to the updates GPtrArray. Caller needs to arrange for these to be freed. */
-static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
-                                                 GPtrArray *updates,
-                                                 TRPS_INSTANCE *trps,
-                                                 TR_NAME *peer_gssname,
-                                                 int triggered)
+/* Add the routes a peer needs for realms in withdrawn_routes that triggered routes
+ * do not cover: the retraction if nothing is advertised to the peer any more, or
+ * an untriggered alternate if the selected route now goes through the peer. */
+static void trps_select_withdrawn_for_peer(GPtrArray *routes,
+                                           TRPS_INSTANCE *trps,
+                                           TR_NAME *peer_gssname)
+{
+  GHashTableIter iter;
+  TRPS_ROUTE_KEY *key=NULL;
+  TRP_ROUTE *retraction=NULL;
+  TRP_ROUTE *route=NULL;
+
+  g_hash_table_iter_init(&iter, trps->withdrawn_routes);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&retraction)) {
+    route=trps_select_realm_update(trps, key->comm, key->realm, peer_gssname);
+    if (route==NULL)
+      g_ptr_array_add(routes, retraction);
+    else if (!trp_route_is_triggered(route))
+      g_ptr_array_add(routes, route);
+  }
+}
+
+/* Add the triggered routes to advertise to a peer. Only the comm/realm pairs in
+ * triggered_routes can have one, so the rest of the table is not visited. */
+static void trps_select_triggered_for_peer(GPtrArray *routes,
+                                           TRPS_INSTANCE *trps,
+                                           TR_NAME *peer_gssname)
+{
+  GHashTableIter iter;
+  TRPS_ROUTE_KEY *key=NULL;
+  TRP_ROUTE *best=NULL;
+
+  g_hash_table_iter_init(&iter, trps->triggered_routes);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL)) {
+    best=trps_select_realm_update(trps, key->comm, key->realm, peer_gssname);
+    if ((best!=NULL) && trp_route_is_triggered(best))
+      g_ptr_array_add(routes, best);
+  }
+}
+
+/* Add the TRP_ROUTEs to advertise to a peer to the routes GPtrArray. With triggered
+ * set, this includes retractions for realms no longer advertised to the peer. The
+ * routes still belong to the routing table or trps. */
+static TRP_RC trps_select_routes_for_peer(GPtrArray *routes,
+                                          TRPS_INSTANCE *trps,
+                                          TR_NAME *peer_gssname,
+                                          int triggered)
 {
   size_t n_comm=0;
-  TR_NAME **comm=trp_rtable_get_comms(trps->rtable, &n_comm);
+  TR_NAME **comm=NULL;
   TR_NAME **realm=NULL;
   size_t n_realm=0;
   size_t ii=0, jj=0;
   TRP_ROUTE *best=NULL;
-  TRP_UPD *upd=NULL;
 
-  if (updates==NULL)
+  if (routes==NULL)
     return TRP_BADARG;
 
+  if (triggered) {
+    trps_select_triggered_for_peer(routes, trps, peer_gssname);
+    trps_select_withdrawn_for_peer(routes, trps, peer_gssname);
+    return TRP_SUCCESS;
+  }
+
+  comm=trp_rtable_get_comms(trps->rtable, &n_comm);
   for (ii=0; ii<n_comm; ii++) {
     realm=trp_rtable_get_comm_realms(trps->rtable, comm[ii], &n_realm);
     for (jj=0; jj<n_realm; jj++) {
       best=trps_select_realm_update(trps, comm[ii], realm[jj], peer_gssname);
-      /* If we found a route, add it to the list. If triggered!=0, then only
-       * add triggered routes. */
-      if ((best!=NULL) && ((!triggered) || trp_route_is_triggered(best))) {
-        upd=trps_route_to_upd(mem_ctx, trps, best);
-        if (upd==NULL) {
-          tr_err("trps_select_route_updates_for_peer: unable to create update message.");
-          continue;
-        }
-        g_ptr_array_add(updates, upd);
-      }
+      if (best!=NULL)
+        g_ptr_array_add(routes, best);
     }
     
     if (realm!=NULL)
@@ -1423,10 +2197,80 @@ static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
 
   if (comm!=NULL)
     talloc_free(comm);
-  
   return TRP_SUCCESS;
 }
 
+/* Add TRP_UPD msgs to the updates GPtrArray. Caller needs to arrange for these to be freed. */
+static TRP_RC trps_select_route_updates_for_peer(TALLOC_CTX *mem_ctx,
+                                                 GPtrArray *updates,
+                                                 TRPS_INSTANCE *trps,
+                                                 TR_NAME *peer_gssname,
+                                                 int triggered)
+{
+  GPtrArray *routes=g_ptr_array_new();
+  TRP_UPD *upd=NULL;
+  size_t ii=0;
+
+  if (updates==NULL) {
+    g_ptr_array_free(routes, TRUE);
+    return TRP_BADARG;
+  }
+
+  trps_select_routes_for_peer(routes, trps, peer_gssname, triggered);
+  for (ii=0; ii<routes->len; ii++) {
+    upd=trps_route_to_upd(mem_ctx, trps, g_ptr_array_index(routes, ii));
+    if (upd==NULL) {
+      tr_err("trps_select_route_updates_for_peer: unable to create update message.");
+      continue;
+    }
+    g_ptr_array_add(updates, upd);
+  }
+
+  g_ptr_array_free(routes, TRUE);
+  return TRP_SUCCESS;
+}
+
+/* Hash of one advertised route. Routes are combined by addition, so a digest
+ * does not depend on the order tables are walked in. */
+unsigned int trps_route_digest(TR_NAME *comm, TR_NAME *realm, TR_NAME *trust_router, unsigned int metric)
+{
+  unsigned int hash=tr_name_hash(comm);
+
+  hash=(hash*16777619u) ^ tr_name_hash(realm);
+  hash=(hash*16777619u) ^ tr_name_hash(trust_router);
+  hash=(hash*16777619u) ^ metric;
+  return hash;
+}
+
+/* Digest of the routes we hold from a peer. Matches trps_advertised_digest() on the
+ * peer when we have everything it sent us. */
+static void trps_learned_digest(TRPS_INSTANCE *trps,
+                                TR_NAME *peer_gssname,
+                                unsigned int *digest,
+                                unsigned int *n_routes)
+{
+  size_t n_entry=0;
+  TRP_ROUTE **entry=trp_rtable_get_peer_entries(trps->rtable, peer_gssname, &n_entry);
+  TRP_ROUTE *route=NULL;
+  size_t ii=0;
+
+  *digest=0;
+  *n_routes=0;
+  for (ii=0; ii<n_entry; ii++) {
+    route=entry[ii];
+    if (!trp_metric_is_finite(trp_route_get_metric(route)))
+      continue;
+
+    *digest+=trps_route_digest(trp_route_get_comm(route),
+                               trp_route_get_realm(route),
+                               trp_route_get_trust_router(route),
+                               trp_route_get_metric(route));
+    (*n_routes)++;
+  }
+  if (entry!=NULL)
+    talloc_free(entry);
+}
+
 static TRP_INFOREC *trps_memb_to_inforec(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_COMM_MEMB *memb)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
@@ -1474,7 +2318,7 @@ static TRP_INFOREC *trps_memb_to_inforec(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trp
   }
 
   if ((NULL!=tr_comm_memb_get_provenance(memb)) &&
-      (TRP_SUCCESS!=trp_inforec_set_provenance(rec, tr_comm_memb_get_provenance(memb)))) {
+      (TRP_SUCCESS!=trp_inforec_set_provenance(rec, tr_provenance_dup(rec, tr_comm_memb_get_provenance(memb))))) {
     rec=NULL;
     goto cleanup;
   }
@@ -1492,8 +2336,40 @@ cleanup:
   return rec;
 }
 
+/* Inforec withdrawing the membership identified by key. Its provenance holds
+ * only the origin; the receiver adds us as the peer it came from. */
+static TRP_INFOREC *trps_memb_withdrawal(TALLOC_CTX *mem_ctx, TRPS_MEMB_KEY *key)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TRP_INFOREC *rec=trp_inforec_new(tmp_ctx, TRP_INFOREC_TYPE_COMMUNITY);
+  TR_PROVENANCE *prov=tr_provenance_new(tmp_ctx);
+
+  if ((rec==NULL)
+     || (prov==NULL)
+     || (0!=tr_provenance_add(prov, key->origin))
+     || (TRP_SUCCESS!=trp_inforec_set_comm_type(rec, key->comm_type))
+     || (TRP_SUCCESS!=trp_inforec_set_role(rec, key->role))
+     || (TRP_SUCCESS!=trp_inforec_set_provenance(rec, prov))
+     || (TRP_SUCCESS!=trp_inforec_set_interval(rec, TRP_INTERVAL_WITHDRAWN))) {
+    rec=NULL;
+    goto cleanup;
+  }
+
+  /* success! */
+  talloc_steal(mem_ctx, rec);
+
+cleanup:
+  talloc_free(tmp_ctx);
+  return rec;
+}
+
 /* construct an update with all the inforecs for comm/realm/role to be sent to peer */
-static TRP_UPD *trps_comm_update(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_NAME *peer_gssname, TR_COMM *comm, TR_REALM *realm)
+static TRP_UPD *trps_comm_update(TALLOC_CTX *mem_ctx,
+                                 TRPS_INSTANCE *trps,
+                                 TR_NAME *peer_gssname,
+                                 TR_NAME *comm_id,
+                                 TR_NAME *realm_id,
+                                 TR_REALM_ROLE role)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TRP_UPD *upd=trp_upd_new(tmp_ctx);
@@ -1504,8 +2380,8 @@ static TRP_UPD *trps_comm_update(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_NA
   if (upd==NULL)
     goto cleanup;
   
-  trp_upd_set_comm(upd, tr_comm_dup_id(comm));
-  trp_upd_set_realm(upd, tr_realm_dup_id(realm));
+  trp_upd_set_comm(upd, tr_dup_name(comm_id));
+  trp_upd_set_realm(upd, tr_dup_name(realm_id));
   /* leave peer empty */
 
   iter=tr_comm_iter_new(tmp_ctx);
@@ -1516,16 +2392,12 @@ static TRP_UPD *trps_comm_update(TALLOC_CTX *mem_ctx, TRPS_INSTANCE *trps, TR_NA
   }
   
   /* now add inforecs */
-  switch (realm->role) {
+  switch (role) {
   case TR_ROLE_IDP:
-    memb=tr_comm_table_find_idp_memb(trps->ctable,
-                                     tr_realm_get_id(realm),
-                                     tr_comm_get_id(comm));
+    memb=tr_comm_table_find_idp_memb(trps->ctable, realm_id, comm_id);
     break;
   case TR_ROLE_RP:
-    memb=tr_comm_table_find_rp_memb(trps->ctable,
-                                    tr_realm_get_id(realm),
-                                    tr_comm_get_id(comm));
+    memb=tr_comm_table_find_rp_memb(trps->ctable, realm_id, comm_id);
     break;
   default:
     break;
@@ -1559,8 +2431,7 @@ cleanup:
 static TRP_RC trps_select_comm_updates_for_peer(TALLOC_CTX *mem_ctx,
                                                 GPtrArray *updates,
                                                 TRPS_INSTANCE *trps,
-                                                TR_NAME *peer_gssname,
-                                                int triggered)
+                                                TR_NAME *peer_gssname)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TR_COMM_ITER *comm_iter=NULL;
@@ -1570,12 +2441,6 @@ static TRP_RC trps_select_comm_updates_for_peer(TALLOC_CTX *mem_ctx,
   TRP_UPD *upd=NULL;
   TRP_RC rc=TRP_ERROR;
 
-  /* currently do not send any communities on triggered updates */
-  if (triggered) {
-    rc=TRP_SUCCESS;
-    goto cleanup;
-  }
-
   comm_iter=tr_comm_iter_new(tmp_ctx);
   realm_iter=tr_comm_iter_new(tmp_ctx);
   if ((comm_iter==NULL) || (realm_iter==NULL)) {
@@ -1599,17 +2464,70 @@ static TRP_RC trps_select_comm_updates_for_peer(TALLOC_CTX *mem_ctx,
       tr_debug("trps_select_comm_updates_for_peer: adding realm %.*s",
                tr_realm_get_id(realm)->len,
                tr_realm_get_id(realm)->buf);
-      upd=trps_comm_update(mem_ctx, trps, peer_gssname, comm, realm);
+      upd=trps_comm_update(mem_ctx, trps, peer_gssname, tr_comm_get_id(comm), tr_realm_get_id(realm), realm->role);
       if (upd!=NULL)
         g_ptr_array_add(updates, upd);
     }
   }
+  rc=TRP_SUCCESS;
 
 cleanup:
   talloc_free(tmp_ctx);
   return rc;
 }
 
+/* Add updates for the memberships that changed since the last triggered update
+ * to the updates GPtrArray, withdrawing those that are gone. */
+static TRP_RC trps_select_comm_deltas(TALLOC_CTX *mem_ctx, GPtrArray *updates, TRPS_INSTANCE *trps)
+{
+  GHashTableIter iter;
+  TRPS_MEMB_KEY *key=NULL;
+  TR_COMM_MEMB *memb=NULL;
+  TRP_UPD *upd=NULL;
+  TRP_INFOREC *rec=NULL;
+
+  g_hash_table_iter_init(&iter, trps->triggered_membs);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL)) {
+    upd=trp_upd_new(mem_ctx);
+    if (upd==NULL) {
+      tr_err("trps_select_comm_deltas: unable to allocate update.");
+      return TRP_NOMEM;
+    }
+    trp_upd_set_comm(upd, tr_dup_name(key->comm));
+    trp_upd_set_realm(upd, tr_dup_name(key->realm));
+
+    memb=trps_find_memb(trps, key->role, key->comm, key->realm, key->origin);
+    if (memb!=NULL)
+      rec=trps_memb_to_inforec(upd, trps, memb);
+    else
+      rec=trps_memb_withdrawal(upd, key);
+    if (rec==NULL) {
+      tr_err("trps_select_comm_deltas: unable to allocate inforec.");
+      trp_upd_free(upd);
+      continue;
+    }
+    trp_upd_add_inforec(upd, rec);
+    g_ptr_array_add(updates, upd);
+  }
+  return TRP_SUCCESS;
+}
+
+/* Memberships have been sent with a triggered update; stop tracking them. */
+static void trps_clear_triggered_membs(TRPS_INSTANCE *trps)
+{
+  GHashTableIter iter;
+  TRPS_MEMB_KEY *key=NULL;
+  TR_COMM_MEMB *memb=NULL;
+
+  g_hash_table_iter_init(&iter, trps->triggered_membs);
+  while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL)) {
+    memb=trps_find_memb(trps, key->role, key->comm, key->realm, key->origin);
+    if (memb!=NULL)
+      tr_comm_memb_set_triggered(memb, 0);
+  }
+  g_hash_table_remove_all(trps->triggered_membs);
+}
+
 
 /* helper for trps_update_one_peer. Frees the TRP_UPD pointed to by a GPtrArray element */
 static void trps_trp_upd_destroy(gpointer data)
@@ -1617,17 +2535,322 @@ static void trps_trp_upd_destroy(gpointer data)
   trp_upd_free((TRP_UPD *)data);
 }
 
-/* all routes/communities to a single peer, unless comm/realm are specified (both or neither must be NULL) */
+/* Encoded updates shared by every peer during one trps_update() pass. Most
+ * updates are the same for all peers, so each is encoded only once. */
+typedef struct trps_upd_frags {
+  GHashTable *routes; /* TRP_ROUTE * -> GBytes holding its encoded update */
+  GPtrArray *comms; /* GBytes for each community update, NULL until first needed */
+  GPtrArray *comm_deltas; /* GBytes for each changed membership, NULL until first needed */
+  int have_digest; /* digest/n_routes are valid */
+  unsigned int digest; /* digest of the selected routes, before split horizon */
+  unsigned int n_routes;
+} TRPS_UPD_FRAGS;
+
+static int trps_upd_frags_destructor(void *object)
+{
+  TRPS_UPD_FRAGS *frags=talloc_get_type_abort(object, TRPS_UPD_FRAGS);
+  if (frags->routes!=NULL)
+    g_hash_table_destroy(frags->routes);
+  if (frags->comms!=NULL)
+    g_ptr_array_free(frags->comms, TRUE);
+  if (frags->comm_deltas!=NULL)
+    g_ptr_array_free(frags->comm_deltas, TRUE);
+  return 0;
+}
+
+static TRPS_UPD_FRAGS *trps_upd_frags_new(TALLOC_CTX *mem_ctx)
+{
+  TRPS_UPD_FRAGS *frags=talloc(mem_ctx, TRPS_UPD_FRAGS);
+  if (frags!=NULL) {
+    frags->routes=g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_bytes_unref);
+    frags->comms=NULL;
+    frags->comm_deltas=NULL;
+    frags->have_digest=0;
+    frags->digest=0;
+    frags->n_routes=0;
+    talloc_set_destructor((void *)frags, trps_upd_frags_destructor);
+  }
+  return frags;
+}
+
+/* Caller must release the result with g_bytes_unref(). */
+static GBytes *trps_encode_upd(TRP_UPD *upd)
+{
+  char *encoded=tr_msg_encode_trp_upd_body(upd);
+  if (encoded==NULL)
+    return NULL;
+  return g_bytes_new_with_free_func(encoded, strlen(encoded), (GDestroyNotify)tr_msg_free_encoded, encoded);
+}
+
+/* Encoded update advertising route. Owned by frags. */
+static GBytes *trps_route_frag(TRPS_INSTANCE *trps, TRPS_UPD_FRAGS *frags, TRP_ROUTE *route)
+{
+  GBytes *frag=g_hash_table_lookup(frags->routes, route);
+  TRP_UPD *upd=NULL;
+
+  if (frag==NULL) {
+    upd=trps_route_to_upd(NULL, trps, route);
+    if (upd==NULL)
+      return NULL;
+    frag=trps_encode_upd(upd);
+    trp_upd_free(upd);
+    if (frag!=NULL)
+      g_hash_table_insert(frags->routes, route, frag);
+  }
+  return frag;
+}
+
+/* Encoded community updates, the same for every peer. With triggered set, only
+ * the memberships that changed, otherwise all of them. Owned by frags. */
+static GPtrArray *trps_comm_frags(TRPS_INSTANCE *trps, TRPS_UPD_FRAGS *frags, int triggered)
+{
+  GPtrArray **comm_frags=triggered?&(frags->comm_deltas):&(frags->comms);
+  TALLOC_CTX *tmp_ctx=NULL;
+  GPtrArray *updates=NULL;
+  GBytes *frag=NULL;
+  size_t ii=0;
+
+  if (*comm_frags!=NULL)
+    return *comm_frags;
+
+  tmp_ctx=talloc_new(NULL);
+  updates=g_ptr_array_new_with_free_func(trps_trp_upd_destroy);
+  *comm_frags=g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+  if (triggered)
+    trps_select_comm_deltas(tmp_ctx, updates, trps);
+  else
+    trps_select_comm_updates_for_peer(tmp_ctx, updates, trps, NULL);
+  for (ii=0; ii<updates->len; ii++) {
+    frag=trps_encode_upd(g_ptr_array_index(updates, ii));
+    if (frag==NULL) {
+      tr_err("trps_comm_frags: error encoding community update.");
+      continue;
+    }
+    g_ptr_array_add(*comm_frags, frag);
+  }
+  g_ptr_array_free(updates, TRUE);
+  talloc_free(tmp_ctx);
+  return *comm_frags;
+}
+
+/* Add (sign=1) or remove (sign=-1) an advertised route's share of a digest. */
+static void trps_digest_route(TRPS_INSTANCE *trps,
+                              TRP_ROUTE *route,
+                              int sign,
+                              unsigned int *digest,
+                              unsigned int *n_routes)
+{
+  unsigned int metric=trps_route_advertised_metric(trps, route);
+
+  if (!trp_metric_is_finite(metric))
+    return;
+  *digest+=sign*trps_route_digest(trp_route_get_comm(route),
+                                  trp_route_get_realm(route),
+                                  trp_route_get_trust_router(route),
+                                  metric);
+  *n_routes+=sign;
+}
+
+/* Digest of the selected routes, as a full update to a peer that none of
+ * them go through would contain. */
+static void trps_selected_digest(TRPS_INSTANCE *trps, unsigned int *digest, unsigned int *n_routes)
+{
+  size_t n_comm=0;
+  TR_NAME **comm=trp_rtable_get_comms(trps->rtable, &n_comm);
+  TR_NAME **realm=NULL;
+  size_t n_realm=0;
+  size_t ii=0, jj=0;
+  TRP_ROUTE *selected=NULL;
+
+  *digest=0;
+  *n_routes=0;
+  for (ii=0; ii<n_comm; ii++) {
+    realm=trp_rtable_get_comm_realms(trps->rtable, comm[ii], &n_realm);
+    for (jj=0; jj<n_realm; jj++) {
+      selected=trp_rtable_get_selected_entry(trps->rtable, comm[ii], realm[jj]);
+      if (selected!=NULL)
+        trps_digest_route(trps, selected, 1, digest, n_routes);
+    }
+    if (realm!=NULL)
+      talloc_free(realm);
+    realm=NULL;
+    n_realm=0;
+  }
+  if (comm!=NULL)
+    talloc_free(comm);
+}
+
+/* Digest of the routes a full update to this peer would contain. Starts from the
+ * digest of the selected routes, shared through frags if not NULL, and applies
+ * split horizon to the routes that go through the peer, as trps_select_realm_update()
+ * does. */
+static void trps_advertised_digest(TRPS_INSTANCE *trps,
+                                   TRPS_UPD_FRAGS *frags,
+                                   TR_NAME *peer_gssname,
+                                   unsigned int *digest,
+                                   unsigned int *n_routes)
+{
+  size_t n_entry=0;
+  TRP_ROUTE **entry=NULL;
+  TRP_ROUTE *route=NULL;
+  TRP_ROUTE *alt=NULL;
+  size_t ii=0;
+
+  if (frags==NULL)
+    trps_selected_digest(trps, digest, n_routes);
+  else {
+    if (!frags->have_digest) {
+      trps_selected_digest(trps, &frags->digest, &frags->n_routes);
+      frags->have_digest=1;
+    }
+    *digest=frags->digest;
+    *n_routes=frags->n_routes;
+  }
+
+  entry=trp_rtable_get_peer_entries(trps->rtable, peer_gssname, &n_entry);
+  for (ii=0; ii<n_entry; ii++) {
+    route=entry[ii];
+    if (route!=trp_rtable_get_selected_entry(trps->rtable,
+                                             trp_route_get_comm(route),
+                                             trp_route_get_realm(route)))
+      continue;
+    trps_digest_route(trps, route, -1, digest, n_routes);
+    alt=trps_find_best_route(trps, trp_route_get_comm(route), trp_route_get_realm(route), peer_gssname);
+    if ((alt!=NULL) && trp_metric_is_finite(trp_route_get_metric(alt)))
+      trps_digest_route(trps, alt, 1, digest, n_routes);
+  }
+  if (entry!=NULL)
+    talloc_free(entry);
+}
+
+/* Tell a peer what we would send it in a full route update. Sent in place of
+ * the routes themselves once the peer has shown it understands keepalives.
+ * frags shares work between peers during one pass, or is NULL. */
+static TRP_RC trps_send_kalive(TRPS_INSTANCE *trps, TRP_PEER *peer, TRPS_UPD_FRAGS *frags)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_MSG msg; /* not a pointer */
+  TRP_KALIVE *kalive=trp_kalive_new(tmp_ctx);
+  TR_NAME *peer_label=trp_peer_get_label(peer);
+  unsigned int digest=0, n_routes=0;
+  char *encoded=NULL;
+  TRP_RC rc=TRP_ERROR;
+
+  if (kalive==NULL) {
+    tr_err("trps_send_kalive: unable to allocate keepalive.");
+    rc=TRP_NOMEM;
+    goto cleanup;
+  }
+
+  trps_advertised_digest(trps, frags, peer_label, &digest, &n_routes);
+  trp_kalive_set_seq(kalive, trp_peer_get_send_seq(peer));
+  trp_kalive_set_digest(kalive, digest);
+  trp_kalive_set_n_routes(kalive, n_routes);
+  trp_kalive_set_interval(kalive, trps_get_update_interval(trps));
+
+  tr_msg_set_trp_kalive(&msg, kalive);
+  encoded=tr_msg_encode(&msg);
+  if (encoded==NULL) {
+    tr_err("trps_send_kalive: error encoding keepalive.");
+    rc=TRP_ERROR;
+    goto cleanup;
+  }
+
+  tr_debug("trps_send_kalive: %u routes to %.*s, seq=%u, digest=%08x.",
+           n_routes, peer_label->len, peer_label->buf, trp_peer_get_send_seq(peer), digest);
+  if (trps_send_msg(trps, peer, encoded) != TRP_SUCCESS) {
+    tr_err("trps_send_kalive: error queueing keepalive.");
+    rc=TRP_ERROR;
+  } else
+    rc=TRP_SUCCESS;
+
+cleanup:
+  if (encoded!=NULL)
+    tr_msg_free_encoded(encoded);
+  talloc_free(tmp_ctx);
+  return rc;
+}
+
+/* All routes/communities to a peer that accepts packed messages, assembled
+ * from the encoded updates in frags rather than encoding them again. */
+static TRP_RC trps_update_one_peer_packed(TRPS_INSTANCE *trps,
+                                          TRP_PEER *peer,
+                                          TRP_UPDATE_TYPE update_type,
+                                          TRPS_UPD_FRAGS *frags)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_NAME *peer_label=trp_peer_get_label(peer);
+  GPtrArray *routes=g_ptr_array_new();
+  GPtrArray *bodies=g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+  GPtrArray *comm_frags=NULL;
+  GBytes *frag=NULL;
+  char *encoded=NULL;
+  size_t n_packed=0;
+  size_t ii=0;
+
+  if (frags==NULL)
+    frags=trps_upd_frags_new(tmp_ctx); /* nothing to share with */
+
+  /* A scheduled update to a peer that takes keepalives carries no routes or
+   * communities; it has had every change as a triggered update. */
+  if (update_type!=TRP_UPDATE_SCHEDULED) {
+    trps_select_routes_for_peer(routes, trps, peer_label, update_type==TRP_UPDATE_TRIGGERED);
+    for (ii=0; ii<routes->len; ii++) {
+      frag=trps_route_frag(trps, frags, g_ptr_array_index(routes, ii));
+      if (frag==NULL) {
+        tr_err("trps_update_one_peer_packed: unable to encode route update.");
+        continue;
+      }
+      g_ptr_array_add(bodies, g_bytes_ref(frag));
+    }
+  }
+
+  if (update_type!=TRP_UPDATE_SCHEDULED) {
+    comm_frags=trps_comm_frags(trps, frags, update_type==TRP_UPDATE_TRIGGERED);
+    for (ii=0; ii<comm_frags->len; ii++)
+      g_ptr_array_add(bodies, g_bytes_ref(g_ptr_array_index(comm_frags, ii)));
+  }
+
+  tr_debug("trps_update_one_peer_packed: sending %u updates to %.*s.",
+           bodies->len, peer_label->len, peer_label->buf);
+  for (ii=0; ii<bodies->len; ii+=n_packed) {
+    encoded=tr_msg_pack_trp_upds((GBytes **)(bodies->pdata)+ii,
+                                 bodies->len-ii,
+                                 trp_peer_next_send_seq(peer),
+                                 trps_get_max_update_bytes(trps),
+                                 &n_packed);
+    if (encoded==NULL) {
+      tr_err("trps_update_one_peer_packed: error packing updates.");
+      break;
+    }
+    if (trps_send_msg(trps, peer, encoded) != TRP_SUCCESS)
+      tr_err("trps_update_one_peer_packed: error queueing update.");
+    tr_msg_free_encoded(encoded);
+  }
+
+  if (update_type==TRP_UPDATE_SCHEDULED)
+    trps_send_kalive(trps, peer, frags);
+
+  g_ptr_array_free(bodies, TRUE);
+  g_ptr_array_free(routes, TRUE);
+  talloc_free(tmp_ctx);
+  return TRP_SUCCESS;
+}
+
+/* all routes/communities to a single peer, unless comm/realm are specified (both or neither must be NULL).
+ * frags holds encoded updates shared between calls, or is NULL. */
 static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
                                    TRP_PEER *peer,
                                    TRP_UPDATE_TYPE update_type,
                                    TR_NAME *comm,
-                                   TR_NAME *realm)
+                                   TR_NAME *realm,
+                                   TRPS_UPD_FRAGS *frags)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TR_MSG msg; /* not a pointer! */
   TRP_UPD *upd=NULL;
   TRP_ROUTE *route=NULL;
+  TR_REALM_ROLE roles[]={TR_ROLE_IDP, TR_ROLE_RP};
   size_t ii=0;
   char *encoded=NULL;
   TRP_RC rc=TRP_ERROR;
@@ -1659,9 +2882,21 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
     goto cleanup;
   }
 
+  /* Peers that send keepalives also accept several updates per message. */
+  if ((comm==NULL) && (realm==NULL)
+     && (trps_get_max_update_bytes(trps)>0) && trp_peer_get_keepalive_ok(peer)) {
+    rc=trps_update_one_peer_packed(trps, peer, update_type, frags);
+    goto cleanup;
+  }
+
   /* First, gather route updates. */
   tr_debug("trps_update_one_peer: selecting route updates for %.*s.", peer_label->len, peer_label->buf);
-  if ((comm==NULL) && (realm==NULL)) {
+  if ((update_type==TRP_UPDATE_SCHEDULED) && trp_peer_get_keepalive_ok(peer)) {
+    /* the peer has had every change as a triggered update; the keepalive sent below
+     * lets it confirm that and refresh its routes */
+    tr_debug("trps_update_one_peer: %.*s accepts keepalives, not resending routes.",
+             peer_label->len, peer_label->buf);
+  } else if ((comm==NULL) && (realm==NULL)) {
     /* do all realms */
     rc=trps_select_route_updates_for_peer(tmp_ctx,
                                           updates,
@@ -1674,13 +2909,12 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
     if (route==NULL) {
       /* we have no actual update to send back, MUST send a retraction */
       tr_debug("trps_update_one_peer: community/realm without route requested, sending mandatory retraction.");
-      route=trp_route_new(tmp_ctx);
-      trp_route_set_comm(route, tr_dup_name(comm));
-      trp_route_set_realm(route, tr_dup_name(realm));
-      trp_route_set_peer(route, tr_new_name(""));
-      trp_route_set_metric(route, TRP_METRIC_INFINITY);
-      trp_route_set_trust_router(route, tr_new_name(""));
-      trp_route_set_next_hop(route, tr_new_name(""));
+      route=trps_new_retraction(tmp_ctx, comm, realm);
+      if (route==NULL) {
+        tr_err("trps_update_one_peer: unable to allocate retraction.");
+        rc=TRP_NOMEM;
+        goto cleanup;
+      }
     }
     upd=trps_route_to_upd(tmp_ctx, trps, route);
     if (upd==NULL) {
@@ -1695,9 +2929,22 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
     goto cleanup;
   }
 
-  /* Second, gather community updates */
+  /* Second, gather community updates. Triggered updates carry only the memberships
+   * that changed; peers that take keepalives get them all only when they ask. */
   tr_debug("trps_update_one_peer: selecting community updates for %.*s.", peer_label->len, peer_label->buf);
-  rc=trps_select_comm_updates_for_peer(tmp_ctx, updates, trps, peer_label, update_type==TRP_UPDATE_TRIGGERED);
+  if ((comm!=NULL) && (realm!=NULL)) {
+    for (ii=0; ii<sizeof(roles)/sizeof(roles[0]); ii++) {
+      upd=trps_comm_update(tmp_ctx, trps, peer_label, comm, realm, roles[ii]);
+      if (upd!=NULL)
+        g_ptr_array_add(updates, upd);
+    }
+  } else if (update_type==TRP_UPDATE_TRIGGERED)
+    rc=trps_select_comm_deltas(tmp_ctx, updates, trps);
+  else if ((update_type==TRP_UPDATE_SCHEDULED) && trp_peer_get_keepalive_ok(peer)) {
+    tr_debug("trps_update_one_peer: %.*s accepts keepalives, not resending communities.",
+             peer_label->len, peer_label->buf);
+  } else
+    rc=trps_select_comm_updates_for_peer(tmp_ctx, updates, trps, peer_label);
 
   /* see if we have anything to send */
   if (updates->len<=0)
@@ -1706,6 +2953,7 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
     tr_debug("trps_update_one_peer: sending %d update messages.", updates->len);
     for (ii=0; ii<updates->len; ii++) {
       upd=(TRP_UPD *)g_ptr_array_index(updates, ii);
+      trp_upd_set_seq(upd, trp_peer_next_send_seq(peer));
       /* now encode the update message */
       tr_msg_set_trp_upd(&msg, upd);
       encoded=tr_msg_encode(&msg);
@@ -1726,6 +2974,11 @@ static TRP_RC trps_update_one_peer(TRPS_INSTANCE *trps,
     }
   }
 
+  /* Every scheduled update ends with a keepalive. Peers that understand it
+   * answer with their own, after which we stop resending routes to them. */
+  if (update_type==TRP_UPDATE_SCHEDULED)
+    trps_send_kalive(trps, peer, frags);
+
   rc=TRP_SUCCESS;
 
 cleanup:
@@ -1740,6 +2993,7 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TRP_PTABLE_ITER *iter=trp_ptable_iter_new(tmp_ctx);
+  TRPS_UPD_FRAGS *frags=trps_upd_frags_new(tmp_ctx);
   TRP_PEER *peer=NULL;
   TRP_RC rc=TRP_SUCCESS;
 
@@ -1762,12 +3016,16 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
                peer_label->len, peer_label->buf);
       continue;
     }
-    rc=trps_update_one_peer(trps, peer, update_type, NULL, NULL);
+    rc=trps_update_one_peer(trps, peer, update_type, NULL, NULL, frags);
   }
 
   tr_debug("trps_update: rc=%u after attempting update.", rc);
   trp_ptable_iter_free(iter);
-  trp_rtable_clear_triggered(trps->rtable); /* don't re-send triggered updates */
+  trps_clear_triggered_routes(trps); /* don't re-send triggered updates */
+  if (update_type==TRP_UPDATE_TRIGGERED) {
+    trps_clear_triggered_membs(trps);
+    g_hash_table_remove_all(trps->withdrawn_routes); /* retractions have been sent */
+  }
   talloc_free(tmp_ctx);
   return rc;
 }        
@@ -1775,6 +3033,7 @@ TRP_RC trps_update(TRPS_INSTANCE *trps, TRP_UPDATE_TYPE update_type)
 TRP_RC trps_add_route(TRPS_INSTANCE *trps, TRP_ROUTE *route)
 {
   trp_rtable_add(trps->rtable, route); /* should return status */
+  trps_mark_dirty(trps, trp_route_get_comm(route), trp_route_get_realm(route));
   return TRP_SUCCESS; 
 }
 
@@ -1843,20 +3102,106 @@ static TRP_RC trps_handle_request(TRPS_INSTANCE *trps, TRP_REQ *req)
                               trps_get_peer_by_gssname(trps, trp_req_get_peer(req)),
                               TRP_UPDATE_REQUESTED,
                               comm,
-                              realm);
+                              realm,
+                              NULL);
 }
 
 
+/* A peer's connection went up or down. Its keepalives no longer vouch for the
+ * memberships we learned from it, so mark them expired; the peer's reply to our
+ * wildcard request replaces those it still has, and the rest are flushed. */
+void trps_peer_membs_stale(TRPS_INSTANCE *trps, TRP_PEER *peer)
+{
+  TALLOC_CTX *tmp_ctx=talloc_new(NULL);
+  TR_COMM_ITER *iter=tr_comm_iter_new(tmp_ctx);
+  TR_COMM_MEMB *memb=NULL;
+  TR_NAME *learned_from=NULL;
+
+  /* nor do its earlier keepalives */
+  trp_peer_set_membs_vouched(peer, &(struct timespec){0,0});
+  trp_peer_set_routes_vouched(peer, &(struct timespec){0,0}, 0);
+
+  if ((trps->ctable==NULL) || (iter==NULL))
+    goto cleanup;
+
+  for (memb=tr_comm_memb_iter_all_first(iter, trps->ctable);
+       memb!=NULL;
+       memb=tr_comm_memb_iter_all_next(iter)) {
+    learned_from=trps_memb_learned_from(memb);
+    if ((learned_from!=NULL)
+       && tr_name_equal(learned_from, trp_peer_get_label(peer))
+       && (tr_comm_memb_get_times_expired(memb)==0))
+      tr_comm_memb_expire(memb);
+  }
+
+cleanup:
+  talloc_free(tmp_ctx);
+}
+
+/* Check a peer's keepalive against the routes we hold from it. If they match,
+ * the routes are still good; otherwise ask the peer to send everything again.
+ * Either way, the memberships learned from the peer are still good; changes to
+ * those reach us as triggered updates. Routes and memberships that are vouched
+ * for get their new expiry when the sweeps come to them. */
+static TRP_RC trps_handle_kalive(TRPS_INSTANCE *trps, TRP_KALIVE *kalive)
+{
+  TRP_PEER *peer=NULL;
+  TR_NAME *peer_label=NULL;
+  unsigned int digest=0, n_routes=0;
+  struct timespec now={0,0};
+
+  if ((kalive==NULL) || (trp_kalive_get_peer(kalive)==NULL)) {
+    tr_notice("trps_handle_kalive: received invalid TRP keepalive.");
+    return TRP_ERROR;
+  }
+
+  peer=trps_get_peer_by_gssname(trps, trp_kalive_get_peer(kalive));
+  if (peer==NULL) {
+    tr_notice("trps_handle_kalive: keepalive from unknown peer.");
+    return TRP_ERROR;
+  }
+  peer_label=trp_peer_get_label(peer);
+  trp_peer_set_keepalive_ok(peer, 1);
+  if (0!=clock_gettime(TRP_CLOCK, &now)) {
+    tr_err("trps_handle_kalive: could not read realtime clock.");
+    return TRP_ERROR;
+  }
+  trp_peer_set_membs_vouched(peer, &now);
+
+  trps_learned_digest(trps, trp_kalive_get_peer(kalive), &digest, &n_routes);
+  if ((trp_kalive_get_seq(kalive)==trp_peer_get_recv_seq(peer))
+     && (trp_kalive_get_digest(kalive)==digest)
+     && (trp_kalive_get_n_routes(kalive)==n_routes)) {
+    tr_debug("trps_handle_kalive: %u routes from %.*s up to date.",
+             n_routes, peer_label->len, peer_label->buf);
+    trp_peer_set_routes_vouched(peer, &now, trp_kalive_get_interval(kalive));
+    return TRP_SUCCESS;
+  }
+
+  /* Routes we hold but the peer no longer advertises are not refreshed, so they expire. */
+  tr_notice("trps_handle_kalive: routes from %.*s out of sync (seq %u/%u, %u/%u routes), requesting full update.",
+            peer_label->len, peer_label->buf,
+            trp_peer_get_recv_seq(peer), trp_kalive_get_seq(kalive),
+            n_routes, trp_kalive_get_n_routes(kalive));
+  return trps_wildcard_route_req(trps, trp_peer_get_servicename(peer));
+}
+
 TRP_RC trps_handle_tr_msg(TRPS_INSTANCE *trps, TR_MSG *tr_msg)
 {
   TRP_RC rc=TRP_ERROR;
+  TRP_UPD *upd=NULL;
 
   switch (tr_msg_get_msg_type(tr_msg)) {
   case TRP_UPDATE:
-    rc=trps_handle_update(trps, tr_msg_get_trp_upd(tr_msg));
-    if (rc==TRP_SUCCESS) {
-      rc=trps_update_active_routes(trps);
-      trps_update(trps, TRP_UPDATE_TRIGGERED); /* send any triggered routes */
+    /* Route selection and triggered updates wait for trps_apply_updates(),
+     * so a burst of updates is handled in one pass. */
+    upd=tr_msg_get_trp_upd(tr_msg);
+    if (upd==NULL)
+      return trps_handle_update(trps, upd); /* reports the invalid update */
+    rc=TRP_SUCCESS;
+    for (; upd!=NULL; upd=trp_upd_get_next(upd)) {
+      if (trps_handle_update(trps, upd)!=TRP_SUCCESS)
+        rc=TRP_ERROR;
     }
     return rc;
 
@@ -1864,14 +3209,26 @@ TRP_RC trps_handle_tr_msg(TRPS_INSTANCE *trps, TR_MSG *tr_msg)
     rc=trps_handle_request(trps, tr_msg_get_trp_req(tr_msg));
     return rc;
 
+  case TRP_KEEPALIVE:
+    return trps_handle_kalive(trps, tr_msg_get_trp_kalive(tr_msg));
+
   default:
     /* unknown error or one we don't care about (e.g., TID messages) */
     return TRP_ERROR;
   }
 }
 
-/* send wildcard route request to a peer */
-TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename)
+/* Select routes and send triggered updates for everything received since
+ * the last call. */
+TRP_RC trps_apply_updates(TRPS_INSTANCE *trps)
+{
+  TRP_RC rc=trps_update_dirty_routes(trps);
+  trps_update(trps, TRP_UPDATE_TRIGGERED); /* send any triggered routes */
+  return rc;
+}
+
+/* send a route request for comm/realm to a peer, or a wildcard request if both are NULL */
+static TRP_RC trps_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename, TR_NAME *comm, TR_NAME *realm)
 {
   TALLOC_CTX *tmp_ctx=talloc_new(NULL);
   TRP_PEER *peer=trps_get_peer_by_servicename(trps, peer_servicename);
@@ -1881,30 +3238,40 @@ TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename)
   TRP_RC rc=TRP_ERROR;
 
   if (peer==NULL) {
-    tr_err("trps_wildcard_route_req: unknown peer (%.*s).", peer_servicename->len, peer_servicename->buf);
+    tr_err("trps_route_req: unknown peer (%.*s).", peer_servicename->len, peer_servicename->buf);
     rc=TRP_BADARG;
     goto cleanup;
   }
-  if ((req==NULL) || (trp_req_make_wildcard(req)!=TRP_SUCCESS)) {
-    tr_err("trps_wildcard_route_req: unable to create wildcard TRP request.");
+  if (req==NULL) {
+    tr_err("trps_route_req: unable to allocate TRP request.");
     rc=TRP_NOMEM;
     goto cleanup;
   }
+  if ((comm==NULL) && (realm==NULL)) {
+    if (trp_req_make_wildcard(req)!=TRP_SUCCESS) {
+      tr_err("trps_route_req: unable to create wildcard TRP request.");
+      rc=TRP_NOMEM;
+      goto cleanup;
+    }
+  } else {
+    trp_req_set_comm(req, tr_dup_name(comm));
+    trp_req_set_realm(req, tr_dup_name(realm));
+  }
 
   tr_msg_set_trp_req(&msg, req);
   encoded=tr_msg_encode(&msg);
   if (encoded==NULL) {
-    tr_err("trps_wildcard_route_req: error encoding wildcard TRP request.");
+    tr_err("trps_route_req: error encoding TRP request.");
     rc=TRP_ERROR;
     goto cleanup;
   }
 
-  tr_debug("trps_wildcard_route_req: adding message to queue.");
+  tr_debug("trps_route_req: adding message to queue.");
   if (trps_send_msg(trps, peer, encoded) != TRP_SUCCESS) {
-    tr_err("trps_wildcard_route_req: error queueing request.");
+    tr_err("trps_route_req: error queueing request.");
     rc=TRP_ERROR;
   } else {
-    tr_debug("trps_wildcard_route_req: request queued successfully.");
+    tr_debug("trps_route_req: request queued successfully.");
     rc=TRP_SUCCESS;
   }
 
@@ -1917,3 +3284,9 @@ cleanup:
   talloc_free(tmp_ctx);
   return rc;
 }
+
+/* send wildcard route request to a peer */
+TRP_RC trps_wildcard_route_req(TRPS_INSTANCE *trps, TR_NAME *peer_servicename)
+{
+  return trps_route_req(trps, peer_servicename, NULL, NULL);
+}